@@ -456,6 +456,7 @@ void __mmap_allocator_notify_mremap_before(void *old_addr, size_t old_size,
 void __mmap_allocator_notify_mremap_after(void *ret_addr, void *old_addr, size_t old_size, 
 	size_t new_size, int flags, void *new_address, void *caller);
 void __mmap_allocator_notify_munmap(void *addr, size_t length, void *caller);
+void __mmap_allocator_notify_mprotect(void *addr, size_t len, int prot);
 
 _Bool __mmap_allocator_is_initialized(void) __attribute__((visibility("hidden")));
 _Bool __mmap_allocator_notify_unindexed_address(const void *ptr);
@@ -535,6 +536,7 @@ void __stack_allocator_init(void) __attribute__((constructor(101)));
 _Bool __stack_allocator_notify_unindexed_address(const void *ptr);
 
 void init_frames_info(struct allocs_file_metadata *file) __attribute__((visibility("hidden")));
+void deinit_frames_info(struct allocs_file_metadata *file) __attribute__((visibility("hidden")));
 
 void __auxv_allocator_init(void) __attribute__((constructor(101)));
 void __alloca_allocator_init(void);
@@ -90,9 +90,20 @@ allocsites_id_entry_slot_next_free __attribute__((visibility("hidden")));
 
 void
 init_allocsites_info(struct allocs_file_metadata *file) __attribute__((visibility("hidden")));
+/* init_allocsites_info in two halves, so that the hashing can be done
+ * later or on another thread. Until it is, lookups of the file's sites
+ * fall back to a bsearch. The first half must be called in load order. */
+void
+init_allocsites_info_unhashed(struct allocs_file_metadata *file) __attribute__((visibility("hidden")));
+void
+hash_allocsites_info(struct allocs_file_metadata *file) __attribute__((visibility("hidden")));
+void
+deinit_allocsites_info(struct allocs_file_metadata *file) __attribute__((visibility("hidden")));
 
 struct allocsite_entry *__liballocs_find_allocsite_entry_at(
 	const void *allocsite) __attribute__((visibility("protected")));
+struct allocsite_entry *__liballocs_find_allocsite_entry_and_id_at(
+	const void *allocsite, allocsite_id_t *out_id) __attribute__((visibility("hidden")));
 allocsite_id_t __liballocs_allocsite_id(const void *allocsite) __attribute__((visibility("protected")));
 struct allocsite_entry *__liballocs_allocsite_entry_by_id(allocsite_id_t id,
 	uintptr_t *out_file_base_addr) __attribute__((visibility("protected")));
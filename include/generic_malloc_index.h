@@ -5,6 +5,7 @@
 
 #include <stdbool.h>
 #include <pthread.h>
+#include <sys/mman.h>
 #include "liballocs_config.h"
 #include "liballocs.h"
 #include "liballocs_ext.h"
@@ -42,7 +43,11 @@ extern int __currently_allocating;
 #define __liballocs_private_free __private_free
 //void __free_arena_bitmap_and_info(void *info);
 #define __liballocs_free_arena_bitmap_and_info __free_arena_bitmap_and_info
+//void __grow_arena_bitmap(void *info, unsigned long total_words);
+#define __liballocs_grow_arena_bitmap __grow_arena_bitmap
 #define __liballocs_extract_and_output_alloc_site_and_type extract_and_output_alloc_site_and_type
+#define __liballocs_extract_and_output_generic_malloc_site_and_type extract_and_output_generic_malloc_site_and_type
+#define __liballocs_peek_alloc_site_and_type peek_alloc_site_and_type
 #endif
 
 /* Generic heap indexing implementation.
@@ -112,6 +117,18 @@ struct arena_bitmap_info
 	unsigned long nwords;
 	bitmap_word_t *bitmap;
 	void *bitmap_base_addr;
+	/* If nonzero, the bitmap is a MAP_NORESERVE mapping of this many words,
+	 * which never moves, of which the first nwords_usable are read-write;
+	 * growth just bumps nwords, and nwords_usable a window at a time.
+	 * If zero, the bitmap (if any) came from __private_realloc. */
+	unsigned long nwords_reserved;
+	unsigned long nwords_usable;
+	/* Set if the reservation couldn't be made or grown. Then nwords stops at
+	 * nwords_usable, and chunks beyond it go unindexed. */
+	_Bool bitmap_capped;
+	/* One bit per bitmap word, set if that word may have any bits set.
+	 * In the reserved case this is a mapping of its own, made usable alongside. */
+	bitmap_word_t *summary;
 	pthread_mutex_t mutex;
 	unsigned long bitmap_insert_count;
 	unsigned long biggest_allocated_object;
@@ -125,6 +142,7 @@ struct arena_bitmap_info
 #endif
 };
 void __free_arena_bitmap_and_info(void *info  /* really struct arena_bitmap_info * */);
+void __grow_arena_bitmap(void *info  /* really struct arena_bitmap_info * */, unsigned long total_words);
 
 /* Chunks can also have lifetime policies attached, if we are built
  * with support for this.
@@ -139,9 +157,13 @@ void __free_arena_bitmap_and_info(void *info  /* really struct arena_bitmap_info
  *         can even point to its allocsites?
  * -one bit per lifetime policy (~6 bits?).
  *
- * When we get rid of the memtable in favour of the bitmap,
- * we should be able to fit this in.
- * For now, strip out the lifetime policies support.
+ * Now that we use the bitmap, struct insert is 64 bits: the flag, 47 bits of
+ * site-or-uniqtype, and 16 compact bits, which hold the allocsite id once
+ * the site has been replaced by its type (see insert in malloc-meta.h).
+ * Squeezing the uniqtype into 44 bits would need it shifted by its
+ * alignment, costing the low "loose" bit that libcrunch uses and the
+ * INSERT_DESCRIBES_OBJECT address test, so for now we still strip out
+ * the lifetime policies support.
  */
 typedef /*LIFETIME_INSERT_TYPE*/ uint8_t lifetime_insert_t;
 #define LIFETIME_POLICY_FLAG(id) (0x1 << (id))
@@ -245,9 +267,12 @@ struct big_allocation *arena_for_userptr(struct allocator *a, void *userptr)
 	return b;
 }
 
-/* We use a big lock to protect access to our bitmap. Ideally we would
- * just do lock-free CAS for bitmap updates. */
-#ifndef NO_PTHREADS
+/* By default we use a big lock to protect access to our bitmap. In the
+ * lock-free configuration, we instead update bitmap words with atomic
+ * read-modify-write operations, and the bitmap is a reserve-once mapping
+ * that never moves, so readers never see a realloc'd bitmap. The mutex
+ * is then used only on the (once-per-arena) reservation slow path. */
+#if !defined(NO_PTHREADS) && !defined(GENERIC_MALLOC_INDEX_LOCK_FREE)
 #define BIG_LOCK \
 	lock_ret = pthread_mutex_lock(&info->mutex); \
 	assert(lock_ret == 0);
@@ -259,6 +284,136 @@ struct big_allocation *arena_for_userptr(struct allocator *a, void *userptr)
 #define BIG_UNLOCK
 #endif
 
+#ifdef GENERIC_MALLOC_INDEX_LOCK_FREE
+/* Setting is (at least) a release so that a reader who sees the bit also
+ * sees the insert. We use seq_cst, which costs the same on x86, because
+ * keeping the summary bitmap right needs store-load ordering (see
+ * index_clear_start). */
+#define INDEX_BITMAP_SET(bitmap, idx) \
+	__atomic_fetch_or((bitmap) + ((idx) / BITMAP_WORD_NBITS), \
+		(bitmap_word_t) 1 << ((idx) % BITMAP_WORD_NBITS), __ATOMIC_SEQ_CST)
+#define INDEX_BITMAP_CLEAR(bitmap, idx) \
+	__atomic_fetch_and((bitmap) + ((idx) / BITMAP_WORD_NBITS), \
+		~((bitmap_word_t) 1 << ((idx) % BITMAP_WORD_NBITS)), __ATOMIC_SEQ_CST)
+#define INDEX_BITMAP_LOAD_WORD(bitmap, word_idx) \
+	__atomic_load_n((bitmap) + (word_idx), __ATOMIC_SEQ_CST)
+static inline void update_max_atomic(unsigned long *p_max, unsigned long val)
+{
+	unsigned long cur = __atomic_load_n(p_max, __ATOMIC_RELAXED);
+	while (cur < val && !__atomic_compare_exchange_n(p_max, &cur, val,
+			/* weak */ 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+#define INDEX_UPDATE_MAX(lval, val) update_max_atomic(&(lval), (val))
+#define INDEX_COUNT_INSERT(lval) __atomic_fetch_add(&(lval), 1, __ATOMIC_RELAXED)
+#else
+#define INDEX_BITMAP_SET(bitmap, idx) bitmap_set_l((bitmap), (idx))
+#define INDEX_BITMAP_CLEAR(bitmap, idx) bitmap_clear_l((bitmap), (idx))
+#define INDEX_BITMAP_LOAD_WORD(bitmap, word_idx) ((bitmap)[(word_idx)])
+#define INDEX_UPDATE_MAX(lval, val) \
+	((lval) = /* max */ ((val) > (lval)) ? (val) : (lval))
+#define INDEX_COUNT_INSERT(lval) (++(lval))
+#endif
+
+/* The summary bitmap lets a backward search skip BITMAP_WORD_NBITS empty
+ * bitmap words (64kB of arena, at 64-bit words and 16-byte alignment) with
+ * one load, so finding a chunk start costs a bounded number of word scans
+ * however sparse the arena is. */
+#define INDEX_SUMMARY_NWORDS(nwords) \
+	(((nwords) + BITMAP_WORD_NBITS - 1) / BITMAP_WORD_NBITS)
+static inline void index_set_start(struct arena_bitmap_info *info, unsigned long idx)
+{
+	unsigned long word_idx = idx / BITMAP_WORD_NBITS;
+	INDEX_BITMAP_SET(info->bitmap, idx);
+	/* Usually the summary bit is already set, so check before writing. */
+	if (!(INDEX_BITMAP_LOAD_WORD(info->summary, word_idx / BITMAP_WORD_NBITS)
+			& ((bitmap_word_t) 1 << (word_idx % BITMAP_WORD_NBITS))))
+	{
+		INDEX_BITMAP_SET(info->summary, word_idx);
+	}
+}
+static inline void index_clear_start(struct arena_bitmap_info *info, unsigned long idx)
+{
+	unsigned long word_idx = idx / BITMAP_WORD_NBITS;
+	INDEX_BITMAP_CLEAR(info->bitmap, idx);
+	if (INDEX_BITMAP_LOAD_WORD(info->bitmap, word_idx) == 0)
+	{
+		INDEX_BITMAP_CLEAR(info->summary, word_idx);
+		/* In the lock-free case, a racing index_set_start may have set a bit
+		 * after our check but seen the summary bit before our clear. Either
+		 * it sees our clear, or we see its bit here. */
+		if (INDEX_BITMAP_LOAD_WORD(info->bitmap, word_idx) != 0)
+		{
+			INDEX_BITMAP_SET(info->summary, word_idx);
+		}
+	}
+}
+/* Highest set bit of word at or below bit, or -1. */
+static inline unsigned long index_word_highest_set_leq(bitmap_word_t word, unsigned bit)
+{
+	if (bit < BITMAP_WORD_NBITS - 1) word &= ((bitmap_word_t) 1 << (bit + 1)) - 1;
+	return word ? (BITMAP_WORD_NBITS - 1) - __builtin_clzl(word) : (unsigned long) -1;
+}
+/* Find the highest start bit at or below idx, looking no lower than
+ * bitmap word lowest_word. Returns (unsigned long) -1 if there is none. */
+static inline unsigned long index_rfind_start_leq(struct arena_bitmap_info *info,
+	unsigned long idx, unsigned long lowest_word)
+{
+	unsigned long word_idx = idx / BITMAP_WORD_NBITS;
+	unsigned long found = index_word_highest_set_leq(
+		INDEX_BITMAP_LOAD_WORD(info->bitmap, word_idx), idx % BITMAP_WORD_NBITS);
+	if (found != (unsigned long) -1) return word_idx * BITMAP_WORD_NBITS + found;
+	while (word_idx > lowest_word)
+	{
+		/* Use the summary to find the nearest lower word that may be nonempty. */
+		unsigned long prev = word_idx - 1;
+		unsigned long summary_found = index_word_highest_set_leq(
+			INDEX_BITMAP_LOAD_WORD(info->summary, prev / BITMAP_WORD_NBITS),
+			prev % BITMAP_WORD_NBITS);
+		word_idx = (prev / BITMAP_WORD_NBITS) * BITMAP_WORD_NBITS;
+		if (summary_found == (unsigned long) -1) continue;
+		word_idx += summary_found;
+		if (word_idx < lowest_word) break;
+		found = index_word_highest_set_leq(
+			INDEX_BITMAP_LOAD_WORD(info->bitmap, word_idx), BITMAP_WORD_NBITS - 1);
+		/* The word may have emptied since we read the summary. */
+		if (found != (unsigned long) -1) return word_idx * BITMAP_WORD_NBITS + found;
+	}
+	return (unsigned long) -1;
+}
+/* The lowest bitmap word in [word_idx, last_word] that may have any bits set,
+ * or (unsigned long) -1 if there is none. Forward counterpart of the above,
+ * for walking an arena. */
+static inline unsigned long index_next_nonempty_word(struct arena_bitmap_info *info,
+	unsigned long word_idx, unsigned long last_word)
+{
+	if (!info->summary) return word_idx <= last_word ? word_idx : (unsigned long) -1;
+	while (word_idx <= last_word)
+	{
+		bitmap_word_t summary = INDEX_BITMAP_LOAD_WORD(info->summary, word_idx / BITMAP_WORD_NBITS)
+			>> (word_idx % BITMAP_WORD_NBITS);
+		if (summary)
+		{
+			word_idx += __builtin_ctzl(summary);
+			return word_idx <= last_word ? word_idx : (unsigned long) -1;
+		}
+		word_idx = (word_idx / BITMAP_WORD_NBITS + 1) * BITMAP_WORD_NBITS;
+	}
+	return (unsigned long) -1;
+}
+/* Recompute the summary from scratch, e.g. after the bitmap has been shifted. */
+static inline void rebuild_index_summary(struct arena_bitmap_info *info)
+{
+	unsigned long nsummary_words = INDEX_SUMMARY_NWORDS(info->nwords);
+	info->summary = __liballocs_private_realloc(info->summary,
+		nsummary_words * sizeof (bitmap_word_t));
+	if (!info->summary) abort();
+	bzero(info->summary, nsummary_words * sizeof (bitmap_word_t));
+	for (unsigned long i = 0; i < info->nwords; ++i)
+	{
+		if (info->bitmap[i]) bitmap_set_l(info->summary, i);
+	}
+}
+
 #define SHOULD_PROMOTE_TO_BIGALLOC(userchunk, usable_size) \
 	((usable_size) > /* HACK: default glibc lower mmap threshold: 128 kB */ 131072)
 
@@ -268,7 +423,7 @@ struct big_allocation *arena_for_userptr(struct allocator *a, void *userptr)
  * What's a better way of doing that?
  *
  * I think the only symbols are __private_malloc, __private_realloc, __private_free,
- * big_allocations, __free_arena_bitmap_and_info. They should all be 'protected'
+ * big_allocations, __free_arena_bitmap_and_info, __grow_arena_bitmap. They should all be 'protected'
  * or have protected aliases that are used in this function.
  *
  * If indexing is built in to a binary, it should link -lallocs. Then, references
@@ -292,6 +447,10 @@ static inline void ensure_has_info(struct big_allocation *arena)
 		arena->suballocator_private_free = __liballocs_free_arena_bitmap_and_info;
 		info->nwords = 0;
 		info->bitmap = NULL;
+		info->nwords_reserved = 0;
+		info->nwords_usable = 0;
+		info->bitmap_capped = 0;
+		info->summary = NULL;
 		/* Mutex is recursive only because assertion failures sometimes want to do
 		 * asprintf, so try to re-acquire our mutex. */
 		info->mutex = (pthread_mutex_t) PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
@@ -306,6 +465,24 @@ static inline void ensure_has_info(struct big_allocation *arena)
 	}
 }
 
+#ifdef GENERIC_MALLOC_INDEX_LOCK_FREE
+/* The reserved bitmap and its summary are separate MAP_NORESERVE mappings,
+ * so neither ever moves. We reserve address space for an arena of up to
+ * INDEX_RESERVE_MAX_COVERAGE bytes (less if RLIMIT_AS won't allow it), but
+ * it starts PROT_NONE, so it costs no commit charge. We make it usable a
+ * window at a time, a few times the arena's current span. This is done
+ * out of line, in __grow_arena_bitmap, so that it can use raw syscalls. */
+#ifndef INDEX_RESERVE_MAX_COVERAGE
+#define INDEX_RESERVE_MAX_COVERAGE (1ul<<37) /* 128GB of arena, in 1GB of bitmap */
+#endif
+#define INDEX_RESERVE_MIN_NWORDS (1ul<<20) /* 1GB of arena, in 8MB of bitmap */
+#define INDEX_RESERVE_GROWTH 4
+static inline size_t index_mapping_size(unsigned long nwords)
+{
+	return ROUND_UP(nwords * sizeof (bitmap_word_t), PAGE_SIZE);
+}
+#endif
+
 static inline void ensure_has_bitmap_to_current_end(struct big_allocation *arena)
 {
 	uintptr_t bitmap_base_addr = (uintptr_t)ROUND_DOWN_PTR(arena->begin, MALLOC_ALIGN*BITMAP_WORD_NBITS);
@@ -318,11 +495,51 @@ static inline void ensure_has_bitmap_to_current_end(struct big_allocation *arena
 	unsigned long total_words = ((uintptr_t)(ROUND_UP_PTR(arena->end, MALLOC_ALIGN*BITMAP_WORD_NBITS))
 			- bitmap_base_addr)
 			/ (MALLOC_ALIGN * BITMAP_WORD_NBITS);
+#ifdef GENERIC_MALLOC_INDEX_LOCK_FREE
+	unsigned long nwords = __atomic_load_n(&info->nwords, __ATOMIC_ACQUIRE);
+	if (__builtin_expect(nwords >= total_words, 1)) return;
+	if (!__atomic_load_n(&info->bitmap_capped, __ATOMIC_ACQUIRE)
+			&& __atomic_load_n(&info->nwords_usable, __ATOMIC_ACQUIRE) < total_words
+			&& (__atomic_load_n(&info->nwords_reserved, __ATOMIC_RELAXED)
+				|| !__atomic_load_n(&info->bitmap, __ATOMIC_ACQUIRE)))
+	{
+		int lock_ret = pthread_mutex_lock(&info->mutex);
+		assert(lock_ret == 0);
+		if (!info->bitmap_capped && info->nwords_usable < total_words)
+		{
+			if (!info->bitmap || info->nwords_reserved)
+			{
+				__liballocs_grow_arena_bitmap(info, total_words);
+			}
+		}
+		lock_ret = pthread_mutex_unlock(&info->mutex);
+		assert(lock_ret == 0);
+	}
+	unsigned long nwords_usable = __atomic_load_n(&info->nwords_usable, __ATOMIC_ACQUIRE);
+	if (nwords_usable || __atomic_load_n(&info->bitmap_capped, __ATOMIC_ACQUIRE))
+	{
+		/* If we couldn't reserve enough, chunks beyond the reservation
+		 * go unindexed; our callers check against nwords. */
+		unsigned long want = (total_words < nwords_usable) ? total_words : nwords_usable;
+		while (nwords < want && !__atomic_compare_exchange_n(&info->nwords,
+				&nwords, want, /* weak */ 1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+		return;
+	}
+	/* Otherwise it's a bitmap we don't own the reservation for (e.g. alloca's,
+	 * which is thread-private), so fall through to the realloc path. */
+#endif
 	if (__builtin_expect(info->nwords < total_words, 0))
 	{
 		info->bitmap = __liballocs_private_realloc(info->bitmap, total_words * sizeof (bitmap_word_t));
 		if (!info->bitmap) abort();
 		bzero(info->bitmap + info->nwords, (total_words - info->nwords) * sizeof (bitmap_word_t));
+		unsigned long old_nsummary_words = info->summary ? INDEX_SUMMARY_NWORDS(info->nwords) : 0;
+		unsigned long nsummary_words = INDEX_SUMMARY_NWORDS(total_words);
+		info->summary = __liballocs_private_realloc(info->summary,
+			nsummary_words * sizeof (bitmap_word_t));
+		if (!info->summary) abort();
+		bzero(info->summary + old_nsummary_words,
+			(nsummary_words - old_nsummary_words) * sizeof (bitmap_word_t));
 		info->nwords = total_words;
 	}
 }
@@ -342,11 +559,12 @@ static inline void __generic_malloc_index_insert(struct big_allocation *arena,
 	BIG_LOCK
 	ensure_has_bitmap_to_current_end(arena);
 	bitmap_word_t *bitmap = info->bitmap;
-	/* The address *must* be in our tracked range. Assert this. */
+	/* The address *must* be in our tracked range, unless we couldn't
+	 * reserve a big enough bitmap. Assert this. */
 	assert(info->bitmap_base_addr == ROUND_DOWN_PTR(arena->begin, MALLOC_ALIGN*BITMAP_WORD_NBITS)); // start of coverage (not of bitmap)
 	void *bitmap_end_addr = (void*)((uintptr_t) info->bitmap_base_addr +       // limit of coverage
 		((struct arena_bitmap_info *) arena->suballocator_private)->nwords * MALLOC_ALIGN * BITMAP_WORD_NBITS);
-	assert((uintptr_t) allocptr <= (uintptr_t) bitmap_end_addr);
+	assert((uintptr_t) allocptr < (uintptr_t) bitmap_end_addr || info->bitmap_capped);
 
 #ifdef TRACE_GENERIC_MALLOC_INDEX
 	/* Check the recently freed list for this pointer. Delete it if we find it. */
@@ -365,8 +583,11 @@ static inline void __generic_malloc_index_insert(struct big_allocation *arena,
 	struct insert *p_insert = insert_for_chunk_and_caller_usable_size(allocptr,
 		caller_usable_size);
 	/* Populate our extra in-chunk fields */
-	p_insert->alloc_site_flag = 0U;
-	p_insert->alloc_site = (uintptr_t) caller;
+	insert_store(p_insert, (struct insert) {
+		.alloc_site_flag = 0U,
+		.alloc_site = (uintptr_t) caller,
+		.un = { .bits = (allocsite_id_t) -1 } /* resolved on first query */
+	});
 
 #if 0 // def PRECISE_REQUESTED_ALLOCSIZE
 	/* FIXME: this isn't really the insert size. It's the insert plus padding.
@@ -387,8 +608,7 @@ static inline void __generic_malloc_index_insert(struct big_allocation *arena,
 	}
 #endif
 	/* Metadata remains in the chunk */
-	info->biggest_allocated_object = /* max */ (caller_usable_size > info->biggest_allocated_object) ?
-		caller_usable_size : info->biggest_allocated_object;
+	INDEX_UPDATE_MAX(info->biggest_allocated_object, caller_usable_size);
 	if (__builtin_expect(SHOULD_PROMOTE_TO_BIGALLOC(allocptr, alloc_usable_size), 0))
 	{
 		void *bigalloc_begin = allocptr;
@@ -401,8 +621,7 @@ static inline void __generic_malloc_index_insert(struct big_allocation *arena,
 	}
 	else
 	{
-		info->biggest_unpromoted_object = /* max */ (caller_usable_size > info->biggest_unpromoted_object)
-			? caller_usable_size : info->biggest_unpromoted_object;
+		INDEX_UPDATE_MAX(info->biggest_unpromoted_object, caller_usable_size);
 	}
 #undef insert_size
 #ifdef TRACE_GENERIC_MALLOC_INDEX
@@ -410,10 +629,14 @@ static inline void __generic_malloc_index_insert(struct big_allocation *arena,
 		info->bitmap_insert_count, allocptr, bitmap);
 #endif
 #if !defined(NDEBUG) || defined(TRACE_GENERIC_MALLOC_INDEX)
-	++info->bitmap_insert_count;
+	INDEX_COUNT_INSERT(info->bitmap_insert_count);
 #endif
-	/* Add it to the bitmap. */
-	bitmap_set_l(bitmap, (allocptr - info->bitmap_base_addr) / MALLOC_ALIGN);
+	/* Add it to the bitmap. If it's beyond what we could reserve, it goes
+	 * unindexed, and queries on it will say so. */
+	if ((uintptr_t) allocptr < (uintptr_t) bitmap_end_addr)
+	{
+		index_set_start(info, (allocptr - info->bitmap_base_addr) / MALLOC_ALIGN);
+	}
 out:
 	BIG_UNLOCK
 }
@@ -432,7 +655,8 @@ static inline void __generic_malloc_index_delete(struct big_allocation *arena,
 	 */
 	assert(userptr != NULL);
 	void *allocptr = userptr;
-	__liballocs_uncache_all(allocptr, sizefn(allocptr)); // FIXME: per-allocator call
+	size_t alloc_usable_size = sizefn(allocptr);
+	__liballocs_uncache_all(allocptr, alloc_usable_size); // FIXME: per-allocator call
 
 #ifdef TRACE_GENERIC_MALLOC_INDEX
 	/* Check the recently-freed list for this pointer. We will warn about
@@ -447,15 +671,17 @@ static inline void __generic_malloc_index_delete(struct big_allocation *arena,
 		}
 	}
 #endif
-	/* Are we a bigalloc? */
-	struct big_allocation *b = __lookup_bigalloc_under(userptr, arena->suballocator,
-		arena, NULL);
+	/* Are we a bigalloc? Only chunks big enough to have been promoted can be,
+	 * so most frees needn't look. */
+	struct big_allocation *b = __builtin_expect(SHOULD_PROMOTE_TO_BIGALLOC(userptr,
+			alloc_usable_size), 0) ? __lookup_bigalloc_under(userptr, arena->suballocator,
+		arena, NULL) : NULL;
 	/* If so, we promoted this entry into the bigalloc index. We still
 	 * kept its metadata locally, though. */
 	if (__builtin_expect(b != NULL, 0))
 	{
 		void *allocptr = userptr;
-		unsigned long size = sizefn(allocptr); // FIXME: use per-alloc call
+		unsigned long size = alloc_usable_size;
 #ifdef TRACE_GENERIC_MALLOC_INDEX
 		fprintf(stderr, "*** Unindexing bigalloc entry for alloc chunk %p (size %lu)\n",
 				allocptr, size);
@@ -478,8 +704,9 @@ static inline void __generic_malloc_index_delete(struct big_allocation *arena,
 	/* The address *must* be in our tracked range. Assert this. */
 	assert(info->bitmap_base_addr == ROUND_DOWN_PTR(arena->begin, MALLOC_ALIGN*BITMAP_WORD_NBITS));
 	assert((uintptr_t) userptr >= (uintptr_t) info->bitmap_base_addr);
-	bitmap_clear_l(bitmap, ((uintptr_t) userptr - (uintptr_t) info->bitmap_base_addr)
-			/ MALLOC_ALIGN);
+	unsigned long idx = ((uintptr_t) userptr - (uintptr_t) info->bitmap_base_addr) / MALLOC_ALIGN;
+	/* Chunks beyond a capped bitmap were never indexed. */
+	if (idx / BITMAP_WORD_NBITS < info->nwords) index_clear_start(info, idx);
 
 #ifdef TRACE_GENERIC_MALLOC_INDEX
 	fprintf(stderr, "*** Deleting entry for chunk %p, from bitmap at %p\n",
@@ -567,26 +794,32 @@ struct insert *lookup_object_info(struct big_allocation *arena,
 	assert(info->bitmap_base_addr == ROUND_DOWN_PTR(arena->begin, MALLOC_ALIGN*BITMAP_WORD_NBITS));
 	unsigned start_idx = ((uintptr_t) mem - (uintptr_t) info->bitmap_base_addr) / MALLOC_ALIGN;
 	/* OPTIMISATION: since we have a maximum object size,
-	 * fake out the bitmap so that we bound the backward search */
-	unsigned long nbits_hidden = 0;
+	 * we bound the backward search. The summary bitmap then
+	 * skips the empty words in between. */
+	unsigned long lowest_word = 0;
 #ifdef NDEBUG
 	void *fake_bitmap_base_addr = ROUND_DOWN_PTR((uintptr_t) mem -
 		(uintptr_t) info->biggest_unpromoted_object, MALLOC_ALIGN*BITMAP_WORD_NBITS);
 	if ((uintptr_t) fake_bitmap_base_addr > (uintptr_t) info->bitmap_base_addr)
 	{
-		nbits_hidden = BITMAP_WORD_NBITS *
-			(((uintptr_t) fake_bitmap_base_addr - (uintptr_t) info->bitmap_base_addr) /
-			(MALLOC_ALIGN * BITMAP_WORD_NBITS));
+		lowest_word = ((uintptr_t) fake_bitmap_base_addr - (uintptr_t) info->bitmap_base_addr) /
+			(MALLOC_ALIGN * BITMAP_WORD_NBITS);
 	}
 #endif
-	assert(nbits_hidden % BITMAP_WORD_NBITS == 0);
-	unsigned long found_bitidx = bitmap_rfind_first_set_leq_l(
-		info->bitmap + (nbits_hidden / BITMAP_WORD_NBITS),
-		info->bitmap + info->nwords,
-		start_idx - nbits_hidden, NULL);
+	/* Chunks beyond a capped bitmap were never indexed. */
+	if (start_idx / BITMAP_WORD_NBITS >= info->nwords)
+	{
+		assert(info->bitmap_capped);
+		return NULL;
+	}
+	unsigned long found_bitidx = info->summary ? index_rfind_start_leq(info, start_idx, lowest_word)
+		: bitmap_rfind_first_set_leq_l(
+			info->bitmap + lowest_word,
+			info->bitmap + info->nwords,
+			start_idx - lowest_word * BITMAP_WORD_NBITS, NULL);
 	if (found_bitidx != (unsigned long) -1)
 	{
-		found_bitidx += nbits_hidden;
+		if (!info->summary) found_bitidx += lowest_word * BITMAP_WORD_NBITS;
 		object_start = info->bitmap_base_addr + (MALLOC_ALIGN * found_bitidx);
 		found_ins = insert_for_chunk(object_start, sizefn);
 	}
@@ -609,7 +842,7 @@ liballocs_err_t __generic_malloc_get_info(struct allocator *a, sizefn_t *sizefn,
 	struct uniqtype **out_type, void **out_base,
 	unsigned long *out_size, const void **out_site)
 {
-	++__liballocs_hit_heap_case;
+	__liballocs_stat_inc(LIBALLOCS_STAT_HIT_HEAP_CASE);
 	/* For heap allocations, we look up the allocation site.
 	 * (This also yields an offset within a toplevel object.)
 	 * Then we translate the allocation site to a uniqtypes rec location.
@@ -643,7 +876,7 @@ liballocs_err_t __generic_malloc_get_info(struct allocator *a, sizefn_t *sizefn,
 			 * for promoted chunks, we might know the size and base because we
 			 * can promote to bigalloc knowing just the original base pointer, from
 			 * which malloc_usable_size() can do the rest. */
-			++__liballocs_aborted_unindexed_heap;
+			__liballocs_stat_inc(LIBALLOCS_STAT_ABORTED_UNINDEXED_HEAP);
 			return &__liballocs_err_unindexed_heap_object;
 		}
 		assert(base);
@@ -653,7 +886,7 @@ liballocs_err_t __generic_malloc_get_info(struct allocator *a, sizefn_t *sizefn,
 	assert(heap_info);
 	if (out_base) *out_base = base;
 	if (out_size) *out_size = caller_usable_size;
-	if (out_type || out_site) return __liballocs_extract_and_output_alloc_site_and_type(
+	if (out_type || out_site) return __liballocs_extract_and_output_generic_malloc_site_and_type(
 		heap_info, out_type, (void**) out_site);
 	// no error
 	return NULL;
@@ -667,9 +900,112 @@ liballocs_err_t __generic_malloc_set_type(struct allocator *a,
 	struct insert *ins = lookup_object_info(arena_for_userptr(a, obj), obj,
 		NULL, NULL, NULL, sizefn);
 	if (!ins) return &__liballocs_err_unindexed_heap_object;
-	ins->alloc_site = (uintptr_t) new_type;
-	ins->alloc_site_flag = 1; // meaning it's a type, not a site
+	/* Keep the site, as its id, if it isn't already. */
+	struct insert old_ins = insert_load(ins);
+	allocsite_id_t id = old_ins.alloc_site_flag ? (allocsite_id_t) old_ins.un.bits
+		: __liballocs_allocsite_id((const void *) (uintptr_t) old_ins.alloc_site);
+	insert_store(ins, (struct insert) {
+		.alloc_site_flag = 1, // meaning it's a type, not a site
+		.alloc_site = (uintptr_t) new_type,
+		.un = { .bits = id }
+	});
 	return NULL;
 }
 
+/* Walk the indexed chunks of an arena in address order, calling back for
+ * each one starting in [maybe_range_begin, maybe_range_end). We go a
+ * bitmap word at a time, skipping empty words via the summary, and work
+ * in batches so that each chunk's malloc header and then its insert are
+ * prefetched well before we need them. The containee_coord we pass is the
+ * chunk's bitmap index plus one: unique and ordered, though not dense.
+ * Like lookup, this does not lock the arena, so a walk that races with
+ * frees in the range may see freed chunks. */
+#ifndef GENERIC_MALLOC_WALK_BATCH
+#define GENERIC_MALLOC_WALK_BATCH 16
+#endif
+static inline bitmap_word_t index_word_for_walk(struct arena_bitmap_info *info,
+	unsigned long word_idx, unsigned long first_idx, unsigned long end_idx)
+{
+	bitmap_word_t word = INDEX_BITMAP_LOAD_WORD(info->bitmap, word_idx);
+	if (word_idx == first_idx / BITMAP_WORD_NBITS)
+	{
+		word &= ~(bitmap_word_t) 0 << (first_idx % BITMAP_WORD_NBITS);
+	}
+	if (word_idx == (end_idx - 1) / BITMAP_WORD_NBITS && end_idx % BITMAP_WORD_NBITS)
+	{
+		word &= ((bitmap_word_t) 1 << (end_idx % BITMAP_WORD_NBITS)) - 1;
+	}
+	return word;
+}
+static inline
+int __generic_malloc_walk_allocations(struct allocator *a, sizefn_t *sizefn,
+	struct alloc_tree_pos *pos, walk_alloc_cb_t *cb, void *arg,
+	void *maybe_range_begin, void *maybe_range_end)
+{
+	struct big_allocation *arena = BOU_BIGALLOC(pos->bigalloc_or_uniqtype);
+	struct arena_bitmap_info *info = arena->suballocator_private;
+	if (!info || !info->bitmap) return 0;
+	uintptr_t bitmap_base = (uintptr_t) info->bitmap_base_addr;
+	uintptr_t lo = (uintptr_t) (maybe_range_begin ?: arena->begin);
+	uintptr_t hi = (uintptr_t) (maybe_range_end ?: arena->end);
+	uintptr_t covered_end = bitmap_base + info->nwords * BITMAP_WORD_NBITS * MALLOC_ALIGN;
+	if (lo < bitmap_base) lo = bitmap_base;
+	if (hi > covered_end) hi = covered_end;
+	if (hi <= lo) return 0;
+	unsigned long first_idx = (lo - bitmap_base + MALLOC_ALIGN - 1) / MALLOC_ALIGN;
+	unsigned long end_idx = (hi - bitmap_base + MALLOC_ALIGN - 1) / MALLOC_ALIGN;
+	unsigned long last_word = (end_idx - 1) / BITMAP_WORD_NBITS;
+	unsigned long word_idx = index_next_nonempty_word(info,
+		first_idx / BITMAP_WORD_NBITS, last_word);
+	bitmap_word_t word = (word_idx == (unsigned long) -1) ? 0
+		: index_word_for_walk(info, word_idx, first_idx, end_idx);
+	struct alloc_tree_link link = {
+		.container = { pos->base, pos->bigalloc_or_uniqtype },
+		.containee_coord = 0
+	};
+	unsigned long batch_idx[GENERIC_MALLOC_WALK_BATCH];
+	struct insert *batch_ins[GENERIC_MALLOC_WALK_BATCH];
+	int ret = 0;
+	while (word_idx != (unsigned long) -1)
+	{
+		/* Gather the next batch of chunk starts. The usable size lives in
+		 * the malloc header just below the chunk, so fetch that first. */
+		unsigned n = 0;
+		while (n < GENERIC_MALLOC_WALK_BATCH)
+		{
+			if (!word)
+			{
+				word_idx = index_next_nonempty_word(info, word_idx + 1, last_word);
+				if (word_idx == (unsigned long) -1) break;
+				word = index_word_for_walk(info, word_idx, first_idx, end_idx);
+				continue;
+			}
+			unsigned long idx = word_idx * BITMAP_WORD_NBITS + __builtin_ctzl(word);
+			word &= word - 1;
+			batch_idx[n++] = idx;
+			__builtin_prefetch((char*) bitmap_base + idx * MALLOC_ALIGN - sizeof (size_t));
+		}
+		/* Now that the headers are on their way, find and fetch the inserts. */
+		for (unsigned i = 0; i < n; ++i)
+		{
+			void *chunk = (char*) bitmap_base + batch_idx[i] * MALLOC_ALIGN;
+			batch_ins[i] = insert_for_chunk(chunk, sizefn);
+			__builtin_prefetch(batch_ins[i]);
+		}
+		for (unsigned i = 0; i < n; ++i)
+		{
+			if (!INSERT_DESCRIBES_OBJECT(batch_ins[i])) continue;
+			void *chunk = (char*) bitmap_base + batch_idx[i] * MALLOC_ALIGN;
+			struct uniqtype *t = NULL;
+			const void *site = NULL;
+			/* Only read the insert; extracting would write to it. */
+			__liballocs_peek_alloc_site_and_type(batch_ins[i], &t, &site);
+			link.containee_coord = batch_idx[i] + 1;
+			ret = cb(NULL, chunk, t, site, &link, arg);
+			if (ret) return ret;
+		}
+	}
+	return ret;
+}
+
 #endif
@@ -51,14 +51,7 @@ struct allocator; // instead of allocmeta.h
 #include "vas.h"
 #include "liballocs_cil_inlines.h"
 
-extern unsigned long __liballocs_aborted_stack;
-extern unsigned long __liballocs_aborted_static;
-extern unsigned long __liballocs_aborted_unknown_storage;
-extern unsigned long __liballocs_hit_heap_case;
-extern unsigned long __liballocs_hit_stack_case;
-extern unsigned long __liballocs_hit_static_case;
-extern unsigned long __liballocs_aborted_unindexed_heap;
-extern unsigned long __liballocs_aborted_unrecognised_allocsite;
+#include "liballocs_stats.h"
 
 /* This API is a mess because there are three different classes of client. 
  * 
@@ -96,6 +89,7 @@ extern inline struct uniqtype * __attribute__((gnu_inline)) allocsite_to_uniqtyp
 struct uniqtype *__liballocs_allocsite_to_uniqtype(const void *allocsite);
 typedef unsigned short allocsite_id_t;
 const void *__liballocs_allocsite_by_id(allocsite_id_t id);
+allocsite_id_t __liballocs_allocsite_id(const void *allocsite);
 
 extern inline _Bool 
 __attribute__((always_inline,gnu_inline))
@@ -181,6 +175,26 @@ liballocs_err_t extract_and_output_alloc_site_and_type(
     struct uniqtype **out_type,
     void **out_site
 ) __attribute__((visibility("hidden")));
+liballocs_err_t extract_and_output_generic_malloc_site_and_type(
+    struct insert *p_ins,
+    struct uniqtype **out_type,
+    void **out_site
+) __attribute__((visibility("hidden")));
+liballocs_err_t __liballocs_extract_and_output_generic_malloc_site_and_type(
+    struct insert *p_ins,
+    struct uniqtype **out_type,
+    void **out_site
+);
+void peek_alloc_site_and_type(
+    const struct insert *p_ins,
+    struct uniqtype **out_type,
+    const void **out_site
+) __attribute__((visibility("hidden")));
+void __liballocs_peek_alloc_site_and_type(
+    const struct insert *p_ins,
+    struct uniqtype **out_type,
+    const void **out_site
+);
 
 
 /* We define a dladdr that caches stuff. */
@@ -631,7 +645,7 @@ __liballocs_get_alloc_info
 		else
 		{
 			__liballocs_report_wild_address(obj);
-			++__liballocs_aborted_unknown_storage;
+			__liballocs_stat_inc(LIBALLOCS_STAT_ABORTED_UNKNOWN_STORAGE);
 			err = &__liballocs_err_object_of_unknown_storage;
 			goto out_nocache;
 		}
@@ -639,8 +653,11 @@ __liballocs_get_alloc_info
 	 * Those with depth == 0 reflect leaf allocations. */
 	}
 	if (out_allocator) *out_allocator = a;
+	unsigned long t0_ns = __builtin_expect(__liballocs_stats_detail, 0)
+		? __liballocs_stats_now_ns() : 0;
 	err = a->get_info((void*) obj, the_bigalloc, out_alloc_uniqtype, (void**) out_alloc_start,
 			out_alloc_size_bytes, out_alloc_site);
+	if (__builtin_expect(t0_ns != 0, 0)) __liballocs_stats_note_query(a, err, t0_ns);
 	if (!err || err == &__liballocs_err_unrecognised_alloc_site)
 	{
 		/* We can cache something negative, if we like. */
@@ -842,6 +859,9 @@ struct uniqtype *__liballocs_get_or_create_unbounded_array_type(struct uniqtype
 
 struct uniqtype *
 __liballocs_get_or_create_union_type(unsigned n, /* struct uniqtype *first_memb_t, */...);
+/* Types created at run time are bound into the dynamic uniqtypes object
+ * in batches; call this before looking one up by symbol name. */
+void __liballocs_publish_rt_uniqtypes(void);
 int __liballocs_add_type_to_block(void *block, struct uniqtype *t);
 
 #ifdef __cplusplus
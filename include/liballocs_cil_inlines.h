@@ -161,17 +161,36 @@ struct __liballocs_memrange_cache_entry_s
 #ifndef LIBALLOCS_MEMRANGE_CACHE_MAX_SIZE
 #define LIBALLOCS_MEMRANGE_CACHE_MAX_SIZE 8
 #endif
+/* Each thread has its own cache. The caches themselves live in a global
+ * pool, not in TLS, so that a freeing thread can safely invalidate entries
+ * in other threads' caches even if those threads exit concurrently. It does
+ * this by setting bits in 'remote_invalid'; only the owning thread touches
+ * its validity mask and MRU links, and it drains remote_invalid before each
+ * lookup. */
+#ifndef LIBALLOCS_MEMRANGE_CACHE_NPOOL
+#define LIBALLOCS_MEMRANGE_CACHE_NPOOL 256
+#endif
 struct __liballocs_memrange_cache
 {
 	unsigned int validity; /* does *not* include the null entry */
-	const unsigned short size_plus_one; /* i.e. including the null entry */
+	unsigned short size_plus_one; /* i.e. including the null entry; 0 means unclaimed */
 	unsigned short next_victim;
 	unsigned char head_mru;
 	unsigned char tail_mru;
+	_Bool claimed;
+	unsigned int remote_invalid; /* set by other threads, drained by the owner */
+	/* A conservative summary of the obj_base of every valid entry: all lie
+	 * in [base_lo, base_hi). Lets uncaching skip caches that can't match. */
+	const void *base_lo;
+	const void *base_hi;
 	/* We use index 0 to mean "unused" / "null". */
 	struct __liballocs_memrange_cache_entry_s entries[1 + LIBALLOCS_MEMRANGE_CACHE_MAX_SIZE];
 };
-extern struct __liballocs_memrange_cache /* __thread */ __liballocs_ool_cache;
+#ifndef NO_TLS
+extern __thread struct __liballocs_memrange_cache *__liballocs_ool_cache;
+#else
+extern struct __liballocs_memrange_cache *__liballocs_ool_cache;
+#endif
 
 extern inline void (__attribute__((always_inline,gnu_inline,used)) __liballocs_check_cache_sanity )(struct __liballocs_memrange_cache *cache __attribute__((unused)));
 extern inline void (__attribute__((always_inline,gnu_inline,used)) __liballocs_check_cache_sanity )(struct __liballocs_memrange_cache *cache __attribute__((unused)))
@@ -223,9 +242,31 @@ extern inline void (__attribute__((always_inline,gnu_inline,used)) __liballocs_c
 	if (cache->tail_mru == i) cache->tail_mru = our_prev;
 	/* We're definitely invalid. */
 	cache->validity &= ~(1u<<(i-1));
+	/* If nothing's valid, the summary can be emptied. */
+	if (!cache->validity)
+	{
+		cache->base_lo = (const void *) -1;
+		cache->base_hi = (const void *) 0;
+	}
 	__liballocs_check_cache_sanity(cache);
 }
 
+extern inline void (__attribute__((always_inline,gnu_inline,used)) __liballocs_cache_drain_remote_invalid )(struct __liballocs_memrange_cache *cache);
+extern inline void (__attribute__((always_inline,gnu_inline,used)) __liballocs_cache_drain_remote_invalid )(struct __liballocs_memrange_cache *cache)
+{
+	if (unlikely(__atomic_load_n(&cache->remote_invalid, __ATOMIC_RELAXED)))
+	{
+		unsigned int to_unlink = __atomic_exchange_n(&cache->remote_invalid, 0u,
+			__ATOMIC_ACQUIRE) & cache->validity;
+		while (to_unlink)
+		{
+			unsigned i = __builtin_ctz(to_unlink) + 1;
+			__liballocs_cache_unlink(cache, i);
+			to_unlink &= ~(1u<<(i-1));
+		}
+	}
+}
+
 extern inline void (__attribute__((always_inline,gnu_inline,used)) __liballocs_cache_push_head_mru )(struct __liballocs_memrange_cache *cache, unsigned i);
 extern inline void (__attribute__((always_inline,gnu_inline,used)) __liballocs_cache_push_head_mru )(struct __liballocs_memrange_cache *cache, unsigned i)
 {
@@ -279,6 +320,7 @@ struct __liballocs_memrange_cache_entry_s *(__attribute__((always_inline,gnu_inl
 __liballocs_memrange_cache_lookup )(struct __liballocs_memrange_cache *cache, const void *obj, struct uniqtype *t, unsigned long require_period)
 {
 #ifndef LIBALLOCS_NOOP_INLINES
+	__liballocs_cache_drain_remote_invalid(cache);
 	__liballocs_check_cache_sanity(cache);
 #ifdef LIBALLOCS_CACHE_LINEAR
 	for (unsigned char i = 1; i < cache->size_plus_one; ++i)
@@ -319,6 +361,7 @@ struct __liballocs_memrange_cache_entry_s *(__attribute__((always_inline,gnu_inl
 __liballocs_memrange_cache_lookup_notype )(struct __liballocs_memrange_cache *cache, const void *obj, unsigned long require_period)
 {
 #ifndef LIBALLOCS_NOOP_INLINES
+	__liballocs_cache_drain_remote_invalid(cache);
 	__liballocs_check_cache_sanity(cache);
 #ifdef LIBALLOCS_CACHE_LINEAR
 	for (unsigned char i = 1; i < cache->size_plus_one; ++i)
@@ -353,7 +396,7 @@ extern inline struct uniqtype *(__attribute__((always_inline,gnu_inline,used)) _
 extern inline struct uniqtype *(__attribute__((always_inline,gnu_inline,used)) __liballocs_get_cached_object_type)(const void *addr)
 {
 	struct __liballocs_memrange_cache_entry_s *found = __liballocs_memrange_cache_lookup_notype(
-		&__liballocs_ool_cache,
+		__liballocs_ool_cache,
 		addr, 0);
 	/* This will give us "zero-offset matches", but not contained matches. 
 	 * I.e. we know that "addr" is a "found->uniqtype", but we pass over
@@ -363,6 +406,7 @@ extern inline struct uniqtype *(__attribute__((always_inline,gnu_inline,used)) _
 }
 
 void __liballocs_uncache_all(const void *allocptr, unsigned long size);
+struct __liballocs_memrange_cache *__liballocs_claim_memrange_cache(void);
 
 extern inline void
 (__attribute__((always_inline,gnu_inline)) __liballocs_cache_with_type)(
@@ -370,7 +414,9 @@ extern inline void
 	const void *obj_base, const void *obj_limit, const struct uniqtype *t, 
 	short depth, unsigned short period, const void *alloc_base)
 {
-	assert((__liballocs_check_cache_sanity(&__liballocs_ool_cache), 1));
+	/* An unclaimed or zero-sized cache holds nothing. */
+	if (c->size_plus_one <= 1) return;
+	assert((__liballocs_check_cache_sanity(c), 1));
 #ifdef LIBALLOCS_CACHE_REPLACE_FIFO
 	unsigned pos = c->next_victim;
 #else
@@ -383,7 +429,9 @@ extern inline void
 		assert(pos != 0);
 	}
 #endif
-	// unsigned pos = __liballocs_ool_cache.next_victim;
+	// unsigned pos = __liballocs_ool_cache->next_victim;
+	if ((const char *) obj_base < (const char *) c->base_lo) c->base_lo = obj_base;
+	if ((const char *) obj_base >= (const char *) c->base_hi) c->base_hi = (const char *) obj_base + 1;
 	c->entries[pos] = (struct __liballocs_memrange_cache_entry_s) {
 		.obj_base = obj_base,
 		.obj_limit = obj_limit,
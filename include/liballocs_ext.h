@@ -15,6 +15,7 @@ void *__liballocs_private_realloc(void*, size_t);
 void __liballocs_private_free(void *);
 
 void __liballocs_free_arena_bitmap_and_info(void *info  /* really struct arena_bitmap_info * */);
+void __liballocs_grow_arena_bitmap(void *info  /* really struct arena_bitmap_info * */, unsigned long total_words);
 
 /* All the above are created as global aliases (would ideally
  * be protected ). */
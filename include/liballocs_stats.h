@@ -0,0 +1,179 @@
+#ifndef LIBALLOCS_STATS_H_
+#define LIBALLOCS_STATS_H_
+
+#include <string.h>
+
+/* Query statistics. Each thread counts into its own cache-line-aligned
+ * block, claimed from a pool on its first count, so a count is a plain
+ * store to memory no other thread writes. The pool lives in a single
+ * mapping that starts with a self-describing header. It can be given a
+ * name under /dev/shm (LIBALLOCS_STATS_SHM, or __liballocs_stats_export)
+ * so that an external tool can map it read-only and add up the blocks
+ * with the same __liballocs_stats_sum() that the in-process reader uses.
+ *
+ * The fixed counters are always kept, in private memory that appears on
+ * the first count; only if LIBALLOCS_STATS or LIBALLOCS_STATS_SHM is set
+ * (or the pool is exported before the first count) is it shareable.
+ * Per-allocator query counts and get_info latency histograms cost a clock
+ * read per query, so they too are only kept if asked for.
+ *
+ * Sums are not snapshots: every counter is read atomically, but not all
+ * at the same instant, and a count may briefly appear twice while an
+ * exiting thread's block is folded into the retired block. */
+
+#define LIBALLOCS_STATS_COUNTERS(f) \
+	f(ABORTED_UNKNOWN_STORAGE,        "queries aborted for unknown storage") \
+	f(HIT_STATIC_CASE,                "queries handled by static case") \
+	f(HIT_STACK_CASE,                 "queries handled by stack case") \
+	f(HIT_HEAP_CASE,                  "queries handled by heap case") \
+	f(HIT_ALLOCA_CASE,                "queries handled by alloca case") \
+	f(ABORTED_UNINDEXED_HEAP,         "queries aborted for unindexed heap") \
+	f(ABORTED_UNRECOGNISED_ALLOCSITE, "queries aborted for unknown heap allocsite") \
+	f(ABORTED_UNINDEXED_ALLOCA,       "queries aborted for unindexed alloca") \
+	f(ABORTED_STACK,                  "queries aborted for unknown stackframes") \
+	f(ABORTED_STATIC,                 "queries aborted for unknown static obj")
+
+enum __liballocs_stat
+{
+#define __liballocs_stat_enumerator(tok, desc) LIBALLOCS_STAT_ ## tok,
+	LIBALLOCS_STATS_COUNTERS(__liballocs_stat_enumerator)
+#undef __liballocs_stat_enumerator
+	LIBALLOCS_STAT_NCOUNTERS
+};
+
+static inline const char *__liballocs_stat_name(enum __liballocs_stat which)
+{
+	switch (which)
+	{
+#define __liballocs_stat_case(tok, desc) case LIBALLOCS_STAT_ ## tok: return desc;
+		LIBALLOCS_STATS_COUNTERS(__liballocs_stat_case)
+#undef __liballocs_stat_case
+		default: return "(unknown)";
+	}
+}
+
+#ifndef LIBALLOCS_STATS_MAX_ALLOCATORS
+#define LIBALLOCS_STATS_MAX_ALLOCATORS 16
+#endif
+#define LIBALLOCS_STATS_ALLOCATOR_NAME_MAX 32
+/* Bucket i counts get_info calls taking [2^i, 2^(i+1)) ns; bucket 0 also
+ * takes zero, and the last bucket everything above. */
+#define LIBALLOCS_STATS_LATENCY_NBUCKETS 32
+#ifndef LIBALLOCS_STATS_NPOOL
+#define LIBALLOCS_STATS_NPOOL 256
+#endif
+#define LIBALLOCS_STATS_MAGIC 0x0a7374617473616cul /* "lastats\n" */
+#define LIBALLOCS_STATS_VERSION 1
+
+struct __liballocs_stats_block
+{
+	_Bool claimed;
+	_Bool shared; /* counted into by many threads, so needs atomic adds */
+	unsigned long counters[LIBALLOCS_STAT_NCOUNTERS];
+	unsigned long alloc_queries[LIBALLOCS_STATS_MAX_ALLOCATORS];
+	unsigned long alloc_failures[LIBALLOCS_STATS_MAX_ALLOCATORS];
+	unsigned long alloc_latency[LIBALLOCS_STATS_MAX_ALLOCATORS][LIBALLOCS_STATS_LATENCY_NBUCKETS];
+} __attribute__((aligned(64)));
+
+/* The layout of the whole mapping. A reader should check magic, version
+ * and block_size before trusting the rest. */
+struct __liballocs_stats_shm
+{
+	unsigned long magic;
+	unsigned version;
+	unsigned block_size;
+	int pid;
+	unsigned npool;
+	unsigned highwater; /* one past the highest pool block ever claimed */
+	unsigned nallocators;
+	char allocator_names[LIBALLOCS_STATS_MAX_ALLOCATORS][LIBALLOCS_STATS_ALLOCATOR_NAME_MAX];
+	struct __liballocs_stats_block retired;  /* counts from exited threads */
+	struct __liballocs_stats_block overflow; /* shared once the pool is exhausted */
+	struct __liballocs_stats_block pool[LIBALLOCS_STATS_NPOOL];
+};
+
+struct liballocs_stats
+{
+	unsigned long counters[LIBALLOCS_STAT_NCOUNTERS];
+	unsigned nallocators;
+	const char *allocator_names[LIBALLOCS_STATS_MAX_ALLOCATORS];
+	unsigned long alloc_queries[LIBALLOCS_STATS_MAX_ALLOCATORS];
+	unsigned long alloc_failures[LIBALLOCS_STATS_MAX_ALLOCATORS];
+	unsigned long alloc_latency[LIBALLOCS_STATS_MAX_ALLOCATORS][LIBALLOCS_STATS_LATENCY_NBUCKETS];
+};
+
+static inline void __liballocs_stats_add_block(struct liballocs_stats *out,
+	const struct __liballocs_stats_block *b)
+{
+	for (unsigned i = 0; i < LIBALLOCS_STAT_NCOUNTERS; ++i)
+		out->counters[i] += __atomic_load_n(&b->counters[i], __ATOMIC_RELAXED);
+	for (unsigned a = 0; a < out->nallocators; ++a)
+	{
+		out->alloc_queries[a] += __atomic_load_n(&b->alloc_queries[a], __ATOMIC_RELAXED);
+		out->alloc_failures[a] += __atomic_load_n(&b->alloc_failures[a], __ATOMIC_RELAXED);
+		for (unsigned j = 0; j < LIBALLOCS_STATS_LATENCY_NBUCKETS; ++j)
+			out->alloc_latency[a][j] += __atomic_load_n(&b->alloc_latency[a][j], __ATOMIC_RELAXED);
+	}
+}
+
+/* Sum a stats mapping, whether our own or another process's. */
+static inline void __liballocs_stats_sum(const struct __liballocs_stats_shm *s,
+	struct liballocs_stats *out)
+{
+	memset(out, 0, sizeof *out);
+	if (!s) return;
+	unsigned nallocators = __atomic_load_n(&s->nallocators, __ATOMIC_ACQUIRE);
+	if (nallocators > LIBALLOCS_STATS_MAX_ALLOCATORS) nallocators = LIBALLOCS_STATS_MAX_ALLOCATORS;
+	out->nallocators = nallocators;
+	for (unsigned a = 0; a < nallocators; ++a) out->allocator_names[a] = s->allocator_names[a];
+	__liballocs_stats_add_block(out, &s->retired);
+	__liballocs_stats_add_block(out, &s->overflow);
+	unsigned highwater = __atomic_load_n(&s->highwater, __ATOMIC_ACQUIRE);
+	if (highwater > s->npool) highwater = s->npool;
+	for (unsigned i = 0; i < highwater; ++i) __liballocs_stats_add_block(out, &s->pool[i]);
+}
+
+#ifndef NO_TLS
+extern __thread struct __liballocs_stats_block *__liballocs_stats_mine;
+#else
+extern struct __liballocs_stats_block *__liballocs_stats_mine;
+#endif
+/* Nonzero if per-allocator counts and latencies are being kept. */
+extern int __liballocs_stats_detail;
+
+struct __liballocs_stats_block *__liballocs_stats_claim_block(void);
+unsigned long __liballocs_stats_now_ns(void);
+struct allocator;
+struct liballocs_err;
+void __liballocs_stats_note_query(struct allocator *a, struct liballocs_err *err,
+	unsigned long t0_ns);
+
+/* Sum our own statistics. */
+void __liballocs_stats_read(struct liballocs_stats *out);
+/* The old global counters, kept for client DSOs. Counts added to them are
+ * taken into the statistics, and they are set to the totals, whenever
+ * the statistics are read; otherwise they are not kept up to date. */
+extern unsigned long __liballocs_hit_heap_case;
+extern unsigned long __liballocs_aborted_unindexed_heap;
+extern unsigned long __liballocs_aborted_unrecognised_allocsite;
+/* Give our stats mapping a name that other processes can open: path, or
+ * /dev/shm/liballocs-stats.<pid> if path is null. Returns the name, or
+ * null if the mapping cannot be named. */
+const char *__liballocs_stats_export(const char *path);
+
+static inline void __liballocs_stats_bump(struct __liballocs_stats_block *b,
+	unsigned long *counter)
+{
+	if (__builtin_expect(b->shared, 0)) __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+	else __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + 1,
+		__ATOMIC_RELAXED);
+}
+
+static inline void __liballocs_stat_inc(enum __liballocs_stat which)
+{
+	struct __liballocs_stats_block *b = __liballocs_stats_mine;
+	if (__builtin_expect(!b, 0)) b = __liballocs_stats_claim_block();
+	__liballocs_stats_bump(b, &b->counters[which]);
+}
+
+#endif
@@ -53,8 +53,30 @@ struct insert
 #endif
 	union __attribute__((packed))
 	{
-		unsigned bits:16; /* used to store alloc site in compact form */
+		/* Used to store alloc site in compact form. In generic malloc inserts,
+		 * this is the allocsite id, or (allocsite_id_t) -1 if not yet known;
+		 * it is filled in when alloc_site is replaced by the uniqtype. */
+		unsigned bits:16;
 	} un;
 } __attribute__((packed));
 
+/* Read or replace a whole insert with one access, so that a racing reader
+ * sees either the old insert or the new, never a mixture. Assigning the
+ * packed struct doesn't promise that. */
+static __inline__ struct insert insert_load(const struct insert *p_ins)
+{
+	unsigned long long word = __atomic_load_n((const unsigned long long *) p_ins, __ATOMIC_RELAXED);
+	struct insert ins;
+	(void) sizeof (char[(sizeof ins == sizeof word) ? 1 : -1]);
+	__builtin_memcpy(&ins, &word, sizeof ins);
+	return ins;
+}
+static __inline__ void insert_store(struct insert *p_ins, struct insert ins)
+{
+	unsigned long long word;
+	(void) sizeof (char[(sizeof ins == sizeof word) ? 1 : -1]);
+	__builtin_memcpy(&word, &ins, sizeof word);
+	__atomic_store_n((unsigned long long *) p_ins, word, __ATOMIC_RELAXED);
+}
+
 #endif
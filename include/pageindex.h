@@ -20,6 +20,7 @@
  */
 
 struct allocator;
+struct bigalloc_child_index;
 struct big_allocation
 {
 	void *begin;
@@ -34,6 +35,11 @@ struct big_allocation
 	void (*allocator_private_free)(void*);
 	void *suballocator_private;     // metadata for use by the suballocator, if any -- generic_small uses this to hold its chunk_rec
 	void (*suballocator_private_free)(void*);
+	unsigned nchildren;
+	/* Once a bigalloc has many children, we also keep them in an
+	 * address-ordered array, so that finding the child containing an
+	 * address is a binary search rather than a walk of the sibling list. */
+	struct bigalloc_child_index *child_index;
 	/* Contemplating adding some common suballocator helpers -- if
 	 * we fix these, we gain some potential for fast paths later.
 	 * But shortcut vectors only really make sense for static
@@ -55,7 +61,10 @@ struct big_allocation
 	 */
 };
 #define BIGALLOC_IN_USE(b) ((b)->begin && (b)->end)
-#define NBIGALLOCS 1024
+/* Every number a bigalloc_num_t can hold, though entry 0 is never used.
+ * The table is only touched up to its high-water mark, so most of it
+ * stays as untouched zero pages. */
+#define NBIGALLOCS 65536
 extern struct big_allocation big_allocations[] __attribute__((weak));
 extern struct big_allocation __liballocs_big_allocations[] __attribute__((weak));
 
@@ -66,6 +75,15 @@ typedef uint16_t bigalloc_num_t;
 // If I didn't want that (good arguments for a single <allocs.h>), then some refactoring to do.
 extern bigalloc_num_t *pageindex __attribute__((weak));
 extern bigalloc_num_t *__liballocs_pageindex __attribute__((weak));
+/* An auxiliary index mapping page numbers to the deepest bigalloc, if
+ * one bigalloc covers the whole page and none of its children overlap
+ * any of it. Then that bigalloc is the deepest for every address in the
+ * page, and a query needs just one load. Zero means "don't know". Entries
+ * are filled lazily by queries and cleared when the tree changes. The
+ * sequence number is odd while the tree is changing; a query that filled
+ * an entry while it changed must undo the fill. */
+extern bigalloc_num_t *__liballocs_pageindex_leaf __attribute__((weak));
+extern unsigned long __liballocs_pageindex_leaf_seq __attribute__((weak));
 
 enum object_memory_kind __liballocs_get_memory_kind(const void *obj) __attribute__((visibility("protected")));
 
@@ -93,12 +111,14 @@ struct big_allocation *__lookup_bigalloc_from_root(const void *mem, struct alloc
 struct big_allocation *__lookup_bigalloc_from_root_by_suballocator(const void *mem, struct allocator *sub_a, void **out_object_start);
 struct big_allocation *__lookup_bigalloc_top_level(const void *mem);
 struct big_allocation *__lookup_deepest_bigalloc(const void *mem);
+_Bool __liballocs_bigalloc_is_leaf_for_page(struct big_allocation *b, const void *obj) __attribute__((visibility("protected")));
 
 struct allocator *__liballocs_get_allocator_upper_bound(const void *obj) __attribute__((visibility("protected")));
 struct allocator *__liballocs_ool_get_allocator(const void *obj) __attribute__((visibility("protected")));
 _Bool __pages_unused(void *begin, void *end) __attribute__((visibility("hidden")));
 _Bool __liballocs_notify_unindexed_address(const void *);
 void __adjust_bigalloc_end(struct big_allocation *b, void *new_curbrk) __attribute__((visibility("hidden")));
+void __liballocs_invalidate_pageindex_leaf(const void *begin, const void *end) __attribute__((visibility("hidden")));
 
 /* mappings of 4GB or more in size are assumed to be memtables and are ignored */
 #define BIGGEST_BIGALLOC BIGGEST_SANE_USER_ALLOC
@@ -142,11 +162,38 @@ __liballocs_infer_allocator(void *obj, struct big_allocation *maybe_the_allocati
 	return a;
 }
 
+static inline
+void __liballocs_pageindex_leaf_fill(const void *obj, struct big_allocation *b,
+	unsigned long seq_before)
+{
+	if (seq_before & 1) return;
+	if (!__liballocs_bigalloc_is_leaf_for_page(b, obj)) return;
+	bigalloc_num_t *p_entry = &__liballocs_pageindex_leaf[PAGENUM(obj)];
+	__atomic_store_n(p_entry, (bigalloc_num_t) (b - &__liballocs_big_allocations[0]), __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&__liballocs_pageindex_leaf_seq, __ATOMIC_SEQ_CST) != seq_before)
+	{
+		/* The tree changed under us, so our answer may be stale. */
+		__atomic_store_n(p_entry, (bigalloc_num_t) 0, __ATOMIC_SEQ_CST);
+	}
+}
+
 inline
 struct allocator *__liballocs_leaf_allocator_for(const void *obj,
 	struct big_allocation **out_bigalloc)
 {
 	struct big_allocation *deepest = NULL;
+	unsigned long seq_before = 1;
+	if (__builtin_expect(__liballocs_pageindex_leaf != NULL, 1))
+	{
+		bigalloc_num_t leaf_num = __atomic_load_n(
+			&__liballocs_pageindex_leaf[PAGENUM(obj)], __ATOMIC_RELAXED);
+		if (__builtin_expect(leaf_num != 0, 1))
+		{
+			deepest = &__liballocs_big_allocations[leaf_num];
+			goto found;
+		}
+		seq_before = __atomic_load_n(&__liballocs_pageindex_leaf_seq, __ATOMIC_SEQ_CST);
+	}
 	for (struct big_allocation *cur = __liballocs_get_bigalloc_containing(obj);
 			__builtin_expect(cur != NULL, 1);
 			)
@@ -205,6 +252,8 @@ struct allocator *__liballocs_leaf_allocator_for(const void *obj,
 	 */
 	
 	if (__builtin_expect(!deepest, 0)) return NULL;
+	if (__liballocs_pageindex_leaf) __liballocs_pageindex_leaf_fill(obj, deepest, seq_before);
+found:
 	if (out_bigalloc) *out_bigalloc = deepest;
 	if (__builtin_expect(deepest->suballocator != NULL, 1))
 	{
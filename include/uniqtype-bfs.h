@@ -55,6 +55,28 @@ void __uniqtype_walk_bfs_from_object(
 	follow_ptr_fn *follow_ptr, void *fp_arg,
 	on_blacken_fn *on_blacken, void *ob_arg);
 
+/* Parallel walks visit each reachable object once, in no particular
+ * order unless on_discover is given, in which case the walk proceeds
+ * level by level and reports each object as it is first reached, with
+ * the object it was reached from and its distance from the root. Unless
+ * UNIQTYPE_BFS_THREADSAFE_CALLBACKS is set, callbacks are serialized. */
+typedef void on_discover_fn(void *obj, struct uniqtype *t,
+	void *predecessor, unsigned long distance, void *);
+#define UNIQTYPE_BFS_THREADSAFE_CALLBACKS 0x1u
+struct __uniqtype_bfs_opts
+{
+	unsigned nthreads; /* 0 means $LIBALLOCS_BFS_THREADS, else one per CPU */
+	unsigned flags;
+	on_discover_fn *on_discover;
+	void *od_arg;
+};
+
+void __uniqtype_walk_bfs_parallel(
+	void *object, struct uniqtype *t,
+	follow_ptr_fn *follow_ptr, void *fp_arg,
+	on_blacken_fn *on_blacken, void *ob_arg,
+	const struct __uniqtype_bfs_opts *opts);
+
 void __uniqtype_process_bfs_queue(
 	__uniqtype_node_rec **p_q_head,
 	__uniqtype_node_rec **p_q_tail,
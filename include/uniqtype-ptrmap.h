@@ -0,0 +1,49 @@
+#ifndef UNIQTYPE_PTRMAP_H_
+#define UNIQTYPE_PTRMAP_H_
+
+/* Pointer maps: where the pointers in an instance of a uniqtype live.
+ * Each uniqtype's map is computed on first request and cached, so graph
+ * walks, copy notification and the like can iterate over a flat list
+ * instead of recursing through subobjects on every visit. Small arrays
+ * are flattened into their enclosing map; bigger ones become a single
+ * "run" entry repeating the element's map at a stride, so that a walk
+ * over a sub-range can skip straight to the elements it touches.
+ * A map is not a compact bitmap: each entry is 32 bytes on LP64, since
+ * it carries the pointer's type, so a map costs 32 bytes per pointer
+ * (or per run) plus its header. */
+
+struct uniqtype;
+struct uniqtype_ptrmap;
+
+struct uniqtype_ptrmap_entry
+{
+	unsigned long offset;              /* of the pointer, or of a run's first element */
+	struct uniqtype *ptr_t;            /* the pointer's type, or NULL for a run */
+	const struct uniqtype_ptrmap *run; /* for a run, the element's map */
+	unsigned long run_count;           /* ... and how many elements */
+};
+#define UNIQTYPE_PTRMAP_UNBOUNDED (~0ul)
+
+struct uniqtype_ptrmap
+{
+	struct uniqtype *t;
+	unsigned long size;                /* in bytes; the stride when repeated */
+	unsigned nentries;                 /* zero iff the type is pointer-free */
+	struct uniqtype_ptrmap_entry entries[];
+};
+
+const struct uniqtype_ptrmap *__liballocs_get_ptrmap(struct uniqtype *t);
+
+static inline _Bool __uniqtype_ptrmap_has_pointers(const struct uniqtype_ptrmap *m)
+{
+	return m && m->nentries != 0;
+}
+
+typedef void uniqtype_ptrmap_cb(void **slot, struct uniqtype *ptr_t, void *arg);
+/* Call cb for each pointer slot of the object at obj that lies wholly
+ * within [lo, hi), in address order. */
+void __liballocs_ptrmap_for_each_in_range(const struct uniqtype_ptrmap *m,
+	void *obj, const void *lo, const void *hi,
+	uniqtype_ptrmap_cb *cb, void *arg);
+
+#endif
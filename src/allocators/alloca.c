@@ -51,7 +51,7 @@ liballocs_err_t __alloca_get_info(void *obj, struct big_allocation *b,
 	struct uniqtype **out_type, void **out_base,
 	unsigned long *out_size, const void **out_site)
 {
-	++__liballocs_hit_alloca_case;
+	__liballocs_stat_inc(LIBALLOCS_STAT_HIT_ALLOCA_CASE);
 	struct insert *heap_info = NULL;
 	void *base;
 	size_t caller_usable_size;
@@ -65,7 +65,7 @@ liballocs_err_t __alloca_get_info(void *obj, struct big_allocation *b,
 		obj, &base, &alloc_usable_chunksize, NULL, usable_size)))
 	{
 		/* For an unindexed chunk, we don't know the base, so we don't know anything. */
-		++__liballocs_aborted_unindexed_alloca;
+		__liballocs_stat_inc(LIBALLOCS_STAT_ABORTED_UNINDEXED_ALLOCA);
 		return &__liballocs_err_unindexed_alloca_object;
 	}
 	assert(base);
@@ -74,7 +74,7 @@ liballocs_err_t __alloca_get_info(void *obj, struct big_allocation *b,
 	assert(heap_info);
 	if (out_base) *out_base = base;
 	if (out_size) *out_size = caller_usable_size;
-	if (out_type || out_site) return extract_and_output_alloc_site_and_type(
+	if (out_type || out_site) return extract_and_output_generic_malloc_site_and_type(
 		heap_info, out_type, (void**) out_site);
 	// no error
 	return NULL;
@@ -91,6 +91,10 @@ void __liballocs_unindex_stack_objects_counted_by(unsigned long *bytes_counter,
 {
 	struct big_allocation *b = __lookup_bigalloc_under_pageindex(bytes_counter,
 		&__stackframe_allocator, NULL);
+	/* The range of chunks we unindex, for invalidating the cache. */
+	unsigned long total_to_unindex = *bytes_counter;
+	uintptr_t chunks_begin = (uintptr_t) -1;
+	uintptr_t chunks_end = 0;
 	if (*bytes_counter == 0) goto out;
 	if (!b) abort();
 	
@@ -105,45 +109,64 @@ void __liballocs_unindex_stack_objects_counted_by(unsigned long *bytes_counter,
 	ensure_arena_covers_addr(b, sp);
 
 	struct arena_bitmap_info *info = b->suballocator_private;
-	unsigned long total_to_unindex = *bytes_counter;
 	unsigned long total_unindexed = 0;
-	unsigned chunks_unindexed = 0;
 	assert(!info->bitmap_base_addr || info->bitmap_base_addr == ROUND_DOWN_PTR(b->begin, ALLOCA_ALIGN*BITMAP_WORD_NBITS));
-	// pretend we're currently on 'one before the initial search start pos'
-	unsigned long cur_bit_idx = (((uintptr_t) sp - (uintptr_t) info->bitmap_base_addr)
-			/ ALLOCA_ALIGN) - 1;
-	
-	/* Iterate forward over bits */
-	while ((unsigned long)-1 != (cur_bit_idx = bitmap_find_first_set1_geq_l(
-			info->bitmap, info->bitmap + info->nwords,
-			cur_bit_idx + 1, NULL)))
+	/* The arena is private to this thread's frame, so rather than
+	 * deleting chunk by chunk (each taking the lock and flushing the
+	 * cache), we walk the set bits from sp upwards a word at a time,
+	 * clear each word's bits with one store, and invalidate the cache
+	 * once for the whole range at the end. */
+	unsigned long start_bit_idx = ((uintptr_t) sp - (uintptr_t) info->bitmap_base_addr)
+			/ ALLOCA_ALIGN;
+	for (unsigned long word_idx = start_bit_idx / BITMAP_WORD_NBITS;
+			word_idx < info->nwords; ++word_idx)
 	{
-		void *cur_userchunk = (void*)((uintptr_t) info->bitmap_base_addr
-			+ (cur_bit_idx * ALLOCA_ALIGN));
-		debug_printf(0, "Walking an alloca chunk at %p (bitmap base: %p) idx %d\n", cur_userchunk,
-			(void*) info->bitmap_base_addr, (int) cur_bit_idx);
-		struct insert *cur_insert = insert_for_chunk(cur_userchunk, usable_size);
-
-		unsigned long bytes_to_unindex = usable_size(cur_userchunk);
-		assert(ALLOCA_ALIGN == MALLOC_ALIGN);
-		__generic_malloc_index_delete(b, cur_userchunk, usable_size);
-		assert(bytes_to_unindex < BIGGEST_SANE_ALLOCA);
-		total_unindexed += bytes_to_unindex;
-		if (total_unindexed >= total_to_unindex)
+		bitmap_word_t word = info->bitmap[word_idx];
+		if (word_idx == start_bit_idx / BITMAP_WORD_NBITS)
 		{
-			if (total_unindexed > total_to_unindex)
+			word &= ~(bitmap_word_t) 0 << (start_bit_idx % BITMAP_WORD_NBITS);
+		}
+		if (!word) continue;
+		bitmap_word_t cleared = 0;
+		_Bool done = 0;
+		while (word && !done)
+		{
+			unsigned bit = __builtin_ctzl(word);
+			word &= word - 1;
+			cleared |= (bitmap_word_t) 1 << bit;
+			void *cur_userchunk = (void*)((uintptr_t) info->bitmap_base_addr
+				+ ((word_idx * BITMAP_WORD_NBITS + bit) * ALLOCA_ALIGN));
+			debug_printf(2, "Walking an alloca chunk at %p (bitmap base: %p) idx %lu\n", cur_userchunk,
+				(void*) info->bitmap_base_addr, word_idx * BITMAP_WORD_NBITS + bit);
+			unsigned long bytes_to_unindex = usable_size(cur_userchunk);
+			assert(bytes_to_unindex < BIGGEST_SANE_ALLOCA);
+			assert(ALLOCA_ALIGN == MALLOC_ALIGN);
+			/* Big chunks were promoted to bigallocs, so need the full treatment. */
+			if (__builtin_expect(SHOULD_PROMOTE_TO_BIGALLOC(cur_userchunk, bytes_to_unindex), 0))
 			{
-				fprintf(stderr, 
-					"Warning: unindexed too many bytes "
-					"(requested %lu from %p; got %lu)\n",
-					total_to_unindex, frame_addr, total_unindexed);
+				__generic_malloc_index_delete(b, cur_userchunk, usable_size);
 			}
-			goto out;
+			if ((uintptr_t) cur_userchunk < chunks_begin) chunks_begin = (uintptr_t) cur_userchunk;
+			chunks_end = (uintptr_t) cur_userchunk + bytes_to_unindex;
+			total_unindexed += bytes_to_unindex;
+			done = (total_unindexed >= total_to_unindex);
 		}
+		info->bitmap[word_idx] &= ~cleared;
+		if (!info->bitmap[word_idx] && info->summary) bitmap_clear_l(info->summary, word_idx);
+		if (done) break;
+	}
+	if (total_unindexed > total_to_unindex)
+	{
+		fprintf(stderr, 
+			"Warning: unindexed too many bytes "
+			"(requested %lu from %p; got %lu)\n",
+			total_to_unindex, frame_addr, total_unindexed);
 	}
 out:
 	/* FIXME: be more discriminating in what cache we zap -- only ours or children */
-	__liballocs_uncache_all(frame_addr, total_to_unindex);
+	if ((uintptr_t) frame_addr < chunks_begin) chunks_begin = (uintptr_t) frame_addr;
+	if ((uintptr_t) frame_addr + total_to_unindex > chunks_end) chunks_end = (uintptr_t) frame_addr + total_to_unindex;
+	__liballocs_uncache_all((void*) chunks_begin, chunks_end - chunks_begin);
 	if (b) __liballocs_delete_bigalloc_at(bytes_counter, &__stackframe_allocator);
 }
 
@@ -182,6 +205,8 @@ static void realloc_bitmap_prepend(struct arena_bitmap_info *info,
 		}
 		// zero the fresh bits, which are at the beginning
 		bzero(info->bitmap, sizeof (bitmap_word_t) * nwords_added);
+		// the shift moved every word, so the summary is stale
+		rebuild_index_summary(info);
 	}
 }
 static void *first_chunk_addr(struct big_allocation *arena, long *out_bit_idx)
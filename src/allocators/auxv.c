@@ -120,7 +120,12 @@ void __auxv_allocator_notify_init_stack_mapping_sequence(struct big_allocation *
 	{
 		/* We've been here before. Adjust the lower bound of the stack,
 		 * which is the *minimum* of the *begins*. */
-		if ((char*) our_bigalloc->begin > (char*) begin) our_bigalloc->begin = begin;
+		if ((char*) our_bigalloc->begin > (char*) begin)
+		{
+			void *old_begin = our_bigalloc->begin;
+			our_bigalloc->begin = begin;
+			__liballocs_invalidate_pageindex_leaf(begin, old_begin);
+		}
 		/* We also adjust the upper bound of the stack. The reason is a giant
 		 * HACK. After the "[stack]" region which is rwx, there may be a separate rw-
 		 * region which contains the asciiz but is a separate /proc line. When we are
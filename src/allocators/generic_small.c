@@ -778,7 +778,7 @@ static liballocs_err_t get_info(void *obj, struct big_allocation *b,
 		container, out_base, out_size);
 	if (!heap_info)
 	{
-		++__liballocs_aborted_unindexed_heap;
+		__liballocs_stat_inc(LIBALLOCS_STAT_ABORTED_UNINDEXED_HEAP);
 		return &__liballocs_err_unindexed_heap_object;
 	}
 	
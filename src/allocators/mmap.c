@@ -9,6 +9,9 @@
 #include <string.h>
 #include <dlfcn.h>
 #include <link.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include "librunt.h"
 #include "relf.h"
 #include "maps.h"
@@ -57,7 +60,85 @@ static const char *filename_for_fd(int fd)
 
 static void check_mapping_sequence_sanity(struct mapping_sequence *cur);
 
-/* How are we supposed to allocate the mapping sequence metadata? */
+/* How are we supposed to allocate the mapping sequence metadata?
+ * The sequence struct and its mappings vector both live in the private
+ * heap. Temporary sequences on the stack start out empty and get a
+ * vector on their first augment; whoever owns them must clear them. */
+#define MAPPING_SEQUENCE_INITIAL_LEN 8
+
+static void mapping_sequence_reserve(struct mapping_sequence *seq, unsigned n)
+{
+	if (n <= seq->nalloc) return;
+	unsigned new_nalloc = seq->nalloc ? seq->nalloc : MAPPING_SEQUENCE_INITIAL_LEN;
+	while (new_nalloc < n) new_nalloc *= 2;
+	struct mapping_entry *new_mappings;
+	if (seq->mappings_borrowed || !seq->mappings)
+	{
+		new_mappings = __private_malloc(new_nalloc * sizeof (struct mapping_entry));
+		if (!new_mappings) abort();
+		if (seq->nused) memcpy(new_mappings, seq->mappings,
+			seq->nused * sizeof (struct mapping_entry));
+	}
+	else
+	{
+		new_mappings = __private_realloc(seq->mappings,
+			new_nalloc * sizeof (struct mapping_entry));
+		if (!new_mappings) abort();
+	}
+	seq->mappings = new_mappings;
+	seq->nalloc = new_nalloc;
+	seq->mappings_borrowed = 0;
+}
+static void mapping_sequence_clear(struct mapping_sequence *seq)
+{
+	if (seq->mappings && !seq->mappings_borrowed) __private_free(seq->mappings);
+	*seq = (struct mapping_sequence) { .begin = NULL };
+}
+/* Make dst a copy of src, reusing dst's vector where it is big enough. */
+static void mapping_sequence_assign(struct mapping_sequence *dst,
+	struct mapping_sequence *src)
+{
+	if (dst == src) return;
+	mapping_sequence_reserve(dst, src->nused);
+	if (src->nused) memcpy(dst->mappings, src->mappings,
+		src->nused * sizeof (struct mapping_entry));
+	dst->begin = src->begin;
+	dst->end = src->end;
+	dst->filename = src->filename;
+	dst->nused = src->nused;
+}
+static void free_mapping_sequence(void *arg)
+{
+	struct mapping_sequence *seq = arg;
+	mapping_sequence_clear(seq);
+	__private_free(seq);
+}
+
+/* Index of the first mapping ending above addr. In a contiguous sequence
+ * that is the mapping containing addr, if any. */
+static unsigned mapping_sequence_lower_bound(struct mapping_sequence *seq, const void *addr)
+{
+	unsigned lo = 0, hi = seq->nused;
+	while (lo < hi)
+	{
+		unsigned mid = lo + (hi - lo) / 2;
+		if ((char*) seq->mappings[mid].end <= (char*) addr) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+/* Index of the first mapping beginning at or above addr. */
+static unsigned mapping_sequence_upper_bound(struct mapping_sequence *seq, const void *addr)
+{
+	unsigned lo = 0, hi = seq->nused;
+	while (lo < hi)
+	{
+		unsigned mid = lo + (hi - lo) / 2;
+		if ((char*) seq->mappings[mid].begin < (char*) addr) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
 
 static struct big_allocation *add_bigalloc(void *begin, size_t size)
 {
@@ -86,11 +167,9 @@ static struct big_allocation *add_mapping_sequence_bigalloc(struct mapping_seque
 {
 	struct mapping_sequence *copy = __private_malloc(sizeof (struct mapping_sequence));
 	if (!copy) abort();
-	memcpy(copy, seq, sizeof (struct mapping_sequence));
-	struct big_allocation *b = add_mapping_sequence_bigalloc_nocopy(seq, __private_free);
-	b->allocator_private = copy;
-	b->allocator_private_free = __private_free;
-	return b;
+	*copy = (struct mapping_sequence) { .begin = NULL };
+	mapping_sequence_assign(copy, seq);
+	return add_mapping_sequence_bigalloc_nocopy(copy, free_mapping_sequence);
 }
 /* This function is used only for the single statically-allocated mapping sequence
  * representing the private malloc heap, that we create during pageindex init. */
@@ -212,8 +291,6 @@ void add_mapping_sequence_bigalloc_if_absent(struct mapping_sequence *seq)
 			write_ulong((unsigned long) parent_end->end);
 			write_string("\n");
 			/* Delete the last existing_seq->nused elements from seq */
-			bzero(&seq->mappings[seq->nused - existing_seq->nused],
-					existing_seq->nused * sizeof (struct mapping_entry));
 			seq->nused -= existing_seq->nused;
 			seq->end = existing_seq->begin;
 			check_mapping_sequence_sanity(seq);
@@ -252,8 +329,7 @@ void add_mapping_sequence_bigalloc_if_absent(struct mapping_sequence *seq)
 			seq))
 		{
 			__liballocs_extend_bigalloc(parent_begin, seq->end);
-			memcpy(parent_begin->allocator_private,
-				seq, sizeof *seq);
+			mapping_sequence_assign(parent_begin->allocator_private, seq);
 			return;
 		}
 		else
@@ -309,7 +385,7 @@ void add_mapping_sequence_bigalloc_if_absent(struct mapping_sequence *seq)
 					}
 				}
 				write_string("\n");
-				memcpy(existing_seq, seq, sizeof *seq);
+				mapping_sequence_assign(existing_seq, seq);
 				return;
 			}
 			/* The new sequence is a prefix of the existing one. In other words,
@@ -320,7 +396,7 @@ void add_mapping_sequence_bigalloc_if_absent(struct mapping_sequence *seq)
 			write_string(" up to ");
 			write_ulong((unsigned long) existing_seq->end);
 			write_string("\n");
-			memcpy(existing_seq, seq, sizeof *seq);
+			mapping_sequence_assign(existing_seq, seq);
 			__liballocs_truncate_bigalloc_at_end(parent_begin, seq->end);
 			return;
 		}
@@ -424,82 +500,76 @@ report_problem:
 	abort();
 }
 
+void copy_all_left_from_by(struct mapping_sequence *s, int from, int by);
+void copy_all_right_from_by(struct mapping_sequence *s, int from, int by);
+
+/* Split the mapping containing addr, if any, so that a mapping begins
+ * at addr. The sequence's bounds are unchanged. Finding the mapping is a
+ * binary search, but making room for the new one shifts every mapping
+ * above it, so a split is linear in the sequence's length. */
+static void split_mapping_entry_at(struct mapping_sequence *seq, void *addr)
+{
+	unsigned i = mapping_sequence_lower_bound(seq, addr);
+	if (i == seq->nused || (char*) seq->mappings[i].begin >= (char*) addr) return;
+	copy_all_right_from_by(seq, i, 1);
+	seq->mappings[i].end = addr;
+	seq->mappings[i + 1].begin = addr;
+	if (!seq->mappings[i + 1].is_anon)
+	{
+		seq->mappings[i + 1].offset += (char*) addr - (char*) seq->mappings[i].begin;
+	}
+}
+
+/* Move everything from addr upwards into a new sequence, which we return. */
+static struct mapping_sequence *split_mapping_sequence_at(struct mapping_sequence *seq,
+	void *addr)
+{
+	check_mapping_sequence_sanity(seq);
+	assert((char*) addr > (char*) seq->begin && (char*) addr < (char*) seq->end);
+	split_mapping_entry_at(seq, addr);
+	unsigned i = mapping_sequence_lower_bound(seq, addr);
+	struct mapping_sequence *upper = __private_malloc(sizeof (struct mapping_sequence));
+	if (!upper) abort();
+	*upper = (struct mapping_sequence) {
+		.begin = addr,
+		.end = seq->end,
+		.filename = seq->filename
+	};
+	mapping_sequence_reserve(upper, seq->nused - i);
+	memcpy(upper->mappings, &seq->mappings[i],
+		(seq->nused - i) * sizeof (struct mapping_entry));
+	upper->nused = seq->nused - i;
+	seq->nused = i;
+	seq->end = addr;
+	check_mapping_sequence_sanity(seq);
+	check_mapping_sequence_sanity(upper);
+	return upper;
+}
+
 static void delete_mapping_sequence_span(struct mapping_sequence *seq,
 	void *addr, size_t length)
 {
 	check_mapping_sequence_sanity(seq);
-	for (int i = 0; i < MAPPING_SEQUENCE_MAX_LEN; ++i)
-	{
-		if ((char*) seq->mappings[i].begin <= (char*) addr + length
-				&& (char*) seq->mappings[i].end > (char*) addr)
-		{
-			/* We have some overlap. Is it partial or total? */
-
-			// we can't punch holes, yet (FIXME)
-			_Bool splits_mapping = ((char*) addr > (char*) seq->mappings[i].begin
-					&& (char*) addr + length < (char*) seq->mappings[i].end);
-			if (splits_mapping) abort();
-			
-			size_t left_at_beginning = 
-				((char*) addr > (char*) seq->mappings[i].begin) 
-					? (char*) addr - (char*) seq->mappings[i].begin
-					: 0;
-			size_t left_at_end = ((char*) addr + length > (char*) seq->mappings[i].end)
-					? 0
-					: (char*) seq->mappings[i].end - ((char*) addr + length);
-			
-			_Bool total = (left_at_beginning == 0) && (left_at_end == 0);
-			
-			if (total)
-			{
-				/* clear it */
-				memset(&seq->mappings[i], 0, sizeof (struct mapping_entry));
-			}
-			else
-			{
-				assert(left_at_beginning == 0 || left_at_end == 0);
-				unsigned long current_length =  seq->mappings[i].end - seq->mappings[i].begin;
-				if (left_at_beginning == 0)
-				{
-					seq->mappings[i].begin = (char*) seq->mappings[i].begin
-						 + (current_length - left_at_end);
-					if (i == 0) seq->begin = seq->mappings[i].begin;
-				}
-				else
-				{
-					seq->mappings[i].end = (char*) seq->mappings[i].end
-						 - (current_length - left_at_beginning);
-					if (i == seq->nused - 1) seq->end = seq->mappings[i].end;
-				}
-			}
-		}
-	}
-	
-	/* Now compact the sequence. */
-	int i = 0;
-	while (i < seq->nused)
-	{
-		if (!seq->mappings[i].begin)
-		{
-			// it's cleared; move all subsequent mappings down one
-			memmove(&seq->mappings[i], &seq->mappings[i + 1],
-					(seq->nused - (i + 1)) * sizeof (struct mapping_entry));
-			memset(&seq->mappings[seq->nused - 1], 0, sizeof (struct mapping_entry));
-			--(seq->nused);
-		}
-		else ++i;
-	}
+	char *span_end = (char*) addr + length;
+	/* A sequence has no holes, so a span strictly inside it must first be
+	 * split off with split_mapping_sequence_at(). */
+	assert((char*) addr <= (char*) seq->begin || span_end >= (char*) seq->end);
+	split_mapping_entry_at(seq, addr);
+	split_mapping_entry_at(seq, span_end);
+	unsigned first = mapping_sequence_lower_bound(seq, addr);
+	unsigned last = mapping_sequence_upper_bound(seq, span_end);
+	if (first < last) copy_all_left_from_by(seq, last, last - first);
 	
 	/* Update the overall metadata.
 	 * If the beginning is in the deleted span, push it to the end of the deleted span. 
 	 * If the end is in the deleted span, push it to the beginning of the deleted span. */
 	if ((char*) seq->begin >= (char*) addr
-			&& (char*) seq->begin < (char*) addr + length)
+			&& (char*) seq->begin < span_end)
 	{
-		seq->begin = (char*) addr + length;
+		seq->begin = span_end;
 	}
 	if ((char*) seq->end > (char*) addr
-			&& (char*) seq->end <= (char*) addr + length)
+			&& (char*) seq->end <= span_end)
 	{
 		seq->end = addr;
 	}
@@ -562,47 +632,46 @@ static void do_munmap(void *addr, size_t length, void *caller)
 			{
 				/* We're chopping out a hole in the middle of the mapping. 
 				 * First split the bigalloc. The metadata pointer will be shared
-				 * between the two. Then copy and update the metadata. From each
-				 * half's mapping_sequence, we delete the hole *and* the other's 
-				 * part. */
-				
-				void *old_end = b->end;
+				 * between the two, so split the sequence too, giving the
+				 * upper part to the second half. Then the hole is just the
+				 * tail of the first half. */
+				char *hole_end = cur + remaining_length;
 				struct big_allocation *second_half = 
-					__liballocs_split_bigalloc_at_page_boundary(b, (char*) addr + length);
+					__liballocs_split_bigalloc_at_page_boundary(b, hole_end);
 				if (!second_half) abort();
-				__liballocs_truncate_bigalloc_at_end(b, addr);
-				/* Now the bigallocs are in the right place, but their metadata is wrong. */
-				struct mapping_sequence *new_seq = __private_malloc(sizeof (struct mapping_sequence));
-				struct mapping_sequence *orig_seq = b->allocator_private;
-				memcpy(new_seq, orig_seq, sizeof (struct mapping_sequence));
-				/* From the first, delete from the hole all the way. */
-				delete_mapping_sequence_span(orig_seq, addr, (char*) old_end - (char*) addr);
-				/* From the second, delete from the old begin to the end of the hole. */
-				delete_mapping_sequence_span(new_seq, b->begin, 
-						((char*) addr + length) - (char*) b->begin);
-				second_half->allocator_private = new_seq;
+				__liballocs_truncate_bigalloc_at_end(b, cur);
+				second_half->allocator_private = split_mapping_sequence_at(seq, hole_end);
 				/* same free function as before */
+				delete_mapping_sequence_span(seq, cur, remaining_length);
+				/* We're necessarily finished */
+				break;
 			}
 		}
 	}
 }
 
+/* Bumped on every trapped mapping change, so that reconciliation can
+ * trust a remembered miss only until the next one (see below). */
+static unsigned long maps_generation;
+static void note_maps_changed(void)
+{
+	__atomic_fetch_add(&maps_generation, 1, __ATOMIC_RELAXED);
+}
+
 void __mmap_allocator_notify_munmap(void *addr, size_t length, void *caller)
 {
 	/* HACK: Is it actually a stack or sbrk area? Branch out if so. */
 	// FIXME
+	note_maps_changed();
 	do_munmap(addr, length, caller);
 }
 
 struct mapping_entry *__mmap_allocator_find_entry(const void *addr, struct mapping_sequence *seq)
 {
-	for (unsigned i = 0; i < seq->nused; ++i)
+	unsigned i = mapping_sequence_lower_bound(seq, addr);
+	if (i < seq->nused && (char*) addr >= (char*) seq->mappings[i].begin)
 	{
-		if ((char*) addr >= (char*) seq->mappings[i].begin
-				&& (char*) addr < (char*) seq->mappings[i].end)
-		{
-			return &seq->mappings[i];
-		}
+		return &seq->mappings[i];
 	}
 	return NULL;
 }
@@ -642,6 +711,7 @@ void __mmap_allocator_notify_mremap_after(void *ret_addr, void *old_addr, size_t
 {
 	if (ret_addr != MAP_FAILED)
 	{
+		note_maps_changed();
 		/* Does the address match the remembered one? This is a HACK, i.e. 
 		 * we should really thread these through from mremap_replacement. */
 		if (remembered_old_addr == old_addr)
@@ -723,13 +793,13 @@ static void do_mmap(void *mapped_addr, void *requested_addr, size_t requested_le
 		}
 
 		/* If we got here, we have to create a new bigalloc. */
-		struct mapping_sequence new_seq;
-		memset(&new_seq, 0, sizeof new_seq);
+		struct mapping_sequence new_seq = { .begin = NULL };
 		/* "Extend" the empty sequence. */
 		_Bool success = augment_sequence(&new_seq, mapped_addr, (char*) mapped_addr + mapped_length, 
 				prot, flags, offset, filename, caller);
 		if (!success) abort();
 		add_mapping_sequence_bigalloc(&new_seq);
+		mapping_sequence_clear(&new_seq);
 	}
 }
 void __mmap_allocator_notify_mmap(void *mapped_addr, void *requested_addr, size_t length, 
@@ -737,12 +807,73 @@ void __mmap_allocator_notify_mmap(void *mapped_addr, void *requested_addr, size_
 {
 	/* HACK: Is it actually a stack or sbrk area? Branch out if so. */
 	// FIXME
+	note_maps_changed();
 	do_mmap(mapped_addr, requested_addr, length, prot, flags, filename_for_fd(fd), offset, caller);
 }
 
+static _Bool mapping_entries_mergeable(struct mapping_entry *e1,
+		struct mapping_entry *e2)
+{
+	return e1->end == e2->begin &&
+		e1->prot == e2->prot &&
+		e1->flags == e2->flags &&
+		e1->is_anon == e2->is_anon &&
+		e1->caller == e2->caller &&
+		(e1->is_anon || e1->offset + ((char*) e2->begin - (char*) e1->begin) == e2->offset);
+}
+
+/* Coalesce mergeable neighbours among mappings [from, to). */
+static void merge_mapping_entries(struct mapping_sequence *seq, unsigned from, unsigned to)
+{
+	if (to - from < 2) return;
+	unsigned w = from;
+	for (unsigned r = from + 1; r < to; ++r)
+	{
+		if (mapping_entries_mergeable(&seq->mappings[w], &seq->mappings[r]))
+		{
+			seq->mappings[w].end = seq->mappings[r].end;
+		}
+		else seq->mappings[++w] = seq->mappings[r];
+	}
+	if (w + 1 < to) copy_all_left_from_by(seq, to, to - (w + 1));
+}
+
+/* Give [begin, end) of the sequence the new protection. Only the mappings
+ * at either end need splitting; afterwards we merge back any that the
+ * change made indistinguishable from their neighbours, so toggling a
+ * guard region back and forth does not grow the sequence. */
+static void set_mapping_sequence_prot(struct mapping_sequence *seq,
+	void *begin, void *end, int prot)
+{
+	check_mapping_sequence_sanity(seq);
+	split_mapping_entry_at(seq, begin);
+	split_mapping_entry_at(seq, end);
+	unsigned first = mapping_sequence_lower_bound(seq, begin);
+	unsigned last = mapping_sequence_upper_bound(seq, end);
+	for (unsigned i = first; i < last; ++i) seq->mappings[i].prot = prot;
+	merge_mapping_entries(seq, first ? first - 1 : 0,
+		(last < seq->nused) ? last + 1 : seq->nused);
+	check_mapping_sequence_sanity(seq);
+}
+
 void __mmap_allocator_notify_mprotect(void *addr, size_t len, int prot)
 {
-	
+	char *cur = (char*) addr;
+	char *end = (char*) addr + ROUND_UP(len, PAGE_SIZE);
+	while (cur < end)
+	{
+		struct big_allocation *b = __lookup_bigalloc_from_root(cur, &__mmap_allocator, NULL);
+		if (!b)
+		{
+			cur += PAGE_SIZE;
+			continue;
+		}
+		char *this_end = ((char*) b->end < end) ? (char*) b->end : end;
+		struct mapping_sequence *seq = b->allocator_private;
+		/* A pool belonging to our own dlmalloc has no sequence. */
+		if (seq) set_mapping_sequence_prot(seq, cur, this_end, prot);
+		cur = this_end;
+	}
 }
 
 static int add_missing_cb(struct maps_entry *ent, char *linebuf, void *arg);
@@ -778,6 +909,7 @@ void add_missing_mappings_from_proc(void *executable_end_addr)
 		add_missing_cb, &args);
 	/* Finish off the last mapping. */
 	if (current.nused > 0) add_mapping_sequence_bigalloc_if_absent(&current);
+	mapping_sequence_clear(&current);
 
 	close(fd);
 }
@@ -797,10 +929,321 @@ struct big_allocation *executable_file_bigalloc __attribute__((visibility("hidde
 struct big_allocation *executable_data_segment_bigalloc __attribute__((visibility("hidden")));
 void __adjust_bigalloc_end(struct big_allocation *b, void *new_curbrk);
 
+/* Incremental reconciliation with /proc/<pid>/maps. Once we are trapping
+ * mmap, an unindexed address is usually just wild, but it may lie in a
+ * mapping created behind our back (by a raw syscall we did not trap, say).
+ * Rather than rescanning the whole maps file, which costs milliseconds
+ * in processes with many thousands of mappings, we look only at the
+ * mappings around the address. With PROCMAP_QUERY (Linux 6.11) we ask
+ * the kernel directly. Otherwise we read the file once, sequentially, in
+ * large chunks, parsing with a table-driven scanner and stopping soon after
+ * the address. (Seeking is no use: the kernel regenerates a seq_file from
+ * its first record up to any offset we pread from.) Either way, we add
+ * only the run of contiguous, unindexed mappings that covers the address,
+ * and we remember misses until the next trapped mmap, munmap or mremap. */
+struct maps_line
+{
+	void *begin;
+	void *end;
+	int prot;
+	int flags;
+	off_t offset;
+	const char *rest;
+};
+
+/* Hex digit value plus one, so that zero means "not a hex digit". */
+static const unsigned char hex_digit_value_plus_one[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16
+};
+static char *scan_hex(char *p, uintptr_t *out)
+{
+	uintptr_t v = 0;
+	unsigned d;
+	while (0 != (d = hex_digit_value_plus_one[(unsigned char) *p]))
+	{
+		v = (v << 4) | (d - 1);
+		++p;
+	}
+	*out = v;
+	return p;
+}
+/* Parse the line at p, which must be in a NUL-terminated buffer, and
+ * return the start of the next line. Returns NULL if the line is
+ * incomplete. A line we cannot parse comes back with begin == end. */
+static char *parse_maps_line(char *p, struct maps_line *out)
+{
+	char *nl = strchr(p, '\n');
+	if (!nl) return NULL;
+	*nl = '\0';
+	*out = (struct maps_line) { .begin = NULL };
+	uintptr_t begin, end, offset, ignored;
+	p = scan_hex(p, &begin);
+	if (*p++ != '-') return nl + 1;
+	p = scan_hex(p, &end);
+	if (*p++ != ' ' || !p[0] || !p[1] || !p[2] || !p[3]) return nl + 1;
+	out->prot = ((p[0] == 'r') ? PROT_READ : 0)
+		| ((p[1] == 'w') ? PROT_WRITE : 0)
+		| ((p[2] == 'x') ? PROT_EXEC : 0);
+	out->flags = (p[3] == 's') ? MAP_SHARED : MAP_PRIVATE;
+	p += 4;
+	if (*p++ != ' ') return nl + 1;
+	p = scan_hex(p, &offset);
+	if (*p++ != ' ') return nl + 1;
+	p = scan_hex(p, &ignored); /* device major */
+	if (*p++ != ':') return nl + 1;
+	p = scan_hex(p, &ignored); /* device minor */
+	if (*p++ != ' ') return nl + 1;
+	while (*p >= '0' && *p <= '9') ++p; /* inode */
+	while (*p == ' ') ++p;
+	out->begin = (void*) begin;
+	out->end = (void*) end;
+	out->offset = offset;
+	out->rest = p;
+	return nl + 1;
+}
+/* Decide the filename as extend_current does. Returns 0 for mappings
+ * that are not ours to add. */
+static _Bool maps_line_filename(const char *rest, const char **out_filename)
+{
+	switch (rest[0])
+	{
+		case '\0':
+			*out_filename = NULL;
+			return 1;
+		case '/':
+			*out_filename = rest;
+			return 1;
+		case '[':
+			if (0 == strncmp(rest, "[stack", 6)) { *out_filename = rest; return 1; }
+			/* The brk allocator looks after the heap. */
+			if (0 == strncmp(rest, "[heap", 5)) return 0;
+			*out_filename = NULL;
+			return 1;
+		default:
+			return 0;
+	}
+}
+static _Bool maps_line_is_addable(struct maps_line *l)
+{
+	const char *ignored;
+	size_t size = (char*) l->end - (char*) l->begin;
+	return size > 0 && size <= BIGGEST_SANE_USER_ALLOC
+		&& (intptr_t) l->begin >= 0
+		&& maps_line_filename(l->rest, &ignored)
+		&& __pages_unused(l->begin, l->end);
+}
+/* Feed the next line upwards into the sequence we are rebuilding around
+ * addr. Returns 0 once no later line can belong to that sequence. */
+static _Bool reconcile_add_line(struct mapping_sequence *seq, struct maps_line *l,
+	const void *addr)
+{
+	const char *filename;
+	maps_line_filename(l->rest, &filename);
+	_Bool covers_addr = seq->nused > 0
+		&& (char*) seq->begin <= (char*) addr && (char*) addr < (char*) seq->end;
+	if (augment_sequence(seq, l->begin, l->end, l->prot,
+			l->flags | (filename ? 0 : MAP_ANONYMOUS), l->offset, filename, NULL))
+	{
+		return 1;
+	}
+	if (covers_addr) return 0;
+	/* A sequence below addr ended; start afresh. */
+	mapping_sequence_clear(seq);
+	if (!augment_sequence(seq, l->begin, l->end, l->prot,
+			l->flags | (filename ? 0 : MAP_ANONYMOUS), l->offset, filename, NULL)) abort();
+	return 1;
+}
+static _Bool reconcile_commit(struct mapping_sequence *seq, const void *addr)
+{
+	_Bool covers_addr = seq->nused > 0
+		&& (char*) seq->begin <= (char*) addr && (char*) addr < (char*) seq->end;
+	if (covers_addr) add_mapping_sequence_bigalloc_if_absent(seq);
+	mapping_sequence_clear(seq);
+	return covers_addr;
+}
+
+/* How many neighbouring mappings either side of the address we consider. */
+#define RECONCILE_MAX_NEIGHBOURS 64
+
+#ifdef PROCMAP_QUERY
+static _Bool procmap_query_unsupported;
+/* Returns 0 if no mapping covers addr, -1 if the ioctl is unsupported. */
+static int query_maps_line(int fd, const void *addr, struct maps_line *out,
+	char *namebuf, size_t namebuf_sz)
+{
+	struct procmap_query q = {
+		.size = sizeof q,
+		.query_flags = 0, /* exactly covering */
+		.query_addr = (uintptr_t) addr,
+		.vma_name_addr = (uintptr_t) namebuf,
+		.vma_name_size = namebuf_sz
+	};
+	if (-1 == ioctl(fd, PROCMAP_QUERY, &q))
+	{
+		return (errno == ENOTTY || errno == EINVAL) ? -1 : 0;
+	}
+	if (q.vma_name_size == 0) namebuf[0] = '\0';
+	*out = (struct maps_line) {
+		.begin = (void*) (uintptr_t) q.vma_start,
+		.end = (void*) (uintptr_t) q.vma_end,
+		.prot = ((q.vma_flags & PROCMAP_QUERY_VMA_READABLE) ? PROT_READ : 0)
+			| ((q.vma_flags & PROCMAP_QUERY_VMA_WRITABLE) ? PROT_WRITE : 0)
+			| ((q.vma_flags & PROCMAP_QUERY_VMA_EXECUTABLE) ? PROT_EXEC : 0),
+		.flags = (q.vma_flags & PROCMAP_QUERY_VMA_SHARED) ? MAP_SHARED : MAP_PRIVATE,
+		.offset = q.vma_offset,
+		.rest = namebuf
+	};
+	return 1;
+}
+/* Returns -1 if we should fall back to reading the file. */
+static int reconcile_by_query(int fd, const void *addr)
+{
+	static __thread char namebuf[4096];
+	struct maps_line l;
+	int ret = query_maps_line(fd, addr, &l, namebuf, sizeof namebuf);
+	if (ret <= 0) return ret;
+	if (!maps_line_is_addable(&l)) return 0;
+	/* Walk down to the lowest contiguous addable mapping... */
+	void *lowest = l.begin;
+	for (unsigned n = 0; n < RECONCILE_MAX_NEIGHBOURS; ++n)
+	{
+		struct maps_line below;
+		if (1 != query_maps_line(fd, (char*) lowest - 1, &below, namebuf, sizeof namebuf)
+				|| below.end != lowest
+				|| !maps_line_is_addable(&below)) break;
+		lowest = below.begin;
+	}
+	/* ... then add upwards from there. */
+	struct mapping_sequence seq = { .begin = NULL };
+	void *next = lowest;
+	for (unsigned n = 0; n < 2 * RECONCILE_MAX_NEIGHBOURS + 1; ++n)
+	{
+		if (1 != query_maps_line(fd, next, &l, namebuf, sizeof namebuf)
+				|| l.begin != next
+				|| !maps_line_is_addable(&l)
+				|| !reconcile_add_line(&seq, &l, addr)) break;
+		next = l.end;
+	}
+	return reconcile_commit(&seq, addr);
+}
+#endif
+
+#define MAPS_CHUNK_SIZE (64 * 1024)
+#define MAPS_MAX_LINE 8192
+static _Bool reconcile_by_reading(int fd, const void *addr)
+{
+	char *buf = __private_malloc(MAPS_CHUNK_SIZE + MAPS_MAX_LINE + 1);
+	if (!buf) abort();
+	/* Lines below addr go into seq as we pass them, restarting whenever
+	 * the run of contiguous addable lines breaks, so by the time we reach
+	 * addr, seq holds the run just below it. */
+	struct mapping_sequence seq = { .begin = NULL };
+	_Bool reached_addr = 0;
+	_Bool done = 0;
+	unsigned nabove = 0;
+	size_t have = 0;
+	while (!done)
+	{
+		ssize_t ret = read(fd, buf + have, MAPS_CHUNK_SIZE);
+		if (ret == -1 && errno == EINTR) continue;
+		if (ret <= 0) break;
+		have += ret;
+		buf[have] = '\0';
+		char *pos = buf;
+		char *next;
+		struct maps_line l;
+		while (!done && (next = parse_maps_line(pos, &l)))
+		{
+			pos = next;
+			if (!reached_addr && (char*) l.end <= (char*) addr)
+			{
+				if (!maps_line_is_addable(&l)
+						|| seq.nused >= RECONCILE_MAX_NEIGHBOURS) mapping_sequence_clear(&seq);
+				if (maps_line_is_addable(&l)) reconcile_add_line(&seq, &l, addr);
+				continue;
+			}
+			if (!reached_addr)
+			{
+				reached_addr = 1;
+				/* Nothing covers addr, or what does is not ours to add. */
+				if ((char*) l.begin > (char*) addr || !maps_line_is_addable(&l))
+				{
+					mapping_sequence_clear(&seq);
+					done = 1;
+					break;
+				}
+			}
+			/* Add upwards from the covering line. */
+			else if (l.begin != seq.end || !maps_line_is_addable(&l)
+					|| ++nabove > RECONCILE_MAX_NEIGHBOURS) { done = 1; break; }
+			if (!reconcile_add_line(&seq, &l, addr)) done = 1;
+		}
+		/* Keep the partial line for the next chunk. */
+		have = (buf + have) - pos;
+		if (have > MAPS_MAX_LINE) break;
+		memmove(buf, pos, have);
+	}
+	__private_free(buf);
+	return reconcile_commit(&seq, addr);
+}
+
+/* Addresses that reconciliation found unmapped, each tagged with the
+ * generation of trapped mapping changes it was found in. */
+#define RECONCILE_MISS_CACHE_SIZE 64
+#define RECONCILE_MISS_GENERATION_BITS 28
+static unsigned long reconcile_misses[RECONCILE_MISS_CACHE_SIZE];
+static unsigned long reconcile_miss_key(const void *addr, unsigned long generation)
+{
+	/* Zero is never a key, so the empty cache matches nothing. */
+	return ((PAGENUM(addr) + 1) << RECONCILE_MISS_GENERATION_BITS)
+		| (generation & ((1ul << RECONCILE_MISS_GENERATION_BITS) - 1));
+}
+static unsigned reconcile_miss_slot(const void *addr)
+{
+	return PAGENUM(addr) % RECONCILE_MISS_CACHE_SIZE;
+}
+
+static _Bool reconcile_maps_around(const void *addr)
+{
+	/* Until we trap mmap, the generation tells us nothing. */
+	_Bool use_cache = __liballocs_systrap_is_initialized;
+	unsigned long generation = __atomic_load_n(&maps_generation, __ATOMIC_RELAXED);
+	if (use_cache && __atomic_load_n(&reconcile_misses[reconcile_miss_slot(addr)],
+			__ATOMIC_RELAXED) == reconcile_miss_key(addr, generation)) return 0;
+	char proc_buf[64];
+	int ret = snprintf(proc_buf, sizeof proc_buf, "/proc/%d/maps", getpid());
+	if (!(ret > 0)) return 0;
+	int fd = open(proc_buf, O_RDONLY|O_CLOEXEC);
+	if (fd == -1) return 0;
+	_Bool claimed;
+#ifdef PROCMAP_QUERY
+	if (!procmap_query_unsupported && !getenv("LIBALLOCS_NO_PROCMAP_QUERY"))
+	{
+		int queried = reconcile_by_query(fd, addr);
+		if (queried != -1)
+		{
+			claimed = queried;
+			goto out;
+		}
+		procmap_query_unsupported = 1;
+	}
+#endif
+	claimed = reconcile_by_reading(fd, addr);
+out:
+	close(fd);
+	if (!claimed && use_cache) __atomic_store_n(&reconcile_misses[reconcile_miss_slot(addr)],
+			reconcile_miss_key(addr, generation), __ATOMIC_RELAXED);
+	return claimed;
+}
+
 _Bool __mmap_allocator_notify_unindexed_address(const void *mem)
 {
 	if (!initialized) return 0;
-	return __brk_allocator_notify_unindexed_address(mem);
+	if (__brk_allocator_notify_unindexed_address(mem)) return 1;
+	return reconcile_maps_around(mem);
 }
 
 static void set_executable_mapping_bigalloc(void *real_end)
@@ -1022,6 +1465,7 @@ void copy_all_left_from_by(struct mapping_sequence *s, int from, int by)
 
 void copy_all_right_from_by(struct mapping_sequence *s, int from, int by)
 {
+	mapping_sequence_reserve(s, s->nused + by);
 	memmove(s->mappings + from + by, s->mappings + from,
 		sizeof (struct mapping_entry) * (s->nused - from));
 	s->nused += by;
@@ -1064,9 +1508,7 @@ static _Bool augment_sequence(struct mapping_sequence *cur,
 	_Bool bounds_would_remain_contiguous
 		 = is_clean_extension || /* overlaps */ OVERLAPS(cur->begin, cur->end, begin, end);
 	_Bool begin_addr_unchanged = (char*) begin >= (char*) cur->begin;
-	_Bool not_too_many = cur->nused != MAPPING_SEQUENCE_MAX_LEN; /* FIXME: check against increase */
-	if (bounds_would_remain_contiguous && begin_addr_unchanged
-		&& not_too_many)
+	if (bounds_would_remain_contiguous && begin_addr_unchanged)
 	{
 		if (is_clean_extension)
 		{
@@ -1091,6 +1533,7 @@ static _Bool augment_sequence(struct mapping_sequence *cur,
 			if (!cur->begin) cur->begin = begin;
 			cur->end = end;
 			if (!cur->filename) cur->filename = filename ? __liballocs_private_strdup(filename) : NULL;
+			mapping_sequence_reserve(cur, cur->nused + 1);
 			cur->mappings[cur->nused] = (struct mapping_entry) {
 				.begin = begin,
 				.end = end,
@@ -1105,15 +1548,17 @@ static _Bool augment_sequence(struct mapping_sequence *cur,
 		}
 		else
 		{
-			/* Skip to the first affected (overlapped) element in the sequence. */
-			int i = 0;
-			while (!(OVERLAPS(cur->mappings[i].begin, cur->mappings[i].end, begin, end))) ++i;
-			int first_overlapped = i;
+			/* Find the first affected (overlapped) element in the sequence.
+			 * OVERLAPS counts a mapping ending exactly at 'begin', so search
+			 * from the byte before. */
+			int first_overlapped = mapping_sequence_lower_bound(cur, (char*) begin - 1);
+			assert(OVERLAPS(cur->mappings[first_overlapped].begin,
+				cur->mappings[first_overlapped].end, begin, end));
 			
 			/* Find the last affected (overlapped) element in the sequence. */
-			i = cur->nused - 1;
-			while (!(OVERLAPS(cur->mappings[i].begin, cur->mappings[i].end, begin, end))) --i;
-			int last_overlapped = i;
+			int last_overlapped = (int) mapping_sequence_upper_bound(cur, end) - 1;
+			assert(OVERLAPS(cur->mappings[last_overlapped].begin,
+				cur->mappings[last_overlapped].end, begin, end));
 
 			_Bool begin_overlap_is_partial = 
 				cur->mappings[first_overlapped].begin != begin;
@@ -1195,15 +1640,7 @@ static _Bool augment_sequence(struct mapping_sequence *cur,
 // 				ret = 1; goto out;
 // 			}
 
-			/* First, check we have room to copy right. */
-			unsigned nspare = MAPPING_SEQUENCE_MAX_LEN - cur->nused;
-			if (nspare < 
-					(begin_overlap_is_partial ? 1 : 0)
-				  + (end_overlap_is_partial ? 1 : 0))
-			{
-				ret = 0; reason = "no more room in sequence structure (1)"; goto out;
-			}
-
+			/* Copying right grows the sequence as needed. */
 			/* The number of obsolete mappings is the number to be
 			 * completely replaced. We want it to equal 1. */
 			/* Eliminate partial overlap at the beginning. */
@@ -1265,7 +1702,6 @@ static _Bool augment_sequence(struct mapping_sequence *cur,
 		ret = 0;
 		if (!bounds_would_remain_contiguous) reason = "discontiguous bounds";
 		else if (!begin_addr_unchanged) reason = "begins before current sequence";
-		else if (!not_too_many) reason = "no more room in sequence structure (2)";
 		else assert(0);
 		goto out;
 	}
@@ -1389,7 +1825,7 @@ static int add_missing_cb(struct maps_entry *ent, char *linebuf, void *args_as_v
 	if (!extended)
 	{
 		add_mapping_sequence_bigalloc_if_absent(cur);
-		memset(cur, 0, sizeof (struct mapping_sequence));
+		mapping_sequence_clear(cur);
 		_Bool began_new = extend_current(cur, ent);
 		if (!began_new) abort();
 	}
@@ -1427,6 +1863,7 @@ void __mmap_allocator_notify_brk(void *new_curbrk)
 				 * We have to pretend an anonymous mapping is there.
 				 * FIXME: this behaviour is fine when we're called for
 				 * sbrk(), but not in other cases. */
+				mapping_sequence_reserve(seq, seq->nused + 1);
 				seq->mappings[seq->nused++] = (struct mapping_entry) {
 					.begin = prev_mapping_end,
 					.end = new_end,
@@ -1494,10 +1931,11 @@ static void test_mapping_overlap(void)
 		{ .begin = (void*) 0xbeef22000ul, .end = (void*) 0xbeef2a000ul }
 	};
 #define MAKE_FRESH_MAPPING_SEQUENCE(name) \
-	struct mapping_sequence name = { ms[0].begin, ms[4].end, "/test", sizeof ms / sizeof (struct mapping_entry) }; \
-	memcpy(name.mappings, ms, sizeof ms); \
-	bzero(name.mappings + name.nused, \
-	    sizeof (struct mapping_entry) * (MAPPING_SEQUENCE_MAX_LEN - name.nused));
+	struct mapping_entry name ## _mappings[2 * sizeof ms / sizeof (struct mapping_entry)]; \
+	struct mapping_sequence name = { ms[0].begin, ms[4].end, "/test", \
+	    sizeof ms / sizeof (struct mapping_entry), \
+	    sizeof name ## _mappings / sizeof (struct mapping_entry), 1, name ## _mappings }; \
+	memcpy(name.mappings, ms, sizeof ms);
 	
 	/* case 1: precise pre-overlap on first mapping only */
 	{MAKE_FRESH_MAPPING_SEQUENCE(ms1);
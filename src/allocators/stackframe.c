@@ -36,6 +36,42 @@ static void *main_bp; // beginning of main's stack frame
 static struct frame_uniqtype_and_offset
 pc_to_frame_uniqtype(const void *addr);
 
+/* Per-thread cache of pc_to_frame_uniqtype results, direct-mapped by ip.
+ * A deep recursion revisits the same few ips many times. The whole cache
+ * is flushed whenever any file's frame metadata goes away. */
+#define FRAME_UNIQTYPE_CACHE_SIZE 256
+struct frame_uniqtype_cache_entry
+{
+	const void *ip;
+	struct frame_uniqtype_and_offset s;
+};
+static unsigned frames_info_generation;
+#ifndef NO_TLS
+static __thread struct frame_uniqtype_cache_entry frame_uniqtype_cache[FRAME_UNIQTYPE_CACHE_SIZE];
+static __thread unsigned frame_uniqtype_cache_generation;
+#endif
+static inline struct frame_uniqtype_and_offset
+pc_to_frame_uniqtype_cached(const void *ip)
+{
+#ifndef NO_TLS
+	unsigned generation = __atomic_load_n(&frames_info_generation, __ATOMIC_ACQUIRE);
+	if (__builtin_expect(frame_uniqtype_cache_generation != generation, 0))
+	{
+		bzero(frame_uniqtype_cache, sizeof frame_uniqtype_cache);
+		frame_uniqtype_cache_generation = generation;
+	}
+	struct frame_uniqtype_cache_entry *e = &frame_uniqtype_cache[
+		((uintptr_t) ip ^ ((uintptr_t) ip >> 8)) % FRAME_UNIQTYPE_CACHE_SIZE];
+	if (e->ip == ip) return e->s;
+	/* We cache misses too, since most frames (e.g. ours) have no descriptor. */
+	struct frame_uniqtype_and_offset s = pc_to_frame_uniqtype(ip);
+	*e = (struct frame_uniqtype_cache_entry) { ip, s };
+	return s;
+#else
+	return pc_to_frame_uniqtype(ip);
+#endif
+}
+
 void ( __attribute__((constructor(101))) __stackframe_allocator_init)(void)
 {
 	if (!initialized && !trying_to_initialize)
@@ -167,13 +203,77 @@ struct big_allocation *__stackframe_allocator_find_or_create_bigalloc(
 	return b;
 }
 
+#define BEGINNING_OF_STACK ((uintptr_t) MAXIMUM_USER_ADDRESS)
+/* Walk the frame-pointer chain directly, rather than through the cursor
+ * API. We are built with frame pointers, and so is any code that has
+ * frame descriptors (allocscc insists on it). A frame in between that
+ * lacks them can make us miss a frame, but not misplace one, so whatever
+ * we find is right, and if we fail the caller can still ask libunwind.
+ * As in the fake libunwind, a bp that is below its frame's sp, or more
+ * than 64kB above it, is taken to end the chain. */
+#define SANE_FRAME_BP(bp, sp) \
+	((uintptr_t) (bp) >= (uintptr_t) (sp) && (uintptr_t) (bp) - (uintptr_t) (sp) < 0x10000)
+static liballocs_err_t __attribute__((noinline)) get_info_by_frame_pointers(void *obj,
+	struct uniqtype **out_type, void **out_base,
+	unsigned long *out_size, const void** out_site)
+{
+	/* Start from our caller, get_info, which has no frame descriptor. */
+	void **bp = (void**) __builtin_frame_address(0);
+	const void *ip = __builtin_return_address(0);
+	bp = (void**) bp[0];
+	while (bp && (uintptr_t) bp % _Alignof (void*) == 0)
+	{
+		/* The frame ending at bp, whose code is at ip, has its base
+		 * at the caller's sp, just above the saved bp and return address. */
+		uintptr_t higherframe_sp = (uintptr_t) (bp + 2);
+		void **higherframe_bp = (void**) bp[0];
+		const void *higherframe_ip = bp[1];
+		if (!SANE_FRAME_BP(higherframe_bp, higherframe_sp)) higherframe_bp = NULL;
+		/* If the target is above the next frame's bp, it's in a frame we
+		 * haven't reached, so don't bother looking this one up. */
+		if (!higherframe_bp || (uintptr_t) obj <= (uintptr_t) higherframe_bp)
+		{
+			struct frame_uniqtype_and_offset s = pc_to_frame_uniqtype_cached(ip);
+			if (s.u)
+			{
+				unsigned char *frame_allocation_base = (unsigned char *) higherframe_sp - s.o;
+				if ((unsigned char *) obj >= frame_allocation_base
+					&& (unsigned char *) obj < frame_allocation_base + s.u->pos_maxoff)
+				{
+					if (out_base) *out_base = frame_allocation_base;
+					if (out_type) *out_type = s.u;
+					if (out_site) *out_site = ip;
+					if (out_size) *out_size = s.u->pos_maxoff;
+					return NULL;
+				}
+				/* We are going upwards in memory, so we've gone past it. */
+				if (frame_allocation_base > (unsigned char *) obj)
+				{
+					return &__liballocs_err_stack_walk_reached_higher_frame;
+				}
+			}
+		}
+		ip = higherframe_ip;
+		bp = higherframe_bp;
+	}
+	return &__liballocs_err_stack_walk_reached_top_of_stack;
+}
+#undef SANE_FRAME_BP
+
 static liballocs_err_t get_info(void *obj, struct big_allocation *b,
 	struct uniqtype **out_type, void **out_base, 
 	unsigned long *out_size, const void** out_site)
 {		
-	++__liballocs_hit_stack_case;
+	__liballocs_stat_inc(LIBALLOCS_STAT_HIT_STACK_CASE);
 	liballocs_err_t err;
-#define BEGINNING_OF_STACK ((uintptr_t) MAXIMUM_USER_ADDRESS)
+	err = get_info_by_frame_pointers(obj, out_type, out_base, out_size, out_site);
+#ifdef USE_FAKE_LIBUNWIND
+	/* The fake libunwind would only walk the same chain again. */
+	if (err) __liballocs_stat_inc(LIBALLOCS_STAT_ABORTED_STACK);
+	return err;
+#else
+	if (!err) return NULL;
+	/* The chain may have skipped the frame, so do it the slow way. */
 	// we want to walk a sequence of vaddrs!
 	// how do we know which is the one we want?
 	// we can get a uniqtype for each one, including maximum posoff and negoff
@@ -300,7 +400,7 @@ static liballocs_err_t get_info(void *obj, struct big_allocation *b,
 		// (if our target address is *lower* than sp, we'll abandon the walk, below)
 
 		// 1. get the frame uniqtype for frame_ip
-		struct frame_uniqtype_and_offset s = pc_to_frame_uniqtype((void *) ip);
+		struct frame_uniqtype_and_offset s = pc_to_frame_uniqtype_cached((void *) ip);
 		struct uniqtype *frame_desc = s.u;
 		if (!frame_desc)
 		{
@@ -346,8 +446,9 @@ out_success:
 	return NULL;
 abort_stack:
 	if (!err) err = &__liballocs_err_unknown_stack_walk_problem;
-	++__liballocs_aborted_stack;
+	__liballocs_stat_inc(LIBALLOCS_STAT_ABORTED_STACK);
 	return err;
+#endif
 }
 #define maximum_vaddr_range_size (4*1024) // HACK
 
@@ -367,6 +468,14 @@ void init_frames_info(struct allocs_file_metadata *file)
 	}
 }
 
+void deinit_frames_info(struct allocs_file_metadata *file)
+{
+	file->frames_info = NULL;
+	file->nframes = 0;
+	/* Cached frame uniqtypes may point into this file's meta-object. */
+	__atomic_fetch_add(&frames_info_generation, 1, __ATOMIC_RELEASE);
+}
+
 static struct frame_uniqtype_and_offset
 pc_to_frame_uniqtype(const void *addr)
 {
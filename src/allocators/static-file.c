@@ -14,6 +14,9 @@
 #include <limits.h>
 #include <link.h>
 #include <sys/mman.h>
+#ifndef NO_PTHREADS
+#include <pthread.h>
+#endif
 #include "raw-syscalls-defs.h" /* for raw_open */
 #include "relf.h"
 #include "librunt.h"
@@ -217,7 +220,7 @@ struct file_metadata *__static_file_allocator_metadata_by_addr(const void *addr)
 struct file_metadata *__wrap___runt_files_metadata_by_addr(const void *addr)
 		__attribute__((alias("__static_file_allocator_metadata_by_addr")));
 
-static void load_metadata(struct allocs_file_metadata *meta, void *handle)
+static void load_metadata_unhashed(struct allocs_file_metadata *meta, void *handle)
 {
 	/* Load the separate meta-object for this object. */
 	int ret_meta = dl_for_one_object_phdrs(handle,
@@ -225,9 +228,133 @@ static void load_metadata(struct allocs_file_metadata *meta, void *handle)
 	// meta_obj_handle may be null -- we continue either way
 	meta->extrasym = (meta->meta_obj_handle ? dlsym(meta->meta_obj_handle, "extrasym") : NULL);
 	/* We still haven't filled in everything... */
-	init_allocsites_info(meta);
+	init_allocsites_info_unhashed(meta);
 	init_frames_info(meta);
 }
+static void load_metadata(struct allocs_file_metadata *meta, void *handle)
+{
+	load_metadata_unhashed(meta, handle);
+	hash_allocsites_info(meta);
+}
+static void setup_metavectors(struct allocs_file_metadata *ameta)
+{
+	/* The segment metavector also needs (re-)setting up. */
+	unsigned nload = 0;
+	for (unsigned i = 0; i < ameta->m.phnum; ++i)
+	{
+		// if this phdr's a LOAD
+		if (ameta->m.phdrs[i].p_type == PT_LOAD)
+		{
+			__static_segment_setup_metavector(ameta,
+					i,
+					nload++
+				);
+		}
+	}
+}
+
+/* Loading the early libs' meta-objects is a pipeline, but only partly
+ * a parallel one. The dlopens, and filling in each file's allocsites,
+ * frames and metavectors, all stay on this thread, in order: dlopen
+ * mmaps, the mmap allocator is not thread-safe, and ld.so would
+ * serialize the dlopens anyway. Worker threads only keep ahead of us
+ * reading each meta-object into the page cache, then fall in behind us
+ * faulting in its metavectors and frame records and hashing its
+ * allocsites. Nothing they do maps memory or creates a bigalloc.
+ * Set LIBALLOCS_STARTUP_THREADS=1 to do it all on this thread. We wait
+ * for the workers before returning, so everything is published before
+ * main(); in the meantime, allocsite lookups fall back to the bsearch. */
+#ifndef STARTUP_MAX_THREADS
+#define STARTUP_MAX_THREADS 8
+#endif
+struct startup_job
+{
+	struct link_map *handle;
+	struct allocs_file_metadata *ameta;
+	char *meta_path; /* null if there's nothing to read ahead */
+};
+struct startup_pipeline
+{
+	struct startup_job jobs[MAX_EARLY_LIBS];
+	unsigned njobs;
+	unsigned next_prefetch; /* claimed atomically */
+	unsigned nloaded;       /* published by us, under the lock */
+	unsigned next_index;    /* claimed under the lock */
+#ifndef NO_PTHREADS
+	pthread_mutex_t lock;
+	pthread_cond_t loaded;
+#endif
+};
+
+static void prefetch_meta_object(const char *path)
+{
+	int fd = raw_open(path, O_RDONLY, 0);
+	if (fd < 0) return;
+	struct stat s;
+	if (0 == fstat(fd, &s)) readahead(fd, 0, s.st_size);
+	close(fd);
+}
+
+static void prefault(const void *begin, size_t len)
+{
+	for (uintptr_t p = ROUND_DOWN((uintptr_t) begin, PAGE_SIZE);
+			p < (uintptr_t) begin + len; p += PAGE_SIZE)
+	{
+		(void) *(volatile const char *) p;
+	}
+}
+
+static void index_one(struct allocs_file_metadata *ameta)
+{
+	for (unsigned i = 0; i < ameta->m.nload; ++i)
+	{
+		prefault(ameta->m.segments[i].metavector, ameta->m.segments[i].metavector_size);
+	}
+	prefault(ameta->frames_info, ameta->nframes * sizeof (struct frame_allocsite_entry));
+	hash_allocsites_info(ameta);
+}
+
+#ifndef NO_PTHREADS
+static void *run_startup_worker(void *arg)
+{
+	struct startup_pipeline *sp = arg;
+	unsigned i;
+	while ((i = __atomic_fetch_add(&sp->next_prefetch, 1, __ATOMIC_RELAXED)) < sp->njobs)
+	{
+		/* Don't bother if we've fallen behind the loading. */
+		if (i < __atomic_load_n(&sp->nloaded, __ATOMIC_RELAXED)) continue;
+		if (sp->jobs[i].meta_path) prefetch_meta_object(sp->jobs[i].meta_path);
+	}
+	pthread_mutex_lock(&sp->lock);
+	while (sp->next_index < sp->njobs)
+	{
+		if (sp->next_index == sp->nloaded) { pthread_cond_wait(&sp->loaded, &sp->lock); continue; }
+		i = sp->next_index++;
+		pthread_mutex_unlock(&sp->lock);
+		index_one(sp->jobs[i].ameta);
+		pthread_mutex_lock(&sp->lock);
+	}
+	pthread_mutex_unlock(&sp->lock);
+	return NULL;
+}
+#endif
+
+#ifndef NO_PTHREADS
+/* We run from inside the mmap allocator's init, i.e. from a priority
+ * constructor. If libpthread isn't loaded (older glibc, or a static
+ * link) pthread_create may not even be there yet, so don't insist. */
+#pragma weak pthread_create
+#endif
+static unsigned default_startup_nthreads(void)
+{
+#ifndef NO_PTHREADS
+	if (!&pthread_create) return 1;
+#endif
+	const char *nthreads_str = getenv("LIBALLOCS_STARTUP_THREADS");
+	long n = nthreads_str ? atol(nthreads_str) : sysconf(_SC_NPROCESSORS_ONLN);
+	return (n < 1) ? 1 : n;
+}
+
 void load_meta_objects_for_early_libs(void)
 {
 	assert(early_lib_handles[0]);
@@ -237,27 +364,75 @@ void load_meta_objects_for_early_libs(void)
 	if (!meta_base) meta_base = "/usr/lib/meta";
 	meta_base_len = strlen(meta_base);
 
+	struct startup_pipeline sp = { .njobs = 0 };
 	for (unsigned i = 0; i < MAX_EARLY_LIBS; ++i)
 	{
 		if (!early_lib_handles[i]) break;
 		struct file_metadata *meta = __static_file_allocator_metadata_by_addr(
 			early_lib_handles[i]->l_ld);
 		struct allocs_file_metadata *ameta = CONTAINER_OF(meta, struct allocs_file_metadata, m);
-		load_metadata(ameta, early_lib_handles[i]);
-		/* The segment metavector also needs (re-)setting up. */
-		unsigned nload = 0;
-		for (unsigned i = 0; i < meta->phnum; ++i)
+		const char *canon_objname = dynobj_name_from_dlpi_name(early_lib_handles[i]->l_name,
+			(void *) early_lib_handles[i]->l_addr);
+		const char *meta_path = canon_objname ? __liballocs_meta_libfile_name(canon_objname) : NULL;
+		sp.jobs[sp.njobs++] = (struct startup_job) {
+			.handle = early_lib_handles[i],
+			.ameta = ameta,
+			.meta_path = meta_path ? __liballocs_private_strdup(meta_path) : NULL
+		};
+	}
+	unsigned nthreads = default_startup_nthreads();
+	if (nthreads > STARTUP_MAX_THREADS) nthreads = STARTUP_MAX_THREADS;
+	if (nthreads > sp.njobs) nthreads = sp.njobs;
+#ifdef NO_PTHREADS
+	nthreads = 1;
+#else
+	pthread_t workers[STARTUP_MAX_THREADS];
+	unsigned nworkers = 0;
+	pthread_mutex_init(&sp.lock, NULL);
+	pthread_cond_init(&sp.loaded, NULL);
+	/* We are one of the threads. */
+	for (unsigned i = 1; i < nthreads; ++i)
+	{
+		if (0 != pthread_create(&workers[nworkers], NULL, run_startup_worker, &sp)) break;
+		++nworkers;
+	}
+#endif
+	for (unsigned i = 0; i < sp.njobs; ++i)
+	{
+		struct allocs_file_metadata *ameta = sp.jobs[i].ameta;
+		load_metadata_unhashed(ameta, sp.jobs[i].handle);
+		setup_metavectors(ameta);
+#ifndef NO_PTHREADS
+		if (nworkers > 0)
 		{
-			// if this phdr's a LOAD
-			if (meta->phdrs[i].p_type == PT_LOAD)
-			{
-				__static_segment_setup_metavector(ameta,
-						i,
-						nload++
-					);
-			}
+			pthread_mutex_lock(&sp.lock);
+			__atomic_store_n(&sp.nloaded, sp.nloaded + 1, __ATOMIC_RELAXED);
+			pthread_cond_broadcast(&sp.loaded);
+			pthread_mutex_unlock(&sp.lock);
+			continue;
 		}
+#endif
+		hash_allocsites_info(ameta);
 	}
+#ifndef NO_PTHREADS
+	if (nworkers > 0)
+	{
+		/* Help with the indexing, then wait for the rest. */
+		pthread_mutex_lock(&sp.lock);
+		while (sp.next_index < sp.njobs)
+		{
+			unsigned i = sp.next_index++;
+			pthread_mutex_unlock(&sp.lock);
+			index_one(sp.jobs[i].ameta);
+			pthread_mutex_lock(&sp.lock);
+		}
+		pthread_mutex_unlock(&sp.lock);
+		for (unsigned i = 0; i < nworkers; ++i) pthread_join(workers[i], NULL);
+	}
+	pthread_cond_destroy(&sp.loaded);
+	pthread_mutex_destroy(&sp.lock);
+#endif
+	for (unsigned i = 0; i < sp.njobs; ++i) __private_free(sp.jobs[i].meta_path);
 }
 
 struct file_metadata *__real___runt_files_notify_load(void *handle, const void *load_site);
@@ -415,6 +590,8 @@ struct file_metadata *__wrap___runt_files_notify_load(void *handle, const void *
 static void free_file_metadata(void *afm_as_void)
 {
 	struct allocs_file_metadata *afm = (struct allocs_file_metadata *) afm_as_void;
+	deinit_allocsites_info(afm);
+	deinit_frames_info(afm);
 	__runt_deinit_file_metadata(&afm->m);
 	__private_free(afm);
 }
@@ -444,15 +621,17 @@ void __static_file_allocator_notify_unload(const char *copied_filename)
 		assert(copied_filename);
 		/* For all big allocations, if we're the allocator and the filename matches, 
 		 * delete them. */
-		for (struct big_allocation *b = &big_allocations[0]; b != &big_allocations[NBIGALLOCS]; ++b)
+		for (struct big_allocation *b = &big_allocations[0]; b != &big_allocations[bigallocs_highwater]; ++b)
 		{
 			if (BIGALLOC_IN_USE(b) && b->allocated_by == &__static_file_allocator)
 			{
 				struct allocs_file_metadata *afm = (struct allocs_file_metadata *) b->allocator_private;
 				if (0 == strcmp(copied_filename, afm->m.filename))
 				{
-					/* unload meta-object */
+					/* unload meta-object, forgetting any types we interned or mapped from it */
 					dlclose(afm->meta_obj_handle);
+					__liballocs_intern_notify_unload();
+					__liballocs_ptrmap_notify_unload();
 					/* It's a match, so delete. FIXME: don't match by name (fragile);
 					 * load addr is better */
 					__liballocs_delete_bigalloc_at(b->begin, &__static_file_allocator);
@@ -253,11 +253,38 @@ DEFINE_META_VEC_FUNCS(sym, SYM, sym_or_reloc_rec, /* raw record -- ignored */ sy
 	/* metaval_from_raw -- ignored */ NOOP1,
 	/* addr_from_metaptr */ addr_from_rec, /* addr_from_metaptr_arg */ NULL)
 #endif
+/* Our bigallocs are symbols promoted to bigallocs, or the sections or
+ * segments that we suballocate. Whichever we're given, find the segment,
+ * which holds the metavector. */
+static inline struct big_allocation *segment_bigalloc_for(struct big_allocation *b)
+{
+	if (b->allocated_by == &__static_symbol_allocator) b = b->parent;
+	assert(b->allocated_by == &__static_section_allocator
+			|| b->allocated_by == &__static_segment_allocator);
+	struct big_allocation *segment_bigalloc
+	 = (b->allocated_by == &__static_section_allocator) ? b->parent
+			: b;
+	assert(segment_bigalloc->allocated_by == &__static_segment_allocator);
+	return segment_bigalloc;
+}
+
+static inline ElfW(Sym) *symtab_for_rec(union sym_or_reloc_rec *p,
+	struct allocs_file_metadata *file)
+{
+	switch (p->sym.kind)
+	{
+		case REC_DYNSYM:   return file->m.dynsym;
+		case REC_SYMTAB:   return file->m.symtab;
+		case REC_EXTRASYM: return file->extrasym;
+		default: abort();
+	}
+}
+
 static liballocs_err_t get_info(void *obj, struct big_allocation *maybe_bigalloc,
 	struct uniqtype **out_type, void **out_base,
 	unsigned long *out_size, const void **out_site)
 {
-	++__liballocs_hit_static_case;
+	__liballocs_stat_inc(LIBALLOCS_STAT_HIT_STATIC_CASE);
 	/* Search backwards in the bitmap for the first bit set
 	 * -- bounded by the biggest static object (can we do better?).
 	 * Then count backwards for bits set, down to a shortcut vector
@@ -281,15 +308,7 @@ static liballocs_err_t get_info(void *obj, struct big_allocation *maybe_bigalloc
 	// FIXME: not supposed to use pageindex directly
 	// FIXME: in the section case, shortcut vector needs an offset
 	maybe_bigalloc = maybe_bigalloc ? maybe_bigalloc : &big_allocations[PAGENUM(obj)];
-	struct big_allocation *b =
-		(maybe_bigalloc->allocated_by == &__static_symbol_allocator) ?
-		maybe_bigalloc->parent : maybe_bigalloc;
-	assert(b->allocated_by == &__static_section_allocator
-			|| b->allocated_by == &__static_segment_allocator);
-	struct big_allocation *segment_bigalloc
-	 = (b->allocated_by == &__static_section_allocator) ? b->parent
-			: b;
-	assert(segment_bigalloc->allocated_by == &__static_segment_allocator);
+	struct big_allocation *segment_bigalloc = segment_bigalloc_for(maybe_bigalloc);
 	struct segment_metadata *segment = segment_bigalloc->allocator_private;
 
 	uintptr_t obj_addr = (uintptr_t) obj;
@@ -317,28 +336,12 @@ static liballocs_err_t get_info(void *obj, struct big_allocation *maybe_bigalloc
 			found_limit_vaddr = found_base_vaddr + found->reloc.size;
 			found_type = pointer_to___uniqtype____uninterpreted_byte;
 		}
-		else switch (found->sym.kind)
+		else
 		{
-			case REC_DYNSYM:   symtab = file->m.dynsym; goto sym;
-			case REC_SYMTAB:   symtab = file->m.symtab; goto sym;
-			case REC_EXTRASYM: symtab = file->extrasym; goto sym;
-			sym:
-				found_limit_vaddr = found_base_vaddr + symtab[found->sym.idx].st_size;
-				// FIXME: there should be a macro in allocmeta-defs.h for this
-				found_type = (struct uniqtype *)(((uintptr_t) found->sym.uniqtype_ptr_bits_no_lowbits) << 3);
-				break;
-			default: // the default case's `found+1' trick is cute, but not necessary
-#if 0
-				/* the limit is either the next start address, or the
-				 * end of the segment */
-				if (unlikely(found == segment->metavector + metavector_nrecs - 1))
-				{
-					found_limit_vaddr = (uintptr_t) segment_bigalloc->end
-						- file_load_addr;
-				} else found_limit_vaddr = vaddr_from_rec(found+1, file);
-#else
-				abort();
-#endif
+			symtab = symtab_for_rec(found, file);
+			found_limit_vaddr = found_base_vaddr + symtab[found->sym.idx].st_size;
+			// FIXME: there should be a macro in allocmeta-defs.h for this
+			found_type = (struct uniqtype *)(((uintptr_t) found->sym.uniqtype_ptr_bits_no_lowbits) << 3);
 		}
 		if (target_vaddr > found_limit_vaddr) goto fail;
 		// else we can go ahead
@@ -349,7 +352,7 @@ static liballocs_err_t get_info(void *obj, struct big_allocation *maybe_bigalloc
 		return NULL;
 	}
 fail:
-	++__liballocs_aborted_static;
+	__liballocs_stat_inc(LIBALLOCS_STAT_ABORTED_STATIC);
 	return &__liballocs_err_unrecognised_static_object;
 }
 
@@ -362,9 +365,73 @@ liballocs_err_t __static_symbol_allocator_get_info(void *obj, struct big_allocat
 
 DEFAULT_GET_TYPE
 
+/* Walk the symbols (and reloc targets) starting within the given range of
+ * a segment or section. The metavector is already sorted by address, so
+ * after one binary search for the range start this is a linear pass:
+ * types come straight from the metavector record, and the only other
+ * memory we touch is each symbol's ElfW(Sym), for its address.
+ * Those are in symtab order rather than ours, so we prefetch a few
+ * records ahead. The containee_coord is the 1-based metavector index. */
+#define STATIC_SYMBOL_WALK_PREFETCH 8
+static int walk_allocations(struct alloc_tree_pos *pos, walk_alloc_cb_t *cb, void *arg,
+	void *maybe_range_begin, void *maybe_range_end)
+{
+	struct big_allocation *b = BOU_BIGALLOC(pos->bigalloc_or_uniqtype);
+	struct big_allocation *segment_bigalloc = segment_bigalloc_for(b);
+	struct segment_metadata *segment = segment_bigalloc->allocator_private;
+	struct allocs_file_metadata *file = segment_bigalloc->parent->allocator_private;
+	uintptr_t file_load_addr = file->m.l->l_addr;
+	unsigned metavector_nrecs = segment->metavector_size / sizeof (union sym_or_reloc_rec);
+	if (metavector_nrecs == 0) return 0;
+	uintptr_t begin_vaddr = (uintptr_t) (maybe_range_begin ?: b->begin) - file_load_addr;
+	uintptr_t end_vaddr = (uintptr_t) (maybe_range_end ?: b->end) - file_load_addr;
+	/* Find the first record starting at or after begin_vaddr. */
+#define proj(p) vaddr_from_rec(p, file)
+	union sym_or_reloc_rec *first = bsearch_leq_generic(
+		union sym_or_reloc_rec, begin_vaddr,
+		/*  T*  */ segment->metavector, /* unsigned */ metavector_nrecs,
+		proj);
+#undef proj
+	union sym_or_reloc_rec *const end_rec = segment->metavector + metavector_nrecs;
+	if (!first || first == end_rec) first = segment->metavector;
+	else if (vaddr_from_rec(first, file) < begin_vaddr) ++first;
+	struct alloc_tree_link link = {
+		.container = { pos->base, pos->bigalloc_or_uniqtype },
+		.containee_coord = 0
+	};
+	int ret = 0;
+	for (union sym_or_reloc_rec *p = first; p != end_rec; ++p)
+	{
+		union sym_or_reloc_rec *ahead = p + STATIC_SYMBOL_WALK_PREFETCH;
+		if (ahead < end_rec && !ahead->is_reloc)
+		{
+			__builtin_prefetch(&symtab_for_rec(ahead, file)[ahead->sym.idx]);
+		}
+		uintptr_t base_vaddr;
+		struct uniqtype *t;
+		if (p->is_reloc)
+		{
+			base_vaddr = p->reloc.base_vaddr;
+			t = pointer_to___uniqtype____uninterpreted_byte;
+		}
+		else
+		{
+			base_vaddr = symtab_for_rec(p, file)[p->sym.idx].st_value;
+			// FIXME: there should be a macro in allocmeta-defs.h for this
+			t = (struct uniqtype *)(((uintptr_t) p->sym.uniqtype_ptr_bits_no_lowbits) << 3);
+		}
+		if (base_vaddr >= end_vaddr) break;
+		link.containee_coord = 1 + (p - segment->metavector);
+		ret = cb(NULL, (void*)(file_load_addr + base_vaddr), t, file->m.load_site, &link, arg);
+		if (ret) return ret;
+	}
+	return ret;
+}
+
 struct allocator __static_symbol_allocator = {
 	.name = "static-symbol",
 	.is_cacheable = 1,
 	.get_info = __static_symbol_allocator_get_info,
-	.get_type = get_type
+	.get_type = get_type,
+	.walk_allocations = walk_allocations
 };
@@ -5,16 +5,22 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include "liballocs.h"
 #include "liballocs_private.h"
 #include "allocsites.h"
 #include "relf.h"
-/* This alias needs to go before generic_malloc_index.h because of
- * the aliasing HACK in that file, which will #define __liballocs_free_arena_bitmap_and_info. */
+#include "raw-syscalls-defs.h"
+/* These aliases need to go before generic_malloc_index.h because of
+ * the aliasing HACK in that file, which will #define them. */
 void __liballocs_free_arena_bitmap_and_info(void *info)
 __attribute__((alias("__free_arena_bitmap_and_info")));
+void __liballocs_grow_arena_bitmap(void *info, unsigned long total_words)
+__attribute__((alias("__grow_arena_bitmap")));
 
 #include "generic_malloc_index.h" /* FIXME: want to remove this */
 
@@ -39,10 +45,95 @@ __attribute__((visibility("hidden")))
 void __free_arena_bitmap_and_info(void *info /* really struct arena_bitmap_info * */)
 {
 	struct arena_bitmap_info *the_info = info;
-	if (the_info && the_info->bitmap) __private_free(the_info->bitmap);
+	if (the_info && the_info->bitmap)
+	{
+#ifdef GENERIC_MALLOC_INDEX_LOCK_FREE
+		if (the_info->nwords_reserved)
+		{
+			raw_munmap(the_info->bitmap, index_mapping_size(the_info->nwords_reserved));
+			raw_munmap(the_info->summary, index_mapping_size(
+				INDEX_SUMMARY_NWORDS(the_info->nwords_reserved)));
+		}
+		else
+#endif
+		{
+			__private_free(the_info->bitmap);
+			if (the_info->summary) __private_free(the_info->summary);
+		}
+	}
 	if (the_info) __private_free(the_info);
 }
 
+#ifdef GENERIC_MALLOC_INDEX_LOCK_FREE
+/* We use raw syscalls for the reservation, so that it doesn't show up
+ * as an mmap'd bigalloc, and so that no nudging policy moves it. */
+static void grow_usable(struct arena_bitmap_info *info, unsigned long total_words)
+{
+	unsigned long want = INDEX_RESERVE_GROWTH * total_words;
+	if (want < INDEX_RESERVE_MIN_NWORDS) want = INDEX_RESERVE_MIN_NWORDS;
+	if (want > info->nwords_reserved) want = info->nwords_reserved;
+	unsigned long old = info->nwords_usable;
+	/* Fresh anonymous pages are zero, so growth needs no bzero. If the
+	 * reservation falls short, we still make all of it usable. */
+	if (want > old
+			&& 0 == raw_mprotect((char*) info->bitmap + index_mapping_size(old),
+				index_mapping_size(want) - index_mapping_size(old), PROT_READ|PROT_WRITE)
+			&& 0 == raw_mprotect((char*) info->summary + index_mapping_size(INDEX_SUMMARY_NWORDS(old)),
+				index_mapping_size(INDEX_SUMMARY_NWORDS(want))
+					- index_mapping_size(INDEX_SUMMARY_NWORDS(old)), PROT_READ|PROT_WRITE))
+	{
+		__atomic_store_n(&info->nwords_usable, want, __ATOMIC_RELEASE);
+		old = want;
+	}
+	if (old >= total_words) return;
+	/* Out of reservation, or out of commit charge. The bitmap stays
+	 * usable as far as it got, and chunks beyond it go unindexed. */
+	__atomic_store_n(&info->bitmap_capped, 1, __ATOMIC_RELEASE);
+}
+#endif
+/* Called with the info's mutex held, when nwords_usable falls short of
+ * total_words. On the first call we reserve, halving the reservation until
+ * RLIMIT_AS allows it; if even total_words won't fit, we give up and set
+ * bitmap_capped. We never abort: an unindexed chunk is merely unqueryable. */
+__attribute__((visibility("hidden")))
+void __grow_arena_bitmap(void *info /* really struct arena_bitmap_info * */, unsigned long total_words)
+{
+#ifdef GENERIC_MALLOC_INDEX_LOCK_FREE
+	struct arena_bitmap_info *the_info = info;
+	if (the_info->bitmap)
+	{
+		grow_usable(the_info, total_words);
+		return;
+	}
+	unsigned long max_words = ((uintptr_t) ROUND_UP_PTR(MAXIMUM_USER_ADDRESS + 1,
+			MALLOC_ALIGN*BITMAP_WORD_NBITS) - (uintptr_t) the_info->bitmap_base_addr)
+		/ (MALLOC_ALIGN * BITMAP_WORD_NBITS);
+	unsigned long n = INDEX_RESERVE_MAX_COVERAGE / (MALLOC_ALIGN * BITMAP_WORD_NBITS);
+	if (n > max_words) n = max_words;
+	for (; n >= total_words && n > 0; n /= 2)
+	{
+		void *bitmap = raw_mmap(NULL, index_mapping_size(n), PROT_NONE,
+			MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+		if (MMAP_RETURN_IS_ERROR(bitmap)) continue;
+		void *summary = raw_mmap(NULL, index_mapping_size(INDEX_SUMMARY_NWORDS(n)), PROT_NONE,
+			MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+		if (MMAP_RETURN_IS_ERROR(summary))
+		{
+			raw_munmap(bitmap, index_mapping_size(n));
+			continue;
+		}
+		the_info->summary = summary;
+		the_info->nwords_reserved = n;
+		/* Readers gate on nwords, which grows only after nwords_usable,
+		 * so they never touch the PROT_NONE part. */
+		__atomic_store_n(&the_info->bitmap, bitmap, __ATOMIC_RELEASE);
+		grow_usable(the_info, total_words);
+		return;
+	}
+	__atomic_store_n(&the_info->bitmap_capped, 1, __ATOMIC_RELEASE);
+#endif
+}
+
 /* Each allocsite is logically assigned a contiguous
  * ID, defined as the sum of its index in the allocsite array
  * and its file's "base ID" (or start_id). The lookup
@@ -54,7 +145,100 @@ allocsites_vectors_by_base_id[ALLOCSITES_INDEX_SIZE];
 /* Positions in the id array are issued sequentially */
 allocsite_id_t allocsites_id_entry_slot_next_free  __attribute__((visibility("hidden")));
 
+/* An open-addressing hash from allocsite address to its entry and id,
+ * filled as each file's allocsites are loaded. It saves first-time type
+ * queries from finding the file's bigalloc and bsearching its allocsites.
+ * Readers don't lock: a slot's key is published after its value, and
+ * an old table is never unmapped after growing, because queries may still
+ * be probing it. Since sizes double, that at most doubles our footprint. */
+struct allocsite_hash_slot
+{
+	const void *allocsite; /* NULL if empty */
+	struct allocsite_entry *entry;
+	allocsite_id_t id;
+};
+struct allocsite_hash_table
+{
+	unsigned long nslots; /* a power of two */
+	unsigned long nused; /* includes tombstones */
+	struct allocsite_hash_slot slots[];
+};
+#define ALLOCSITE_HASH_TOMBSTONE ((const void *) 1)
+#define ALLOCSITE_HASH_MIN_NSLOTS 1024
+static struct allocsite_hash_table *allocsite_hash;
+/* Sites we have reserved room for but not yet inserted. */
+static unsigned long allocsite_hash_npending;
+static pthread_mutex_t allocsite_hash_mutex = PTHREAD_MUTEX_INITIALIZER;
+static _Bool allocsite_hash_disabled;
+
+static inline unsigned long allocsite_hash_idx(const void *allocsite, unsigned long nslots)
+{
+	return ((uintptr_t) allocsite * 0x9e3779b97f4a7c15ul) >> (64 - __builtin_ctzl(nslots));
+}
+static void allocsite_hash_insert_in(struct allocsite_hash_table *table,
+	const void *allocsite, struct allocsite_entry *entry, allocsite_id_t id)
+{
+	unsigned long mask = table->nslots - 1;
+	for (unsigned long i = allocsite_hash_idx(allocsite, table->nslots); ; i = (i + 1) & mask)
+	{
+		const void *cur = table->slots[i].allocsite;
+		if (cur == allocsite) return; /* same site in two files? keep the first */
+		if (cur == NULL || cur == ALLOCSITE_HASH_TOMBSTONE)
+		{
+			if (cur == NULL) ++table->nused;
+			table->slots[i].entry = entry;
+			table->slots[i].id = id;
+			__atomic_store_n(&table->slots[i].allocsite, allocsite, __ATOMIC_RELEASE);
+			return;
+		}
+	}
+}
+/* Make room for n more sites, keeping the load factor at most 1/2 even
+ * once all pending sites are in. Call with the mutex held. */
+static void allocsite_hash_reserve(unsigned long n)
+{
+	struct allocsite_hash_table *old = allocsite_hash;
+	allocsite_hash_npending += n;
+	unsigned long nslots = old ? old->nslots : ALLOCSITE_HASH_MIN_NSLOTS;
+	while (2 * ((old ? old->nused : 0) + allocsite_hash_npending) > nslots) nslots *= 2;
+	if (old && nslots == old->nslots) return;
+	struct allocsite_hash_table *table = mmap(NULL, offsetof(struct allocsite_hash_table, slots)
+			+ nslots * sizeof (struct allocsite_hash_slot),
+		PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (MMAP_RETURN_IS_ERROR(table)) abort();
+	table->nslots = nslots;
+	for (unsigned long i = 0; old && i < old->nslots; ++i)
+	{
+		/* Rehashing drops the tombstones. */
+		if (old->slots[i].allocsite && old->slots[i].allocsite != ALLOCSITE_HASH_TOMBSTONE)
+		{
+			allocsite_hash_insert_in(table, old->slots[i].allocsite,
+				old->slots[i].entry, old->slots[i].id);
+		}
+	}
+	__atomic_store_n(&allocsite_hash, table, __ATOMIC_RELEASE);
+}
+static struct allocsite_hash_slot *allocsite_hash_lookup(const void *allocsite)
+{
+	struct allocsite_hash_table *table = __atomic_load_n(&allocsite_hash, __ATOMIC_ACQUIRE);
+	if (!table) return NULL;
+	unsigned long mask = table->nslots - 1;
+	/* The load factor is at most 1/2, so we always hit an empty slot. */
+	for (unsigned long i = allocsite_hash_idx(allocsite, table->nslots); ; i = (i + 1) & mask)
+	{
+		const void *cur = __atomic_load_n(&table->slots[i].allocsite, __ATOMIC_ACQUIRE);
+		if (cur == allocsite) return &table->slots[i];
+		if (cur == NULL) return NULL;
+	}
+}
+
 void init_allocsites_info(struct allocs_file_metadata *file)
+{
+	init_allocsites_info_unhashed(file);
+	hash_allocsites_info(file);
+}
+
+void init_allocsites_info_unhashed(struct allocs_file_metadata *file)
 {
 	if (!file->meta_obj_handle) return;
 	ElfW(Sym) *found = gnu_hash_lookup(
@@ -88,7 +272,51 @@ void init_allocsites_info(struct allocs_file_metadata *file)
 			.ptr = first_entry 
 		};
 		file->allocsites_info = &allocsites_vectors_by_base_id[slot_pos];
+		/* Make room to hash this file's allocsites. Growing the table
+		 * may mmap, so we do it here rather than in the hashing half. */
+		static _Bool checked_env;
+		if (!checked_env)
+		{
+			allocsite_hash_disabled = (getenv("LIBALLOCS_NO_ALLOCSITE_HASH") != NULL);
+			checked_env = 1;
+		}
+		if (allocsite_hash_disabled) return;
+		pthread_mutex_lock(&allocsite_hash_mutex);
+		allocsite_hash_reserve(file->allocsites_info->count);
+		pthread_mutex_unlock(&allocsite_hash_mutex);
+	}
+}
+
+void hash_allocsites_info(struct allocs_file_metadata *file)
+{
+	struct allocsites_vectors_by_base_id_entry *info = file->allocsites_info;
+	if (!info || allocsite_hash_disabled) return;
+	pthread_mutex_lock(&allocsite_hash_mutex);
+	for (unsigned i = 0; i < info->count; ++i)
+	{
+		allocsite_hash_insert_in(allocsite_hash,
+			(const void *)(info->file_base_addr + info->ptr[i].allocsite_vaddr),
+			&info->ptr[i], info->start_id + i);
 	}
+	allocsite_hash_npending -= info->count;
+	pthread_mutex_unlock(&allocsite_hash_mutex);
+}
+
+void deinit_allocsites_info(struct allocs_file_metadata *file)
+{
+	struct allocsites_vectors_by_base_id_entry *info = file->allocsites_info;
+	if (!info || !allocsite_hash) return;
+	pthread_mutex_lock(&allocsite_hash_mutex);
+	for (unsigned i = 0; i < info->count; ++i)
+	{
+		struct allocsite_hash_slot *found = allocsite_hash_lookup(
+			(const void *)(info->file_base_addr + info->ptr[i].allocsite_vaddr));
+		/* Tombstone it, so that probes for later sites keep going. */
+		if (found && found->entry == &info->ptr[i]) __atomic_store_n(&found->allocsite,
+			ALLOCSITE_HASH_TOMBSTONE, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&allocsite_hash_mutex);
+	file->allocsites_info = NULL;
 }
 
 static struct allocs_file_metadata *get_file(const void *allocsite)
@@ -100,9 +328,18 @@ static struct allocs_file_metadata *get_file(const void *allocsite)
 	return file;
 }
 
-struct allocsite_entry *__liballocs_find_allocsite_entry_at(
-	const void *allocsite)
+struct allocsite_entry *__liballocs_find_allocsite_entry_and_id_at(
+	const void *allocsite, allocsite_id_t *out_id)
 {
+	struct allocsite_hash_slot *hashed = allocsite_hash_lookup(allocsite);
+	if (hashed)
+	{
+		if (out_id) *out_id = hashed->id;
+		return hashed->entry;
+	}
+	/* Not hashed, so fall back to the bsearch. This also gives the
+	 * nearest site at or below the address, which the hash does not. */
+	if (out_id) *out_id = (allocsite_id_t) -1;
 	struct allocs_file_metadata *file = get_file(allocsite);
 	uintptr_t allocsite_vaddr = (uintptr_t) allocsite - file->m.l->l_addr;
 	if (!file->allocsites_info) return NULL;
@@ -116,16 +353,22 @@ struct allocsite_entry *__liballocs_find_allocsite_entry_at(
 		/* n */ file->allocsites_info->count,
 		proj);
 #undef proj
+	if (found && out_id) *out_id = file->allocsites_info->start_id
+		+ (found - file->allocsites_info->ptr);
 	return found;
 }
 
+struct allocsite_entry *__liballocs_find_allocsite_entry_at(
+	const void *allocsite)
+{
+	return __liballocs_find_allocsite_entry_and_id_at(allocsite, NULL);
+}
+
 allocsite_id_t __liballocs_allocsite_id(const void *allocsite)
 {
-	struct allocs_file_metadata *file = get_file(allocsite);
-	struct allocsite_entry *found_entry
-	 = __liballocs_find_allocsite_entry_at(allocsite);
-	if (!found_entry) return (allocsite_id_t) -1;
-	return file->allocsites_info->start_id + (found_entry - file->allocsites_info->ptr);
+	allocsite_id_t id;
+	__liballocs_find_allocsite_entry_and_id_at(allocsite, &id);
+	return id;
 }
 
 struct allocsite_entry *__liballocs_allocsite_entry_by_id(allocsite_id_t id,
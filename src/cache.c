@@ -1,33 +1,150 @@
 #define _GNU_SOURCE
+#include <stdlib.h>
+#include <pthread.h>
 #include "liballocs_cil_inlines.h"
 #include "liballocs.h"
 #include "pageindex.h"
 
-// FIXME: this should be thread-local but my gdb can't grok that
-struct __liballocs_memrange_cache /* __thread */ __liballocs_ool_cache = {
-	.size_plus_one = 1 + LIBALLOCS_MEMRANGE_CACHE_MAX_SIZE,
-	.next_victim = 1
+/* Threads start out pointing at this, which never hits and never caches.
+ * They claim a real cache from the pool on their first out-of-line miss. */
+static struct __liballocs_memrange_cache unclaimed_cache;
+/* If the pool runs out, later threads share this zero-sized cache. */
+static struct __liballocs_memrange_cache disabled_cache = {
+	.size_plus_one = 1,
+	.next_victim = 1,
+	.base_lo = (const void *) -1
 };
 
+#ifndef NO_TLS
+__thread struct __liballocs_memrange_cache *__liballocs_ool_cache = &unclaimed_cache;
+#else
+struct __liballocs_memrange_cache *__liballocs_ool_cache = &unclaimed_cache;
+#endif
+
+static struct __liballocs_memrange_cache cache_pool[LIBALLOCS_MEMRANGE_CACHE_NPOOL];
+/* One past the highest pool slot ever claimed, so invalidation scans only that far. */
+static unsigned cache_pool_highwater;
+
+/* Entry count used by newly claimed caches. It can be lowered
+ * at run time with LIBALLOCS_MEMRANGE_CACHE_SIZE. */
+static unsigned memrange_cache_size(void)
+{
+	static int size = -1;
+	if (size == -1)
+	{
+		const char *size_str = getenv("LIBALLOCS_MEMRANGE_CACHE_SIZE");
+		int requested = size_str ? atoi(size_str) : LIBALLOCS_MEMRANGE_CACHE_MAX_SIZE;
+		if (requested < 0) requested = 0;
+		if (requested > LIBALLOCS_MEMRANGE_CACHE_MAX_SIZE) requested = LIBALLOCS_MEMRANGE_CACHE_MAX_SIZE;
+		size = requested;
+	}
+	return size;
+}
+
+#ifndef NO_PTHREADS
+static pthread_key_t release_key;
+static pthread_once_t release_key_once = PTHREAD_ONCE_INIT;
+static void release_memrange_cache(void *arg)
+{
+	struct __liballocs_memrange_cache *c = arg;
+	__liballocs_ool_cache = &disabled_cache;
+	/* Clear the entries before letting another thread claim the slot. */
+	c->validity = 0;
+	c->head_mru = c->tail_mru = 0;
+	c->base_lo = (const void *) -1;
+	c->base_hi = (const void *) 0;
+	__atomic_store_n(&c->remote_invalid, 0u, __ATOMIC_RELAXED);
+	__atomic_store_n(&c->claimed, 0, __ATOMIC_RELEASE);
+}
+static void init_release_key(void)
+{
+	pthread_key_create(&release_key, release_memrange_cache);
+}
+#endif
+
+struct __liballocs_memrange_cache *__liballocs_claim_memrange_cache(void)
+{
+	if (__liballocs_ool_cache != &unclaimed_cache) return __liballocs_ool_cache;
+	struct __liballocs_memrange_cache *c = &disabled_cache;
+	for (unsigned i = 0; i < LIBALLOCS_MEMRANGE_CACHE_NPOOL; ++i)
+	{
+		_Bool expected = 0;
+		if (__atomic_compare_exchange_n(&cache_pool[i].claimed, &expected, 1,
+				0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		{
+			c = &cache_pool[i];
+			unsigned highwater = __atomic_load_n(&cache_pool_highwater, __ATOMIC_RELAXED);
+			while (highwater < i + 1 && !__atomic_compare_exchange_n(&cache_pool_highwater,
+					&highwater, i + 1, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+			c->size_plus_one = 1 + memrange_cache_size();
+			c->next_victim = 1;
+			c->base_lo = (const void *) -1;
+			c->base_hi = (const void *) 0;
+#ifndef NO_PTHREADS
+			pthread_once(&release_key_once, init_release_key);
+			pthread_setspecific(release_key, c);
+#endif
+			break;
+		}
+	}
+	__liballocs_ool_cache = c;
+	return c;
+}
+
+/* Might any entry of c have its obj_base within [allocptr, allocptr+size)? */
+static inline _Bool cache_may_hold(struct __liballocs_memrange_cache *c,
+	const void *allocptr, unsigned long size)
+{
+	return (const char *) allocptr < (const char *) __atomic_load_n(&c->base_hi, __ATOMIC_RELAXED)
+		&& (const char *) allocptr + size > (const char *) __atomic_load_n(&c->base_lo, __ATOMIC_RELAXED);
+}
+
 /* FIXME: rewrite these */
 void __liballocs_uncache_all(const void *allocptr, unsigned long size)
 {
-	assert((__liballocs_check_cache_sanity(&__liballocs_ool_cache), 1));
-	for (unsigned i = 1; i < __liballocs_ool_cache.size_plus_one; ++i)
+	struct __liballocs_memrange_cache *ours = __liballocs_ool_cache;
+	assert((__liballocs_check_cache_sanity(ours), 1));
+	if (cache_may_hold(ours, allocptr, size)) for (unsigned i = 1; i < ours->size_plus_one; ++i)
 	{
-		if (__liballocs_ool_cache.validity & (1u << (i-1)))
+		if (ours->validity & (1u << (i-1)))
 		{
-			assert((__liballocs_check_cache_sanity(&__liballocs_ool_cache), 1));
+			assert((__liballocs_check_cache_sanity(ours), 1));
 			/* Uncache any object beginning anywhere within the passed-in range. */
-			if ((char*) __liballocs_ool_cache.entries[i].obj_base >= (char*) allocptr
-					 && (char*) __liballocs_ool_cache.entries[i].obj_base < (char*) allocptr + size)
+			if ((char*) ours->entries[i].obj_base >= (char*) allocptr
+					 && (char*) ours->entries[i].obj_base < (char*) allocptr + size)
 			{
 				// unset validity and make this the next victim
-				__liballocs_cache_unlink(&__liballocs_ool_cache, i);
-				__liballocs_ool_cache.next_victim = i;
+				__liballocs_cache_unlink(ours, i);
+				ours->next_victim = i;
+			}
+			assert((__liballocs_check_cache_sanity(ours), 1));
+		}
+	}
+	assert((__liballocs_check_cache_sanity(ours), 1));
+	/* Other threads' caches we can only mark; their owners do the unlinking.
+	 * Our reads of their entries may race with their updates, but the
+	 * entry for a chunk being freed is stable, so at worst we spuriously
+	 * invalidate a newly written entry. */
+	unsigned highwater = __atomic_load_n(&cache_pool_highwater, __ATOMIC_ACQUIRE);
+	for (unsigned n = 0; n < highwater; ++n)
+	{
+		struct __liballocs_memrange_cache *c = &cache_pool[n];
+		if (c == ours || !__atomic_load_n(&c->claimed, __ATOMIC_RELAXED)) continue;
+		if (!cache_may_hold(c, allocptr, size)) continue;
+		unsigned validity = __atomic_load_n(&c->validity, __ATOMIC_RELAXED);
+		unsigned to_invalidate = 0;
+		while (validity)
+		{
+			unsigned i = __builtin_ctz(validity) + 1;
+			const void *obj_base = __atomic_load_n(&c->entries[i].obj_base, __ATOMIC_RELAXED);
+			if ((char*) obj_base >= (char*) allocptr
+					 && (char*) obj_base < (char*) allocptr + size)
+			{
+				to_invalidate |= (1u << (i-1));
 			}
-			assert((__liballocs_check_cache_sanity(&__liballocs_ool_cache), 1));
+			validity &= ~(1u << (i-1));
 		}
+		if (to_invalidate) __atomic_fetch_or(&c->remote_invalid, to_invalidate,
+			__ATOMIC_RELEASE);
 	}
-	assert((__liballocs_check_cache_sanity(&__liballocs_ool_cache), 1));
 }
@@ -7,6 +7,7 @@
 #include "uniqtype.h"
 #include "uniqtype-bfs.h"
 #include "liballocs_cil_inlines.h"
+#include "liballocs_stats.h"
 #include "pageindex.h"
 
 /* NOTE: is linking -R, i.e. "symbols only", the right solution for 
@@ -43,12 +44,15 @@
  * Can we use -R with a linker script?
  */
 
-struct __liballocs_memrange_cache __liballocs_ool_cache; // all zeroes
+static struct __liballocs_memrange_cache unclaimed_cache; // all zeroes
+__thread struct __liballocs_memrange_cache *__liballocs_ool_cache = &unclaimed_cache;
 _Bool __liballocs_is_initialized;
 
 struct big_allocation;
 
 uint16_t *pageindex __attribute__((visibility("protected")));
+uint16_t *__liballocs_pageindex_leaf;
+unsigned long __liballocs_pageindex_leaf_seq;
 
 __attribute__((visibility("protected")))
 struct big_allocation big_allocations[/*NBIGALLOCS*/1];
@@ -229,6 +233,12 @@ void __uniqtype_walk_bfs_from_object(
 	follow_ptr_fn *follow_ptr, void *fp_arg,
 	on_blacken_fn *on_blacken, void *ob_arg) {}
 
+void __uniqtype_walk_bfs_parallel(
+	void *object, struct uniqtype *t,
+	follow_ptr_fn *follow_ptr, void *fp_arg,
+	on_blacken_fn *on_blacken, void *ob_arg,
+	const struct __uniqtype_bfs_opts *opts) {}
+
 struct uniqtype *
 __liballocs_get_or_create_union_type(unsigned n, /* struct uniqtype *first_memb_t, */...)
 {
@@ -238,6 +248,7 @@ struct uniqtype *__liballocs_get_or_create_unbounded_array_type(struct uniqtype
 {
 	return NULL;
 }
+void __liballocs_publish_rt_uniqtypes(void) {}
 int __liballocs_add_type_to_block(void *block, struct uniqtype *t)
 {
 	return 0;
@@ -260,6 +271,9 @@ struct big_allocation *__lookup_bigalloc_from_root(const void *mem, struct alloc
 __attribute__((visibility("protected")))
 struct big_allocation *__lookup_deepest_bigalloc(const void *mem)
 { return NULL; }
+__attribute__((visibility("protected")))
+_Bool __liballocs_bigalloc_is_leaf_for_page(struct big_allocation *b, const void *obj)
+{ return 0; }
 
 __attribute__((visibility("protected")))
 struct big_allocation *__lookup_bigalloc_under_by_suballocator(const void *mem, struct allocator *sub_a,
@@ -433,17 +447,22 @@ void *__liballocs_private_realloc(void*, size_t);
 void __liballocs_private_free(void *);
 
 void __liballocs_free_arena_bitmap_and_info(void *info  /* really struct arena_bitmap_info * */);
-
-unsigned long __liballocs_aborted_stack __attribute__((visibility("hidden")));;
-unsigned long __liballocs_aborted_static __attribute__((visibility("hidden")));;
-unsigned long __liballocs_aborted_unknown_storage __attribute__((visibility("protected")));;
+void __liballocs_grow_arena_bitmap(void *info  /* really struct arena_bitmap_info * */, unsigned long total_words);
+
+static struct __liballocs_stats_block dummy_stats_block = { .claimed = 1, .shared = 1 };
+__thread struct __liballocs_stats_block *__liballocs_stats_mine = &dummy_stats_block;
+int __liballocs_stats_detail;
+struct __liballocs_stats_block *__liballocs_stats_claim_block(void)
+{ return &dummy_stats_block; }
+unsigned long __liballocs_stats_now_ns(void) { return 0; }
+void __liballocs_stats_note_query(struct allocator *a, struct liballocs_err *err,
+	unsigned long t0_ns) {}
+void __liballocs_stats_read(struct liballocs_stats *out)
+{ memset(out, 0, sizeof *out); }
+const char *__liballocs_stats_export(const char *path) { return NULL; }
 unsigned long __liballocs_hit_heap_case __attribute__((visibility("protected")));
-unsigned long __liballocs_hit_alloca_case __attribute__((visibility("hidden")));;
-unsigned long __liballocs_hit_stack_case __attribute__((visibility("hidden")));;
-unsigned long __liballocs_hit_static_case __attribute__((visibility("hidden")));;
-unsigned long __liballocs_aborted_unindexed_heap __attribute__((visibility("protected")));;
-unsigned long __liballocs_aborted_unindexed_alloca __attribute__((visibility("hidden")));;
-unsigned long __liballocs_aborted_unrecognised_allocsite __attribute__((visibility("protected")));;
+unsigned long __liballocs_aborted_unindexed_heap __attribute__((visibility("protected")));
+unsigned long __liballocs_aborted_unrecognised_allocsite __attribute__((visibility("protected")));
 
 __attribute__((visibility("protected")))
 liballocs_err_t __liballocs_extract_and_output_alloc_site_and_type(
@@ -451,6 +470,18 @@ liballocs_err_t __liballocs_extract_and_output_alloc_site_and_type(
     struct uniqtype **out_type,
     void **out_site
 ) { return NULL; }
+__attribute__((visibility("protected")))
+liballocs_err_t __liballocs_extract_and_output_generic_malloc_site_and_type(
+    struct insert *p_ins,
+    struct uniqtype **out_type,
+    void **out_site
+) { return NULL; }
+__attribute__((visibility("protected")))
+void __liballocs_peek_alloc_site_and_type(
+    const struct insert *p_ins,
+    struct uniqtype **out_type,
+    const void **out_site
+) { if (out_type) *out_type = NULL; if (out_site) *out_site = NULL; }
 
 void *__liballocs_private_malloc(size_t sz)
 { return NULL; }
@@ -458,7 +489,11 @@ void *__liballocs_private_realloc(void *ptr, size_t sz)
 { return NULL; }
 void __liballocs_free_arena_bitmap_and_info(void *info)
 {}
+void __liballocs_grow_arena_bitmap(void *info, unsigned long total_words)
+{}
 void __liballocs_uncache_all(const void *allocptr, unsigned long size)
 {}
+struct __liballocs_memrange_cache *__liballocs_claim_memrange_cache(void)
+{ return &unclaimed_cache; }
 
 _Bool __liballocs_notify_unindexed_address(const void *obj) { return 1; }
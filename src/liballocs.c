@@ -39,8 +39,8 @@ unsigned char *__liballocs_rt_uniqtypes_dynstr;
 
 /* FIXME: why is this function necessary?
  * We keep pointers into this object. Why?
- * We use them only in get_type_from_symname,
- * which appears to be just a faster way than fake_dlsym. */
+ * We used them only to look up runtime-created types by name,
+ * which we no longer do (see uniqtype-intern.c). */
 __attribute__((visibility("hidden")))
 void
 update_rt_uniqtypes_obj(void *handle, void *old_base)
@@ -59,76 +59,49 @@ update_rt_uniqtypes_obj(void *handle, void *old_base)
 	}
 }
 
-static struct uniqtype *
-get_type_from_symname(const char *precise_uniqtype_name)
-{
-	/* Does such a type exist?
-	 * On the assumption that we get called many times for the same typename,
-	 * and that usually therefore it *does* exist but in the synthetic libdlbind
-	 * object, we try a GNU hash lookup on that first. */
-	ElfW(Sym) *found_sym = __liballocs_rt_uniqtypes_gnu_hash ?
-		gnu_hash_lookup(__liballocs_rt_uniqtypes_gnu_hash,
-			__liballocs_rt_uniqtypes_dynsym, __liballocs_rt_uniqtypes_dynstr,
-			precise_uniqtype_name)
-		: NULL;
-	void *found = (found_sym ? sym_to_addr(found_sym) : NULL);
-	if (found) return (struct uniqtype *) found;
-	return (struct uniqtype *) dlsym(NULL, precise_uniqtype_name);
-}
+#define SIZE_FOR_NRELATED(n) offsetof(struct uniqtype, related) + (n) * sizeof (struct uniqtype_rel_info)
 
-static
-struct uniqtype *
-get_or_create_array_type(struct uniqtype *element_t, unsigned array_len)
+struct array_init_arg
 {
-	char precise_uniqtype_name[4096];
-	const char *element_name = UNIQTYPE_NAME(element_t); /* gets "simple", not symbol, name */
-	if (array_len == UNIQTYPE_ARRAY_LENGTH_UNBOUNDED)
-	{
-		snprintf(precise_uniqtype_name, sizeof precise_uniqtype_name,
-				"__uniqtype____ARR_%s",
-				element_name);
-	}
-	else
-	{
-		snprintf(precise_uniqtype_name, sizeof precise_uniqtype_name,
-				"__uniqtype____ARR%d_%s",
-				array_len,
-				element_name);
-	}
-	/* FIXME: compute hash code. Should be an easy case. */
-
-	struct uniqtype *found = get_type_from_symname(precise_uniqtype_name);
-	if (found) return found;
-
-	/* Create it and memoise using libdlbind. */
-	size_t sz = offsetof(struct uniqtype, related) + 1 * (sizeof (struct uniqtype_rel_info));
-	void *allocated = dlalloc(__liballocs_rt_uniqtypes_obj, sz, SHF_WRITE);
-	struct uniqtype *allocated_uniqtype = allocated;
+	struct uniqtype *element_t;
+	unsigned array_len;
+	_Bool flexible;
+};
+static void init_array_type(struct uniqtype *allocated_uniqtype, void *arg)
+{
+	struct array_init_arg *a = arg;
 	*allocated_uniqtype = (struct uniqtype) {
-		.pos_maxoff = (array_len == UNIQTYPE_ARRAY_LENGTH_UNBOUNDED)
+		.pos_maxoff = (a->array_len == UNIQTYPE_ARRAY_LENGTH_UNBOUNDED)
 				? UNIQTYPE_POS_MAXOFF_UNBOUNDED
-				: (array_len * element_t->pos_maxoff),
+				: (a->array_len * a->element_t->pos_maxoff),
 		.un = {
 			array: {
 				.is_array = 1,
-				.nelems = array_len
+				.nelems = a->array_len
 			}
 		},
-		.make_precise = NULL
+		.make_precise = a->flexible ? __liballocs_make_array_precise_with_memory_bounds : NULL
 	};
 	allocated_uniqtype->related[0] = (struct uniqtype_rel_info) {
 		.un = {
 			t: {
-				.ptr = element_t
+				.ptr = a->element_t
 			}
 		}
 	};
-	void *old_base = (void*) ((struct link_map *) __liballocs_rt_uniqtypes_obj)->l_addr;
-	void *reloaded = dlbind(__liballocs_rt_uniqtypes_obj, precise_uniqtype_name,
-		allocated, sz, STT_OBJECT);
-	assert(reloaded);
+}
 
-	return allocated_uniqtype;
+static
+struct uniqtype *
+get_or_create_array_type(struct uniqtype *element_t, unsigned array_len,
+	_Bool flexible)
+{
+	/* An unbounded array type and a flexible one share a key (and a name),
+	 * so whichever is made first serves for both. */
+	struct uniqtype_intern_key k = { .kind = ARRAY, .n = array_len, .rel = &element_t };
+	struct array_init_arg arg = { element_t, array_len, flexible };
+	return __liballocs_intern_get_or_create(&k, SIZE_FOR_NRELATED(1),
+		init_array_type, &arg);
 }
 
 struct uniqtype *
@@ -138,7 +111,7 @@ __liballocs_get_or_create_array_type(struct uniqtype *element_t, unsigned array_
 	assert(array_len < UNIQTYPE_ARRAY_LENGTH_UNBOUNDED);
 	if (element_t->pos_maxoff == 0) return NULL;
 	if (element_t->pos_maxoff == UNIQTYPE_POS_MAXOFF_UNBOUNDED) return NULL;
-	return get_or_create_array_type(element_t, array_len);
+	return get_or_create_array_type(element_t, array_len, 0);
 }
 struct uniqtype *
 __liballocs_get_or_create_unbounded_array_type(struct uniqtype *element_t)
@@ -146,7 +119,7 @@ __liballocs_get_or_create_unbounded_array_type(struct uniqtype *element_t)
 	if (!element_t || element_t == (void*) -1) return NULL;
 	if (element_t->pos_maxoff == 0) return NULL;
 	if (element_t->pos_maxoff == UNIQTYPE_POS_MAXOFF_UNBOUNDED) return NULL;
-	return get_or_create_array_type(element_t, UNIQTYPE_ARRAY_LENGTH_UNBOUNDED);
+	return get_or_create_array_type(element_t, UNIQTYPE_ARRAY_LENGTH_UNBOUNDED, 0);
 }
 struct uniqtype *
 __liballocs_get_or_create_flexible_array_type(struct uniqtype *element_t)
@@ -154,59 +127,12 @@ __liballocs_get_or_create_flexible_array_type(struct uniqtype *element_t)
 	assert(element_t);
 	if (element_t->pos_maxoff == 0) return NULL;
 	if (element_t->pos_maxoff == UNIQTYPE_POS_MAXOFF_UNBOUNDED) return NULL;
-
-	char precise_uniqtype_name[4096];
-	const char *element_name = UNIQTYPE_NAME(element_t); /* gets "simple", not symbol, name */
-	snprintf(precise_uniqtype_name, sizeof precise_uniqtype_name,
-			"__uniqtype____ARR_%s", element_name);
-	/* FIXME: compute hash code. */
-
-	struct uniqtype *found = get_type_from_symname(precise_uniqtype_name);
-	if (found) return found;
-
-	/* Create it and memoise using libdlbind. */
-	size_t sz = offsetof(struct uniqtype, related) + 1 * (sizeof (struct uniqtype_rel_info));
-	void *allocated = dlalloc(__liballocs_rt_uniqtypes_obj, sz, SHF_WRITE);
-	struct uniqtype *allocated_uniqtype = allocated;
-	*allocated_uniqtype = (struct uniqtype) {
-		.pos_maxoff = UNIQTYPE_POS_MAXOFF_UNBOUNDED,
-		.un = {
-			array: {
-				.is_array = 1,
-				.nelems = UNIQTYPE_ARRAY_LENGTH_UNBOUNDED
-			}
-		},
-		.make_precise = __liballocs_make_array_precise_with_memory_bounds
-	};
-	allocated_uniqtype->related[0] = (struct uniqtype_rel_info) {
-		.un = {
-			t: {
-				.ptr = element_t
-			}
-		}
-	};
-	void *old_base = (void*) ((struct link_map *) __liballocs_rt_uniqtypes_obj)->l_addr;
-	void *reloaded = dlbind(__liballocs_rt_uniqtypes_obj, precise_uniqtype_name,
-		allocated, sz, STT_OBJECT);
-	assert(reloaded);
-
-	return allocated_uniqtype;
+	return get_or_create_array_type(element_t, UNIQTYPE_ARRAY_LENGTH_UNBOUNDED, 1);
 }
 
-struct uniqtype *
-__liballocs_get_or_create_address_type(const struct uniqtype *pointee_t)
+static void init_address_type(struct uniqtype *allocated_uniqtype, void *arg)
 {
-	assert(pointee_t);
-
-	char precise_uniqtype_name[4096];
-	const char *pointee_name = UNIQTYPE_NAME(pointee_t); /* gets "simple", not symbol, name */
-	snprintf(precise_uniqtype_name, sizeof precise_uniqtype_name,
-			"__uniqtype____PTR_%s", pointee_name);
-	/* FIXME: compute hash code. Should be an easy case. */
-
-	struct uniqtype *found = get_type_from_symname(precise_uniqtype_name);
-	if (found) return found;
-
+	const struct uniqtype *pointee_t = arg;
 	int indir_level;
 	const struct uniqtype *ultimate_pointee_t;
 	if (UNIQTYPE_IS_POINTER_TYPE(pointee_t))
@@ -219,11 +145,6 @@ __liballocs_get_or_create_address_type(const struct uniqtype *pointee_t)
 		indir_level = 1;
 		ultimate_pointee_t = pointee_t;
 	}
-
-	/* Create it and memoise using libdlbind. */
-	size_t sz = offsetof(struct uniqtype, related) + 2 * (sizeof (struct uniqtype_rel_info));
-	void *allocated = dlalloc(__liballocs_rt_uniqtypes_obj, sz, SHF_WRITE);
-	struct uniqtype *allocated_uniqtype = allocated;
 	*allocated_uniqtype = (struct uniqtype) {
 		.pos_maxoff = sizeof(void *),
 		.un = {
@@ -241,43 +162,22 @@ __liballocs_get_or_create_address_type(const struct uniqtype *pointee_t)
 	allocated_uniqtype->related[1] = (struct uniqtype_rel_info) {
 		.un = { t: { .ptr = (struct uniqtype *) ultimate_pointee_t } }
 	};
-	void *old_base = (void*) ((struct link_map *) __liballocs_rt_uniqtypes_obj)->l_addr;
-	void *reloaded = dlbind(__liballocs_rt_uniqtypes_obj, precise_uniqtype_name,
-		allocated, sz, STT_OBJECT);
-	assert(reloaded);
-
-	return allocated_uniqtype;
 }
 
 struct uniqtype *
-__liballocs_get_or_create_subprogram_type(struct uniqtype *return_type, unsigned narg, struct uniqtype **arg_types)
+__liballocs_get_or_create_address_type(const struct uniqtype *pointee_t)
 {
-	assert(return_type);
-	assert(narg == 0 || arg_types);
-
-	char precise_uniqtype_name[4096];
-	memcpy(precise_uniqtype_name, "__uniqtype____FUN_FROM_", sizeof "__uniqtype____FUN_FROM_");
-	unsigned uniqtype_name_pos = sizeof "__uniqtype____FUN_FROM_" - 1;
-	for (unsigned i = 0; i < narg; ++i)
-	{
-		char *uniqtype_arg_name = precise_uniqtype_name + uniqtype_name_pos;
-		unsigned bufsz = sizeof precise_uniqtype_name - uniqtype_name_pos;
-		uniqtype_name_pos += snprintf(uniqtype_arg_name, bufsz, "__ARG%d_%s", i, UNIQTYPE_NAME(arg_types[i]));
-	}
-
-	char *uniqtype_ret_name = precise_uniqtype_name + uniqtype_name_pos;
-	unsigned bufsz = sizeof precise_uniqtype_name - uniqtype_name_pos;
-	snprintf(uniqtype_ret_name, bufsz, "__FUN_TO_%s", UNIQTYPE_NAME(return_type));
-
-	/* FIXME: compute hash code. */
-
-	struct uniqtype *found = get_type_from_symname(precise_uniqtype_name);
-	if (found) return found;
+	assert(pointee_t);
+	struct uniqtype *rel = (struct uniqtype *) pointee_t;
+	struct uniqtype_intern_key k = { .kind = ADDRESS, .n = 0, .rel = &rel };
+	return __liballocs_intern_get_or_create(&k, SIZE_FOR_NRELATED(2),
+		init_address_type, rel);
+}
 
-	/* Create it and memoise using libdlbind. */
-	size_t sz = offsetof(struct uniqtype, related) + (1+narg) * (sizeof (struct uniqtype_rel_info));
-	void *allocated = dlalloc(__liballocs_rt_uniqtypes_obj, sz, SHF_WRITE);
-	struct uniqtype *allocated_uniqtype = allocated;
+static void init_subprogram_type(struct uniqtype *allocated_uniqtype, void *arg)
+{
+	const struct uniqtype_intern_key *k = arg;
+	unsigned narg = k->n;
 	*allocated_uniqtype = (struct uniqtype) {
 		.pos_maxoff = UNIQTYPE_POS_MAXOFF_UNBOUNDED,
 		.un = {
@@ -291,29 +191,31 @@ __liballocs_get_or_create_subprogram_type(struct uniqtype *return_type, unsigned
 		},
 		.make_precise = NULL,
 	};
-	allocated_uniqtype->related[0] = (struct uniqtype_rel_info) {
-		.un = {
-			t: {
-				.ptr = return_type
-			}
-		}
-	};
-	for (unsigned i = 0; i < narg; i++)
+	/* related[0] is the return type, then the arguments */
+	for (unsigned i = 0; i < 1 + narg; i++)
 	{
-		allocated_uniqtype->related[i+1] = (struct uniqtype_rel_info) {
+		allocated_uniqtype->related[i] = (struct uniqtype_rel_info) {
 			.un = {
 				t: {
-					.ptr = arg_types[i]
+					.ptr = k->rel[i]
 				}
 			}
 		};
 	}
-	void *old_base = (void*) ((struct link_map *) __liballocs_rt_uniqtypes_obj)->l_addr;
-	void *reloaded = dlbind(__liballocs_rt_uniqtypes_obj, precise_uniqtype_name,
-		allocated, sz, STT_OBJECT);
-	assert(reloaded);
+}
+
+struct uniqtype *
+__liballocs_get_or_create_subprogram_type(struct uniqtype *return_type, unsigned narg, struct uniqtype **arg_types)
+{
+	assert(return_type);
+	assert(narg == 0 || arg_types);
 
-	return allocated_uniqtype;
+	struct uniqtype *rel[1 + narg];
+	rel[0] = return_type;
+	for (unsigned i = 0; i < narg; ++i) rel[1 + i] = arg_types[i];
+	struct uniqtype_intern_key k = { .kind = SUBPROGRAM, .n = narg, .rel = rel };
+	return __liballocs_intern_get_or_create(&k, SIZE_FOR_NRELATED(1 + narg),
+		init_subprogram_type, &k);
 }
 
 struct uniqtype *
@@ -342,70 +244,31 @@ __liballocs_make_precise_identity(struct uniqtype *in,
 	return in;
 }
 
-/* This is the "bzip2 fix". We need the ability to dynamically re-bless memory
- * as a simultaneous combination (union) of a new type and the type it had earlier.
- * PROBLEM: what do we call the union? OK, we can make it anonymous, but we're going
- * (for now) to skip computing the summary code. So build a name by concatenating
- * the constituent element names. */
-struct uniqtype *
-__liballocs_get_or_create_union_type(unsigned n, /* struct uniqtype *first_memb_t, */...)
+static void init_union_type(struct uniqtype *allocated_uniqtype, void *arg)
 {
-	if (n == 0) return NULL;
-	va_list ap;
-	va_start(ap, n);
-#define UNION_NAME_MAXLEN 4096
-	char union_raw_name[UNION_NAME_MAXLEN] = { '\0' };
-	unsigned cur_len = 0;
-	struct uniqtype *membs[n]; // ooh, C99 variable-length array...
-	unsigned n_left = n;
+	const struct uniqtype_intern_key *k = arg;
 	unsigned max_len = 0;
-	while (n_left > 0)
+	for (unsigned i = 0; i < k->n; ++i)
 	{
-		struct uniqtype *memb_t = va_arg(ap, struct uniqtype *);
-		assert(memb_t);
-		assert(memb_t->pos_maxoff > 0);
-		assert(memb_t->pos_maxoff != UNIQTYPE_POS_MAXOFF_UNBOUNDED);
-		const char *memb_name = NAME_FOR_UNIQTYPE(memb_t);
-		membs[n - n_left] = memb_t;
-		unsigned len = strlen(memb_name);
-		if (cur_len + len >= UNION_NAME_MAXLEN) return NULL;
-		strcat(union_raw_name, memb_name);
-		if (memb_t->pos_maxoff > max_len) max_len = memb_t->pos_maxoff;
-		--n_left;
-	}
-	char union_uniqtype_name[UNION_NAME_MAXLEN + sizeof "__uniqtype____SYNTHUNION_"] = { '\0' };
-	strcat(union_uniqtype_name, "__uniqtype____SYNTHUNION_");
-	strcat(union_uniqtype_name, union_raw_name);
-#undef UNION_NAME_MAXLEN
-	/* FIXME: compute hash code. Should be an easy case. */
-	/* Does such a type exist? */
-	void *found = NULL;
-	if (NULL != (found = dlsym(NULL, union_uniqtype_name)))
-	{
-		return (struct uniqtype *) found;
+		if (k->rel[i]->pos_maxoff > max_len) max_len = k->rel[i]->pos_maxoff;
 	}
-	/* Create it and memoise using libdlbind. */
-	size_t sz = offsetof(struct uniqtype, related) + n * (sizeof (struct uniqtype_rel_info));
-	void *allocated = dlalloc(__liballocs_rt_uniqtypes_obj, sz, SHF_WRITE);
-	struct uniqtype *allocated_uniqtype = allocated;
 	*allocated_uniqtype = (struct uniqtype) {
 		.pos_maxoff = max_len,
 		.un = {
 			composite: {
 				.kind = COMPOSITE,
-				.nmemb = n,
+				.nmemb = k->n,
 				.not_simultaneous = 0
 			}
 		},
 		.make_precise = NULL
 	};
-	for (unsigned i = 0; i < n; ++i)
+	for (unsigned i = 0; i < k->n; ++i)
 	{
-		struct uniqtype *memb_t = membs[i];
 		allocated_uniqtype->related[i] = (struct uniqtype_rel_info) {
 			.un = {
 				memb: {
-					.ptr = memb_t,
+					.ptr = k->rel[i],
 					.off = 0,
 					.is_absolute_address = 0,
 					.may_be_invalid = 0
@@ -413,13 +276,31 @@ __liballocs_get_or_create_union_type(unsigned n, /* struct uniqtype *first_memb_
 			}
 		};
 	}
-	
-	void *old_base = (void*) ((struct link_map *) __liballocs_rt_uniqtypes_obj)->l_addr;
-	void *reloaded = dlbind(__liballocs_rt_uniqtypes_obj, union_uniqtype_name,
-		allocated, sz, STT_OBJECT);
-	assert(reloaded);
-
-	return allocated_uniqtype;
+}
+/* This is the "bzip2 fix". We need the ability to dynamically re-bless memory
+ * as a simultaneous combination (union) of a new type and the type it had earlier.
+ * PROBLEM: what do we call the union? OK, we can make it anonymous, but we're going
+ * (for now) to skip computing the summary code. Its symbol name, made when
+ * we bind it, concatenates the constituent element names. */
+struct uniqtype *
+__liballocs_get_or_create_union_type(unsigned n, /* struct uniqtype *first_memb_t, */...)
+{
+	if (n == 0) return NULL;
+	va_list ap;
+	va_start(ap, n);
+	struct uniqtype *membs[n]; // ooh, C99 variable-length array...
+	for (unsigned i = 0; i < n; ++i)
+	{
+		struct uniqtype *memb_t = va_arg(ap, struct uniqtype *);
+		assert(memb_t);
+		assert(memb_t->pos_maxoff > 0);
+		assert(memb_t->pos_maxoff != UNIQTYPE_POS_MAXOFF_UNBOUNDED);
+		membs[i] = memb_t;
+	}
+	va_end(ap);
+	struct uniqtype_intern_key k = { .kind = COMPOSITE, .n = n, .rel = membs };
+	return __liballocs_intern_get_or_create(&k, SIZE_FOR_NRELATED(n),
+		init_union_type, &k);
 }
 
 /* Force a definition of this inline function to be emitted.
@@ -825,40 +706,54 @@ int load_and_init_all_metadata_for_one_object(struct dl_phdr_info *info, size_t
 
 void *__liballocs_main_bp; // beginning of main's stack frame
 
-/* Counters -- these are mostly liballocs-internal and therefore hidden,
- * but the ones to do with heap allocation might get ref'd from other
- * DSOs. Also we may find that we want ot inline some paths
- * into clients, in which case others may have to become more visible. */
-unsigned long __liballocs_aborted_stack __attribute__((visibility("hidden")));;
-unsigned long __liballocs_aborted_static __attribute__((visibility("hidden")));;
-unsigned long __liballocs_aborted_unknown_storage __attribute__((visibility("hidden")));;
-unsigned long __liballocs_hit_heap_case __attribute__((visibility("protected")));
-unsigned long __liballocs_hit_alloca_case __attribute__((visibility("hidden")));;
-unsigned long __liballocs_hit_stack_case __attribute__((visibility("hidden")));;
-unsigned long __liballocs_hit_static_case __attribute__((visibility("hidden")));;
-unsigned long __liballocs_aborted_unindexed_heap __attribute__((visibility("protected")));;
-unsigned long __liballocs_aborted_unindexed_alloca __attribute__((visibility("hidden")));;
-unsigned long __liballocs_aborted_unrecognised_allocsite __attribute__((visibility("protected")));;
+/* Upper bound, in ns, of the latency bucket holding the given quantile. */
+static unsigned long latency_quantile_bound(const unsigned long *hist,
+	unsigned long total, unsigned permille)
+{
+	unsigned long seen = 0;
+	for (unsigned i = 0; i < LIBALLOCS_STATS_LATENCY_NBUCKETS; ++i)
+	{
+		seen += hist[i];
+		if (seen * 1000 >= total * permille) return 2ul << i;
+	}
+	return 2ul << (LIBALLOCS_STATS_LATENCY_NBUCKETS - 1);
+}
 
 static void print_exit_summary(void)
 {
-	if (__liballocs_aborted_unknown_storage + __liballocs_hit_static_case + __liballocs_hit_stack_case
-			 + __liballocs_hit_heap_case + __liballocs_hit_alloca_case > 0)
+	static struct liballocs_stats st;
+	__liballocs_stats_read(&st);
+	unsigned long *c = st.counters;
+	if (c[LIBALLOCS_STAT_ABORTED_UNKNOWN_STORAGE] + c[LIBALLOCS_STAT_HIT_STATIC_CASE]
+			 + c[LIBALLOCS_STAT_HIT_STACK_CASE] + c[LIBALLOCS_STAT_HIT_HEAP_CASE]
+			 + c[LIBALLOCS_STAT_HIT_ALLOCA_CASE] > 0)
 	{
 		fprintf(get_stream_err(), "====================================================\n");
 		fprintf(get_stream_err(), "liballocs summary: \n");
 		fprintf(get_stream_err(), "----------------------------------------------------\n");
-		fprintf(get_stream_err(), "queries aborted for unknown storage:       % 9ld\n", __liballocs_aborted_unknown_storage);
-		fprintf(get_stream_err(), "queries handled by static case:            % 9ld\n", __liballocs_hit_static_case);
-		fprintf(get_stream_err(), "queries handled by stack case:             % 9ld\n", __liballocs_hit_stack_case);
-		fprintf(get_stream_err(), "queries handled by heap case:              % 9ld\n", __liballocs_hit_heap_case);
-		fprintf(get_stream_err(), "queries handled by alloca case:            % 9ld\n", __liballocs_hit_alloca_case);
-		fprintf(get_stream_err(), "----------------------------------------------------\n");
-		fprintf(get_stream_err(), "queries aborted for unindexed heap:        % 9ld\n", __liballocs_aborted_unindexed_heap);
-		fprintf(get_stream_err(), "queries aborted for unknown heap allocsite:% 9ld\n", __liballocs_aborted_unrecognised_allocsite);
-		fprintf(get_stream_err(), "queries aborted for unindexed alloca:      % 9ld\n", __liballocs_aborted_unindexed_alloca);
-		fprintf(get_stream_err(), "queries aborted for unknown stackframes:   % 9ld\n", __liballocs_aborted_stack);
-		fprintf(get_stream_err(), "queries aborted for unknown static obj:    % 9ld\n", __liballocs_aborted_static);
+		for (unsigned i = 0; i < LIBALLOCS_STAT_NCOUNTERS; ++i)
+		{
+			if (i == LIBALLOCS_STAT_ABORTED_UNINDEXED_HEAP)
+			{
+				fprintf(get_stream_err(), "----------------------------------------------------\n");
+			}
+			char label[64];
+			snprintf(label, sizeof label, "%s:", __liballocs_stat_name(i));
+			fprintf(get_stream_err(), "%-43s% 9ld\n", label, c[i]);
+		}
+		if (st.nallocators > 0)
+		{
+			fprintf(get_stream_err(), "----------------------------------------------------\n");
+			fprintf(get_stream_err(), "%-22s%9s%9s%6s%6s (ns)\n", "get_info by allocator",
+				"queries", "failed", "p50<", "p99<");
+			for (unsigned a = 0; a < st.nallocators; ++a)
+			{
+				fprintf(get_stream_err(), "%-22.22s%9ld%9ld%6ld%6ld\n", st.allocator_names[a],
+					st.alloc_queries[a], st.alloc_failures[a],
+					latency_quantile_bound(st.alloc_latency[a], st.alloc_queries[a], 500),
+					latency_quantile_bound(st.alloc_latency[a], st.alloc_queries[a], 990));
+			}
+		}
 		fprintf(get_stream_err(), "====================================================\n");
 		for (unsigned i = 0; i < __liballocs_unrecognised_heap_alloc_sites.count; ++i)
 		{
@@ -960,6 +855,7 @@ int ( __attribute__((constructor(103))) __liballocs_global_init)(void)
 	
 	// print a summary when the program exits
 	atexit(print_exit_summary);
+	__liballocs_stats_init();
 
 	const char *debug_level_str = getenv("LIBALLOCS_DEBUG_LEVEL");
 	if (debug_level_str) __liballocs_debug_level = atoi(debug_level_str);
@@ -1035,7 +931,6 @@ void __liballocs_post_systrap_init(void)
 		 * and from a preload we also can't bind to anything defined elsewhere.
 		 * So we use the dynamic linker to work around this mess. */
 		pointer_to___uniqtype__void = dlsym(RTLD_DEFAULT, "__uniqtype__void");
-	#define SIZE_FOR_NRELATED(n) offsetof(struct uniqtype, related) + (n) * sizeof (struct uniqtype_rel_info)
 	#define CREATE(varname, symstr, nrelated, ...) \
 			size_t sz = SIZE_FOR_NRELATED(nrelated); \
 			pointer_to_ ## varname = dlalloc(__liballocs_rt_uniqtypes_obj, sz, SHF_WRITE); \
@@ -1254,53 +1149,57 @@ static const void *typestr_to_uniqtype_from_lib(void *handle, const char *typest
 	return (struct uniqtype *) returned;
 }
 
-__attribute__((visibility("hidden")))
-liballocs_err_t extract_and_output_alloc_site_and_type(
+/* Generic malloc inserts keep the allocsite id in their compact bits once
+ * the site has been replaced by its type. Other inserts, like generic
+ * small's, use those bits for their own purposes, so only the generic
+ * malloc entry point below may read or write the id there. */
+static liballocs_err_t extract_and_output(
     struct insert *p_ins,
     struct uniqtype **out_type,
-    void **out_site
+    void **out_site,
+    _Bool site_id_in_bits
 )
 {
 	if (!p_ins)
 	{
-		++__liballocs_aborted_unindexed_heap;
+		__liballocs_stat_inc(LIBALLOCS_STAT_ABORTED_UNINDEXED_HEAP);
 		return &__liballocs_err_unindexed_heap_object;
 	}
-	void *alloc_site_addr = (void *) ((uintptr_t) p_ins->alloc_site);
+	/* Where we install the id, we install the whole insert at once, so read
+	 * it at once too; then we see either the site or the type and its id. */
+	struct insert ins = site_id_in_bits ? insert_load(p_ins) : *p_ins;
 
 	/* Now we have a uniqtype or an allocsite. For long-lived objects 
 	 * the uniqtype will have been installed in the heap header already.
 	 * This is the expected case.
 	 */
 	struct uniqtype *alloc_uniqtype;
-	if (__builtin_expect(p_ins->alloc_site_flag, 1))
+	if (__builtin_expect(ins.alloc_site_flag, 1))
 	{
 		if (out_site)
 		{
-			//unsigned short id = (unsigned short) p_ins->un.bits;
-			//if (id != (unsigned short) -1)
-			//{
-			//	const void *allocsite = __liballocs_allocsite_by_id(id);
-			//	*out_site = (void*) allocsite;
-			//}
-			//else 
-			*out_site = NULL;
+			/* The site was replaced by the type. Maybe we kept its id. */
+			allocsite_id_t id = site_id_in_bits ? (allocsite_id_t) ins.un.bits
+				: (allocsite_id_t) -1;
+			*out_site = (id != (allocsite_id_t) -1) ? (void*) __liballocs_allocsite_by_id(id)
+				: NULL;
 		}
 		/* Clear the low-order bit, which is available as an extra flag 
 		 * bit. libcrunch uses this to track whether an object is "loose"
 		 * or not. Loose objects have approximate type info that might be 
 		 * "refined" later, typically e.g. from __PTR_void to __PTR_T.
 		 * FIXME: this should just be determined by abstractness of the type. */
-		alloc_uniqtype = (struct uniqtype *)((uintptr_t)(p_ins->alloc_site) & ~0x1ul);
+		alloc_uniqtype = (struct uniqtype *)((uintptr_t)(ins.alloc_site) & ~0x1ul);
 	}
 	else
 	{
-		/* Look up the allocsite's uniqtype, and install it in the heap info 
-		 * (on NDEBUG builds only, because it reduces debuggability a bit). */
-		uintptr_t alloc_site_addr = p_ins->alloc_site;
+		/* Look up the allocsite's uniqtype, and install it in the heap info. */
+		uintptr_t alloc_site_addr = ins.alloc_site;
 		void *alloc_site = (void*) alloc_site_addr;
 		if (out_site) *out_site = alloc_site;
-		struct allocsite_entry *entry = __liballocs_find_allocsite_entry_at(alloc_site);
+		allocsite_id_t allocsite_id;
+		struct allocsite_entry *entry = __liballocs_find_allocsite_entry_and_id_at(alloc_site,
+			&allocsite_id);
 		alloc_uniqtype = entry ? entry->uniqtype : NULL;
 		/* Remember the unrecog'd alloc sites we see. */
 		if (!alloc_uniqtype && alloc_site && 
@@ -1308,29 +1207,32 @@ liballocs_err_t extract_and_output_alloc_site_and_type(
 		{
 			__liballocs_addrlist_add(&__liballocs_unrecognised_heap_alloc_sites, alloc_site);
 		}
-#ifdef NDEBUG
-		// install it for future lookups
-		// FIXME: make this atomic using a union
-		// Is this in a loose state? NO. We always make it strict.
-		// The client might override us by noticing that we return
-		// it a dynamically-sized alloc with a uniqtype.
-		// This means we're the first query to rewrite the alloc site,
-		// and is the client's queue to go poking in the insert.
-		p_ins->alloc_site_flag = 1;
-		p_ins->alloc_site = (uintptr_t) alloc_uniqtype /* | 0x0ul */;
-		/* How do we get the id? Doing a binary search on the by-id spine is
-		 * okay because there will be very few of them. We don't want to do
-		 * a binary search on the table proper. But that's okay. We get
-		 * everything we need. */
-		allocsite_id_t allocsite_id = __liballocs_allocsite_id((const void *) alloc_site_addr);
-		if (allocsite_id != (allocsite_id_t) -1)
+		/* Install it for future lookups. Is this in a loose state? NO. We
+		 * always make it strict. The client might override us by noticing
+		 * that we return it a dynamically-sized alloc with a uniqtype.
+		 * Where the site survives as its id, we no longer reserve this for
+		 * NDEBUG builds, but we only do it if we have both, so as not to
+		 * lose the site. */
+		if (site_id_in_bits)
 		{
-			// what to do with the id?? We have no spare bits...
-			// we could scrounge a few but certainly not 16 of them.
-			// When we're using a bitmap, we will have the space.
+			if (alloc_uniqtype && allocsite_id != (allocsite_id_t) -1)
+			{
+				insert_store(p_ins, (struct insert) {
+					.alloc_site_flag = 1,
+					.alloc_site = (uintptr_t) alloc_uniqtype /* | 0x0ul */,
+					.un = { .bits = allocsite_id }
+				});
+			}
 		}
-		
+		else
+		{
+#ifdef NDEBUG
+			/* Elsewhere the site is lost, which reduces debuggability a bit.
+			 * FIXME: make this atomic using a union */
+			p_ins->alloc_site_flag = 1;
+			p_ins->alloc_site = (uintptr_t) alloc_uniqtype /* | 0x0ul */;
 #endif
+		}
 	}
 
 	// if we didn't get an alloc uniqtype, we abort
@@ -1338,9 +1240,9 @@ liballocs_err_t extract_and_output_alloc_site_and_type(
 	{
 		//if (__builtin_expect(k == HEAP, 1))
 		//{
-			++__liballocs_aborted_unrecognised_allocsite;
+			__liballocs_stat_inc(LIBALLOCS_STAT_ABORTED_UNRECOGNISED_ALLOCSITE);
 		//}
-		//else ++__liballocs_aborted_stack;
+		//else __liballocs_stat_inc(LIBALLOCS_STAT_ABORTED_STACK);
 			
 		/* We used to do this in clear_alloc_site_metadata in libcrunch... 
 		 * In cases where heap classification failed, we null out the allocsite 
@@ -1367,12 +1269,73 @@ liballocs_err_t extract_and_output_alloc_site_and_type(
 	/* return success */
 	return NULL;
 }
+
+__attribute__((visibility("hidden")))
+liballocs_err_t extract_and_output_alloc_site_and_type(
+    struct insert *p_ins,
+    struct uniqtype **out_type,
+    void **out_site
+)
+{
+	return extract_and_output(p_ins, out_type, out_site, 0);
+}
 liballocs_err_t __liballocs_extract_and_output_alloc_site_and_type(
     struct insert *p_ins,
     struct uniqtype **out_type,
     void **out_site
 ) __attribute__((visibility("protected"),alias("extract_and_output_alloc_site_and_type")));
 
+__attribute__((visibility("hidden")))
+liballocs_err_t extract_and_output_generic_malloc_site_and_type(
+    struct insert *p_ins,
+    struct uniqtype **out_type,
+    void **out_site
+)
+{
+	return extract_and_output(p_ins, out_type, out_site, 1);
+}
+liballocs_err_t __liballocs_extract_and_output_generic_malloc_site_and_type(
+    struct insert *p_ins,
+    struct uniqtype **out_type,
+    void **out_site
+) __attribute__((visibility("protected"),alias("extract_and_output_generic_malloc_site_and_type")));
+
+/* Like the generic malloc case above, but never writes anything: not the
+ * insert, not the list of unrecognised sites, not the stats. This is for
+ * walks, which don't lock the arena and so may be looking at a chunk that
+ * is being freed. We read the insert just once, so that we see either the
+ * site or the type that replaced it, never a mixture. */
+__attribute__((visibility("hidden")))
+void peek_alloc_site_and_type(
+    const struct insert *p_ins,
+    struct uniqtype **out_type,
+    const void **out_site
+)
+{
+	struct insert ins = insert_load(p_ins);
+	struct uniqtype *t = NULL;
+	const void *site = NULL;
+	if (ins.alloc_site_flag)
+	{
+		allocsite_id_t id = (allocsite_id_t) ins.un.bits;
+		if (out_site && id != (allocsite_id_t) -1) site = __liballocs_allocsite_by_id(id);
+		t = (struct uniqtype *)((uintptr_t)(ins.alloc_site) & ~0x1ul);
+	}
+	else if (ins.alloc_site)
+	{
+		site = (const void *) (uintptr_t) ins.alloc_site;
+		struct allocsite_entry *entry = __liballocs_find_allocsite_entry_at(site);
+		t = entry ? entry->uniqtype : NULL;
+	}
+	if (out_type) *out_type = t;
+	if (out_site) *out_site = site;
+}
+void __liballocs_peek_alloc_site_and_type(
+    const struct insert *p_ins,
+    struct uniqtype **out_type,
+    const void **out_site
+) __attribute__((visibility("protected"),alias("peek_alloc_site_and_type")));
+
 #ifdef __liballocs_get_base
 #undef __liballocs_get_base
 #endif
@@ -1385,7 +1348,7 @@ __liballocs_get_base(void *obj)
 	const void *out;
 	/* Try the cache first. */
 	struct __liballocs_memrange_cache_entry_s *hit =
-		__liballocs_memrange_cache_lookup_notype(&__liballocs_ool_cache,
+		__liballocs_memrange_cache_lookup_notype(__liballocs_ool_cache,
 			obj, 0);
 	/* We only want depth-0 cached memranges, i.e. leaf-level. */
 	if (hit && hit->depth == 0) return (void*) hit->obj_base;
@@ -1397,7 +1360,7 @@ __liballocs_get_base(void *obj)
 		&sz, NULL, NULL);
 	if (err && err != &__liballocs_err_unrecognised_alloc_site) return NULL;
 	/* We can cache the alloc base and size. */
-	if (a && a->is_cacheable) __liballocs_cache_with_type(&__liballocs_ool_cache,
+	if (a && a->is_cacheable) __liballocs_cache_with_type(__liballocs_claim_memrange_cache(),
 		out, (char*) out + sz, t ? t : pointer_to___uniqtype____uninterpreted_byte,
 		0, 1, out);
 	return (void*) out;
@@ -72,22 +72,30 @@ const char *format_symbolic_address(const void *addr);
 
 #include "pageindex.h"
 
-/* FIXME: this should probably be a flexible array member, to
- * allow for DSOs that have tons of segments.*/
-#define MAPPING_SEQUENCE_MAX_LEN 8
+/* The mappings are a sorted, contiguous vector in the private heap, grown
+ * on demand, so a sequence can hold any number of them. A sequence whose
+ * vector was not allocated by us (the static one for the private heap,
+ * or a caller's stack buffer) has mappings_borrowed set; we copy it
+ * into the private heap the first time it needs to grow. Pointers into
+ * mappings[] are invalidated by any change to the sequence. */
 struct mapping_sequence
 {
 	void *begin;
 	void *end;
 	const char *filename;
 	unsigned nused;
-	struct mapping_entry mappings[MAPPING_SEQUENCE_MAX_LEN];
+	unsigned nalloc;
+	_Bool mappings_borrowed;
+	struct mapping_entry *mappings;
 };
 _Bool __augment_mapping_sequence(struct mapping_sequence *cur, 
 	void *begin, void *end, int prot, int flags, off_t offset, const char *filename,
 	void *caller);
 struct big_allocation *__add_mapping_sequence_bigalloc_nocopy(struct mapping_sequence *seq);
 
+/* One past the highest bigalloc number ever issued. */
+extern unsigned bigallocs_highwater __attribute__((visibility("hidden")));
+
 extern struct big_allocation *executable_mapping_bigalloc;
 extern struct big_allocation *executable_file_bigalloc;
 extern struct big_allocation *executable_data_segment_bigalloc;
@@ -162,17 +170,8 @@ void __assert_fail(const char *assertion,
 void warnx(const char *fmt, ...);
 unsigned long malloc_usable_size (void *ptr);
 
-/* counters */
-extern unsigned long __liballocs_aborted_stack;
-extern unsigned long __liballocs_aborted_static;
-extern unsigned long __liballocs_aborted_unknown_storage;
-extern unsigned long __liballocs_hit_heap_case;
-extern unsigned long __liballocs_hit_alloca_case;
-extern unsigned long __liballocs_hit_stack_case;
-extern unsigned long __liballocs_hit_static_case;
-extern unsigned long __liballocs_aborted_unindexed_heap;
-extern unsigned long __liballocs_aborted_unindexed_alloca;
-extern unsigned long __liballocs_aborted_unrecognised_allocsite;
+/* statistics; see liballocs_stats.h */
+void __liballocs_stats_init(void);
 
 /* We're allowed to malloc, thanks to __private_malloc(), but we 
  * we shouldn't call strdup because libc will do the malloc. */
@@ -191,6 +190,12 @@ int load_and_init_all_metadata_for_one_object(struct dl_phdr_info *info, size_t
 
 void __notify_copy(void *dest, const void *src, unsigned long n);
 void __notify_free(void *dest);
+/* Copies shorter than this can't write a whole pointer, so the memcpy and
+ * memmove wrappers don't notify them at all. Raising it trades precision
+ * for speed on workloads dominated by small copies. */
+#ifndef LIBALLOCS_COPY_NOTIFY_MIN_SIZE
+#define LIBALLOCS_COPY_NOTIFY_MIN_SIZE (sizeof (void *))
+#endif
 
 /* Some boilerplate helpers for use by allocators. */
 #define DEFAULT_GET_TYPE \
@@ -211,6 +216,24 @@ static struct uniqtype *get_type(void *obj) \
 #endif
 
 void update_rt_uniqtypes_obj(void *handle, void *old_base);
+extern void *__liballocs_rt_uniqtypes_obj;
+
+/* Runtime-created uniqtypes are interned by structure (see uniqtype-intern.c).
+ * kind is ARRAY, ADDRESS, SUBPROGRAM or COMPOSITE (for synthetic unions);
+ * n is the array length, or the argument or member count; rel holds the
+ * element or pointee type, or the return type then argument types, or
+ * the member types. */
+struct uniqtype_intern_key
+{
+	unsigned kind;
+	unsigned long n;
+	struct uniqtype *const *rel;
+};
+struct uniqtype *__liballocs_intern_lookup(const struct uniqtype_intern_key *k);
+struct uniqtype *__liballocs_intern_get_or_create(const struct uniqtype_intern_key *k,
+	size_t sz, void (*init)(struct uniqtype *t, void *arg), void *arg);
+void __liballocs_intern_notify_unload(void);
+void __liballocs_ptrmap_notify_unload(void);
 
 extern struct uniqtype *pointer_to___uniqtype__void;
 extern struct uniqtype *pointer_to___uniqtype__signed_char;
@@ -1,5 +1,6 @@
 #define _GNU_SOURCE
 #include "liballocs_private.h"
+#include "uniqtype-ptrmap.h"
 
 #ifndef LIFETIME_POLICIES
 #error "This file can only be compiled if LIFETIME_POLICIES is set"
@@ -106,78 +107,34 @@ void __notify_ptr_write(const void **dest, const void *val)
 	}
 }
 
-static _Bool need_copy_notification(struct uniqtype *type)
+struct copy_notify_arg
 {
-	switch (UNIQTYPE_KIND(type))
-	{
-		case ADDRESS:
-			return 1;
-		case ARRAY:
-			return need_copy_notification(UNIQTYPE_ARRAY_ELEMENT_TYPE(type));
-		case COMPOSITE:
-			for (int i = 0; i < UNIQTYPE_COMPOSITE_MEMBER_COUNT(type); ++i)
-			{
-				if (need_copy_notification(type->related[i].un.t.ptr)) return 1;
-			}
-			return 0;
-		default:
-			return 0;
-	}
-}
+	_Bool have_src;
+	intptr_t src_delta;
+};
 
-// Return the size of processed data
-static unsigned long notify_copy_for_type(void *dest, const void *src, unsigned long size, struct uniqtype *type)
+static void notify_copied_ptr(void **slot, struct uniqtype *ptr_t, void *arg)
 {
-	if (!need_copy_notification(type)) return UNIQTYPE_SIZE_IN_BYTES(type);
-	switch (UNIQTYPE_KIND(type))
-	{
-		case ADDRESS:
-			if (size < sizeof(void *)) return size;
-			if (src) __notify_ptr_write((const void **)dest, *(const void **)src);
-			else __notify_ptr_write((const void **)dest, NULL);
-			return sizeof(void *);
-		case ARRAY:
-		{
-			struct uniqtype *elemtyp = UNIQTYPE_ARRAY_ELEMENT_TYPE(type);
-			unsigned long elemsize = UNIQTYPE_SIZE_IN_BYTES(elemtyp);
-			unsigned nelems = UNIQTYPE_ARRAY_LENGTH(type);
-			unsigned long remainsize = size;
-			while (remainsize && nelems)
-			{
-				unsigned long cursize = remainsize > elemsize ? elemsize : remainsize;
-				notify_copy_for_type(dest, src, cursize, elemtyp);
-				dest += cursize;
-				if(src) src += cursize;
-				remainsize -= cursize;
-				--nelems;
-			}
-			return size - remainsize;
-		}
-		case COMPOSITE:
-		{
-			unsigned nmemb = UNIQTYPE_COMPOSITE_MEMBER_COUNT(type);
-			for (int i = 0; i < nmemb; ++i)
-			{
-				struct uniqtype *membtyp = type->related[i].un.memb.ptr;
-				unsigned long memboffset = type->related[i].un.memb.off;
-				unsigned long membsize = UNIQTYPE_SIZE_IN_BYTES(membtyp);
-
-				unsigned long maxmembsize = size - memboffset;
-				if (maxmembsize < membsize) membsize = maxmembsize;
+	struct copy_notify_arg *c = arg;
+	__notify_ptr_write((const void **) slot,
+		c->have_src ? *(const void **) ((char *) slot + c->src_delta) : NULL);
+}
 
-				notify_copy_for_type(dest + memboffset,
-					src ? src + memboffset : NULL, membsize, membtyp);
-			}
-			return UNIQTYPE_SIZE_IN_BYTES(type) < size ?
-				UNIQTYPE_SIZE_IN_BYTES(type) : size;
-		}
-		default:
-			abort();
-	}
+/* Notify the write of each pointer in an object of the given type at obj
+ * that lies wholly within [lo, hi). The pointer written is read from
+ * the same place in the source, which is src_delta bytes from dest, or
+ * is NULL if there is no source. */
+static void notify_copy_in_range(char *obj, const struct uniqtype_ptrmap *map,
+	char *lo, char *hi, _Bool have_src, intptr_t src_delta)
+{
+	struct copy_notify_arg arg = { have_src, src_delta };
+	__liballocs_ptrmap_for_each_in_range(map, obj, lo, hi, notify_copied_ptr, &arg);
 }
 
-// Similar to __liballocs_get_alloc_type but should not generate any errors
-static struct uniqtype *try_get_alloc_type(void *obj)
+/* Resolve the allocation containing obj just once: its type, base and size.
+ * Like __liballocs_get_alloc_info but should not generate any errors. */
+static struct uniqtype *try_get_alloc_type_and_bounds(void *obj,
+	char **out_base, unsigned long *out_size)
 {
 	struct big_allocation *maybe_the_allocation;
 	struct allocator *a = __liballocs_leaf_allocator_for(obj, NULL, &maybe_the_allocation);
@@ -188,41 +145,70 @@ static struct uniqtype *try_get_alloc_type(void *obj)
 	unsigned unrecognized_heap_alloc_site_count =
 		__liballocs_unrecognised_heap_alloc_sites.count;
 
-	struct uniqtype *type;
+	struct uniqtype *type = NULL;
+	void *base = NULL;
+	unsigned long size = 0;
 	struct liballocs_err *err = a->get_info((void *) obj, maybe_the_allocation,
-		&type, NULL, NULL, NULL);
+		&type, &base, &size, NULL);
 
 	__liballocs_unrecognised_heap_alloc_sites.count = unrecognized_heap_alloc_site_count;
-	if (err) return NULL;
+	if (err || !type || !base) return NULL;
 
+	*out_base = base;
+	*out_size = size;
 	return type;
 }
 
-void __notify_copy(void *dest, const void *src, unsigned long n)
+/* Notify the copy into [dest, dest + n), treating each allocation it
+ * touches as an array of its type. */
+static void notify_copy_or_clear(char *dest, const char *src, unsigned long n)
 {
-	// override liballocs.c's version & also wrapped by libcrunch
-	if (!__liballocs_is_initialized) return; // Do nothing until initialized
-	// Is it too expansive ?? Do we really need to loop ?
-	while (n >= sizeof(void *))
+	char *end = dest + n;
+	while (end - dest >= (ptrdiff_t) sizeof (void *))
 	{
-		struct uniqtype *typ = try_get_alloc_type(dest);
-		if (!typ)
+		char *base;
+		unsigned long size;
+		struct uniqtype *type = try_get_alloc_type_and_bounds(dest, &base, &size);
+		if (!type)
 		{
 			debug_printf(1, "No type information for copied memory at %p\n", dest);
 			return;
 		}
-		unsigned long handled = notify_copy_for_type(dest, src, n, typ);
-		dest += handled;
-		src += handled;
-		n -= handled;
+		char *limit = (base + size < end) ? base + size : end;
+		unsigned long elemsize = UNIQTYPE_SIZE_IN_BYTES(type);
+		const struct uniqtype_ptrmap *map = __liballocs_get_ptrmap(type);
+		if (elemsize > 0 && __uniqtype_ptrmap_has_pointers(map))
+		{
+			for (char *elem = base + ((dest - base) / elemsize) * elemsize;
+					elem < limit; elem += elemsize)
+			{
+				notify_copy_in_range(elem, map, dest, limit,
+					src != NULL, src ? (intptr_t) src - (intptr_t) dest : 0);
+			}
+		}
+		if (limit <= dest) return; /* should not happen, but don't spin */
+		if (src) src += limit - dest;
+		dest = limit;
 	}
 }
 
+void __notify_copy(void *dest, const void *src, unsigned long n)
+{
+	// override liballocs.c's version & also wrapped by libcrunch
+	if (!__liballocs_is_initialized) return; // Do nothing until initialized
+	if (n < LIBALLOCS_COPY_NOTIFY_MIN_SIZE) return;
+	notify_copy_or_clear(dest, src, n);
+}
+
 void __notify_free(void *dest)
 {
 	if (!__liballocs_is_initialized) return; // Do nothing until initialized
-	struct uniqtype *typ = try_get_alloc_type(dest);
+	char *base;
+	unsigned long size;
+	struct uniqtype *typ = try_get_alloc_type_and_bounds(dest, &base, &size);
 	if (!typ) return;
-	notify_copy_for_type(dest, NULL, UNIQTYPE_SIZE_IN_BYTES(typ), typ);
+	const struct uniqtype_ptrmap *map = __liballocs_get_ptrmap(typ);
+	if (!__uniqtype_ptrmap_has_pointers(map)) return;
+	notify_copy_in_range(dest, map, dest, (char *) dest + UNIQTYPE_SIZE_IN_BYTES(typ), 0, 0);
 }
 
@@ -31,9 +31,10 @@ extern struct allocator *__liballocs_leaf_allocator_for(const void *obj,
 	struct big_allocation **out_bigalloc);
 extern struct big_allocation *__liballocs_get_bigalloc_containing(const void *obj);
 
-/* How many big allocs? 256 is a bit stingy. 
- * Each bigalloc record is 48--64 bytes, so 4096 of them would take 256KB.
- * Maybe stick to 1024? */
+/* How many big allocs? We allow as many as a bigalloc_num_t can number.
+ * Each bigalloc record is about 100 bytes, so 64K of them take about 6MB.
+ * But this is bss, so we only commit the pages below the high-water mark,
+ * and since the array never moves, &big_allocations[n] stays valid. */
 struct big_allocation big_allocations[NBIGALLOCS] __attribute__((visibility("protected"))); // NOTE: we *don't* use big_allocations[0]; the 0 byte means "empty"
 extern struct big_allocation __liballocs_big_allocations[NBIGALLOCS] __attribute__((alias("big_allocations"))); // NOTE: we *don't* use big_allocations[0]; the 0 byte means "empty"
 
@@ -88,80 +89,169 @@ void __liballocs_sanity_check_bigalloc(struct big_allocation *b) __attribute__((
 
 bigalloc_num_t *pageindex __attribute__((visibility("protected")));
 extern bigalloc_num_t *__liballocs_pageindex __attribute__((alias("pageindex")));
+bigalloc_num_t *pageindex_leaf __attribute__((visibility("protected")));
+extern bigalloc_num_t *__liballocs_pageindex_leaf __attribute__((alias("pageindex_leaf")));
+unsigned long pageindex_leaf_seq __attribute__((visibility("protected")));
+extern unsigned long __liballocs_pageindex_leaf_seq __attribute__((alias("pageindex_leaf_seq")));
 
-static void memset_bigalloc(bigalloc_num_t *begin, bigalloc_num_t num, 
-	bigalloc_num_t old_num, size_t n)
+/* Filling and checking runs of the pageindex. Creating or deleting a large
+ * mapping touches one bigalloc_num_t per page, i.e. millions of entries
+ * for a multi-GB region, so on x86-64 we use SSE2 or AVX2 kernels,
+ * chosen at first use according to what the CPU supports. Elsewhere we
+ * fall back to wmemset and a plain loop. */
+static void pageindex_fill_generic(bigalloc_num_t *begin, bigalloc_num_t num, size_t n)
 {
-	/* NOTE: a lot of this function is debugging checks!
-	 * It collapses to very little when NDEBUG is defined. */
-	assert(1ull<<(8*sizeof(bigalloc_num_t)) >= NBIGALLOCS - 1);
 	assert(sizeof (wchar_t) == 2 * sizeof (bigalloc_num_t));
-#ifndef NDEBUG
-	ptrdiff_t first_bad_n;
-	bigalloc_num_t bad_value;
-#define CHECK_LOC(loc, bad_n_expr) do { \
-	if (!(old_num == (bigalloc_num_t) -1 || !(loc) || (loc) == old_num)) \
-	{ first_bad_n = (bad_n_expr); bad_value = (loc); goto report_failure_and_abort; } \
-} while (0)
-#else
-#define CHECK_LOC(loc, bad_n_expr)
-#endif
-
 	/* We use wmemset with special cases at the beginning and end */
 	if (n > 0 && (uintptr_t) begin % sizeof (wchar_t) != 0)
 	{
-		CHECK_LOC(*begin, begin-pageindex);
 		*begin++ = num;
 		--n;
 	}
-	assert(n == 0 || (uintptr_t) begin % sizeof (wchar_t) == 0);
-	
 	// double up the value
-	wchar_t wchar_val     = ((wchar_t) num)     << (8 * sizeof(bigalloc_num_t)) | num;
-	wchar_t wchar_transition_val = ((wchar_t) num); // FIXME: assumes little-endianness
-	wchar_t wchar_old_val = ((wchar_t) old_num) << (8 * sizeof(bigalloc_num_t)) | old_num;
-	
-	// check the relevant range of the pageindex is in the state we expect
-	if (old_num != (bigalloc_num_t) -1 && old_num) // FIXME: also check when old_num is zero
+	wchar_t wchar_val = ((wchar_t) num) << (8 * sizeof(bigalloc_num_t)) | num;
+	if (n / 2 != 0) wmemset((wchar_t *) begin, wchar_val, n / 2);
+	// if we missed one off the end, do it now
+	if (n % 2 == 1) *(begin + (n-1)) = num;
+}
+/* Returns the index of the first entry that is neither zero nor old_num,
+ * or n if there is none. */
+static size_t pageindex_check_generic(const bigalloc_num_t *begin, bigalloc_num_t old_num, size_t n)
+{
+	for (size_t i = 0; i < n; ++i)
 	{
-		bigalloc_num_t *pageindex_end = pageindex + PAGENUM(MAXIMUM_USER_ADDRESS + 1);
-		// we should get zero or more of the old value
-		// ... followed by zero or one of the transitional value
-		// ... followed by zero or more of the null value
-		// ... adding up to n/2 or more.
-		// We used to use wcsspn directly, but this overruns
-		// if we start it in the last two pages of user-accessible memory
-		// when either of those is nonzero. Or in fact if there is a contiguous
-		// nonempty sequence of pages at the end of user memory, and we start
-		// within that part of the pageindex.
-		// We could also open-code a wchar_t-based solution, but unlike wmemset (-ish!)
-		// this breaks strict aliasing rules. So just do the slower thing... we're debug.
-		bigalloc_num_t *p;
-		// search forwards from p, checking we see zero or old_num
-		for (p = begin; p < pageindex_end && (p - begin) < n; ++p)
-		{
-			// either *p is uninit'd or it equals the old_num we expect to see
-			CHECK_LOC(*p, p-pageindex);
-		}
-		// assert we didn't terminate early
-		assert(p - begin == n);
+		if (begin[i] && begin[i] != old_num) return i;
 	}
-	if (n != 0) wmemset((wchar_t *) begin, wchar_val, n / 2);
-	
-	// if we missed one off the end, do it now
-	if (n % 2 == 1)
+	return n;
+}
+#if defined(__x86_64__)
+#include <immintrin.h>
+static void pageindex_fill_sse2(bigalloc_num_t *begin, bigalloc_num_t num, size_t n)
+{
+	bigalloc_num_t *end = begin + n;
+	while (begin < end && (uintptr_t) begin % 16 != 0) *begin++ = num;
+	__m128i val = _mm_set1_epi16((short) num);
+	for (; begin + 8 <= end; begin += 8) _mm_store_si128((__m128i *) begin, val);
+	while (begin < end) *begin++ = num;
+}
+static size_t pageindex_check_sse2(const bigalloc_num_t *begin, bigalloc_num_t old_num, size_t n)
+{
+	size_t i = 0;
+	__m128i zero = _mm_setzero_si128();
+	__m128i old = _mm_set1_epi16((short) old_num);
+	for (; i + 8 <= n; i += 8)
 	{
-		// if we have one left over, we should have done up to n-1
-		CHECK_LOC(*(begin + (n-1)), (begin-pageindex)+n-1);
-		*(begin + (n-1)) = num;
+		__m128i v = _mm_loadu_si128((const __m128i *)(begin + i));
+		__m128i ok = _mm_or_si128(_mm_cmpeq_epi16(v, zero), _mm_cmpeq_epi16(v, old));
+		if (_mm_movemask_epi8(ok) != 0xffff) break;
 	}
-	return;
+	return i + pageindex_check_generic(begin + i, old_num, n - i);
+}
+/* Above this many bytes, the filled range won't fit in cache anyway, so
+ * bypass it with streaming stores. */
+#define PAGEINDEX_STREAM_THRESHOLD (1ul<<20)
+__attribute__((target("avx2")))
+static void pageindex_fill_avx2(bigalloc_num_t *begin, bigalloc_num_t num, size_t n)
+{
+	bigalloc_num_t *end = begin + n;
+	while (begin < end && (uintptr_t) begin % 32 != 0) *begin++ = num;
+	__m256i val = _mm256_set1_epi16((short) num);
+	if (n * sizeof (bigalloc_num_t) >= PAGEINDEX_STREAM_THRESHOLD)
+	{
+		for (; begin + 16 <= end; begin += 16) _mm256_stream_si256((__m256i *) begin, val);
+		_mm_sfence();
+	}
+	else for (; begin + 16 <= end; begin += 16) _mm256_store_si256((__m256i *) begin, val);
+	while (begin < end) *begin++ = num;
+}
+__attribute__((target("avx2")))
+static size_t pageindex_check_avx2(const bigalloc_num_t *begin, bigalloc_num_t old_num, size_t n)
+{
+	size_t i = 0;
+	__m256i zero = _mm256_setzero_si256();
+	__m256i old = _mm256_set1_epi16((short) old_num);
+	for (; i + 16 <= n; i += 16)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *)(begin + i));
+		__m256i ok = _mm256_or_si256(_mm256_cmpeq_epi16(v, zero), _mm256_cmpeq_epi16(v, old));
+		if (_mm256_movemask_epi8(ok) != -1) break;
+	}
+	return i + pageindex_check_generic(begin + i, old_num, n - i);
+}
+#endif
+static void (*pageindex_fill)(bigalloc_num_t *, bigalloc_num_t, size_t);
+static size_t (*pageindex_check)(const bigalloc_num_t *, bigalloc_num_t, size_t);
+static void select_pageindex_kernels(void)
+{
+	pageindex_fill = pageindex_fill_generic;
+	pageindex_check = pageindex_check_generic;
+#if defined(__x86_64__)
+	/* We may run before libgcc's constructor has initialized the CPU model. */
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		pageindex_fill = pageindex_fill_avx2;
+		pageindex_check = pageindex_check_avx2;
+	}
+	else /* all x86-64 CPUs have SSE2 */
+	{
+		pageindex_fill = pageindex_fill_sse2;
+		pageindex_check = pageindex_check_sse2;
+	}
+#endif
+}
+
+static void memset_bigalloc(bigalloc_num_t *begin, bigalloc_num_t num, 
+	bigalloc_num_t old_num, size_t n)
+{
+	assert(1ull<<(8*sizeof(bigalloc_num_t)) >= NBIGALLOCS - 1);
+	if (__builtin_expect(!pageindex_fill, 0)) select_pageindex_kernels();
 #ifndef NDEBUG
-report_failure_and_abort:
-	debug_printf(0, "pageindex has bad value (%d; expected %d) at page 0x%lx\n",
-		(int) bad_value, (int) old_num, (long) first_bad_n);
-	abort();
+	/* Check the relevant range of the pageindex is in the state we expect:
+	 * each entry is either uninit'd or equals the old_num we expect to see. */
+	size_t first_bad_n = n;
+	if (old_num != (bigalloc_num_t) -1)
+	{
+		assert(begin + n <= pageindex + PAGENUM(MAXIMUM_USER_ADDRESS + 1));
+		first_bad_n = pageindex_check(begin, old_num, n);
+	}
+	if (first_bad_n != n)
+	{
+		debug_printf(0, "pageindex has bad value (%d; expected %d) at page 0x%lx\n",
+			(int) begin[first_bad_n], (int) old_num, (long) ((begin - pageindex) + first_bad_n));
+		abort();
+	}
 #endif
+	pageindex_fill(begin, num, n);
+}
+
+/* Every change to the bigalloc tree is bracketed by begin_tree_update()
+ * and end_tree_update(), and must invalidate the leaf entries of every
+ * page whose deepest bigalloc it may have changed. The brackets nest; all
+ * callers hold the big lock. */
+static unsigned tree_update_depth;
+static void begin_tree_update(void)
+{
+	if (tree_update_depth++ == 0) __atomic_fetch_add(&pageindex_leaf_seq, 1, __ATOMIC_SEQ_CST);
+}
+static void invalidate_leaf_range(const void *begin, const void *end)
+{
+	if (!pageindex_leaf || (char*) end <= (char*) begin) return;
+	if (__builtin_expect(!pageindex_check, 0)) select_pageindex_kernels();
+	bigalloc_num_t *pos = pageindex_leaf + PAGENUM(begin);
+	bigalloc_num_t *limit = pageindex_leaf + PAGENUM((char*) end - 1) + 1;
+	/* Most entries are already zero, so only write the ones that aren't,
+	 * to avoid dirtying untouched pages of the table. */
+	while (pos < limit)
+	{
+		pos += pageindex_check(pos, 0, limit - pos);
+		if (pos < limit) __atomic_store_n(pos++, (bigalloc_num_t) 0, __ATOMIC_SEQ_CST);
+	}
+}
+static void end_tree_update(void)
+{
+	assert(tree_update_depth > 0);
+	if (--tree_update_depth == 0) __atomic_fetch_add(&pageindex_leaf_seq, 1, __ATOMIC_SEQ_CST);
 }
 
 __attribute__((constructor(101),visibility("hidden")))
@@ -211,6 +301,13 @@ void __pageindex_init(void)
 			(void*) (MAXIMUM_USER_ADDRESS + 1), (const void *) 0x410000000000ul);
 		if (pageindex == MAP_FAILED) abort();
 		debug_printf(3, "pageindex at %p\n", pageindex);
+		/* The leaf index is only an accelerator, so we can do without it. */
+		if (!environ_getenv("LIBALLOCS_NO_PAGEINDEX_LEAF", env))
+		{
+			pageindex_leaf = MEMTABLE_NEW_WITH_TYPE(bigalloc_num_t, PAGE_SIZE, (void*) 0,
+				(void*) (MAXIMUM_USER_ADDRESS + 1));
+			if (pageindex_leaf == MAP_FAILED) pageindex_leaf = NULL;
+		}
 
 		/* For now, make our heap region quite large, but not so large that
 		 * we wouldn't want it in our pageindex. FIXME: We want to downscale
@@ -228,21 +325,25 @@ void __pageindex_init(void)
 		__private_malloc_heap_limit = (void*)((uintptr_t) __private_malloc_heap_base
 			+ heapsz);
 		/* It's just a mapping sequence, init. */
+		static struct mapping_entry seq_mappings[1];
 		static struct mapping_sequence seq;
+		seq_mappings[0] = (struct mapping_entry) {
+			.begin = __private_malloc_heap_base,
+			.end = __private_malloc_heap_limit,
+			.prot = prot,
+			.flags = flags & ~MAP_NORESERVE,
+			.offset = 0,
+			.is_anon = 1,
+			.caller = /* &&mmap_return_site */ 0
+		};
 		seq = (struct mapping_sequence) {
 			.begin = __private_malloc_heap_base,
 			.end =  __private_malloc_heap_limit,
 			.filename = NULL,
 			.nused = 1,
-			.mappings = { [0] = (struct mapping_entry) {
-				.begin = __private_malloc_heap_base,
-				.end = __private_malloc_heap_limit,
-				.prot = prot,
-				.flags = flags & ~MAP_NORESERVE,
-				.offset = 0,
-				.is_anon = 1,
-				.caller = /* &&mmap_return_site */ 0
-			} }
+			.nalloc = 1,
+			.mappings_borrowed = 1,
+			.mappings = seq_mappings
 		};
 		struct big_allocation *b = __add_mapping_sequence_bigalloc_nocopy(&seq);
 		/* What about the bitmap? 1GB of 16B regions is 64Mbits or 8Mbytes.
@@ -282,18 +383,37 @@ void __pageindex_init(void)
 	}
 }
 
+/* Released bigallocs go on a LIFO free list, chained through next_sib
+ * (which is otherwise unused once a bigalloc is unlinked). Failing that,
+ * we issue the entry just past the high-water mark. Both are O(1). All
+ * callers hold the big lock. */
+static struct big_allocation *free_bigallocs;
+unsigned bigallocs_highwater __attribute__((visibility("hidden"))) = 1; /* we don't use 0 */
+
 static struct big_allocation *find_free_bigalloc(void)
 {
-	for (struct big_allocation *p = &big_allocations[1]; p < &big_allocations[NBIGALLOCS]; ++p)
+	struct big_allocation *p = free_bigallocs;
+	if (p)
 	{
-		SANITY_CHECK_BIGALLOC(p);
-		
-		if (!BIGALLOC_IN_USE(p))
-		{
-			return p;
-		}
+		free_bigallocs = p->next_sib;
+		p->next_sib = NULL;
+	}
+	else if (bigallocs_highwater < NBIGALLOCS) p = &big_allocations[bigallocs_highwater++];
+	else
+	{
+		write_string("Internal error: out of bigallocs\n");
+		abort();
 	}
-	abort();
+	assert(!BIGALLOC_IN_USE(p));
+	return p;
+}
+
+static void release_bigalloc(struct big_allocation *b)
+{
+	assert(!BIGALLOC_IN_USE(b));
+	assert(!b->parent && !b->prev_sib && !b->next_sib);
+	b->next_sib = free_bigallocs;
+	free_bigallocs = b;
 }
 
 static _Bool
@@ -339,6 +459,149 @@ static void clear_bigalloc(struct big_allocation *b)
 	b->allocator_private_free = NULL;
 }
 
+#ifndef BIGALLOC_CHILD_INDEX_THRESHOLD
+#define BIGALLOC_CHILD_INDEX_THRESHOLD 16
+#endif
+struct bigalloc_child_index
+{
+	unsigned capacity;
+	struct big_allocation *children[]; /* sorted by begin; there are parent->nchildren */
+};
+
+/* Return the position of the first child beginning above addr. */
+static unsigned child_index_upper_bound(struct big_allocation *parent, const void *addr)
+{
+	struct big_allocation **children = parent->child_index->children;
+	unsigned lo = 0, hi = parent->nchildren;
+	while (lo < hi)
+	{
+		unsigned mid = lo + (hi - lo) / 2;
+		if ((char*) children[mid]->begin <= (char*) addr) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+static int compare_bigalloc_begin(const void *p1, const void *p2)
+{
+	const struct big_allocation *b1 = *(const struct big_allocation **) p1;
+	const struct big_allocation *b2 = *(const struct big_allocation **) p2;
+	return ((char*) b1->begin > (char*) b2->begin) - ((char*) b1->begin < (char*) b2->begin);
+}
+
+static void child_index_build(struct big_allocation *parent)
+{
+	unsigned capacity = 2 * parent->nchildren;
+	struct bigalloc_child_index *index = __private_malloc(sizeof (struct bigalloc_child_index)
+		+ capacity * sizeof (struct big_allocation *));
+	if (!index) abort();
+	index->capacity = capacity;
+	unsigned i = 0;
+	for (struct big_allocation *child = parent->first_child; child; child = child->next_sib)
+	{
+		index->children[i++] = child;
+	}
+	assert(i == parent->nchildren);
+	qsort(index->children, i, sizeof index->children[0], compare_bigalloc_begin);
+	parent->child_index = index;
+}
+
+static void child_index_free(struct big_allocation *parent)
+{
+	__private_free(parent->child_index);
+	parent->child_index = NULL;
+}
+
+/* Called after parent->nchildren has counted the new child. */
+static void child_index_insert(struct big_allocation *parent, struct big_allocation *child)
+{
+	struct bigalloc_child_index *index = parent->child_index;
+	if (parent->nchildren > index->capacity)
+	{
+		index->capacity *= 2;
+		index = parent->child_index = __private_realloc(index, sizeof (struct bigalloc_child_index)
+			+ index->capacity * sizeof (struct big_allocation *));
+		if (!index) abort();
+	}
+	unsigned pos = child_index_upper_bound(parent, child->begin);
+	memmove(&index->children[pos + 1], &index->children[pos],
+		(parent->nchildren - 1 - pos) * sizeof (struct big_allocation *));
+	index->children[pos] = child;
+}
+
+/* Called before parent->nchildren has stopped counting the child. */
+static void child_index_remove(struct big_allocation *parent, struct big_allocation *child)
+{
+	struct bigalloc_child_index *index = parent->child_index;
+	unsigned pos = child_index_upper_bound(parent, child->begin);
+	/* Zero-size siblings can share a begin with the child, so look
+	 * back through the run of equal begins for the child itself. */
+	do
+	{
+		assert(pos > 0 && index->children[pos - 1]->begin == child->begin);
+		--pos;
+	} while (index->children[pos] != child);
+	memmove(&index->children[pos], &index->children[pos + 1],
+		(parent->nchildren - 1 - pos) * sizeof (struct big_allocation *));
+}
+
+/* Find the child of parent that spans addr, if any. */
+static struct big_allocation *find_child_containing(struct big_allocation *parent, const void *addr)
+{
+	if (parent->child_index)
+	{
+		unsigned pos = child_index_upper_bound(parent, addr);
+		/* Only one of a run of siblings with equal begins can be non-empty. */
+		for (; pos > 0; --pos)
+		{
+			struct big_allocation *child = parent->child_index->children[pos - 1];
+			if ((char*) child->end > (char*) addr) return child;
+			if (pos == 1 || parent->child_index->children[pos - 2]->begin != child->begin) break;
+		}
+		return NULL;
+	}
+	for (struct big_allocation *child = parent->first_child;
+			child;
+			child = child->next_sib)
+	{
+		if ((char*) child->begin <= (char*) addr && 
+				child->end > addr)
+		{
+			return child;
+		}
+	}
+	return NULL;
+}
+
+/* Does b span the whole of obj's page, with no child overlapping it?
+ * If so, b is the deepest bigalloc for any address on that page. */
+__attribute__((visibility("protected")))
+_Bool __liballocs_bigalloc_is_leaf_for_page(struct big_allocation *b, const void *obj)
+{
+	const void *page_begin = (const void *) ADDR_OF_PAGENUM(PAGENUM(obj));
+	const void *page_end = (const char *) page_begin + PAGE_SIZE;
+	if ((char*) b->begin > (char*) page_begin || (char*) b->end < (char*) page_end) return 0;
+	if (b->child_index)
+	{
+		/* Siblings don't overlap, so only the last child beginning on or
+		 * before the page's last byte can reach into it... unless it is one
+		 * of a run of equal begins, of which only one can be non-empty. */
+		unsigned pos = child_index_upper_bound(b, (const char *) page_end - 1);
+		for (; pos > 0; --pos)
+		{
+			struct big_allocation *child = b->child_index->children[pos - 1];
+			if ((char*) child->end > (char*) page_begin) return 0;
+			if (pos == 1 || b->child_index->children[pos - 2]->begin != child->begin) break;
+		}
+		return 1;
+	}
+	for (struct big_allocation *child = b->first_child; child; child = child->next_sib)
+	{
+		if ((char*) child->begin < (char*) page_end && (char*) child->end > (char*) page_begin) return 0;
+	}
+	return 1;
+}
+
 static void add_child(struct big_allocation *child, struct big_allocation *parent)
 {
 	SANITY_CHECK_BIGALLOC(parent);
@@ -352,6 +615,9 @@ static void add_child(struct big_allocation *child, struct big_allocation *paren
 	assert(!previous_first_child || !previous_first_child->prev_sib);
 	if (previous_first_child) previous_first_child->prev_sib = child;
 	assert(!child->prev_sib);
+	++parent->nchildren;
+	if (parent->child_index) child_index_insert(parent, child);
+	else if (parent->nchildren > BIGALLOC_CHILD_INDEX_THRESHOLD) child_index_build(parent);
 	SANITY_CHECK_BIGALLOC(child);
 	SANITY_CHECK_BIGALLOC(parent);
 }
@@ -362,6 +628,13 @@ static void unlink_child(struct big_allocation *child)
 	if (!parent) abort();
 	SANITY_CHECK_BIGALLOC(child);
 	SANITY_CHECK_BIGALLOC(parent);
+	if (parent->child_index)
+	{
+		child_index_remove(parent, child);
+		/* Hysteresis, so that we don't rebuild the index on every add/remove. */
+		if (parent->nchildren - 1 < BIGALLOC_CHILD_INDEX_THRESHOLD / 2) child_index_free(parent);
+	}
+	--parent->nchildren;
 	/* Unhook it from its current list. */
 	if (child == parent->first_child)
 	{
@@ -390,6 +663,7 @@ static struct big_allocation *find_deepest_bigalloc(const void *addr);
 static void bigalloc_del(struct big_allocation *b)
 {
 	SANITY_CHECK_BIGALLOC(b);
+	begin_tree_update();
 	
 	/* Recursively delete all children. */
 	struct big_allocation *child = b->first_child;
@@ -425,8 +699,11 @@ static void bigalloc_del(struct big_allocation *b)
 		          ROUND_DOWN((unsigned long) end_to_clear, PAGE_SIZE))
 	);
 	clear_bigalloc_nomemset(b);
+	invalidate_leaf_range(begin_to_clear, end_to_clear);
+	end_tree_update();
 	
 	assert(!BIGALLOC_IN_USE(b));
+	release_bigalloc(b);
 }
 
 __attribute__((visibility("protected")))
@@ -450,7 +727,7 @@ void __liballocs_print_l0_to_stream_err(void)
 	BIG_LOCK
 	
 	if (!pageindex) __pageindex_init();
-	for (struct big_allocation *b = &big_allocations[1]; b < &big_allocations[NBIGALLOCS]; ++b)
+	for (struct big_allocation *b = &big_allocations[1]; b < &big_allocations[bigallocs_highwater]; ++b)
 	{
 		if (BIGALLOC_IN_USE(b) && !b->parent) fprintf(get_stream_err(), "%p-%p %s %p\n",
 				b->begin, b->end, b->allocated_by->name, 
@@ -593,6 +870,7 @@ static void bigalloc_init_nomemset(struct big_allocation *b, const void *ptr, si
 	struct allocator *allocated_by, struct allocator *suballocator,
 	void *suballocator_private, void (*suballocator_private_free)(void*))
 {
+	begin_tree_update();
 	b->begin = (void*) ptr;
 	b->end = (char*) ptr + size;
 	b->allocator_private = allocator_private;
@@ -602,6 +880,8 @@ static void bigalloc_init_nomemset(struct big_allocation *b, const void *ptr, si
 	b->suballocator_private = suballocator_private;
 	b->suballocator_private_free = suballocator_private_free;
 	b->first_child = b->next_sib = b->prev_sib = NULL;
+	b->nchildren = 0;
+	b->child_index = NULL;
 	/* Add it to the child list of the parent, if we have one. */
 	if (parent) 
 	{
@@ -618,6 +898,8 @@ static void bigalloc_init_nomemset(struct big_allocation *b, const void *ptr, si
 		// 	// && parent != auxv_bigalloc
 		// ) abort();
 	}
+	invalidate_leaf_range(b->begin, b->end);
+	end_tree_update();
 	
 	SANITY_CHECK_BIGALLOC(b);
 }
@@ -626,6 +908,7 @@ static void bigalloc_init(struct big_allocation *b, const void *ptr, size_t size
 	void *allocator_private, void (*allocator_private_free)(void*), struct allocator *allocated_by, struct allocator *suballocator,
 	void *suballocator_private, void (*suballocator_private_free)(void*))
 {
+	begin_tree_update();
 	bigalloc_init_nomemset(b, ptr, size, parent, allocator_private, allocator_private_free,
 		allocated_by, suballocator,
 		suballocator_private, suballocator_private_free);
@@ -638,6 +921,8 @@ static void bigalloc_init(struct big_allocation *b, const void *ptr, size_t size
 				      ROUND_DOWN((unsigned long) b->end, PAGE_SIZE))
 	);
 	
+	end_tree_update();
+	
 	SANITY_CHECK_BIGALLOC(b);
 }
 
@@ -647,9 +932,11 @@ _Bool __liballocs_extend_bigalloc(struct big_allocation *b, const void *new_end)
 	if (!pageindex) __pageindex_init();
 	int lock_ret;
 	BIG_LOCK
+	begin_tree_update();
 	const void *old_end = b->end;
 	b->end = (void*) new_end;
 	bigalloc_num_t parent_num = b->parent ? b->parent - &big_allocations[0] : 0;
+	invalidate_leaf_range(old_end, new_end);
 	
 	/* For each page that this alloc spans, memset it in the page index. */
 	memset_bigalloc(pageindex + PAGENUM(ROUND_DOWN((unsigned long) old_end, PAGE_SIZE)),
@@ -657,6 +944,7 @@ _Bool __liballocs_extend_bigalloc(struct big_allocation *b, const void *new_end)
 			PAGE_DIST(ROUND_DOWN((unsigned long) old_end, PAGE_SIZE),
 			          ROUND_DOWN((unsigned long) new_end, PAGE_SIZE))
 	);
+	end_tree_update();
 	
 	SANITY_CHECK_BIGALLOC(b);
 	
@@ -705,7 +993,9 @@ _Bool __liballocs_pre_extend_bigalloc(struct big_allocation *b, const void *new_
 	const void *old_begin = b->begin;
 	if ((char*) new_begin < (char*) old_begin)
 	{
+		begin_tree_update();
 		b->begin = (void*) new_begin;
+		invalidate_leaf_range(new_begin, old_begin);
 		bigalloc_num_t parent_num = b->parent ? b->parent - &big_allocations[0] : 0;
 
 		/* For each page that this alloc spans, memset it in the page index. */
@@ -723,6 +1013,7 @@ _Bool __liballocs_pre_extend_bigalloc(struct big_allocation *b, const void *new_
 			                  ? ROUND_UP((unsigned long) old_begin, PAGE_SIZE)
 			                  : ROUND_DOWN((unsigned long) old_begin, PAGE_SIZE) )
 		);
+		end_tree_update();
 	}
 	
 	
@@ -731,6 +1022,18 @@ _Bool __liballocs_pre_extend_bigalloc(struct big_allocation *b, const void *new_
 	return 1;
 }
 
+/* For code that edits a bigalloc's bounds directly. */
+__attribute__((visibility("hidden")))
+void __liballocs_invalidate_pageindex_leaf(const void *begin, const void *end)
+{
+	int lock_ret;
+	BIG_LOCK
+	begin_tree_update();
+	invalidate_leaf_range(begin, end);
+	end_tree_update();
+	BIG_UNLOCK
+}
+
 /* This helper just takes a new end, which may be an expansion or contraction. 
  * Clients must fix up the allocator-specific metadata. */
 __attribute__((visibility("hidden")))
@@ -752,8 +1055,10 @@ void __adjust_bigalloc_end(struct big_allocation *b, void *new_end)
 
 static _Bool bigalloc_truncate_at_end(struct big_allocation *b, const void *new_end)
 {
+	begin_tree_update();
 	const void *old_end = b->end;
 	b->end = (void*) new_end;
+	invalidate_leaf_range(new_end, old_end);
 	bigalloc_num_t parent_num = b->parent ? b->parent - &big_allocations[0] : 0;
 	
 	/* For each page that this alloc no longer spans, memset it back to the parent num. */
@@ -762,6 +1067,7 @@ static _Bool bigalloc_truncate_at_end(struct big_allocation *b, const void *new_
 			PAGE_DIST(ROUND_DOWN((unsigned long) new_end, PAGE_SIZE),
 			          ROUND_DOWN((unsigned long) old_end, PAGE_SIZE))
 	);
+	end_tree_update();
 	
 	SANITY_CHECK_BIGALLOC(b);
 	
@@ -786,9 +1092,11 @@ _Bool __liballocs_truncate_bigalloc_at_beginning(struct big_allocation *b, const
 	if (!pageindex) __pageindex_init();
 	int lock_ret;
 	BIG_LOCK
+	begin_tree_update();
 	const void *old_begin = b->begin;
 	b->begin = (void*) new_begin;
 	bigalloc_num_t parent_num = b->parent ? b->parent - &big_allocations[0] : 0;
+	invalidate_leaf_range(old_begin, new_begin);
 	
 	/* For each page that this alloc no longer spans, memset it in the page index. */
 	memset_bigalloc(pageindex + PAGENUM(ROUND_UP((unsigned long) old_begin, PAGE_SIZE)),
@@ -796,6 +1104,7 @@ _Bool __liballocs_truncate_bigalloc_at_beginning(struct big_allocation *b, const
 			PAGE_DIST(ROUND_UP((unsigned long) old_begin, PAGE_SIZE),
 			          ROUND_UP((unsigned long) new_begin, PAGE_SIZE))
 	);
+	end_tree_update();
 	SANITY_CHECK_BIGALLOC(b);
 	BIG_UNLOCK
 	return 1;
@@ -807,6 +1116,7 @@ struct big_allocation *__liballocs_split_bigalloc_at_page_boundary(struct big_al
 	if (!pageindex) __pageindex_init();
 	int lock_ret;
 	BIG_LOCK
+	begin_tree_update();
 	struct big_allocation tmp = *b;
 	
 	/* Partition the children between the two halves. It's an error
@@ -860,6 +1170,8 @@ struct big_allocation *__liballocs_split_bigalloc_at_page_boundary(struct big_al
 	{
 		if (*pos == (b - &big_allocations[0])) *pos = (new_bigalloc - &big_allocations[0]);
 	}
+	invalidate_leaf_range(tmp.begin, tmp.end);
+	end_tree_update();
 	SANITY_CHECK_BIGALLOC(b);
 	SANITY_CHECK_BIGALLOC(new_bigalloc);
 	BIG_UNLOCK
@@ -921,16 +1233,11 @@ static struct big_allocation *find_bigalloc_recursive(struct big_allocation *sta
 	if ((match_suballocator ? start->suballocator : start->allocated_by) == a) return start;
 	
 	/* Okay, it's not this one. Is it one of the children? */
-	for (struct big_allocation *child = start->first_child;
-			child;
-			child = child->next_sib)
+	struct big_allocation *child = find_child_containing(start, addr);
+	if (child)
 	{
-		if ((char*) child->begin <= (char*) addr && 
-				child->end > addr)
-		{
-			/* okay, tail-recurse down here */
-			return find_bigalloc_recursive(child, addr, a, match_suballocator);
-		}
+		/* okay, tail-recurse down here */
+		return find_bigalloc_recursive(child, addr, a, match_suballocator);
 	}
 	
 	/* We didn't find an overlapping child, so we fail. */
@@ -958,17 +1265,12 @@ static struct big_allocation *find_deepest_bigalloc_recursive(struct big_allocat
 	const void *addr)
 {
 	/* Is it one of the children? */
-	for (struct big_allocation *child = start->first_child;
-			child;
-			child = child->next_sib)
+	struct big_allocation *child = find_child_containing(start, addr);
+	if (child)
 	{
-		if ((char*) child->begin <= (char*) addr && 
-				child->end > addr)
-		{
-			/* Recurse down here */
-			struct big_allocation *maybe_deeper = find_deepest_bigalloc_recursive(child, addr);
-			if (maybe_deeper) return maybe_deeper;
-		}
+		/* Recurse down here */
+		struct big_allocation *maybe_deeper = find_deepest_bigalloc_recursive(child, addr);
+		if (maybe_deeper) return maybe_deeper;
 	}
 
 	/* We didn't find an overlapping child, so start is the best we can do. */
@@ -976,6 +1278,13 @@ static struct big_allocation *find_deepest_bigalloc_recursive(struct big_allocat
 }
 static struct big_allocation *find_deepest_bigalloc(const void *addr)
 {
+	unsigned long seq_before = 1;
+	if (pageindex_leaf)
+	{
+		bigalloc_num_t leaf_num = pageindex_leaf[PAGENUM(addr)];
+		if (leaf_num) return &big_allocations[leaf_num];
+		seq_before = __atomic_load_n(&pageindex_leaf_seq, __ATOMIC_SEQ_CST);
+	}
 	bigalloc_num_t start_idx = pageindex[PAGENUM(addr)];
 	if (unlikely(start_idx == 0))
 	{
@@ -983,7 +1292,9 @@ static struct big_allocation *find_deepest_bigalloc(const void *addr)
 		start_idx = pageindex[PAGENUM(addr)];
 		if (start_idx == 0) return NULL;
 	}
-	return find_deepest_bigalloc_recursive(&big_allocations[start_idx], addr);
+	struct big_allocation *deepest = find_deepest_bigalloc_recursive(&big_allocations[start_idx], addr);
+	if (pageindex_leaf) __liballocs_pageindex_leaf_fill(addr, deepest, seq_before);
+	return deepest;
 }
 
 __attribute__((visibility("protected")))
@@ -317,6 +317,20 @@ void *mremap(void *old_addr, size_t old_size, size_t new_size, int flags, ... /*
 #undef orig_call
 }
 
+/* Like mmap, we do the syscall ourselves, so that only one of the
+ * preload and systrap paths sees it. */
+int mprotect(void *addr, size_t len, int prot)
+{
+	int ret = raw_mprotect(addr, len, prot);
+	if (ret != 0)
+	{
+		errno = -ret;
+		return -1;
+	}
+	if (__liballocs_systrap_is_initialized) __mmap_allocator_notify_mprotect(addr, len, prot);
+	return 0;
+}
+
 static void init(void) __attribute__((constructor));
 static void init(void)
 {
@@ -449,7 +463,7 @@ void *memcpy(void *dest, const void *src, size_t n)
 		assert(orig_memcpy);
 	}
 	
-	__notify_copy(dest, src, n);
+	if (n >= LIBALLOCS_COPY_NOTIFY_MIN_SIZE) __notify_copy(dest, src, n);
 
 	return orig_memcpy(dest, src, n);
 }
@@ -464,7 +478,7 @@ void *memmove(void *dest, const void *src, size_t n)
 		assert(orig_memmove);
 	}
 	
-	__notify_copy(dest, src, n);
+	if (n >= LIBALLOCS_COPY_NOTIFY_MIN_SIZE) __notify_copy(dest, src, n);
 
 	return orig_memmove(dest, src, n);
 }
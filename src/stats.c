@@ -0,0 +1,358 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "liballocs.h"
+#include "liballocs_private.h"
+#include "allocmeta.h"
+#include "pageindex.h"
+
+/* The mapping holding every thread's block, created on the first count.
+ * Normally it is private anonymous memory. If statistics were asked for
+ * (LIBALLOCS_STATS or LIBALLOCS_STATS_SHM, or by exporting before the
+ * first count), it is backed by an unnamed file in /dev/shm instead, which
+ * we can link into the namespace so that other processes can read it. */
+static struct __liballocs_stats_shm *stats;
+static int stats_fd = -1;
+static _Bool stats_want_file;
+/* If we cannot map anything at all, everybody counts here. */
+static struct __liballocs_stats_block fallback_block = { .claimed = 1, .shared = 1 };
+
+#ifndef NO_TLS
+__thread struct __liballocs_stats_block *__liballocs_stats_mine;
+#else
+struct __liballocs_stats_block *__liballocs_stats_mine;
+#endif
+int __liballocs_stats_detail;
+
+/* Allocators are numbered in the order we first see a timed query
+ * against them; their names are copied into the mapping. */
+static struct allocator *registered_allocators[LIBALLOCS_STATS_MAX_ALLOCATORS];
+static _Bool registering;
+
+static char exported_path[4096];
+static _Bool exported_path_is_default;
+
+#define STATS_MAPPING_SIZE \
+	(((sizeof (struct __liballocs_stats_shm)) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+
+static struct __liballocs_stats_shm *create_mapping(int *out_fd)
+{
+	void *m = MAP_FAILED;
+	int fd = stats_want_file ? open("/dev/shm", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600) : -1;
+	if (fd != -1)
+	{
+		if (ftruncate(fd, STATS_MAPPING_SIZE) == 0)
+		{
+			m = mmap(NULL, STATS_MAPPING_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+		}
+		if (MMAP_RETURN_IS_ERROR(m)) { close(fd); fd = -1; }
+	}
+	if (fd == -1)
+	{
+		m = mmap(NULL, STATS_MAPPING_SIZE, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (MMAP_RETURN_IS_ERROR(m)) return NULL;
+	}
+	struct __liballocs_stats_shm *s = m;
+	s->version = LIBALLOCS_STATS_VERSION;
+	s->block_size = sizeof (struct __liballocs_stats_block);
+	s->pid = getpid();
+	s->npool = LIBALLOCS_STATS_NPOOL;
+	s->retired.claimed = 1;
+	s->retired.shared = 1;
+	s->overflow.claimed = 1;
+	s->overflow.shared = 1;
+	/* Readers check the magic last. */
+	__atomic_store_n(&s->magic, LIBALLOCS_STATS_MAGIC, __ATOMIC_RELEASE);
+	*out_fd = fd;
+	return s;
+}
+
+#ifndef NO_PTHREADS
+static void stats_after_fork_child(void);
+#endif
+static struct __liballocs_stats_shm *get_stats(void)
+{
+	struct __liballocs_stats_shm *s = __atomic_load_n(&stats, __ATOMIC_ACQUIRE);
+	if (__builtin_expect(s != NULL, 1)) return s;
+	/* Racing threads may each create a mapping; the losers throw theirs away. */
+	int fd;
+	s = create_mapping(&fd);
+	if (!s) return NULL;
+	struct __liballocs_stats_shm *expected = NULL;
+	if (!__atomic_compare_exchange_n(&stats, &expected, s, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		munmap(s, STATS_MAPPING_SIZE);
+		if (fd != -1) close(fd);
+		return expected;
+	}
+	stats_fd = fd;
+#ifndef NO_PTHREADS
+	/* A shared file needs replacing in a forked child; a private mapping doesn't. */
+	if (fd != -1) pthread_atfork(NULL, NULL, stats_after_fork_child);
+#endif
+	return s;
+}
+
+#ifndef NO_PTHREADS
+static pthread_key_t release_key;
+static pthread_once_t release_key_once = PTHREAD_ONCE_INIT;
+/* Fold an exiting thread's counts into the retired block and free its slot. */
+static void release_stats_block(void *arg)
+{
+	struct __liballocs_stats_block *b = arg;
+	struct __liballocs_stats_shm *s = stats;
+	/* Anything counted by later destructors goes to the shared block. */
+	__liballocs_stats_mine = &s->overflow;
+	unsigned long *from = b->counters;
+	unsigned long *to = s->retired.counters;
+	unsigned n = (sizeof *b - offsetof(struct __liballocs_stats_block, counters))
+		/ sizeof (unsigned long);
+	for (unsigned i = 0; i < n; ++i)
+	{
+		unsigned long v = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+		if (!v) continue;
+		__atomic_fetch_add(&to[i], v, __ATOMIC_RELAXED);
+		__atomic_store_n(&from[i], 0ul, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&b->claimed, 0, __ATOMIC_RELEASE);
+}
+static void init_release_key(void)
+{
+	pthread_key_create(&release_key, release_stats_block);
+}
+#endif
+
+struct __liballocs_stats_block *__liballocs_stats_claim_block(void)
+{
+	if (__liballocs_stats_mine) return __liballocs_stats_mine;
+	struct __liballocs_stats_shm *s = get_stats();
+	struct __liballocs_stats_block *b = s ? &s->overflow : &fallback_block;
+#ifndef NO_TLS
+	if (s) for (unsigned i = 0; i < LIBALLOCS_STATS_NPOOL; ++i)
+	{
+		_Bool expected = 0;
+		if (__atomic_compare_exchange_n(&s->pool[i].claimed, &expected, 1,
+				0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		{
+			b = &s->pool[i];
+			unsigned highwater = __atomic_load_n(&s->highwater, __ATOMIC_RELAXED);
+			while (highwater < i + 1 && !__atomic_compare_exchange_n(&s->highwater,
+					&highwater, i + 1, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+#ifndef NO_PTHREADS
+			pthread_once(&release_key_once, init_release_key);
+			pthread_setspecific(release_key, b);
+#endif
+			break;
+		}
+	}
+#endif
+	__liballocs_stats_mine = b;
+	return b;
+}
+
+unsigned long __liballocs_stats_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+static unsigned allocator_index(struct __liballocs_stats_shm *s, struct allocator *a)
+{
+	unsigned n = __atomic_load_n(&s->nallocators, __ATOMIC_ACQUIRE);
+	for (unsigned i = 0; i < n; ++i) if (registered_allocators[i] == a) return i;
+	while (__atomic_test_and_set(&registering, __ATOMIC_ACQUIRE));
+	n = __atomic_load_n(&s->nallocators, __ATOMIC_RELAXED);
+	unsigned i;
+	for (i = 0; i < n; ++i) if (registered_allocators[i] == a) break;
+	if (i == n && n < LIBALLOCS_STATS_MAX_ALLOCATORS)
+	{
+		registered_allocators[n] = a;
+		strncpy(s->allocator_names[n], a->name ? a->name : "(unnamed)",
+			LIBALLOCS_STATS_ALLOCATOR_NAME_MAX - 1);
+		__atomic_store_n(&s->nallocators, n + 1, __ATOMIC_RELEASE);
+	}
+	__atomic_clear(&registering, __ATOMIC_RELEASE);
+	return i;
+}
+
+void __liballocs_stats_note_query(struct allocator *a, struct liballocs_err *err,
+	unsigned long t0_ns)
+{
+	unsigned long dt = __liballocs_stats_now_ns() - t0_ns;
+	struct __liballocs_stats_block *b = __liballocs_stats_mine;
+	if (!b) b = __liballocs_stats_claim_block();
+	struct __liballocs_stats_shm *s = stats;
+	if (!s) return;
+	unsigned i = allocator_index(s, a);
+	if (i >= LIBALLOCS_STATS_MAX_ALLOCATORS) return;
+	unsigned bucket = dt ? (8 * sizeof dt - 1) - __builtin_clzl(dt) : 0;
+	if (bucket >= LIBALLOCS_STATS_LATENCY_NBUCKETS) bucket = LIBALLOCS_STATS_LATENCY_NBUCKETS - 1;
+	__liballocs_stats_bump(b, &b->alloc_queries[i]);
+	if (err) __liballocs_stats_bump(b, &b->alloc_failures[i]);
+	__liballocs_stats_bump(b, &b->alloc_latency[i][bucket]);
+}
+
+/* Before the per-thread blocks, the counts were global variables, and
+ * these three were visible to client DSOs, which may still read them or
+ * count into them. So we keep them, and whenever anyone reads the stats
+ * we take in whatever was counted into them since the last read, then set
+ * them to the totals. */
+unsigned long __liballocs_hit_heap_case __attribute__((visibility("protected")));
+unsigned long __liballocs_aborted_unindexed_heap __attribute__((visibility("protected")));
+unsigned long __liballocs_aborted_unrecognised_allocsite __attribute__((visibility("protected")));
+static struct
+{
+	unsigned long *var;
+	enum __liballocs_stat which;
+	unsigned long last_set;
+} legacy_counters[] = {
+	{ &__liballocs_hit_heap_case, LIBALLOCS_STAT_HIT_HEAP_CASE },
+	{ &__liballocs_aborted_unindexed_heap, LIBALLOCS_STAT_ABORTED_UNINDEXED_HEAP },
+	{ &__liballocs_aborted_unrecognised_allocsite, LIBALLOCS_STAT_ABORTED_UNRECOGNISED_ALLOCSITE }
+};
+static _Bool syncing_legacy_counters;
+static void sync_legacy_counters(struct __liballocs_stats_shm *s, struct liballocs_stats *out)
+{
+	struct __liballocs_stats_block *into = s ? &s->retired : &fallback_block;
+	while (__atomic_test_and_set(&syncing_legacy_counters, __ATOMIC_ACQUIRE));
+	for (unsigned i = 0; i < sizeof legacy_counters / sizeof legacy_counters[0]; ++i)
+	{
+		unsigned long v = __atomic_load_n(legacy_counters[i].var, __ATOMIC_RELAXED);
+		unsigned long extra = v - legacy_counters[i].last_set;
+		if (extra)
+		{
+			__atomic_fetch_add(&into->counters[legacy_counters[i].which], extra, __ATOMIC_RELAXED);
+			out->counters[legacy_counters[i].which] += extra;
+		}
+		legacy_counters[i].last_set = out->counters[legacy_counters[i].which];
+		__atomic_store_n(legacy_counters[i].var, legacy_counters[i].last_set, __ATOMIC_RELAXED);
+	}
+	__atomic_clear(&syncing_legacy_counters, __ATOMIC_RELEASE);
+}
+
+void __liballocs_stats_read(struct liballocs_stats *out)
+{
+	/* Don't create the mapping just to find it empty. */
+	struct __liballocs_stats_shm *s = __atomic_load_n(&stats, __ATOMIC_ACQUIRE);
+	__liballocs_stats_sum(s, out);
+	/* Normally empty, but see above. */
+	__liballocs_stats_add_block(out, &fallback_block);
+	sync_legacy_counters(s, out);
+}
+
+static const char *link_mapping(const char *path)
+{
+	char fd_path[32];
+	snprintf(fd_path, sizeof fd_path, "/proc/self/fd/%d", stats_fd);
+	int ret = linkat(AT_FDCWD, fd_path, AT_FDCWD, path, AT_SYMLINK_FOLLOW);
+	if (ret != 0 && errno == EEXIST)
+	{
+		/* Most likely left behind by an earlier process. */
+		unlink(path);
+		ret = linkat(AT_FDCWD, fd_path, AT_FDCWD, path, AT_SYMLINK_FOLLOW);
+	}
+	return ret == 0 ? path : NULL;
+}
+
+static void unlink_default_export(void);
+const char *__liballocs_stats_export(const char *path)
+{
+	/* If we haven't counted anything yet, we can still get a shareable mapping. */
+	stats_want_file = 1;
+	if (!get_stats() || stats_fd == -1) return NULL;
+	_Bool is_default = !path;
+	char default_path[64];
+	if (is_default)
+	{
+		snprintf(default_path, sizeof default_path, "/dev/shm/liballocs-stats.%d", getpid());
+		path = default_path;
+	}
+	if (strlen(path) >= sizeof exported_path) return NULL;
+	if (exported_path[0] && 0 == strcmp(path, exported_path)) return exported_path;
+	if (!link_mapping(path))
+	{
+		debug_printf(0, "could not export statistics to %s\n", path);
+		return NULL;
+	}
+	static _Bool registered_unlink;
+	if (!registered_unlink) { atexit(unlink_default_export); registered_unlink = 1; }
+	strcpy(exported_path, path);
+	exported_path_is_default = is_default;
+	/* Whoever is reading will want the full picture. */
+	__liballocs_stats_detail = 1;
+	return exported_path;
+}
+
+static void unlink_default_export(void)
+{
+	/* Nobody else could reuse a pid-named file, so don't leave it lying around.
+	 * A caller-chosen name we leave for reading after we exit. */
+	if (exported_path[0] && exported_path_is_default) unlink(exported_path);
+}
+
+#ifndef NO_PTHREADS
+/* A forked child must not count into its parent's shared file, so it moves
+ * to a copy of its own, renamed for its own pid if the parent's was. */
+static void stats_after_fork_child(void)
+{
+	struct __liballocs_stats_shm *old = stats;
+	if (!old || stats_fd == -1) return; // a private mapping was already copied
+	int fd;
+	struct __liballocs_stats_shm *s = create_mapping(&fd);
+	if (!s)
+	{
+		__liballocs_stats_mine = &fallback_block;
+		__liballocs_stats_detail = 0;
+		return;
+	}
+	unsigned highwater = old->highwater;
+	memcpy(s, old, offsetof(struct __liballocs_stats_shm, pool)
+		+ highwater * sizeof (struct __liballocs_stats_block));
+	s->pid = getpid();
+	struct __liballocs_stats_block *mine = __liballocs_stats_mine;
+	if ((char*) mine >= (char*) old && (char*) mine < (char*) (old + 1))
+	{
+		mine = (struct __liballocs_stats_block *)((char*) s + ((char*) mine - (char*) old));
+		__liballocs_stats_mine = mine;
+		if (mine >= &s->pool[0] && mine < &s->pool[LIBALLOCS_STATS_NPOOL])
+		{
+			pthread_setspecific(release_key, mine);
+		}
+	}
+	__atomic_store_n(&stats, s, __ATOMIC_RELEASE);
+	close(stats_fd);
+	stats_fd = fd;
+	munmap(old, STATS_MAPPING_SIZE);
+	_Bool reexport = exported_path[0] && exported_path_is_default;
+	exported_path[0] = '\0';
+	if (reexport) __liballocs_stats_export(NULL);
+}
+#endif
+
+void __liballocs_stats_init(void)
+{
+	/* Counting costs nothing up front: the mapping appears on the first
+	 * count. Only if asked do we make it shareable, or time queries. */
+	const char *detail_str = getenv("LIBALLOCS_STATS");
+	if (detail_str && atoi(detail_str))
+	{
+		stats_want_file = 1;
+		__liballocs_stats_detail = 1;
+	}
+	const char *shm_str = getenv("LIBALLOCS_STATS_SHM");
+	if (shm_str && *shm_str)
+	{
+		__liballocs_stats_export(0 == strcmp(shm_str, "1") ? NULL : shm_str);
+	}
+}
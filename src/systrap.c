@@ -50,6 +50,23 @@ char *realpath(const char *path, char *resolved_path);
 int snprintf(char *str, size_t size, const char *format, ...);
 int open(const char *pathname, int flags, ...);
 int close(int fd);
+void __liballocs_systrap_trampoline_region(unsigned char *begin, unsigned char *end,
+	const char *name, _Bool is_writable, _Bool is_readable) __attribute__((weak,visibility("hidden")));
+_Bool __liballocs_systrap_cache_trap_region(unsigned char *begin, unsigned char *end,
+	const char *name, _Bool is_writable, _Bool is_readable, _Bool use_trampolines)
+	__attribute__((weak,visibility("hidden")));
+
+/* How we intercept syscalls, chosen at startup by LIBALLOCS_SYSTRAP_BACKEND.
+ * "sigill" (the default) rewrites every syscall site to trap, so each
+ * intercepted mmap costs a signal. "trampoline" first patches the sites it
+ * can into jumps to generated stubs that call the replacement handlers
+ * directly (see systrap_trampoline.c), and traps only the rest. */
+enum systrap_backend
+{
+	SYSTRAP_BACKEND_SIGILL,
+	SYSTRAP_BACKEND_TRAMPOLINE
+};
+static enum systrap_backend backend;
 
 #define GUESS_CALLER(s) \
    generic_syscall_get_ip(s)
@@ -227,8 +244,19 @@ static int maybe_trap_map_cb(struct maps_entry *ent, char *linebuf, void *interp
 #endif
 		)
 	{
-		/* It's an executable mapping we want to blanket-trap, so trap it. */
-		trap_one_executable_region((unsigned char *) ent->first, (unsigned char *) ent->second,
+		/* It's an executable mapping we want to blanket-trap. If the systrap
+		 * cache knows (or can learn) where its syscalls are, let it do the
+		 * work. Otherwise trap the region, then (if asked) patch the sites
+		 * that the trapping found to use trampolines. */
+		_Bool use_trampolines = (backend == SYSTRAP_BACKEND_TRAMPOLINE
+			&& &__liballocs_systrap_trampoline_region);
+		if (&__liballocs_systrap_cache_trap_region
+				&& __liballocs_systrap_cache_trap_region((unsigned char *) ent->first,
+					(unsigned char *) ent->second, ent->rest, ent->w == 'w', ent->r == 'r',
+					use_trampolines)) return 0;
+		if (use_trampolines) __liballocs_systrap_trampoline_region((unsigned char *) ent->first,
+			(unsigned char *) ent->second, ent->rest, ent->w == 'w', ent->r == 'r');
+		else trap_one_executable_region((unsigned char *) ent->first, (unsigned char *) ent->second,
 			ent->rest, ent->w == 'w', ent->r == 'r');
 	}
 	
@@ -277,11 +305,16 @@ void __liballocs_systrap_init(void)
 	 * stubs library, I don't think. Indeed, we don't. */
 	if (__liballocs_systrap_is_initialized) return;
 	
+	const char *backend_str = environ_getenv("LIBALLOCS_SYSTRAP_BACKEND", environ);
+	/* Anything we don't recognise gets the default. */
+	if (backend_str && 0 == strcmp(backend_str, "trampoline")) backend = SYSTRAP_BACKEND_TRAMPOLINE;
+
 	static char realpath_buf[4096]; /* bit of a HACK */
 	/* Make sure we're trapping all syscalls within ld.so. */
 	replaced_syscalls[SYS_mmap] = mmap_replacement;
 	replaced_syscalls[SYS_munmap] = munmap_replacement;
 	replaced_syscalls[SYS_mremap] = mremap_replacement;
+	replaced_syscalls[SYS_mprotect] = mprotect_replacement;
 	replaced_syscalls[SYS_brk] = brk_replacement;
 	replaced_syscalls[SYS_open] = open_replacement;
 	replaced_syscalls[SYS_openat] = openat_replacement;
@@ -307,9 +340,8 @@ void __liballocs_systrap_init(void)
 	
 	/* FIXME: instead of reading the maps file, use section headers to
 	 * figure out the instruction ranges. 
-	 * FIXME: trap everything, and use in-fs caching to mitigate the startup
-	 * overhead. Specifically, we cache a bunch of relocation records having
-	 * a vendor-specific reloc kind R_{ARCH}_SYSCALL_2 for a 2-byte call, etc..*/
+	 * We trap everything, using the in-fs cache (systrap_cache.c) to
+	 * mitigate the startup overhead. */
 
 	struct maps_entry entry;
 	char proc_buf[4096];
@@ -0,0 +1,310 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <link.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "systrap.h"
+#include "raw-syscalls-defs.h"
+#include "vas.h"
+#include "pageindex.h"
+#include "relf.h"
+
+/* A persistent cache of where the syscall instructions are in each
+ * executable region, so that startup need not decode every instruction
+ * of every loaded DSO. There is one file per region, named by the ELF
+ * build-id of the object and the region's vaddr within it, under
+ * LIBALLOCS_SYSTRAP_CACHE (by default $META_BASE/systrap-cache; set it
+ * empty to disable the cache). A file is trusted only if its build-id,
+ * the object's file size and the region's vaddr and length all match,
+ * and every site it lists still holds a syscall instruction.
+ *
+ * On a miss we note every "0f 05" in the region before letting
+ * trap_one_executable_region decode it; the ones it rewrote were real
+ * syscalls, and are what we save. Only then, from that list, does the
+ * trampoline backend patch anything, so nothing it does can get into the
+ * cache. On a hit we trap just the listed instructions. Files are written under a temporary name
+ * and renamed into place, so concurrent processes never see a partial one. */
+
+#define SYSTRAP_CACHE_MAGIC "lasysc\n"
+#define SYSTRAP_CACHE_VERSION 1
+#define SYSTRAP_CACHE_BUILD_ID_MAX 64
+
+struct systrap_cache_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t build_id_len;
+	unsigned char build_id[SYSTRAP_CACHE_BUILD_ID_MAX];
+	uint64_t file_size;
+	uint64_t vaddr;
+	uint64_t region_len;
+	uint32_t nsites;
+	uint32_t padding;
+	/* followed by nsites uint32_t offsets from the region start */
+};
+
+struct systrap_cache_key
+{
+	unsigned char build_id[SYSTRAP_CACHE_BUILD_ID_MAX];
+	unsigned build_id_len;
+	uint64_t file_size;
+	uint64_t vaddr;
+	uint64_t region_len;
+};
+
+int __liballocs_systrap_trampoline_sites(unsigned char *begin, unsigned char *end,
+	unsigned char **syscalls, unsigned nsyscalls, _Bool is_writable) __attribute__((visibility("hidden")));
+
+static const char *cache_dir;
+static char cache_dir_buf[4096];
+
+static const char *get_cache_dir(void)
+{
+	static _Bool done;
+	if (done) return cache_dir;
+	done = 1;
+	const char *dir_str = environ_getenv("LIBALLOCS_SYSTRAP_CACHE", environ);
+	if (dir_str) cache_dir = (dir_str[0] != '\0') ? dir_str : NULL;
+	else
+	{
+		const char *meta_base_str = environ_getenv("META_BASE", environ);
+		if (!meta_base_str) meta_base_str = "/usr/lib/meta";
+		int ret = snprintf(cache_dir_buf, sizeof cache_dir_buf, "%s/systrap-cache", meta_base_str);
+		cache_dir = (ret > 0 && ret < sizeof cache_dir_buf) ? cache_dir_buf : NULL;
+	}
+	return cache_dir;
+}
+
+struct find_build_id_arg
+{
+	unsigned char *addr;
+	struct systrap_cache_key *k;
+	uintptr_t load_addr;
+	_Bool found;
+};
+static int find_build_id_cb(struct dl_phdr_info *info, size_t size, void *arg_as_void)
+{
+	struct find_build_id_arg *arg = arg_as_void;
+	const ElfW(Phdr) *load = NULL;
+	for (unsigned i = 0; i < info->dlpi_phnum; ++i)
+	{
+		const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+		if (ph->p_type == PT_LOAD
+				&& (uintptr_t) arg->addr >= info->dlpi_addr + ph->p_vaddr
+				&& (uintptr_t) arg->addr < info->dlpi_addr + ph->p_vaddr + ph->p_memsz)
+		{ load = ph; break; }
+	}
+	if (!load) return 0;
+	/* This is the object; stop iterating whether or not it has a build-id. */
+	arg->load_addr = info->dlpi_addr;
+	for (unsigned i = 0; i < info->dlpi_phnum; ++i)
+	{
+		const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+		if (ph->p_type != PT_NOTE) continue;
+		const unsigned char *pos = (const unsigned char *) info->dlpi_addr + ph->p_vaddr;
+		const unsigned char *end = pos + ph->p_memsz;
+		while (pos + sizeof (ElfW(Nhdr)) <= end)
+		{
+			const ElfW(Nhdr) *n = (const ElfW(Nhdr) *) pos;
+			const unsigned char *name = pos + sizeof (ElfW(Nhdr));
+			const unsigned char *desc = name + ((n->n_namesz + 3) & ~3u);
+			if (n->n_type == NT_GNU_BUILD_ID && n->n_namesz == 4
+					&& 0 == memcmp(name, "GNU", 4)
+					&& n->n_descsz <= SYSTRAP_CACHE_BUILD_ID_MAX
+					&& desc + n->n_descsz <= end)
+			{
+				memcpy(arg->k->build_id, desc, n->n_descsz);
+				arg->k->build_id_len = n->n_descsz;
+				arg->found = 1;
+				return 1;
+			}
+			pos = desc + ((n->n_descsz + 3) & ~3u);
+		}
+	}
+	return 1;
+}
+
+static _Bool get_key(unsigned char *begin, unsigned char *end, const char *name,
+	struct systrap_cache_key *k)
+{
+	if (!name || name[0] != '/') return 0;
+	memset(k, 0, sizeof *k);
+	struct find_build_id_arg arg = { .addr = begin, .k = k };
+	dl_iterate_phdr(find_build_id_cb, &arg);
+	if (!arg.found) return 0;
+	/* The region's place within the object doesn't vary from run to run. */
+	k->vaddr = (uintptr_t) begin - arg.load_addr;
+	k->region_len = end - begin;
+	struct stat s;
+	if (0 != stat(name, &s)) return 0;
+	k->file_size = s.st_size;
+	return 1;
+}
+
+static int cache_path(char *buf, size_t bufsz, const struct systrap_cache_key *k)
+{
+	char hex[2 * SYSTRAP_CACHE_BUILD_ID_MAX + 1];
+	for (unsigned i = 0; i < k->build_id_len; ++i)
+	{
+		snprintf(&hex[2 * i], 3, "%02x", k->build_id[i]);
+	}
+	hex[2 * k->build_id_len] = '\0';
+	int ret = snprintf(buf, bufsz, "%s/%s-%lx.sites", cache_dir, hex,
+		(unsigned long) k->vaddr);
+	return ret > 0 && ret < bufsz;
+}
+
+/* Read the cached sites for k into a fresh mapping, big enough to be
+ * reused for pointers to them, returning their count or -1 on a miss. */
+static int load(const struct systrap_cache_key *k, unsigned char *begin,
+	uint32_t **out_offsets, size_t *out_maplen)
+{
+	char path[4096];
+	if (!cache_path(path, sizeof path, k)) return -1;
+	int fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd == -1) return -1;
+	struct stat s;
+	struct systrap_cache_header h;
+	if (0 != fstat(fd, &s) || s.st_size < sizeof h
+			|| read(fd, &h, sizeof h) != sizeof h
+			|| 0 != memcmp(h.magic, SYSTRAP_CACHE_MAGIC, sizeof h.magic)
+			|| h.version != SYSTRAP_CACHE_VERSION
+			|| h.build_id_len != k->build_id_len
+			|| 0 != memcmp(h.build_id, k->build_id, k->build_id_len)
+			|| h.file_size != k->file_size
+			|| h.vaddr != k->vaddr
+			|| h.region_len != k->region_len
+			|| s.st_size != sizeof h + (off_t) h.nsites * sizeof (uint32_t))
+	{ close(fd); return -1; }
+	size_t maplen = (h.nsites * sizeof (unsigned char *) + PAGE_SIZE) & ~(PAGE_SIZE - 1);
+	void *mapping = raw_mmap(NULL, maplen, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (MMAP_RETURN_IS_ERROR(mapping)) { close(fd); return -1; }
+	uint32_t *offsets = mapping;
+	ssize_t want = h.nsites * sizeof (uint32_t);
+	_Bool ok = (read(fd, offsets, want) == want);
+	close(fd);
+	for (unsigned i = 0; ok && i < h.nsites; ++i)
+	{
+		ok = offsets[i] + 2 <= k->region_len
+			&& begin[offsets[i]] == 0x0f && begin[offsets[i] + 1] == 0x05;
+	}
+	if (!ok) { raw_munmap(mapping, maplen); return -1; }
+	*out_offsets = offsets;
+	*out_maplen = maplen;
+	return h.nsites;
+}
+
+static void save(const struct systrap_cache_key *k, const uint32_t *offsets, unsigned n)
+{
+	char path[4096];
+	char tmp_path[4096 + 32];
+	if (!cache_path(path, sizeof path, k)) return;
+	int ret = snprintf(tmp_path, sizeof tmp_path, "%s.%d.tmp", path, getpid());
+	if (!(ret > 0 && ret < sizeof tmp_path)) return;
+	mkdir(cache_dir, 0755); /* fine if it exists; if it can't, the open fails */
+	int fd = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (fd == -1) return;
+	struct systrap_cache_header h = {
+		.magic = SYSTRAP_CACHE_MAGIC,
+		.version = SYSTRAP_CACHE_VERSION,
+		.build_id_len = k->build_id_len,
+		.file_size = k->file_size,
+		.vaddr = k->vaddr,
+		.region_len = k->region_len,
+		.nsites = n
+	};
+	memcpy(h.build_id, k->build_id, k->build_id_len);
+	ssize_t want = n * sizeof (uint32_t);
+	_Bool ok = write(fd, &h, sizeof h) == sizeof h
+		&& write(fd, offsets, want) == want;
+	ok &= (0 == close(fd));
+	if (!ok || 0 != rename(tmp_path, path)) unlink(tmp_path);
+}
+
+static void trap_from_cache(unsigned char *begin, unsigned char *end,
+	uint32_t *offsets, unsigned n, _Bool is_writable)
+{
+	/* Make the text writable once, rather than once per site. */
+	_Bool made_writable = !is_writable
+		&& 0 == raw_mprotect(begin, end - begin, PROT_READ|PROT_WRITE|PROT_EXEC);
+	for (unsigned i = 0; i < n; ++i)
+	{
+		trap_one_instruction_range(begin + offsets[i], begin + offsets[i] + 2,
+			is_writable || made_writable, 1);
+	}
+	if (made_writable) raw_mprotect(begin, end - begin, PROT_READ|PROT_EXEC);
+}
+
+static void patch_trampolines(unsigned char *begin, unsigned char *end,
+	uint32_t *offsets, unsigned n, _Bool is_writable)
+{
+	/* Reuse the offsets' mapping to hold pointers, from the top down so as
+	 * not to overwrite any offset before we've read it. */
+	unsigned char **syscalls = (unsigned char **) offsets;
+	for (unsigned i = n; i-- > 0; ) syscalls[i] = begin + offsets[i];
+	__liballocs_systrap_trampoline_sites(begin, end, syscalls, n, is_writable);
+}
+
+/* Trap the region, using or filling the cache. Returns zero, having done
+ * nothing, if the region can't be cached. */
+_Bool __liballocs_systrap_cache_trap_region(unsigned char *begin, unsigned char *end,
+	const char *name, _Bool is_writable, _Bool is_readable, _Bool use_trampolines)
+	__attribute__((visibility("hidden")));
+_Bool __liballocs_systrap_cache_trap_region(unsigned char *begin, unsigned char *end,
+	const char *name, _Bool is_writable, _Bool is_readable, _Bool use_trampolines)
+{
+	if (!get_cache_dir() || !is_readable || end - begin > UINT32_MAX) return 0;
+	struct systrap_cache_key k;
+	if (!get_key(begin, end, name, &k)) return 0;
+
+	uint32_t *offsets;
+	size_t maplen;
+	int n = load(&k, begin, &offsets, &maplen);
+	if (n != -1)
+	{
+		trap_from_cache(begin, end, offsets, n, is_writable);
+		if (use_trampolines) patch_trampolines(begin, end, offsets, n, is_writable);
+		raw_munmap(offsets, maplen);
+		return 1;
+	}
+
+	/* A miss. Note the candidates, then do it the slow way. */
+	unsigned ncandidates = 0;
+	for (unsigned char *p = begin; p + 2 <= end; ++p)
+	{
+		if (p[0] == 0x0f && p[1] == 0x05) ++ncandidates;
+	}
+	maplen = (ncandidates * sizeof (unsigned char *) + PAGE_SIZE) & ~(PAGE_SIZE - 1);
+	void *mapping = raw_mmap(NULL, maplen, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (MMAP_RETURN_IS_ERROR(mapping)) return 0;
+	offsets = mapping;
+	unsigned i = 0;
+	for (unsigned char *p = begin; p + 2 <= end && i < ncandidates; ++p)
+	{
+		if (p[0] == 0x0f && p[1] == 0x05) offsets[i++] = p - begin;
+	}
+	trap_one_executable_region(begin, end, name, is_writable, is_readable);
+	/* The real syscalls are the ones that the decoder rewrote. */
+	unsigned nsites = 0;
+	for (i = 0; i < ncandidates; ++i)
+	{
+		if (begin[offsets[i]] != 0x0f || begin[offsets[i] + 1] != 0x05)
+		{
+			offsets[nsites++] = offsets[i];
+		}
+	}
+	save(&k, offsets, nsites);
+	if (use_trampolines) patch_trampolines(begin, end, offsets, nsites, is_writable);
+	raw_munmap(mapping, maplen);
+	return 1;
+}
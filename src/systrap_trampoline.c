@@ -0,0 +1,376 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include "systrap.h"
+#include "raw-syscalls-defs.h"
+#include "vas.h"
+#include "pageindex.h"
+
+/* The trampoline backend for systrap. Instead of taking a SIGILL and a
+ * sigreturn on every mmap, we look for the common x86-64 idiom
+ *
+ *     b8 NN NN 00 00       mov $nr, %eax
+ *     0f 05                syscall
+ *
+ * and overwrite just the mov with a five-byte jmp to a per-site stub. The
+ * stub steps over the red zone, loads a pointer to the site's record into
+ * %rax and jumps to a common entry point, which saves the registers the
+ * kernel would have preserved (including the extended FP state), calls
+ * the same replacement handler that the SIGILL path would have called,
+ * and resumes after the syscall.
+ *
+ * We never look for the idiom in raw bytes. We consider only syscalls
+ * that libsystrap's decoder has found, and trapped, at an instruction
+ * boundary; and we leave them trapped. So anything that branches to the
+ * syscall itself rather than to the mov still works, via SIGILL. What we
+ * do assume is that five bytes reading as "mov $nr, %eax" just before a
+ * decoded syscall are that instruction, not the tail of a longer one.
+ * We only patch sites whose syscall number has a replacement. Stubs must
+ * be within a rel32 of their site, so each region gets its own stub
+ * pages mapped near it; if we can't get any, the region keeps the SIGILL
+ * path throughout.
+ *
+ * Like the instruction rewriting in libsystrap, the patching is not
+ * atomic with respect to other threads executing the code being patched,
+ * so it had better happen before any have started. */
+
+#ifndef LIBALLOCS_SYSTRAP_TRAMPOLINE_MAX_SITES
+#define LIBALLOCS_SYSTRAP_TRAMPOLINE_MAX_SITES 4096
+#endif
+#define TRAMPOLINE_SITE_LEN  7 /* the mov and the syscall */
+#define TRAMPOLINE_JMP_LEN   5 /* just the mov, which is all we overwrite */
+#define TRAMPOLINE_STUB_LEN 32
+
+void __mmap_allocator_notify_mmap(void *ret, void *requested_addr, size_t length, int prot, int flags,
+                  int fd, off_t offset, void *caller)
+			__attribute__((weak));
+
+struct trampoline_site
+{
+	unsigned char *resume; /* must come first; the entry code reads it */
+	unsigned char *site;
+	long nr;
+};
+static struct trampoline_site sites[LIBALLOCS_SYSTRAP_TRAMPOLINE_MAX_SITES];
+static unsigned nsites;
+
+/* What the entry code has pushed, in ascending address order. */
+struct trampoline_frame
+{
+	struct trampoline_site *site;
+	long r9, r8, r10, rdx, rsi, rdi;
+};
+
+struct trampoline_call
+{
+	struct generic_syscall s; /* must come first; post gets a pointer to it */
+	long ret;
+};
+
+/* Read by the entry code, so not static. */
+unsigned long __liballocs_systrap_trampoline_xstate_size __attribute__((visibility("hidden")));
+_Bool __liballocs_systrap_trampoline_use_xsave __attribute__((visibility("hidden")));
+long __liballocs_systrap_trampoline_handler(struct trampoline_frame *f) __attribute__((visibility("hidden")));
+void __liballocs_systrap_trampoline_entry(void) __attribute__((visibility("hidden")));
+
+#if defined(__x86_64__)
+/* On entry, %rsp is 128 bytes below the interrupted code's stack pointer
+ * and %rax points to the site's record. The syscall instruction clobbers
+ * only %rax, %rcx and %r11, so everything else must survive our call into
+ * C, including the flags and all vector state. */
+__asm__(
+	".text\n"
+	".globl __liballocs_systrap_trampoline_entry\n"
+	".type __liballocs_systrap_trampoline_entry, @function\n"
+"__liballocs_systrap_trampoline_entry:\n"
+	"pushfq\n"
+	"push %rbp\n"
+	"mov %rsp, %rbp\n"
+	"push %rdi\n"
+	"push %rsi\n"
+	"push %rdx\n"
+	"push %r10\n"
+	"push %r8\n"
+	"push %r9\n"
+	"push %rax\n"
+	"sub __liballocs_systrap_trampoline_xstate_size(%rip), %rsp\n"
+	"and $-64, %rsp\n"
+	"cmpb $0, __liballocs_systrap_trampoline_use_xsave(%rip)\n"
+	"je 1f\n"
+	/* XRSTOR faults unless the header's reserved bytes are zero. */
+	"xor %eax, %eax\n"
+	"mov %rax, 512(%rsp)\n"
+	"mov %rax, 520(%rsp)\n"
+	"mov %rax, 528(%rsp)\n"
+	"mov %rax, 536(%rsp)\n"
+	"mov %rax, 544(%rsp)\n"
+	"mov %rax, 552(%rsp)\n"
+	"mov %rax, 560(%rsp)\n"
+	"mov %rax, 568(%rsp)\n"
+	"mov $-1, %eax\n"
+	"mov $-1, %edx\n"
+	"xsave64 (%rsp)\n"
+	"jmp 2f\n"
+"1:\n"
+	"fxsave64 (%rsp)\n"
+"2:\n"
+	"lea -56(%rbp), %rdi\n"
+	"call __liballocs_systrap_trampoline_handler\n"
+	"mov -56(%rbp), %r11\n"
+	"mov (%r11), %r11\n"
+	"mov %rax, -56(%rbp)\n"
+	"cmpb $0, __liballocs_systrap_trampoline_use_xsave(%rip)\n"
+	"je 3f\n"
+	"mov $-1, %eax\n"
+	"mov $-1, %edx\n"
+	"xrstor64 (%rsp)\n"
+	"jmp 4f\n"
+"3:\n"
+	"fxrstor64 (%rsp)\n"
+"4:\n"
+	"lea -56(%rbp), %rsp\n"
+	"pop %rax\n"
+	"pop %r9\n"
+	"pop %r8\n"
+	"pop %r10\n"
+	"pop %rdx\n"
+	"pop %rsi\n"
+	"pop %rdi\n"
+	"pop %rbp\n"
+	"popfq\n"
+	"lea 128(%rsp), %rsp\n"
+	/* As after a real syscall, %rcx holds the return address. */
+	"mov %r11, %rcx\n"
+	"jmp *%r11\n"
+	".size __liballocs_systrap_trampoline_entry, .-__liballocs_systrap_trampoline_entry\n"
+);
+
+static void trampoline_post(struct generic_syscall *s, long ret, _Bool do_resume)
+{
+	/* Nothing to resume: we just return to the entry code. */
+	((struct trampoline_call *) s)->ret = ret;
+}
+
+long __liballocs_systrap_trampoline_handler(struct trampoline_frame *f)
+{
+	/* The replacement handlers only look at the saved context to guess the
+	 * caller, so give them one whose instruction pointer is the syscall. */
+	__typeof__(*((struct generic_syscall *) 0)->saved_context) fake_context;
+	memset(&fake_context, 0, sizeof fake_context);
+	fake_context.uc.uc_mcontext.MC_REG(rip, RIP) = (uintptr_t) f->site->resume - 2;
+	struct trampoline_call call;
+	memset(&call, 0, sizeof call);
+	call.s.saved_context = &fake_context;
+	call.s.args[0] = f->rdi;
+	call.s.args[1] = f->rsi;
+	call.s.args[2] = f->rdx;
+	call.s.args[3] = f->r10;
+	call.s.args[4] = f->r8;
+	call.s.args[5] = f->r9;
+	replaced_syscalls[f->site->nr](&call.s, trampoline_post);
+	return call.ret;
+}
+
+static _Bool is_replaced(long nr)
+{
+	switch (nr)
+	{
+		case SYS_mmap: case SYS_munmap: case SYS_mremap: case SYS_mprotect:
+		case SYS_brk: case SYS_open: case SYS_openat:
+			return replaced_syscalls[nr] != NULL;
+		default: return 0;
+	}
+}
+
+/* Is there a "mov $nr, %eax" for a replaced nr just before this syscall? */
+static _Bool is_site(const unsigned char *syscall, const unsigned char *begin)
+{
+	const unsigned char *p = syscall - TRAMPOLINE_JMP_LEN;
+	if (p < begin) return 0;
+	if (p[0] == 0xb8 && p[3] == 0 && p[4] == 0)
+	{
+		return is_replaced(p[1] | ((long) p[2] << 8));
+	}
+	return 0;
+}
+
+static _Bool within_rel32(const unsigned char *from, const unsigned char *to)
+{
+	intptr_t diff = (intptr_t) to - (intptr_t) from;
+	return diff >= INT32_MIN && diff <= INT32_MAX;
+}
+
+/* Map stub pages within a rel32 of every byte of [begin, end). The
+ * region's neighbours are usually the rest of its own object, so if just
+ * below and just above are taken we try further away, at doubling
+ * distances. The kernel takes a hint only if the range is free, and
+ * otherwise maps somewhere that is usually far off, so we check. */
+static unsigned char *map_stubs_near(unsigned char *begin, unsigned char *end, size_t len)
+{
+	for (uintptr_t distance = 0; distance <= (1ul<<30); distance = distance ? 2 * distance : (1ul<<16))
+	{
+		unsigned char *hints[] = {
+			((uintptr_t) begin > len + distance) ? begin - len - distance : NULL,
+			end + distance
+		};
+		for (unsigned i = 0; i < sizeof hints / sizeof hints[0]; ++i)
+		{
+			if (!hints[i]) continue;
+			void *ret = raw_mmap(hints[i], len, PROT_READ|PROT_WRITE,
+				MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+			if (MMAP_RETURN_IS_ERROR(ret)) continue;
+			unsigned char *stubs = ret;
+			if (within_rel32(begin + TRAMPOLINE_SITE_LEN, stubs + len)
+					&& within_rel32(end, stubs)) return stubs;
+			raw_munmap(ret, len);
+		}
+	}
+	return NULL;
+}
+
+static void write_stub(unsigned char *stub, struct trampoline_site *s)
+{
+	unsigned char *p = stub;
+	/* lea -128(%rsp), %rsp */
+	*p++ = 0x48; *p++ = 0x8d; *p++ = 0x64; *p++ = 0x24; *p++ = 0x80;
+	/* movabs $s, %rax */
+	*p++ = 0x48; *p++ = 0xb8;
+	uint64_t s_addr = (uintptr_t) s;
+	memcpy(p, &s_addr, sizeof s_addr); p += sizeof s_addr;
+	/* jmp *0(%rip), followed by the absolute target */
+	*p++ = 0xff; *p++ = 0x25; *p++ = 0; *p++ = 0; *p++ = 0; *p++ = 0;
+	uint64_t entry_addr = (uintptr_t) __liballocs_systrap_trampoline_entry;
+	memcpy(p, &entry_addr, sizeof entry_addr); p += sizeof entry_addr;
+	/* pad with int3 */
+	while (p < stub + TRAMPOLINE_STUB_LEN) *p++ = 0xcc;
+}
+
+static void init_xstate(void)
+{
+	static _Bool done;
+	if (done) return;
+	unsigned eax, ebx, ecx, edx;
+	__asm__ volatile ("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+	_Bool osxsave = (ecx >> 27) & 1;
+	if (osxsave)
+	{
+		/* Leaf 0xd, subleaf 0: %ebx is the size for the features now enabled. */
+		__asm__ volatile ("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0xd), "c"(0));
+		__liballocs_systrap_trampoline_use_xsave = 1;
+		__liballocs_systrap_trampoline_xstate_size = ebx;
+	}
+	else __liballocs_systrap_trampoline_xstate_size = 512;
+	done = 1;
+}
+
+/* Patch each of the n sites (pointers to the mov of the idiom) in the
+ * region [begin, end). Returns how many we patched: either all of them,
+ * or none if we couldn't get stubs or make the text writable. */
+static unsigned patch_sites(unsigned char *begin, unsigned char *end,
+	unsigned char **idioms, unsigned n, _Bool is_writable)
+{
+	if (n == 0) return 0;
+	init_xstate();
+	size_t stubs_len = ((n * TRAMPOLINE_STUB_LEN) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	unsigned char *stubs = map_stubs_near(begin, end, stubs_len);
+	if (!stubs) return 0;
+	int text_prot = PROT_READ|PROT_EXEC|(is_writable ? PROT_WRITE : 0);
+	if (0 != raw_mprotect(begin, end - begin, PROT_READ|PROT_WRITE|PROT_EXEC))
+	{
+		raw_munmap(stubs, stubs_len);
+		return 0;
+	}
+	for (unsigned i = 0; i < n; ++i)
+	{
+		unsigned char *p = idioms[i];
+		struct trampoline_site *s = &sites[nsites++];
+		*s = (struct trampoline_site) { .resume = p + TRAMPOLINE_SITE_LEN, .site = p,
+			.nr = p[1] | ((long) p[2] << 8) };
+		unsigned char *stub = stubs + i * TRAMPOLINE_STUB_LEN;
+		write_stub(stub, s);
+		int32_t rel = (int32_t) ((intptr_t) stub - (intptr_t) (p + TRAMPOLINE_JMP_LEN));
+		/* jmp rel32, over the mov; the (trapped) syscall stays put */
+		p[0] = 0xe9;
+		memcpy(p + 1, &rel, sizeof rel);
+	}
+	raw_mprotect(begin, end - begin, text_prot);
+	raw_mprotect(stubs, stubs_len, PROT_READ|PROT_EXEC);
+	if (&__mmap_allocator_notify_mmap) __mmap_allocator_notify_mmap(stubs, NULL, stubs_len,
+		PROT_READ|PROT_EXEC, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0, __builtin_return_address(0));
+	return n;
+}
+
+/* We run only during (single-threaded) systrap init, and never patch more
+ * than this many sites in total, so one scratch array will do. */
+static unsigned char *scratch[LIBALLOCS_SYSTRAP_TRAMPOLINE_MAX_SITES];
+
+/* Trap the region as usual, then patch the idiom wherever libsystrap
+ * turned out to have trapped one. */
+void __liballocs_systrap_trampoline_region(unsigned char *begin, unsigned char *end,
+	const char *name, _Bool is_writable, _Bool is_readable) __attribute__((visibility("hidden")));
+void __liballocs_systrap_trampoline_region(unsigned char *begin, unsigned char *end,
+	const char *name, _Bool is_writable, _Bool is_readable)
+{
+	/* We need to read the region to find the sites, and can't patch the
+	 * kernel's special mappings. */
+	if (!is_readable || (name && name[0] == '['))
+	{
+		trap_one_executable_region(begin, end, name, is_writable, is_readable);
+		return;
+	}
+	/* Note the syscall bytes that follow a candidate mov... */
+	unsigned n = 0;
+	for (unsigned char *p = begin + TRAMPOLINE_JMP_LEN; p + 2 <= end
+			&& nsites + n < LIBALLOCS_SYSTRAP_TRAMPOLINE_MAX_SITES; ++p)
+	{
+		if (p[0] == 0x0f && p[1] == 0x05 && is_site(p, begin)) scratch[n++] = p;
+	}
+	trap_one_executable_region(begin, end, name, is_writable, is_readable);
+	/* ... and keep those that the decoder found to be real syscalls. */
+	unsigned nreal = 0;
+	for (unsigned i = 0; i < n; ++i)
+	{
+		if (scratch[i][0] != 0x0f || scratch[i][1] != 0x05)
+		{
+			scratch[nreal++] = scratch[i] - TRAMPOLINE_JMP_LEN;
+		}
+	}
+	patch_sites(begin, end, scratch, nreal, is_writable);
+}
+
+/* Patch the idiom at those of the given syscalls that have it. These must
+ * be real syscalls, found by libsystrap's decoder (perhaps in an earlier
+ * run, via the systrap cache), and must already have been trapped. */
+int __liballocs_systrap_trampoline_sites(unsigned char *begin, unsigned char *end,
+	unsigned char **syscalls, unsigned nsyscalls, _Bool is_writable) __attribute__((visibility("hidden")));
+int __liballocs_systrap_trampoline_sites(unsigned char *begin, unsigned char *end,
+	unsigned char **syscalls, unsigned nsyscalls, _Bool is_writable)
+{
+	unsigned n = 0;
+	for (unsigned i = 0; i < nsyscalls && nsites + n < LIBALLOCS_SYSTRAP_TRAMPOLINE_MAX_SITES; ++i)
+	{
+		if (is_site(syscalls[i], begin)) scratch[n++] = syscalls[i] - TRAMPOLINE_JMP_LEN;
+	}
+	return patch_sites(begin, end, scratch, n, is_writable);
+}
+#else
+void __liballocs_systrap_trampoline_region(unsigned char *begin, unsigned char *end,
+	const char *name, _Bool is_writable, _Bool is_readable) __attribute__((visibility("hidden")));
+void __liballocs_systrap_trampoline_region(unsigned char *begin, unsigned char *end,
+	const char *name, _Bool is_writable, _Bool is_readable)
+{
+	/* No trampolines on this architecture; everything takes the SIGILL path. */
+	trap_one_executable_region(begin, end, name, is_writable, is_readable);
+}
+int __liballocs_systrap_trampoline_sites(unsigned char *begin, unsigned char *end,
+	unsigned char **syscalls, unsigned nsyscalls, _Bool is_writable) __attribute__((visibility("hidden")));
+int __liballocs_systrap_trampoline_sites(unsigned char *begin, unsigned char *end,
+	unsigned char **syscalls, unsigned nsyscalls, _Bool is_writable)
+{
+	return 0;
+}
+#endif
@@ -1,272 +1,282 @@
 #define _GNU_SOURCE
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <limits.h>
 #include <stdio.h>
-#include <search.h>
 #include <assert.h>
 #include <string.h>
 #include <err.h>
+#include <unistd.h>
+#include <sched.h>
+#ifndef NO_PTHREADS
+#include <pthread.h>
+#endif
 #include "uniqtype.h"
 #include "uniqtype-bfs.h"
+#include "uniqtype-ptrmap.h"
 
-// HACK while we conflict with search.h on 'struct entry'
 extern struct uniqtype *pointer_to___uniqtype__void;
 
-/* debugging */
+/* debugging: the per-edge chatter on stderr is compiled in only with
+ * -DUNIQTYPE_BFS_DEBUG, and the dot output only if a filename is given */
 FILE* debug_out = NULL;
-#ifndef DEBUGGING_OUTPUT_FILENAME
-#define DEBUGGING_OUTPUT_FILENAME NULL
-#endif
+#ifdef DEBUGGING_OUTPUT_FILENAME
 const char *debugging_output_filename = DEBUGGING_OUTPUT_FILENAME;
 #define DEBUG_GUARD(stmt) do { if (debug_out != NULL) { stmt; } } while(0)
+#else
+const char *debugging_output_filename = NULL;
+#define DEBUG_GUARD(stmt) do { if (0) { stmt; } } while(0)
+#endif
+#ifdef UNIQTYPE_BFS_DEBUG
+#define bfs_debug_printf(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define bfs_debug_printf(...) do { if (0) fprintf(stderr, __VA_ARGS__); } while(0)
+#endif
 
 typedef __uniqtype_node_rec node_rec;
 
-static void build_adjacency_list_recursive(
-	node_rec **p_adj_u_head, node_rec **p_adj_u_tail, 
-	void *obj_start, struct uniqtype *obj_t, 
-	unsigned long start_offset, struct uniqtype *t_at_offset, 
-	follow_ptr_fn *follow_ptr, void *fp_arg);
-
-enum node_colour { WHITE, GREY, BLACK }; // WHITE == 0, so "absent" pair->v 0 means WHITE
-
-static node_rec *make_node(void *obj, struct uniqtype *t);
-
-struct pair
+/* The set of objects we have seen, i.e. those not white. Each is
+ * enqueued exactly once, on first sight, so we need no more than one
+ * bit of colour: grey and black differ only in whether the object has
+ * left the queue. The set is a flat open-addressing table of object
+ * addresses, with linear probing; zero marks an empty slot, which is
+ * fine since we never visit null. */
+struct visited_set
 {
-	const void *k;
-	uintptr_t v;
+	uintptr_t *slots;
+	unsigned long nslots; /* a power of two */
+	unsigned long nused;
 };
-/* The tsearch man page says 
- * "The first field in each node of the tree is a pointer to the corresponding
- * data item." */
-typedef struct internal_treenode_s
+
+static inline unsigned long hash_obj(uintptr_t obj, unsigned long nslots)
 {
-	void *key;
-} internal_treenode;
-#define TREENODE_TO_PAIR_PTR(n) ((struct pair *)((n)->key))
+	/* Fibonacci hashing; objects are at least word-aligned, so the low
+	 * bits are worthless but the multiply mixes the rest down. */
+	return ((obj * 0x9e3779b97f4a7c15ul) >> 20) & (nslots - 1);
+}
 
-static int compar(const void *key1, const void *key2)
+static void visited_set_init(struct visited_set *s, unsigned long nslots)
 {
-	return (uintptr_t) ((struct pair *) key1)->k - (uintptr_t) ((struct pair *) key2)->k;
+	s->nslots = nslots;
+	s->nused = 0;
+	s->slots = calloc(nslots, sizeof (uintptr_t));
+	if (!s->slots) { warn("insufficient memory"); abort(); }
 }
 
-static uintptr_t treemap_get(void *const *rootp, const void *key)
+static _Bool visited_set_insert_nogrow(struct visited_set *s, uintptr_t obj)
 {
-	/* Find an existing pair, if there is one. */
-	struct pair p = { key, 0 };
-	internal_treenode *found = tfind(&p, rootp, compar);
-	if (found)
+	for (unsigned long i = hash_obj(obj, s->nslots); ; i = (i + 1) & (s->nslots - 1))
 	{
-		assert(TREENODE_TO_PAIR_PTR(found)->v != 0);
-		return TREENODE_TO_PAIR_PTR(found)->v; 
+		if (s->slots[i] == obj) return 0;
+		if (s->slots[i] == 0)
+		{
+			s->slots[i] = obj;
+			++s->nused;
+			return 1;
+		}
 	}
-	return 0ul;
 }
 
-static void treemap_set(void **rootp, const void *key, uintptr_t value)
+/* Add obj to the set, returning whether it was newly added. */
+static _Bool visited_set_insert(struct visited_set *s, const void *obj)
 {
-	/* Find an existing pair, if there is one. */
-	struct pair p = { key, value };
-	internal_treenode *found = tfind(&p, rootp, compar);
-	if (found)
+	if (4 * (s->nused + 1) > 3 * s->nslots)
 	{
-		TREENODE_TO_PAIR_PTR(found)->v = value;
+		struct visited_set bigger;
+		visited_set_init(&bigger, 2 * s->nslots);
+		for (unsigned long i = 0; i < s->nslots; ++i)
+		{
+			if (s->slots[i]) visited_set_insert_nogrow(&bigger, s->slots[i]);
+		}
+		free(s->slots);
+		*s = bigger;
 	}
-	else
+	return visited_set_insert_nogrow(s, (uintptr_t) obj);
+}
+
+static void visited_set_destroy(struct visited_set *s)
+{
+	free(s->slots);
+	s->slots = NULL;
+}
+
+/* The BFS queue is a ring buffer of (object, type) pairs in one
+ * contiguous arena, doubled when full, so queueing an object allocates
+ * nothing in the common case. */
+struct bfs_item
+{
+	void *obj;
+	struct uniqtype *t;
+};
+struct bfs_ring
+{
+	struct bfs_item *items;
+	unsigned long nitems; /* a power of two */
+	unsigned long head; /* index of the next to pop */
+	unsigned long count;
+};
+
+static void bfs_ring_init(struct bfs_ring *q, unsigned long nitems)
+{
+	q->items = malloc(nitems * sizeof (struct bfs_item));
+	if (!q->items) { warn("insufficient memory"); abort(); }
+	q->nitems = nitems;
+	q->head = 0;
+	q->count = 0;
+}
+
+static void bfs_ring_push(struct bfs_ring *q, void *obj, struct uniqtype *t)
+{
+	if (q->count == q->nitems)
 	{
-		/* malloc a new node */
-		struct pair *p_new_pair = malloc(sizeof (struct pair));
-		if (!p_new_pair) { warn("insufficient memory"); abort(); }
-		/* initialize the new node with p's k/v */
-		memcpy(p_new_pair, &p, sizeof (struct pair));
-		/* tsearch will add it */
-		internal_treenode *inserted = tsearch(p_new_pair, rootp, compar);
-		assert(inserted->key == p_new_pair);
-		assert(treemap_get(rootp, key) == value);
+		/* Unwrap into a doubled arena. */
+		struct bfs_item *bigger = malloc(2 * q->nitems * sizeof (struct bfs_item));
+		if (!bigger) { warn("insufficient memory"); abort(); }
+		unsigned long first_part = q->nitems - q->head;
+		memcpy(bigger, q->items + q->head, first_part * sizeof (struct bfs_item));
+		memcpy(bigger + first_part, q->items, q->head * sizeof (struct bfs_item));
+		free(q->items);
+		q->items = bigger;
+		q->head = 0;
+		q->nitems *= 2;
 	}
+	q->items[(q->head + q->count++) & (q->nitems - 1)] = (struct bfs_item) { obj, t };
 }
 
-static void treemap_delete(void **rootp)
+static inline _Bool bfs_ring_pop(struct bfs_ring *q, struct bfs_item *out)
 {
-	tdestroy(*rootp, free);
+	if (q->count == 0) return 0;
+	*out = q->items[q->head];
+	q->head = (q->head + 1) & (q->nitems - 1);
+	--q->count;
+	return 1;
+}
+
+static void bfs_ring_destroy(struct bfs_ring *q)
+{
+	free(q->items);
+	q->items = NULL;
 }
 
 /* HACK: archdep */
 #define IS_PLAUSIBLE_POINTER(p) (!(p) || ((p) == (void*) -1) || (((uintptr_t) (p)) >= 4194304 && ((uintptr_t) (p)) < 0x800000000000ul))
 
+/* How a walker takes each adjacent object: it must check whether the
+ * object has been seen and, if not, queue it for a visit. */
+typedef void on_adjacent_fn(void *walker, void *from, void *obj, struct uniqtype *t);
 struct adj_list_ctxt
 {
-	node_rec **p_adj_u_head;
-	node_rec **p_adj_u_tail;
+	on_adjacent_fn *on_adjacent;
+	void *walker;
 	void *obj_start;
 	struct uniqtype *obj_t;
-	unsigned long start_offset;
-	struct uniqtype *t_at_offset;
 	follow_ptr_fn *follow_ptr;
 	void *fp_arg;
 };
-static void visit_one_subobject(int i, struct uniqtype *element_type, long memb_offset,
-	struct adj_list_ctxt *ctxt)
+static void visit_one_pointer(void **slot, struct uniqtype *ptr_t, void *arg)
 {
-	node_rec **p_adj_u_head = ctxt->p_adj_u_head;
-	node_rec **p_adj_u_tail = ctxt->p_adj_u_tail;
+	struct adj_list_ctxt *ctxt = arg;
 	void *obj_start = ctxt->obj_start;
 	struct uniqtype *obj_t = ctxt->obj_t;
-	unsigned long start_offset = ctxt->start_offset;
-	struct uniqtype *t_at_offset = ctxt->t_at_offset;
-	follow_ptr_fn *follow_ptr = ctxt->follow_ptr;
-	void *fp_arg = ctxt->fp_arg;
-	/* Is it a pointer? If so, add it to the adjacency list. */
-	if (UNIQTYPE_IS_POINTER_TYPE(element_type))
+	/* It's a pointer, so consider what it points to. */
+	struct uniqtype *pointed_to_static_t = UNIQTYPE_POINTEE_TYPE(ptr_t);
+	// get the address of the pointed-to object
+	void *pointed_to_object = *slot;
+	/* Check sanity of the pointer. We might be reading some union'd storage
+	 * that is currently holding a non-pointer. */
+	if (pointed_to_object && IS_PLAUSIBLE_POINTER(pointed_to_object))
 	{
-		struct uniqtype *pointed_to_static_t = UNIQTYPE_POINTEE_TYPE(element_type);
-		// get the address of the pointed-to object
-		void *pointed_to_object = *(void**)((uintptr_t) obj_start + start_offset + memb_offset);
-		/* Check sanity of the pointer. We might be reading some union'd storage
-		 * that is currently holding a non-pointer. */
-		node_rec *to_enqueue = NULL;
-		if (pointed_to_object && IS_PLAUSIBLE_POINTER(pointed_to_object))
-		{
-			/* make a node and put it in the adjacency list */
-			void *ptr = pointed_to_object;
-			struct uniqtype *t = pointed_to_static_t;
-			follow_ptr(&ptr, &t, fp_arg);
-			if (ptr)
-			{
-				to_enqueue = make_node(ptr, t);
-				__uniqtype_node_queue_push_tail(p_adj_u_head, p_adj_u_tail, to_enqueue);
-
-				DEBUG_GUARD(fprintf(debug_out, "\t%s_at_%p -> %s_at_%p;\n",
-					NAME_FOR_UNIQTYPE(obj_t), obj_start,
-					NAME_FOR_UNIQTYPE(to_enqueue->t), to_enqueue->obj));
-			}
-		}
-		else if (!pointed_to_object || pointed_to_object == (void*) -1)
-		{
-			/* null pointer */
-		}
-		else
-		{
-			fprintf(stderr, "Warning: insane pointer value %p found in field index %d in object %p, type %s\n",
-				pointed_to_object,
-				i,
-				(char*)((uintptr_t) obj_start + start_offset),
-				NAME_FOR_UNIQTYPE(t_at_offset)
-			);
-		}
-		if (to_enqueue && to_enqueue->obj) fprintf(stderr, "Found a pointed-to object at %p, statically of type %s, "
-			"added as %p of type %s\n",
-			pointed_to_object, NAME_FOR_UNIQTYPE(pointed_to_static_t),
-			to_enqueue->obj, NAME_FOR_UNIQTYPE(to_enqueue->t));
+		void *ptr = pointed_to_object;
+		struct uniqtype *t = pointed_to_static_t;
+		ctxt->follow_ptr(&ptr, &t, ctxt->fp_arg);
+		if (!ptr) return;
+		DEBUG_GUARD(fprintf(debug_out, "\t%s_at_%p -> %s_at_%p;\n",
+			NAME_FOR_UNIQTYPE(obj_t), obj_start,
+			NAME_FOR_UNIQTYPE(t), ptr));
+		bfs_debug_printf("From object at %p, type %s, considering adjacent object at %p, "
+			"statically of type %s, seen as type %s\n",
+			obj_start, NAME_FOR_UNIQTYPE(obj_t), ptr,
+			NAME_FOR_UNIQTYPE(pointed_to_static_t), NAME_FOR_UNIQTYPE(t));
+		ctxt->on_adjacent(ctxt->walker, obj_start, ptr, t);
+	}
+	else if (!pointed_to_object || pointed_to_object == (void*) -1)
+	{
+		/* null pointer */
 	}
-	else if (UNIQTYPE_IS_COMPOSITE_TYPE(element_type)) /* Else is it a thing with structure? If so, recurse. */
+	else
 	{
-		build_adjacency_list_recursive(
-			p_adj_u_head, p_adj_u_tail,
-			obj_start, obj_t,
-			start_offset + memb_offset, element_type,
-			follow_ptr, fp_arg
+		bfs_debug_printf("Warning: insane pointer value %p found at offset %ld in object %p, type %s\n",
+			pointed_to_object,
+			(long) ((uintptr_t) slot - (uintptr_t) obj_start),
+			obj_start,
+			NAME_FOR_UNIQTYPE(obj_t)
 		);
 	}
 }
-/* This function builds an adjacency list for the current node, by adding
- * *all* nodes, not just (despite the name) those pointed to by subobjects.
- * i.e. the top-level object is a zero-degree subobject. */
-static void build_adjacency_list_recursive(
-	node_rec **p_adj_u_head, node_rec **p_adj_u_tail, 
-	void *obj_start, struct uniqtype *obj_t, 
-	unsigned long start_offset, struct uniqtype *t_at_offset, 
+/* Hand the walker everything pointed to from anywhere within the object.
+ * Rather than descend through the subobject hierarchy each time, we
+ * iterate over the type's cached pointer map, which has already
+ * flattened it. */
+static void for_each_adjacent(on_adjacent_fn *on_adjacent, void *walker,
+	void *obj_start, struct uniqtype *obj_t,
 	follow_ptr_fn *follow_ptr, void *fp_arg)
 {
-	if (t_at_offset == pointer_to___uniqtype__void) return;
-
-	assert(!t_at_offset->make_precise);
-	
-	fprintf(stderr, "Descending through subobjects of object at %p, "
-		"currently at subobject offset %ld of type %s\n",
-		obj_start, start_offset, NAME_FOR_UNIQTYPE(t_at_offset));
-	
 	// If someone tries to walk_bfs from a function pointer, we will try to
 	// bootstrap the list from a queue consisting of a single object (the function)
 	// and no type. If so, the list is already complete (i.e. empty), so return
-	if (!t_at_offset) return;
-	if (!UNIQTYPE_HAS_SUBOBJECTS(t_at_offset)) return;
+	if (!obj_t) return;
+	if (obj_t == pointer_to___uniqtype__void) return;
+
+	assert(!obj_t->make_precise);
+	if (!UNIQTYPE_HAS_SUBOBJECTS(obj_t)) return;
+	/* We don't know how far an unbounded array extends. */
+	if (obj_t->pos_maxoff == UNIQTYPE_POS_MAXOFF_UNBOUNDED) return;
 
 	struct adj_list_ctxt ctxt = {
-		.p_adj_u_head = p_adj_u_head,
-		.p_adj_u_tail = p_adj_u_tail,
+		.on_adjacent = on_adjacent,
+		.walker = walker,
 		.obj_start = obj_start,
 		.obj_t = obj_t,
-		.start_offset = start_offset,
-		.t_at_offset = t_at_offset,
 		.follow_ptr = follow_ptr,
 		.fp_arg = fp_arg
 	};
-#define do_thing(_i, _t, _offs) visit_one_subobject((_i), (_t), (_offs), &ctxt)
-	UNIQTYPE_FOR_EACH_SUBOBJECT(t_at_offset, do_thing);
+	const struct uniqtype_ptrmap *map = __liballocs_get_ptrmap(obj_t);
+	__liballocs_ptrmap_for_each_in_range(map, obj_start,
+		obj_start, (char*) obj_start + map->size, visit_one_pointer, &ctxt);
 }
 
-static void process_bfs_queue_and_maps(
-	node_rec **p_q_head,
-	node_rec **p_q_tail,
-	void **p_colours_root,
-	void **p_distances_root,
-	void **p_predecessors_root,
+struct sequential_walker
+{
+	struct bfs_ring q;
+	struct visited_set seen;
+};
+static void sequential_on_adjacent(void *walker, void *from, void *obj, struct uniqtype *t)
+{
+	struct sequential_walker *w = walker;
+	/* Enqueue it only if it is white, i.e. we have not seen it. */
+	if (visited_set_insert(&w->seen, obj)) bfs_ring_push(&w->q, obj, t);
+}
+
+#define BFS_INITIAL_RING_SIZE 1024
+#define BFS_INITIAL_SET_SIZE 4096
+
+/* Walk the graph from the objects already in w's queue, all of which
+ * must already be in its visited set. */
+static void process_bfs_ring(struct sequential_walker *w,
 	follow_ptr_fn *follow_ptr, void *fp_arg,
 	on_blacken_fn *on_blacken, void *ob_arg)
 {
-	while (!__uniqtype_node_queue_empty(*p_q_head))
+	struct bfs_item u;
+	while (bfs_ring_pop(&w->q, &u))
 	{
-		node_rec *u = __uniqtype_node_queue_pop_head(p_q_head, p_q_tail);
-	
-		treemap_set(p_colours_root, u->obj, GREY);
-		
-		/* create the adjacency list for u, by flattening the subobject hierarchy */
-		node_rec *adj_u_head = NULL;
-		node_rec *adj_u_tail = NULL;
-		build_adjacency_list_recursive(&adj_u_head, &adj_u_tail, 
-			u->obj, u->t, 
-			/* start offset */ 0, u->t, 
-			follow_ptr, fp_arg
-		);
-		/* ^-- this starts at the top-level subobject, i.e. the object, so it builds
-		 * the complete adjacency list for this node. */
-
-		/* now that we have the adjacency list, enqueue any adjacent nodes that are white */
-		node_rec *v;
-		while ((v = __uniqtype_node_queue_pop_head(&adj_u_head, &adj_u_tail)) != NULL)
-		{
-			/* We initialise all nodes' colours to NULL a.k.a. WHITE */
-			uintptr_t colour = treemap_get(p_colours_root, v->obj);
-			fprintf(stderr, "From object at %p, type %s, considering adjacent object at %p, of type %s, colour %s\n",
-				u->obj, NAME_FOR_UNIQTYPE(u->t),
-				v->obj, NAME_FOR_UNIQTYPE(v->t), 
-				(colour == WHITE) ? "white" : (colour == GREY) ? "grey" : (colour == BLACK) ? "black" : "unknown"
-			);
-			if (colour == WHITE)
-			{
-				treemap_set(p_colours_root, v->obj, GREY);
-				treemap_set(p_distances_root, v->obj, treemap_get(p_distances_root, v->obj) + 1);
-				treemap_set(p_predecessors_root, v->obj, (uintptr_t) v->obj);
-				fprintf(stderr, "Enqueued object at %p, type %s\n", 
-					v->obj, NAME_FOR_UNIQTYPE(v->t));
-				__uniqtype_node_queue_push_tail(p_q_head, p_q_tail, v); // the queue takes our copy of v, which we're finished with
-			}
-			else v->free(v);
-		}
-
+		for_each_adjacent(sequential_on_adjacent, w, u.obj, u.t, follow_ptr, fp_arg);
 		/* blacken u, and call the function for it */
-		treemap_set(p_colours_root, u->obj, BLACK);
-		on_blacken(u->obj, u->t, ob_arg);
-		u->free(u);
-		
-		/* Note that it doesn't matter if u's address gets recycled, because 
-		 * we don't use it as a key in a map -- object addresses are keys. */
+		bfs_debug_printf("Blackening object at %p, type %s\n",
+			u.obj, NAME_FOR_UNIQTYPE(u.t));
+		on_blacken(u.obj, u.t, ob_arg);
 	}
 	DEBUG_GUARD(fflush(debug_out));
-	DEBUG_GUARD(fprintf(debug_out, "}\n"));
 }
 void __uniqtype_process_bfs_queue(
 	node_rec **p_q_head,
@@ -274,18 +284,19 @@ void __uniqtype_process_bfs_queue(
 	follow_ptr_fn *follow_ptr, void *fp_arg,
 	on_blacken_fn *on_blacken, void *ob_arg)
 {
-	void *colours_root = NULL; /* map void* -> node_colour */
-	void *distances_root = NULL; /* map void* -> int */
-	void *predecessors_root = NULL; /* map void* -> void* */
-	
-	process_bfs_queue_and_maps(p_q_head, p_q_tail, 
-		&colours_root, &distances_root, &predecessors_root,
-		follow_ptr, fp_arg,
-		on_blacken, ob_arg
-	);
-	treemap_delete(&colours_root);
-	treemap_delete(&distances_root);
-	treemap_delete(&predecessors_root);
+	struct sequential_walker w;
+	bfs_ring_init(&w.q, BFS_INITIAL_RING_SIZE);
+	visited_set_init(&w.seen, BFS_INITIAL_SET_SIZE);
+	/* Take the caller's nodes into our own queue, freeing them as we go. */
+	node_rec *n;
+	while ((n = __uniqtype_node_queue_pop_head(p_q_head, p_q_tail)) != NULL)
+	{
+		if (visited_set_insert(&w.seen, n->obj)) bfs_ring_push(&w.q, n->obj, n->t);
+		if (n->free) n->free(n);
+	}
+	process_bfs_ring(&w, follow_ptr, fp_arg, on_blacken, ob_arg);
+	bfs_ring_destroy(&w.q);
+	visited_set_destroy(&w.seen);
 }
 void __uniqtype_walk_bfs_from_object(
 	void *object, struct uniqtype *t,
@@ -294,7 +305,7 @@ void __uniqtype_walk_bfs_from_object(
 {
 	if (!object) return;
 	/* We are doing breadth-first search through the object graph rooted at object,
-	 * using object_ref_derefed_offsets[object_rep][object_form] to make an adjacency list
+	 * using each object's type's pointer map to make an adjacency list
 	 * out of the actual object graph.*/
 	 
 	/* init debug output */
@@ -304,30 +315,473 @@ void __uniqtype_walk_bfs_from_object(
 	}
 	DEBUG_GUARD(fprintf(debug_out, "digraph view_from_%p {\n", object));
 	
-	node_rec *q_head = NULL;
-	node_rec *q_tail = NULL;
-	
-	/* Make an initial node. Don't adjust the pointer. */
-	node_rec *to_enqueue = make_node(object, t);
-	__uniqtype_node_queue_push_tail(&q_head, &q_tail, to_enqueue);
-	
-	/* Sanity check: assert that our object's start is non-null and within 128MB of our pointer. */
-	assert(!to_enqueue || ((uintptr_t) to_enqueue->obj <= (uintptr_t) object
-						&& (uintptr_t) object - (uintptr_t)to_enqueue->obj < (1U<<27)));
-	
-	__uniqtype_process_bfs_queue(&q_head, &q_tail, follow_ptr, fp_arg, on_blacken, ob_arg);
+	struct sequential_walker w;
+	bfs_ring_init(&w.q, BFS_INITIAL_RING_SIZE);
+	visited_set_init(&w.seen, BFS_INITIAL_SET_SIZE);
+	/* Start from the object itself. Don't adjust the pointer. */
+	visited_set_insert(&w.seen, object);
+	bfs_ring_push(&w.q, object, t);
+	process_bfs_ring(&w, follow_ptr, fp_arg, on_blacken, ob_arg);
+	bfs_ring_destroy(&w.q);
+	visited_set_destroy(&w.seen);
 	
 	DEBUG_GUARD(fprintf(debug_out, "}\n"));
 }
 
-static node_rec *make_node(void *obj, struct uniqtype *t)
+/* Parallel walks. The visited set is split into shards by address hash,
+ * each a visited_set under its own spin lock, so that it can still grow
+ * while contention stays low. */
+#define BFS_SHARDS_LOG2 8
+struct visited_set_shard
+{
+	char lock;
+	struct visited_set set;
+} __attribute__((aligned(64)));
+struct shared_visited_set
+{
+	struct visited_set_shard shards[1u << BFS_SHARDS_LOG2];
+};
+
+static void shared_visited_set_init(struct shared_visited_set *s)
+{
+	for (unsigned i = 0; i < (1u << BFS_SHARDS_LOG2); ++i)
+	{
+		s->shards[i].lock = 0;
+		visited_set_init(&s->shards[i].set, BFS_INITIAL_SET_SIZE >> 4);
+	}
+}
+
+static _Bool shared_visited_set_insert(struct shared_visited_set *s, const void *obj)
+{
+	/* Use the hash's top bits, which visited_set doesn't. */
+	struct visited_set_shard *sh = &s->shards[((uintptr_t) obj * 0x9e3779b97f4a7c15ul)
+		>> (64 - BFS_SHARDS_LOG2)];
+	while (__atomic_test_and_set(&sh->lock, __ATOMIC_ACQUIRE))
+	{
+		while (__atomic_load_n(&sh->lock, __ATOMIC_RELAXED)) {}
+	}
+	_Bool ret = visited_set_insert(&sh->set, obj);
+	__atomic_clear(&sh->lock, __ATOMIC_RELEASE);
+	return ret;
+}
+
+static void shared_visited_set_destroy(struct shared_visited_set *s)
+{
+	for (unsigned i = 0; i < (1u << BFS_SHARDS_LOG2); ++i) visited_set_destroy(&s->shards[i].set);
+}
+
+/* Each worker has a work-stealing deque (after Chase and Lev, with the
+ * memory orderings of Le et al., PPoPP 2013). The owner pushes and pops
+ * at the bottom; idle workers steal from the top. The circular array
+ * doubles when full; arrays it replaces are kept until the walk ends,
+ * since a thief may still be reading one. */
+struct ws_array
+{
+	struct ws_array *retired; /* the array this one replaced */
+	long mask;
+	struct bfs_item items[];
+};
+struct ws_deque
+{
+	long top;
+	long bottom;
+	struct ws_array *array;
+};
+
+static struct ws_array *ws_array_new(long nitems, struct ws_array *retired)
+{
+	struct ws_array *a = malloc(offsetof(struct ws_array, items) + nitems * sizeof (struct bfs_item));
+	if (!a) { warn("insufficient memory"); abort(); }
+	a->retired = retired;
+	a->mask = nitems - 1;
+	return a;
+}
+static inline void ws_store_item(struct ws_array *a, long i, void *obj, struct uniqtype *t)
+{
+	struct bfs_item *it = &a->items[i & a->mask];
+	__atomic_store_n(&it->obj, obj, __ATOMIC_RELAXED);
+	__atomic_store_n(&it->t, t, __ATOMIC_RELAXED);
+}
+static inline struct bfs_item ws_load_item(struct ws_array *a, long i)
+{
+	struct bfs_item *it = &a->items[i & a->mask];
+	return (struct bfs_item) {
+		__atomic_load_n(&it->obj, __ATOMIC_RELAXED),
+		__atomic_load_n(&it->t, __ATOMIC_RELAXED)
+	};
+}
+
+static void ws_deque_init(struct ws_deque *d)
+{
+	d->top = d->bottom = 0;
+	d->array = ws_array_new(BFS_INITIAL_RING_SIZE, NULL);
+}
+
+static void ws_deque_push(struct ws_deque *d, void *obj, struct uniqtype *t)
+{
+	long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+	long top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	struct ws_array *a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+	if (b - top > a->mask)
+	{
+		struct ws_array *bigger = ws_array_new(2 * (a->mask + 1), a);
+		for (long i = top; i < b; ++i)
+		{
+			struct bfs_item it = ws_load_item(a, i);
+			ws_store_item(bigger, i, it.obj, it.t);
+		}
+		__atomic_store_n(&d->array, bigger, __ATOMIC_RELEASE);
+		a = bigger;
+	}
+	ws_store_item(a, b, obj, t);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+}
+
+static _Bool ws_deque_pop(struct ws_deque *d, struct bfs_item *out)
+{
+	long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+	struct ws_array *a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+	__atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	long t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+	if (t > b)
+	{
+		/* empty */
+		__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	*out = ws_load_item(a, b);
+	if (t == b)
+	{
+		/* This is the last item, so we race any thieves for it. */
+		_Bool won = __atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+			__ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+		__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+		return won;
+	}
+	return 1;
+}
+
+static _Bool ws_deque_steal(struct ws_deque *d, struct bfs_item *out)
+{
+	long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	long b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+	if (t >= b) return 0;
+	struct ws_array *a = __atomic_load_n(&d->array, __ATOMIC_ACQUIRE);
+	struct bfs_item it = ws_load_item(a, t);
+	if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+			__ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) return 0;
+	*out = it;
+	return 1;
+}
+
+static void ws_deque_destroy(struct ws_deque *d)
+{
+	struct ws_array *a = d->array;
+	while (a)
+	{
+		struct ws_array *retired = a->retired;
+		free(a);
+		a = retired;
+	}
+	d->array = NULL;
+}
+
+/* In level-synchronous mode, each worker collects the next frontier's
+ * objects that it discovered. */
+struct bfs_frontier
+{
+	struct bfs_item *items;
+	unsigned long len;
+	unsigned long cap;
+};
+static void frontier_push(struct bfs_frontier *f, void *obj, struct uniqtype *t)
+{
+	if (f->len == f->cap)
+	{
+		f->cap = f->cap ? 2 * f->cap : BFS_INITIAL_RING_SIZE;
+		f->items = realloc(f->items, f->cap * sizeof (struct bfs_item));
+		if (!f->items) { warn("insufficient memory"); abort(); }
+	}
+	f->items[f->len++] = (struct bfs_item) { obj, t };
+}
+
+#define BFS_MAX_THREADS 256
+/* Frontier items are handed out in chunks of this many. */
+#define BFS_LEVEL_CHUNK 64
+
+struct parallel_walker;
+struct bfs_worker
+{
+	struct parallel_walker *pw;
+	unsigned index;
+	unsigned rng;
+	struct ws_deque deque;
+	struct bfs_frontier next;
+#ifndef NO_PTHREADS
+	pthread_t thread;
+#endif
+} __attribute__((aligned(64)));
+
+struct parallel_walker
+{
+	unsigned nthreads;
+	_Bool serialize_callbacks;
+	struct bfs_worker *workers;
+	/* The follow_ptr we actually call, which takes the lock if need be. */
+	follow_ptr_fn *follow_ptr;
+	void *fp_arg;
+	follow_ptr_fn *user_follow_ptr;
+	void *user_fp_arg;
+	on_blacken_fn *on_blacken;
+	void *ob_arg;
+	on_discover_fn *on_discover;
+	void *od_arg;
+	/* Work-stealing mode: objects discovered but not yet finished with. */
+	unsigned long pending __attribute__((aligned(64)));
+	/* Level-synchronous mode. */
+	struct bfs_item *frontier;
+	unsigned long frontier_len;
+	unsigned long frontier_next __attribute__((aligned(64)));
+	unsigned long level;
+	_Bool done;
+#ifndef NO_PTHREADS
+	pthread_barrier_t barrier;
+	pthread_mutex_t callback_lock;
+#endif
+	struct shared_visited_set seen;
+};
+
+#ifndef NO_PTHREADS
+#define PARALLEL_CALLBACK(pw, call) do { \
+	if ((pw)->serialize_callbacks) { \
+		pthread_mutex_lock(&(pw)->callback_lock); \
+		call; \
+		pthread_mutex_unlock(&(pw)->callback_lock); \
+	} else { call; } } while (0)
+#else
+#define PARALLEL_CALLBACK(pw, call) do { call; } while (0)
+#endif
+
+static void serialized_follow_ptr(void **p_obj, struct uniqtype **p_t, void *arg)
+{
+	struct parallel_walker *pw = arg;
+	PARALLEL_CALLBACK(pw, pw->user_follow_ptr(p_obj, p_t, pw->user_fp_arg));
+}
+
+static void pool_barrier(struct parallel_walker *pw)
 {
-	node_rec *node = calloc(1, sizeof (node_rec));
-	if (!node) { warn("insufficient memory"); abort(); }
-	node->obj = obj;
-	node->t = t;
-	node->free = free;
-	return node;
+#ifndef NO_PTHREADS
+	if (pw->nthreads > 1) pthread_barrier_wait(&pw->barrier);
+#endif
+}
+
+static void parallel_visit(struct bfs_worker *w, struct bfs_item u, on_adjacent_fn *on_adjacent)
+{
+	struct parallel_walker *pw = w->pw;
+	for_each_adjacent(on_adjacent, w, u.obj, u.t, pw->follow_ptr, pw->fp_arg);
+	PARALLEL_CALLBACK(pw, pw->on_blacken(u.obj, u.t, pw->ob_arg));
+}
+
+static void stealing_on_adjacent(void *walker, void *from, void *obj, struct uniqtype *t)
+{
+	struct bfs_worker *w = walker;
+	if (!shared_visited_set_insert(&w->pw->seen, obj)) return;
+	/* Count it before anyone can take it, so that pending never
+	 * drops to zero while there is work in a deque. */
+	__atomic_fetch_add(&w->pw->pending, 1, __ATOMIC_RELAXED);
+	ws_deque_push(&w->deque, obj, t);
+}
+
+static _Bool steal_some(struct bfs_worker *w, struct bfs_item *out)
+{
+	struct parallel_walker *pw = w->pw;
+	for (unsigned n = 1; n < pw->nthreads; ++n)
+	{
+		/* xorshift */
+		w->rng ^= w->rng << 13;
+		w->rng ^= w->rng >> 17;
+		w->rng ^= w->rng << 5;
+		unsigned victim = w->rng % pw->nthreads;
+		if (victim == w->index) continue;
+		if (ws_deque_steal(&pw->workers[victim].deque, out)) return 1;
+	}
+	return 0;
+}
+
+static void run_stealing(struct bfs_worker *w)
+{
+	struct parallel_walker *pw = w->pw;
+	struct bfs_item u;
+	for (;;)
+	{
+		if (ws_deque_pop(&w->deque, &u) || steal_some(w, &u))
+		{
+			parallel_visit(w, u, stealing_on_adjacent);
+			__atomic_fetch_sub(&pw->pending, 1, __ATOMIC_RELEASE);
+		}
+		else if (__atomic_load_n(&pw->pending, __ATOMIC_ACQUIRE) == 0) return;
+		else sched_yield();
+	}
+}
+
+static void level_on_adjacent(void *walker, void *from, void *obj, struct uniqtype *t)
+{
+	struct bfs_worker *w = walker;
+	struct parallel_walker *pw = w->pw;
+	/* Whoever inserts it first is its predecessor. */
+	if (!shared_visited_set_insert(&pw->seen, obj)) return;
+	frontier_push(&w->next, obj, t);
+	if (pw->on_discover) PARALLEL_CALLBACK(pw,
+		pw->on_discover(obj, t, from, pw->level + 1, pw->od_arg));
+}
+
+/* Called by one thread between levels. */
+static void advance_frontier(struct parallel_walker *pw)
+{
+	unsigned long len = 0;
+	for (unsigned i = 0; i < pw->nthreads; ++i) len += pw->workers[i].next.len;
+	free(pw->frontier);
+	pw->frontier = malloc((len ? len : 1) * sizeof (struct bfs_item));
+	if (!pw->frontier) { warn("insufficient memory"); abort(); }
+	unsigned long pos = 0;
+	for (unsigned i = 0; i < pw->nthreads; ++i)
+	{
+		struct bfs_frontier *f = &pw->workers[i].next;
+		memcpy(pw->frontier + pos, f->items, f->len * sizeof (struct bfs_item));
+		pos += f->len;
+		f->len = 0;
+	}
+	pw->frontier_len = len;
+	pw->frontier_next = 0;
+	++pw->level;
+	pw->done = (len == 0);
+}
+
+static void run_levels(struct bfs_worker *w)
+{
+	struct parallel_walker *pw = w->pw;
+	for (;;)
+	{
+		pool_barrier(pw); /* the frontier is ready */
+		if (pw->done) return;
+		unsigned long i;
+		while ((i = __atomic_fetch_add(&pw->frontier_next, BFS_LEVEL_CHUNK,
+				__ATOMIC_RELAXED)) < pw->frontier_len)
+		{
+			unsigned long end = (i + BFS_LEVEL_CHUNK < pw->frontier_len)
+				? i + BFS_LEVEL_CHUNK : pw->frontier_len;
+			for (; i < end; ++i) parallel_visit(w, pw->frontier[i], level_on_adjacent);
+		}
+		pool_barrier(pw); /* everyone has finished this level */
+		if (w->index == 0) advance_frontier(pw);
+	}
+}
+
+static void *run_worker(void *arg)
+{
+	struct bfs_worker *w = arg;
+	if (w->pw->on_discover) run_levels(w);
+	else run_stealing(w);
+	return NULL;
+}
+
+static unsigned default_bfs_nthreads(void)
+{
+	const char *nthreads_str = getenv("LIBALLOCS_BFS_THREADS");
+	long n = nthreads_str ? atol(nthreads_str) : sysconf(_SC_NPROCESSORS_ONLN);
+	return (n < 1) ? 1 : n;
+}
+
+void __uniqtype_walk_bfs_parallel(
+	void *object, struct uniqtype *t,
+	follow_ptr_fn *follow_ptr, void *fp_arg,
+	on_blacken_fn *on_blacken, void *ob_arg,
+	const struct __uniqtype_bfs_opts *opts)
+{
+	if (!object) return;
+	unsigned nthreads = (opts && opts->nthreads) ? opts->nthreads : default_bfs_nthreads();
+	if (nthreads > BFS_MAX_THREADS) nthreads = BFS_MAX_THREADS;
+#ifdef NO_PTHREADS
+	nthreads = 1;
+#endif
+	struct parallel_walker *pw;
+	struct bfs_worker *workers;
+	/* Both are cache-line-aligned, to keep the workers from false sharing. */
+	if (0 != posix_memalign((void **) &pw, 64, sizeof (struct parallel_walker))
+			|| 0 != posix_memalign((void **) &workers, 64, nthreads * sizeof (struct bfs_worker)))
+	{ warn("insufficient memory"); abort(); }
+	memset(pw, 0, sizeof (struct parallel_walker));
+	memset(workers, 0, nthreads * sizeof (struct bfs_worker));
+	pw->nthreads = nthreads;
+	pw->serialize_callbacks = nthreads > 1
+		&& !(opts && (opts->flags & UNIQTYPE_BFS_THREADSAFE_CALLBACKS));
+	pw->workers = workers;
+	pw->user_follow_ptr = follow_ptr;
+	pw->user_fp_arg = fp_arg;
+	/* The default follow_ptr does nothing, so needs no lock. */
+	_Bool lock_follow_ptr = pw->serialize_callbacks && follow_ptr != __uniqtype_default_follow_ptr;
+	pw->follow_ptr = lock_follow_ptr ? serialized_follow_ptr : follow_ptr;
+	pw->fp_arg = lock_follow_ptr ? pw : fp_arg;
+	pw->on_blacken = on_blacken;
+	pw->ob_arg = ob_arg;
+	pw->on_discover = opts ? opts->on_discover : NULL;
+	pw->od_arg = opts ? opts->od_arg : NULL;
+	shared_visited_set_init(&pw->seen);
+#ifndef NO_PTHREADS
+	pthread_mutex_init(&pw->callback_lock, NULL);
+	if (nthreads > 1) pthread_barrier_init(&pw->barrier, NULL, nthreads);
+#endif
+	for (unsigned i = 0; i < nthreads; ++i)
+	{
+		workers[i].pw = pw;
+		workers[i].index = i;
+		workers[i].rng = 2654435761u * (i + 1);
+		ws_deque_init(&workers[i].deque);
+	}
+
+	/* Start from the object itself. Don't adjust the pointer. */
+	shared_visited_set_insert(&pw->seen, object);
+	if (pw->on_discover)
+	{
+		pw->frontier = malloc(sizeof (struct bfs_item));
+		if (!pw->frontier) { warn("insufficient memory"); abort(); }
+		pw->frontier[0] = (struct bfs_item) { object, t };
+		pw->frontier_len = 1;
+		pw->on_discover(object, t, NULL, 0, pw->od_arg);
+	}
+	else
+	{
+		pw->pending = 1;
+		ws_deque_push(&workers[0].deque, object, t);
+	}
+
+	/* The calling thread is worker 0. */
+#ifndef NO_PTHREADS
+	for (unsigned i = 1; i < nthreads; ++i)
+	{
+		if (0 != pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]))
+		{ warn("could not create BFS worker thread"); abort(); }
+	}
+#endif
+	run_worker(&workers[0]);
+#ifndef NO_PTHREADS
+	for (unsigned i = 1; i < nthreads; ++i) pthread_join(workers[i].thread, NULL);
+	if (nthreads > 1) pthread_barrier_destroy(&pw->barrier);
+	pthread_mutex_destroy(&pw->callback_lock);
+#endif
+
+	for (unsigned i = 0; i < nthreads; ++i)
+	{
+		ws_deque_destroy(&workers[i].deque);
+		free(workers[i].next.items);
+	}
+	free(pw->frontier);
+	shared_visited_set_destroy(&pw->seen);
+	free(workers);
+	free(pw);
 }
 
 void __uniqtype_default_follow_ptr(void **p_obj, struct uniqtype **p_t, void *arg)
@@ -0,0 +1,388 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <link.h>
+#include <dlfcn.h>
+#include <elf.h>
+#ifndef NO_PTHREADS
+#include <pthread.h>
+#endif
+#include "librunt.h"
+#include "relf.h"
+#include "liballocs.h"
+#include "liballocs_private.h"
+#include "dlbind.h"
+
+/* Uniqtypes made at run time (arrays of a given length, pointers,
+ * synthetic unions, subprograms) must be unique like any other, so
+ * before making one we have to know whether it already exists. We used
+ * to find out by formatting its symbol name and looking that up, first
+ * in the libdlbind object and then with dlsym; and each new type was
+ * bound into the libdlbind object there and then.
+ *
+ * Instead we intern them here, keyed by structure: the kind, a length
+ * (array length, member or argument count) and the related uniqtypes.
+ * The table holds both the types we made and the static ones of those
+ * kinds, which we gather from each loaded object's dynsym when first
+ * needed. So a type absent from the table does not exist anywhere, and
+ * neither lookups nor creation need a name. Names are made only when we
+ * bind new types into the libdlbind object, which we do in batches. */
+
+/* The table is an insert-only open-addressing table of uniqtype pointers,
+ * probed without locks. Inserts happen under create_lock; growing or
+ * purging the table publishes a new one, and old tables are not freed
+ * since readers may still be in them. */
+struct intern_table
+{
+	unsigned long nslots; /* a power of two */
+	unsigned long nused;
+	struct uniqtype *slots[];
+};
+static struct intern_table *intern_table;
+
+#ifndef NO_PTHREADS
+static pthread_mutex_t create_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+#define LOCK() pthread_mutex_lock(&create_lock)
+#define UNLOCK() pthread_mutex_unlock(&create_lock)
+#else
+#define LOCK() do {} while (0)
+#define UNLOCK() do {} while (0)
+#endif
+
+static inline uintptr_t hash_mix(uintptr_t h, uintptr_t v)
+{
+	h ^= v + 0x9e3779b97f4a7c15ul + (h << 6) + (h >> 2);
+	return h;
+}
+
+static struct uniqtype *related_type(struct uniqtype *t, unsigned kind, unsigned i)
+{
+	return (kind == COMPOSITE) ? t->related[i].un.memb.ptr : t->related[i].un.t.ptr;
+}
+
+/* How many related types take part in a key. */
+static unsigned key_nrel(unsigned kind, unsigned long n)
+{
+	switch (kind)
+	{
+		case ARRAY: return 1;
+		case ADDRESS: return 1;
+		case COMPOSITE: return n;
+		case SUBPROGRAM: return 1 + n;
+		default: abort();
+	}
+}
+
+static uintptr_t hash_key(const struct uniqtype_intern_key *k)
+{
+	uintptr_t h = hash_mix(k->kind, k->n);
+	for (unsigned i = 0; i < key_nrel(k->kind, k->n); ++i) h = hash_mix(h, (uintptr_t) k->rel[i]);
+	return h;
+}
+
+/* The key a table entry would have, or 0 if it's not internable. */
+static _Bool key_of(struct uniqtype *t, unsigned *out_kind, unsigned long *out_n)
+{
+	if (UNIQTYPE_IS_ARRAY_TYPE(t))
+	{
+		*out_kind = ARRAY;
+		*out_n = (unsigned) UNIQTYPE_ARRAY_LENGTH(t);
+		return 1;
+	}
+	switch (UNIQTYPE_KIND(t))
+	{
+		case ADDRESS:
+			*out_kind = ADDRESS;
+			*out_n = 0;
+			return 1;
+		case SUBPROGRAM:
+			*out_kind = SUBPROGRAM;
+			*out_n = t->un.subprogram.narg;
+			return 1;
+		case COMPOSITE:
+			/* Only synthetic unions are interned: all members at offset zero. */
+			for (unsigned i = 0; i < UNIQTYPE_COMPOSITE_MEMBER_COUNT(t); ++i)
+			{
+				if (t->related[i].un.memb.off != 0) return 0;
+			}
+			*out_kind = COMPOSITE;
+			*out_n = UNIQTYPE_COMPOSITE_MEMBER_COUNT(t);
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+static uintptr_t hash_uniqtype(struct uniqtype *t)
+{
+	unsigned kind;
+	unsigned long n;
+	if (!key_of(t, &kind, &n)) abort();
+	uintptr_t h = hash_mix(kind, n);
+	for (unsigned i = 0; i < key_nrel(kind, n); ++i) h = hash_mix(h, (uintptr_t) related_type(t, kind, i));
+	return h;
+}
+
+static _Bool matches(struct uniqtype *t, const struct uniqtype_intern_key *k)
+{
+	unsigned kind;
+	unsigned long n;
+	if (!key_of(t, &kind, &n) || kind != k->kind || n != k->n) return 0;
+	for (unsigned i = 0; i < key_nrel(kind, n); ++i)
+	{
+		if (related_type(t, kind, i) != k->rel[i]) return 0;
+	}
+	return 1;
+}
+
+struct uniqtype *__liballocs_intern_lookup(const struct uniqtype_intern_key *k)
+{
+	struct intern_table *table = __atomic_load_n(&intern_table, __ATOMIC_ACQUIRE);
+	if (!table) return NULL;
+	for (unsigned long i = hash_key(k), n = 0; n < table->nslots; ++i, ++n)
+	{
+		struct uniqtype *t = __atomic_load_n(&table->slots[i & (table->nslots - 1)],
+			__ATOMIC_ACQUIRE);
+		if (!t) return NULL;
+		if (matches(t, k)) return t;
+	}
+	return NULL;
+}
+
+static struct intern_table *new_table(unsigned long nslots)
+{
+	struct intern_table *table = __private_malloc(offsetof(struct intern_table, slots)
+		+ nslots * sizeof (struct uniqtype *));
+	if (!table) abort();
+	table->nslots = nslots;
+	table->nused = 0;
+	memset(table->slots, 0, nslots * sizeof (struct uniqtype *));
+	return table;
+}
+
+/* Caller holds create_lock and has checked t is not already present. */
+static void table_insert_nogrow(struct intern_table *table, struct uniqtype *t)
+{
+	for (unsigned long i = hash_uniqtype(t); ; ++i)
+	{
+		struct uniqtype **slot = &table->slots[i & (table->nslots - 1)];
+		if (!*slot)
+		{
+			__atomic_store_n(slot, t, __ATOMIC_RELEASE);
+			++table->nused;
+			return;
+		}
+	}
+}
+
+/* Rebuild the table at a size fit for nextra more entries. */
+static void republish(unsigned long nextra)
+{
+	struct intern_table *old = intern_table;
+	unsigned long nslots = old ? old->nslots : 1024;
+	while (2 * ((old ? old->nused : 0) + nextra) > nslots) nslots *= 2;
+	struct intern_table *table = new_table(nslots);
+	if (old) for (unsigned long i = 0; i < old->nslots; ++i)
+	{
+		if (old->slots[i]) table_insert_nogrow(table, old->slots[i]);
+	}
+	__atomic_store_n(&intern_table, table, __ATOMIC_RELEASE);
+}
+
+static void table_insert(struct uniqtype *t)
+{
+	if (!intern_table || 2 * (intern_table->nused + 1) > intern_table->nslots) republish(1);
+	table_insert_nogrow(intern_table, t);
+}
+
+/* Gathering static types. We scan each object once, in link map order
+ * (which is the order dlsym would search them), so for duplicates the
+ * first definition wins. */
+static struct link_map *last_scanned;
+static const char *internable_prefixes[] = {
+	"__uniqtype____ARR", "__uniqtype____PTR_", "__uniqtype____SYNTHUNION_",
+	"__uniqtype____FUN_FROM_"
+};
+
+static void scan_object(struct link_map *l)
+{
+	if ((void*) l == __liballocs_rt_uniqtypes_obj) return; /* all ours anyway */
+	if ((intptr_t) l->l_addr < 0 || !l->l_ld) return; /* HACK x86-64 vdso bug */
+	ElfW(Dyn) *dynsym_ent = dynamic_lookup(l->l_ld, DT_SYMTAB);
+	ElfW(Dyn) *dynstr_ent = dynamic_lookup(l->l_ld, DT_STRTAB);
+	if (!dynsym_ent || !dynstr_ent) return;
+	ElfW(Sym) *dynsym = (ElfW(Sym) *) dynsym_ent->d_un.d_ptr;
+	const char *dynstr = (const char *) dynstr_ent->d_un.d_ptr;
+	if ((intptr_t) dynsym < 0 || (intptr_t) dynstr < 0) return; /* HACK x86-64 vdso bug */
+	ElfW(Sym) *dynsym_end = dynsym + dynamic_symbol_count(l->l_ld, l);
+	for (ElfW(Sym) *s = dynsym; s != dynsym_end; ++s)
+	{
+		if (s->st_shndx == SHN_UNDEF || ELF64_ST_TYPE(s->st_info) != STT_OBJECT) continue;
+		const char *name = dynstr + s->st_name;
+		if (0 != strncmp(name, "__uniqtype__", sizeof "__uniqtype__" - 1)) continue;
+		_Bool internable = 0;
+		for (unsigned i = 0; i < sizeof internable_prefixes / sizeof internable_prefixes[0]; ++i)
+		{
+			if (0 == strncmp(name, internable_prefixes[i], strlen(internable_prefixes[i])))
+			{ internable = 1; break; }
+		}
+		if (!internable) continue;
+		struct uniqtype *t = (struct uniqtype *) (l->l_addr + s->st_value);
+		unsigned kind;
+		unsigned long n;
+		if (!key_of(t, &kind, &n) || key_nrel(kind, n) == 0) continue;
+		/* Make a key out of it, to see whether we have it already. */
+		struct uniqtype *rel[key_nrel(kind, n)];
+		for (unsigned i = 0; i < key_nrel(kind, n); ++i) rel[i] = related_type(t, kind, i);
+		struct uniqtype_intern_key k = { .kind = kind, .n = n, .rel = rel };
+		if (!__liballocs_intern_lookup(&k)) table_insert(t);
+	}
+}
+
+static void scan_new_objects(void)
+{
+	struct link_map *l = last_scanned ? last_scanned->l_next : find_r_debug()->r_map;
+	for (; l; l = l->l_next)
+	{
+		scan_object(l);
+		last_scanned = l;
+	}
+}
+
+/* All the types we made, of which those from npublished onwards have
+ * not yet been bound into the libdlbind object. */
+struct created_type
+{
+	struct uniqtype *t;
+	size_t sz;
+};
+static struct created_type *created;
+static unsigned long ncreated;
+static unsigned long ncreated_alloc;
+static unsigned long npublished;
+
+static unsigned publish_batch_size(void)
+{
+	static int size = -1;
+	if (size == -1)
+	{
+		const char *size_str = getenv("LIBALLOCS_RT_UNIQTYPES_BATCH");
+		size = size_str ? atoi(size_str) : 256;
+		if (size < 1) size = 1;
+	}
+	return size;
+}
+
+/* Reproduce the symbol name we have always given to such a type. */
+static int format_rt_uniqtype_name(struct uniqtype *t, char *buf, size_t bufsz)
+{
+	unsigned kind;
+	unsigned long n;
+	if (!key_of(t, &kind, &n)) return -1;
+	switch (kind)
+	{
+		case ARRAY:
+			if (n == UNIQTYPE_ARRAY_LENGTH_UNBOUNDED) return snprintf(buf, bufsz,
+				"__uniqtype____ARR_%s", UNIQTYPE_NAME(related_type(t, kind, 0)));
+			return snprintf(buf, bufsz, "__uniqtype____ARR%d_%s",
+				(int) n, UNIQTYPE_NAME(related_type(t, kind, 0)));
+		case ADDRESS:
+			return snprintf(buf, bufsz, "__uniqtype____PTR_%s",
+				UNIQTYPE_NAME(related_type(t, kind, 0)));
+		case COMPOSITE:
+		{
+			int pos = snprintf(buf, bufsz, "__uniqtype____SYNTHUNION_");
+			for (unsigned i = 0; i < n && pos < bufsz; ++i)
+			{
+				pos += snprintf(buf + pos, bufsz - pos, "%s",
+					NAME_FOR_UNIQTYPE(related_type(t, kind, i)));
+			}
+			return pos;
+		}
+		case SUBPROGRAM:
+		{
+			int pos = snprintf(buf, bufsz, "__uniqtype____FUN_FROM_");
+			for (unsigned i = 0; i < n && pos < bufsz; ++i)
+			{
+				pos += snprintf(buf + pos, bufsz - pos, "__ARG%d_%s",
+					i, UNIQTYPE_NAME(related_type(t, kind, 1 + i)));
+			}
+			if (pos < bufsz) pos += snprintf(buf + pos, bufsz - pos, "__FUN_TO_%s",
+				UNIQTYPE_NAME(related_type(t, kind, 0)));
+			return pos;
+		}
+		default:
+			return -1;
+	}
+}
+
+void __liballocs_publish_rt_uniqtypes(void)
+{
+	LOCK();
+	for (; npublished < ncreated; ++npublished)
+	{
+		struct created_type *c = &created[npublished];
+		char name[4096];
+		int len = format_rt_uniqtype_name(c->t, name, sizeof name);
+		/* Too long a name would be truncated, and might then clash, so
+		 * such types stay unnamed. They are still interned. */
+		if (len < 0 || len >= sizeof name) continue;
+		void *reloaded = dlbind(__liballocs_rt_uniqtypes_obj, name,
+			c->t, c->sz, STT_OBJECT);
+		assert(reloaded);
+	}
+	UNLOCK();
+}
+
+struct uniqtype *__liballocs_intern_get_or_create(const struct uniqtype_intern_key *k,
+	size_t sz, void (*init)(struct uniqtype *t, void *arg), void *arg)
+{
+	struct uniqtype *found = __liballocs_intern_lookup(k);
+	if (found) return found;
+	LOCK();
+	/* Someone may have made it meanwhile, or it may be a static type
+	 * from an object we haven't scanned yet. */
+	found = __liballocs_intern_lookup(k);
+	if (!found)
+	{
+		scan_new_objects();
+		found = __liballocs_intern_lookup(k);
+	}
+	if (!found)
+	{
+		found = dlalloc(__liballocs_rt_uniqtypes_obj, sz, SHF_WRITE);
+		if (!found) abort();
+		init(found, arg);
+		assert(matches(found, k));
+		table_insert(found);
+		if (ncreated == ncreated_alloc)
+		{
+			ncreated_alloc = ncreated_alloc ? 2 * ncreated_alloc : 64;
+			created = __private_realloc(created, ncreated_alloc * sizeof (struct created_type));
+			if (!created) abort();
+		}
+		created[ncreated++] = (struct created_type) { found, sz };
+		if (ncreated - npublished >= publish_batch_size()) __liballocs_publish_rt_uniqtypes();
+	}
+	UNLOCK();
+	return found;
+}
+
+/* An object has gone away, and any static types we gathered from it
+ * with it. Forget all static types, keeping only those we made, and
+ * rescan from scratch next time. */
+void __liballocs_intern_notify_unload(void)
+{
+	LOCK();
+	if (intern_table)
+	{
+		struct intern_table *emptied = new_table(intern_table->nslots);
+		__atomic_store_n(&intern_table, emptied, __ATOMIC_RELEASE);
+		for (unsigned long i = 0; i < ncreated; ++i) table_insert(created[i].t);
+	}
+	last_scanned = NULL;
+	UNLOCK();
+}
@@ -0,0 +1,234 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include "liballocs.h"
+#include "liballocs_private.h"
+#include "uniqtype-ptrmap.h"
+
+/* Arrays whose flattened entries would number more than this are
+ * represented as a run instead. */
+#define PTRMAP_MAX_FLAT_ENTRIES 64
+
+/* The cache maps uniqtype addresses to their pointer maps. It is an
+ * insert-only open-addressing table of map pointers, each of which
+ * records its uniqtype, so a slot is published with one CAS. When it
+ * fills up we copy it into a bigger table. An insert racing with the
+ * copy may be lost, in which case the map is simply computed again;
+ * old tables and lost maps are never freed, since readers may still
+ * be looking at them. */
+struct ptrmap_table
+{
+	unsigned long nslots; /* a power of two */
+	unsigned long nused;
+	const struct uniqtype_ptrmap *slots[];
+};
+static struct ptrmap_table *ptrmap_table;
+
+static unsigned long hash_uniqtype(struct uniqtype *t)
+{
+	uintptr_t h = (uintptr_t) t >> 3;
+	return h ^ (h >> 17);
+}
+
+static const struct uniqtype_ptrmap *table_lookup(struct ptrmap_table *table, struct uniqtype *t)
+{
+	if (!table) return NULL;
+	for (unsigned long i = hash_uniqtype(t), n = 0; n < table->nslots; ++i, ++n)
+	{
+		const struct uniqtype_ptrmap *m = __atomic_load_n(
+			&table->slots[i & (table->nslots - 1)], __ATOMIC_ACQUIRE);
+		if (!m) return NULL;
+		if (m->t == t) return m;
+	}
+	return NULL;
+}
+
+/* Returns the map now in the table for m's type, which is m unless
+ * another thread got there first. */
+static const struct uniqtype_ptrmap *table_insert(struct ptrmap_table *table,
+	const struct uniqtype_ptrmap *m)
+{
+	for (unsigned long i = hash_uniqtype(m->t), n = 0; n < table->nslots; ++i, ++n)
+	{
+		const struct uniqtype_ptrmap **slot = &table->slots[i & (table->nslots - 1)];
+		const struct uniqtype_ptrmap *expected = NULL;
+		if (__atomic_compare_exchange_n(slot, &expected, m, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			__atomic_fetch_add(&table->nused, 1, __ATOMIC_RELAXED);
+			return m;
+		}
+		if (expected->t == m->t) return expected;
+	}
+	return m; /* full; the caller will grow the table */
+}
+
+static struct ptrmap_table *new_table(unsigned long nslots)
+{
+	struct ptrmap_table *table = __private_malloc(offsetof(struct ptrmap_table, slots)
+		+ nslots * sizeof (const struct uniqtype_ptrmap *));
+	if (!table) abort();
+	table->nslots = nslots;
+	table->nused = 0;
+	memset(table->slots, 0, nslots * sizeof (const struct uniqtype_ptrmap *));
+	return table;
+}
+
+static const struct uniqtype_ptrmap *publish(const struct uniqtype_ptrmap *m)
+{
+	struct ptrmap_table *table = __atomic_load_n(&ptrmap_table, __ATOMIC_ACQUIRE);
+	/* If the CAS fails, someone else grew the table or an unload emptied it,
+	 * and the failed CAS has reloaded it for us (maybe as NULL); try again. */
+	while (!table || 2 * (__atomic_load_n(&table->nused, __ATOMIC_RELAXED) + 1) > table->nslots)
+	{
+		struct ptrmap_table *bigger = new_table(table ? 2 * table->nslots : 256);
+		if (table) for (unsigned long i = 0; i < table->nslots; ++i)
+		{
+			const struct uniqtype_ptrmap *old = __atomic_load_n(&table->slots[i], __ATOMIC_ACQUIRE);
+			if (old) table_insert(bigger, old);
+		}
+		if (__atomic_compare_exchange_n(&ptrmap_table, &table, bigger, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) table = bigger;
+		else __private_free(bigger);
+	}
+	return table_insert(table, m);
+}
+
+/* A growable list of entries, from which we make the finished map. */
+struct ptrmap_builder
+{
+	unsigned nentries;
+	unsigned nalloc;
+	struct uniqtype_ptrmap_entry *entries;
+};
+static void builder_add(struct ptrmap_builder *b, struct uniqtype_ptrmap_entry e)
+{
+	if (b->nentries == b->nalloc)
+	{
+		b->nalloc = b->nalloc ? 2 * b->nalloc : 8;
+		b->entries = __private_realloc(b->entries, b->nalloc * sizeof (struct uniqtype_ptrmap_entry));
+		if (!b->entries) abort();
+	}
+	b->entries[b->nentries++] = e;
+}
+static void builder_add_shifted(struct ptrmap_builder *b, const struct uniqtype_ptrmap *m,
+	unsigned long offset)
+{
+	for (unsigned i = 0; i < m->nentries; ++i)
+	{
+		struct uniqtype_ptrmap_entry e = m->entries[i];
+		e.offset += offset;
+		builder_add(b, e);
+	}
+}
+
+static int compare_entry_offset(const void *p1, const void *p2)
+{
+	const struct uniqtype_ptrmap_entry *e1 = p1;
+	const struct uniqtype_ptrmap_entry *e2 = p2;
+	return (e1->offset > e2->offset) - (e1->offset < e2->offset);
+}
+
+static const struct uniqtype_ptrmap *build_ptrmap(struct uniqtype *t)
+{
+	struct ptrmap_builder b = { 0, 0, NULL };
+	switch (UNIQTYPE_KIND(t))
+	{
+		case ADDRESS:
+			builder_add(&b, (struct uniqtype_ptrmap_entry) { .offset = 0, .ptr_t = t });
+			break;
+		case ARRAY:
+		{
+			struct uniqtype *elemtyp = UNIQTYPE_ARRAY_ELEMENT_TYPE(t);
+			unsigned long elemsize = UNIQTYPE_SIZE_IN_BYTES(elemtyp);
+			const struct uniqtype_ptrmap *elem = __liballocs_get_ptrmap(elemtyp);
+			if (elemsize == 0 || !__uniqtype_ptrmap_has_pointers(elem)) break;
+			unsigned len = UNIQTYPE_ARRAY_LENGTH(t);
+			_Bool unbounded = (len == UNIQTYPE_ARRAY_LENGTH_UNBOUNDED || (int) len < 0);
+			if (!unbounded && (unsigned long) len * elem->nentries <= PTRMAP_MAX_FLAT_ENTRIES)
+			{
+				for (unsigned i = 0; i < len; ++i) builder_add_shifted(&b, elem, i * elemsize);
+			}
+			else builder_add(&b, (struct uniqtype_ptrmap_entry) {
+				.offset = 0,
+				.run = elem,
+				.run_count = unbounded ? UNIQTYPE_PTRMAP_UNBOUNDED : len
+			});
+			break;
+		}
+		case COMPOSITE:
+			for (int i = 0; i < UNIQTYPE_COMPOSITE_MEMBER_COUNT(t); ++i)
+			{
+				const struct uniqtype_ptrmap *memb = __liballocs_get_ptrmap(
+					t->related[i].un.memb.ptr);
+				if (memb) builder_add_shifted(&b, memb, t->related[i].un.memb.off);
+			}
+			/* Union members, and any other overlapping members, needn't come
+			 * in address order, but walking the map relies on it. */
+			if (b.nentries > 1) qsort(b.entries, b.nentries,
+				sizeof (struct uniqtype_ptrmap_entry), compare_entry_offset);
+			break;
+		default:
+			break;
+	}
+	struct uniqtype_ptrmap *m = __private_malloc(offsetof(struct uniqtype_ptrmap, entries)
+		+ b.nentries * sizeof (struct uniqtype_ptrmap_entry));
+	if (!m) abort();
+	m->t = t;
+	m->size = UNIQTYPE_SIZE_IN_BYTES(t);
+	m->nentries = b.nentries;
+	if (b.nentries) memcpy(m->entries, b.entries, b.nentries * sizeof (struct uniqtype_ptrmap_entry));
+	__private_free(b.entries);
+	return m;
+}
+
+const struct uniqtype_ptrmap *__liballocs_get_ptrmap(struct uniqtype *t)
+{
+	if (!t || t == (void*) -1) return NULL;
+	const struct uniqtype_ptrmap *m = table_lookup(
+		__atomic_load_n(&ptrmap_table, __ATOMIC_ACQUIRE), t);
+	if (m) return m;
+	/* Pointers don't lead us to recurse, so this terminates. */
+	return publish(build_ptrmap(t));
+}
+
+/* An object has gone away, and its types with it. A cached map's type
+ * address may now be reused by some other type, so start afresh. As
+ * with growing the table, the old table and its maps are never freed. */
+void __liballocs_ptrmap_notify_unload(void)
+{
+	__atomic_store_n(&ptrmap_table, NULL, __ATOMIC_RELEASE);
+}
+
+void __liballocs_ptrmap_for_each_in_range(const struct uniqtype_ptrmap *m,
+	void *obj, const void *lo, const void *hi,
+	uniqtype_ptrmap_cb *cb, void *arg)
+{
+	if (!m) return;
+	for (unsigned i = 0; i < m->nentries; ++i)
+	{
+		const struct uniqtype_ptrmap_entry *e = &m->entries[i];
+		char *at = (char*) obj + e->offset;
+		if (e->ptr_t)
+		{
+			if (at >= (char*) hi) return; /* entries are in address order */
+			if (at >= (char*) lo && at + sizeof (void*) <= (char*) hi)
+			{
+				cb((void**) at, e->ptr_t, arg);
+			}
+			continue;
+		}
+		/* A run: visit only the elements overlapping [lo, hi). */
+		unsigned long stride = e->run->size;
+		if (at >= (char*) hi) return;
+		unsigned long first = ((char*) lo > at) ? ((char*) lo - at) / stride : 0;
+		unsigned long end = ((char*) hi - at + stride - 1) / stride;
+		if (end > e->run_count) end = e->run_count;
+		for (unsigned long j = first; j < end; ++j)
+		{
+			__liballocs_ptrmap_for_each_in_range(e->run, at + j * stride, lo, hi, cb, arg);
+		}
+	}
+}
@@ -0,0 +1,50 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include "liballocs.h"
+
+/* Time __liballocs_get_alloc_info on heap, static and stack pointers.
+ * Compare against a run with LIBALLOCS_NO_PAGEINDEX_LEAF=1 in the
+ * environment, which disables the per-page leaf index. */
+
+#define NQUERIES 1000000
+
+static int static_array[1024];
+
+static double time_queries(const char *what, const void *obj)
+{
+	struct timespec begin, end;
+	struct liballocs_err *err = NULL;
+	const void *alloc_start = NULL;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (int i = 0; i < NQUERIES; ++i)
+	{
+		err = __liballocs_get_alloc_info(obj, NULL, &alloc_start, NULL, NULL, NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	assert(!err);
+	assert(alloc_start);
+	double ns = ((end.tv_sec - begin.tv_sec) * 1e9 + (end.tv_nsec - begin.tv_nsec)) / NQUERIES;
+	printf("%s\t%.1f\n", what, ns);
+	return ns;
+}
+
+static void (__attribute__((noinline)) query_stack)(void)
+{
+	int stack_array[64];
+	for (int i = 0; i < 64; ++i) stack_array[i] = i;
+	time_queries("stack", &stack_array[32]);
+}
+
+int main(void)
+{
+	int *heap_array = malloc(256 * sizeof (int));
+	printf("kind\tmean ns/query\n");
+	time_queries("heap", &heap_array[100]);
+	time_queries("static", &static_array[100]);
+	query_stack();
+	free(heap_array);
+	return 0;
+}
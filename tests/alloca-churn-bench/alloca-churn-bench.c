@@ -0,0 +1,44 @@
+#define _GNU_SOURCE
+#include <alloca.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include "liballocs.h"
+
+/* Time a recursive workload in which every frame makes many allocas,
+ * so that each return has to unindex all of them. */
+
+#define NALLOCAS 32
+#define DEPTH 20
+#define NREPS 2000
+
+static int (__attribute__((noinline)) recurse)(int remaining)
+{
+	int *chunks[NALLOCAS];
+	for (int i = 0; i < NALLOCAS; ++i)
+	{
+		chunks[i] = alloca((1 + i % 8) * sizeof (int));
+		chunks[i][0] = i;
+	}
+	int sum = (remaining > 0) ? recurse(remaining - 1) : 0;
+	for (int i = 0; i < NALLOCAS; ++i) sum += chunks[i][0];
+	return sum;
+}
+
+int main(void)
+{
+	/* Check that an alloca chunk is indexed, and that it goes away. */
+	int *o = alloca(42 * sizeof (int));
+	assert(__liballocs_get_alloc_base(&o[10]) == o);
+	struct timespec begin, end;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	long total = 0;
+	for (int rep = 0; rep < NREPS; ++rep) total += recurse(DEPTH);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	assert(total == (long) NREPS * (DEPTH + 1) * (NALLOCAS * (NALLOCAS - 1) / 2));
+	double ns = ((end.tv_sec - begin.tv_sec) * 1e9 + (end.tv_nsec - begin.tv_nsec))
+		/ ((double) NREPS * (DEPTH + 1));
+	printf("mean ns per frame of %d allocas: %.1f\n", NALLOCAS, ns);
+	return 0;
+}
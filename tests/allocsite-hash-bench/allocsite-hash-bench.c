@@ -0,0 +1,53 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include "liballocs.h"
+
+/* Time cold type queries, i.e. the first query on each chunk, which has
+ * to map the chunk's allocation site to its type. We make 10000 distinct
+ * allocation sites. Compare against a run with LIBALLOCS_NO_ALLOCSITE_HASH=1
+ * in the environment, which falls back to bsearching the allocsites. */
+
+struct point { int x; int y; };
+
+#define NSITES 10000
+static struct point *chunks[NSITES];
+
+#define SITE chunks[n++] = malloc(sizeof (struct point));
+#define SITE10 SITE SITE SITE SITE SITE SITE SITE SITE SITE SITE
+#define SITE100 SITE10 SITE10 SITE10 SITE10 SITE10 SITE10 SITE10 SITE10 SITE10 SITE10
+#define SITE1000 SITE100 SITE100 SITE100 SITE100 SITE100 SITE100 SITE100 SITE100 SITE100 SITE100
+#define SITE10000 SITE1000 SITE1000 SITE1000 SITE1000 SITE1000 SITE1000 SITE1000 SITE1000 SITE1000 SITE1000
+
+static void allocate_all(void)
+{
+	int n = 0;
+	SITE10000
+	assert(n == NSITES);
+}
+
+int main(void)
+{
+	allocate_all();
+	struct timespec begin, end;
+	struct uniqtype *first_type = NULL;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	/* Query in an order unrelated to the sites' address order. */
+	for (unsigned i = 0; i < NSITES; ++i)
+	{
+		struct point *p = chunks[(i * 7919u) % NSITES];
+		struct uniqtype *t = __liballocs_get_alloc_type(p);
+		assert(t);
+		if (!first_type) first_type = t;
+		assert(t == first_type);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	/* The sites should still be recoverable. */
+	assert(__liballocs_get_alloc_site(chunks[0]));
+	double ns = ((end.tv_sec - begin.tv_sec) * 1e9 + (end.tv_nsec - begin.tv_nsec)) / NSITES;
+	printf("mean cold type-query latency over %d allocation sites: %.1f ns\n", NSITES, ns);
+	for (unsigned i = 0; i < NSITES; ++i) free(chunks[i]);
+	return 0;
+}
@@ -0,0 +1,64 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include "liballocs.h"
+#include "uniqtype-bfs.h"
+
+/* Walk a synthetic object graph of 10M objects: a complete binary tree
+ * laid out heap-style, whose leaves point back at the root, so that
+ * every object is reached once and then seen again from somewhere. */
+
+struct tree_node
+{
+	struct tree_node *left;
+	struct tree_node *right;
+};
+
+#define NOBJS 10000000ul
+
+static unsigned long blackened_count;
+static void on_blacken(void *obj, struct uniqtype *t, void *arg)
+{
+	++blackened_count;
+}
+
+int main(void)
+{
+	struct tree_node *nodes = malloc(NOBJS * sizeof (struct tree_node));
+	assert(nodes);
+	for (unsigned long i = 0; i < NOBJS; ++i)
+	{
+		nodes[i].left = (2 * i + 1 < NOBJS) ? &nodes[2 * i + 1] : &nodes[0];
+		nodes[i].right = (2 * i + 2 < NOBJS) ? &nodes[2 * i + 2] : &nodes[0];
+	}
+	/* The graph's objects are the array's elements, so walk it
+	 * using the element type, not the allocation's. */
+	struct tree_node *one = malloc(sizeof (struct tree_node));
+	struct uniqtype *node_t = __liballocs_get_alloc_type(one);
+	assert(node_t);
+	if (node_t->make_precise)
+	{
+		node_t = node_t->make_precise(node_t, NULL, 0, one, one,
+			sizeof (struct tree_node), NULL, NULL);
+	}
+	assert(node_t && !node_t->make_precise);
+	assert(UNIQTYPE_SIZE_IN_BYTES(node_t) == sizeof (struct tree_node));
+
+	struct timespec begin, end;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	__uniqtype_walk_bfs_from_object(&nodes[0], node_t,
+		__uniqtype_default_follow_ptr, NULL,
+		on_blacken, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double secs = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+
+	assert(blackened_count == NOBJS);
+	printf("walked %lu objects in %.3fs (%.1f ns/object)\n",
+		blackened_count, secs, secs * 1e9 / blackened_count);
+
+	free(one);
+	free(nodes);
+	return 0;
+}
@@ -0,0 +1,102 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include "liballocs.h"
+#include "uniqtype-bfs.h"
+
+/* Time parallel walks of the heap-ordered binary tree from bfs-bench
+ * on 1, 2, 4, ... up to as many threads as there are CPUs, then check
+ * that a level-synchronous walk reports the right distances. */
+
+struct tree_node
+{
+	struct tree_node *left;
+	struct tree_node *right;
+};
+
+#define NOBJS 4000000ul
+
+static struct tree_node *nodes;
+static unsigned long blackened_count;
+static void on_blacken(void *obj, struct uniqtype *t, void *arg)
+{
+	__atomic_fetch_add(&blackened_count, 1, __ATOMIC_RELAXED);
+}
+
+static unsigned long discovered_count;
+static void on_discover(void *obj, struct uniqtype *t, void *predecessor,
+	unsigned long distance, void *arg)
+{
+	unsigned long i = (struct tree_node *) obj - nodes;
+	/* Node i is at depth floor(log2(i + 1)), reached from its parent. */
+	assert(distance == 63 - __builtin_clzl(i + 1));
+	assert(i == 0 ? !predecessor : predecessor == &nodes[(i - 1) / 2]);
+	__atomic_fetch_add(&discovered_count, 1, __ATOMIC_RELAXED);
+}
+
+static double walk(struct uniqtype *node_t, const struct __uniqtype_bfs_opts *opts)
+{
+	blackened_count = 0;
+	struct timespec begin, end;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	__uniqtype_walk_bfs_parallel(&nodes[0], node_t,
+		__uniqtype_default_follow_ptr, NULL,
+		on_blacken, NULL, opts);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	assert(blackened_count == NOBJS);
+	return (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+}
+
+int main(void)
+{
+	nodes = malloc(NOBJS * sizeof (struct tree_node));
+	assert(nodes);
+	for (unsigned long i = 0; i < NOBJS; ++i)
+	{
+		nodes[i].left = (2 * i + 1 < NOBJS) ? &nodes[2 * i + 1] : &nodes[0];
+		nodes[i].right = (2 * i + 2 < NOBJS) ? &nodes[2 * i + 2] : &nodes[0];
+	}
+	struct tree_node *one = malloc(sizeof (struct tree_node));
+	struct uniqtype *node_t = __liballocs_get_alloc_type(one);
+	assert(node_t);
+	if (node_t->make_precise)
+	{
+		node_t = node_t->make_precise(node_t, NULL, 0, one, one,
+			sizeof (struct tree_node), NULL, NULL);
+	}
+	assert(node_t && !node_t->make_precise);
+
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus < 1) ncpus = 1;
+	printf("threads\tstealing s\tspeedup\tlevels s\tspeedup\n");
+	double stealing_base = 0, levels_base = 0;
+	for (unsigned nthreads = 1; ; nthreads *= 2)
+	{
+		if (nthreads > ncpus) nthreads = ncpus;
+		struct __uniqtype_bfs_opts opts = {
+			.nthreads = nthreads,
+			.flags = UNIQTYPE_BFS_THREADSAFE_CALLBACKS
+		};
+		double stealing = walk(node_t, &opts);
+		discovered_count = 0;
+		opts.on_discover = on_discover;
+		double levels = walk(node_t, &opts);
+		assert(discovered_count == NOBJS);
+		if (nthreads == 1) { stealing_base = stealing; levels_base = levels; }
+		printf("%u\t%.3f\t%.2fx\t%.3f\t%.2fx\n", nthreads,
+			stealing, stealing_base / stealing, levels, levels_base / levels);
+		if (nthreads == ncpus) break;
+	}
+
+	/* Callbacks not declared thread-safe are serialized, but still each
+	 * see every object once. */
+	struct __uniqtype_bfs_opts serial_opts = { .nthreads = ncpus };
+	walk(node_t, &serial_opts);
+
+	free(one);
+	free(nodes);
+	return 0;
+}
@@ -0,0 +1,55 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "liballocs.h"
+#include "pageindex.h"
+
+/* Create and destroy 50k bigallocs, far more than the old fixed table
+ * of 1024 could hold at once, and check that released entries are reused. */
+
+#define NBIGS 50000
+
+static struct allocator stress_allocator = { .name = "stress" };
+static struct big_allocation *bigs[NBIGS];
+
+int main(void)
+{
+	size_t pagesz = sysconf(_SC_PAGE_SIZE);
+	char *region = mmap(NULL, NBIGS * pagesz, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	assert(region != MAP_FAILED);
+	for (int round = 0; round < 2; ++round)
+	{
+		for (int i = 0; i < NBIGS; ++i)
+		{
+			bigs[i] = __liballocs_new_bigalloc(region + i * pagesz, pagesz,
+				NULL, NULL, NULL, &stress_allocator);
+			assert(bigs[i]);
+			assert(bigs[i] >= &__liballocs_big_allocations[1]);
+			assert(bigs[i] < &__liballocs_big_allocations[NBIGALLOCS]);
+		}
+		for (int i = 0; i < NBIGS; i += 997)
+		{
+			assert(__lookup_bigalloc_from_root(region + i * pagesz + 1,
+				&stress_allocator, NULL) == bigs[i]);
+		}
+		/* Delete the odd ones, then the even ones, so the free list
+		 * is in neither address order nor reverse address order. */
+		for (int parity = 1; parity >= 0; --parity)
+		{
+			for (int i = parity; i < NBIGS; i += 2)
+			{
+				_Bool deleted = __liballocs_delete_bigalloc_at(region + i * pagesz,
+					&stress_allocator);
+				assert(deleted);
+			}
+		}
+		assert(!__lookup_bigalloc_from_root(region, &stress_allocator, NULL));
+	}
+	munmap(region, NBIGS * pagesz);
+	printf("Created and destroyed %d bigallocs twice\n", NBIGS);
+	return 0;
+}
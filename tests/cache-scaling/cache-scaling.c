@@ -0,0 +1,65 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+#include "liballocs.h"
+
+/* Hit latency of the memrange cache behind __liballocs_get_base, from
+ * 1 to 32 threads. Each thread queries its own few chunks, so every
+ * query after the first should hit in that thread's cache. Run with
+ * LIBALLOCS_MEMRANGE_CACHE_SIZE=0 to see the uncached query cost. */
+
+#define MAX_THREADS 32
+#define NQUERIES 1000000
+#define NCHUNKS 4
+
+static void *worker(void *arg)
+{
+	double *out_ns = arg;
+	void *chunks[NCHUNKS];
+	for (int i = 0; i < NCHUNKS; ++i) chunks[i] = malloc(64 * (i + 1));
+	struct timespec begin, end;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (int i = 0; i < NQUERIES; ++i)
+	{
+		void *chunk = chunks[i % NCHUNKS];
+		void *base = __liballocs_get_base(chunk);
+		assert(base == chunk);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	*out_ns = ((end.tv_sec - begin.tv_sec) * 1e9 + (end.tv_nsec - begin.tv_nsec)) / NQUERIES;
+	/* Freeing must invalidate our own cache entries; a fresh chunk at the
+	 * same address must not be reported with the old base. */
+	free(chunks[0]);
+	char *reused = malloc(256);
+	assert(__liballocs_get_base(reused + 128) == reused);
+	free(reused);
+	for (int i = 1; i < NCHUNKS; ++i) free(chunks[i]);
+	return NULL;
+}
+
+int main(void)
+{
+	printf("threads\tmean ns/query\n");
+	for (int nthreads = 1; nthreads <= MAX_THREADS; nthreads *= 2)
+	{
+		pthread_t threads[MAX_THREADS];
+		double ns[MAX_THREADS];
+		for (int i = 0; i < nthreads; ++i)
+		{
+			int ret = pthread_create(&threads[i], NULL, worker, &ns[i]);
+			assert(ret == 0);
+		}
+		double total = 0;
+		for (int i = 0; i < nthreads; ++i)
+		{
+			pthread_join(threads[i], NULL);
+			total += ns[i];
+		}
+		printf("%d\t%.1f\n", nthreads, total / nthreads);
+	}
+	return 0;
+}
@@ -0,0 +1,112 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include "liballocs.h"
+#include "allocmeta.h"
+#include "pageindex.h"
+
+/* Walk a 2GB heap of small objects with the generic malloc allocator's
+ * walk_allocations, once in full and once over a sub-range. Set
+ * HEAP_WALK_BENCH_MB to use a smaller heap. */
+
+struct small
+{
+	struct small *next;
+	long payload[5];
+};
+
+#define MAX_ARENAS 64
+
+struct count_arg
+{
+	struct uniqtype *small_t;
+	void *range_begin;
+	void *range_end;
+	unsigned long nchunks;
+	unsigned long ntyped;
+};
+static int count_cb(struct big_allocation *maybe_the_allocation, void *obj,
+	struct uniqtype *t, const void *allocsite, struct alloc_tree_link *link, void *arg_as_void)
+{
+	struct count_arg *arg = arg_as_void;
+	assert((char*) obj >= (char*) arg->range_begin);
+	assert(!arg->range_end || (char*) obj < (char*) arg->range_end);
+	++arg->nchunks;
+	if (t == arg->small_t) ++arg->ntyped;
+	return 0;
+}
+
+static double walk(struct allocator *a, struct big_allocation **arenas, unsigned narenas,
+	struct count_arg *arg, _Bool subrange)
+{
+	struct timespec begin, end;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (unsigned i = 0; i < narenas; ++i)
+	{
+		struct big_allocation *b = arenas[i];
+		struct alloc_tree_pos pos = { .base = b->begin, .bigalloc_or_uniqtype = (uintptr_t) b };
+		/* The sub-range is the middle eighth of each arena. */
+		uintptr_t eighth = ((uintptr_t) b->end - (uintptr_t) b->begin) / 8;
+		arg->range_begin = subrange ? (char*) b->begin + 4 * eighth : b->begin;
+		arg->range_end = subrange ? (char*) b->begin + 5 * eighth : NULL;
+		int ret = a->walk_allocations(&pos, count_cb, arg,
+			subrange ? arg->range_begin : NULL, arg->range_end);
+		assert(ret == 0);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+}
+
+int main(void)
+{
+	const char *mb_str = getenv("HEAP_WALK_BENCH_MB");
+	unsigned long nbytes = (mb_str ? atol(mb_str) : 2048) << 20;
+	unsigned long nobjs = nbytes / sizeof (struct small);
+
+	struct small *first = malloc(sizeof (struct small));
+	struct allocator *a = NULL;
+	struct uniqtype *small_t = NULL;
+	liballocs_err_t err = __liballocs_get_alloc_info(first, &a, NULL, NULL, &small_t, NULL);
+	assert(!err && a && a->walk_allocations);
+	/* Remember which arenas we allocate in, by sampling as we go. */
+	struct big_allocation *arenas[MAX_ARENAS];
+	unsigned narenas = 0;
+	struct small *prev = first;
+	for (unsigned long i = 1; i < nobjs; ++i)
+	{
+		struct small *s = malloc(sizeof (struct small));
+		assert(s);
+		s->next = prev;
+		prev = s;
+		if (i % 4096 == 1)
+		{
+			struct big_allocation *b = __lookup_bigalloc_from_root_by_suballocator(s, a, NULL);
+			assert(b);
+			unsigned j;
+			for (j = 0; j < narenas; ++j) if (arenas[j] == b) break;
+			if (j == narenas) { assert(narenas < MAX_ARENAS); arenas[narenas++] = b; }
+		}
+	}
+
+	struct count_arg full = { .small_t = small_t };
+	double secs = walk(a, arenas, narenas, &full, 0);
+	assert(full.ntyped >= nobjs - 4096);
+	printf("walked %lu chunks (%lu of our type) in %u arenas in %.3fs (%.1f ns/chunk)\n",
+		full.nchunks, full.ntyped, narenas, secs, secs * 1e9 / full.nchunks);
+
+	struct count_arg part = { .small_t = small_t };
+	secs = walk(a, arenas, narenas, &part, 1);
+	assert(part.nchunks < full.nchunks);
+	printf("walked %lu chunks in sub-ranges in %.3fs (%.1f ns/chunk)\n",
+		part.nchunks, secs, part.nchunks ? secs * 1e9 / part.nchunks : 0.0);
+
+	for (struct small *s = prev; s; )
+	{
+		struct small *next = s->next;
+		free(s);
+		s = next;
+	}
+	return 0;
+}
@@ -0,0 +1,63 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include <malloc.h>
+#include "liballocs.h"
+
+/* Measure interior-pointer lookups in a fragmented arena. One large
+ * (but unpromoted) chunk raises the arena's biggest object size, which
+ * used to bound the backward bitmap search only loosely. We then query
+ * pointers near the end of chunks that sit after big freed gaps, so
+ * each search has to pass over many empty bitmap words. */
+
+#define NCHUNKS 20000
+#define NQUERIES 5000000
+#define BIG_SIZE (120 * 1024)
+
+static void *chunks[NCHUNKS];
+static size_t sizes[NCHUNKS];
+
+int main(void)
+{
+	mallopt(M_MMAP_THRESHOLD, 64 * 1024 * 1024);
+	void *big = malloc(BIG_SIZE);
+	assert(big);
+	srandom(42);
+	for (int i = 0; i < NCHUNKS; ++i)
+	{
+		/* Mostly small chunks, with a few mid-sized ones to free later. */
+		sizes[i] = (i % 4 == 0) ? 16 + (random() % (64 * 1024)) : 16 + (random() % 512);
+		chunks[i] = malloc(sizes[i]);
+		assert(chunks[i]);
+	}
+	/* Fragment: free the mid-sized chunks, leaving wide empty gaps. */
+	for (int i = 0; i < NCHUNKS; i += 4)
+	{
+		free(chunks[i]);
+		chunks[i] = NULL;
+	}
+	/* Check correctness first. */
+	for (int i = 1; i < NCHUNKS; ++i)
+	{
+		if (!chunks[i]) continue;
+		assert(__liballocs_get_alloc_base((char*) chunks[i] + sizes[i] - 1) == chunks[i]);
+	}
+	assert(__liballocs_get_alloc_base((char*) big + BIG_SIZE - 1) == big);
+	struct timespec begin, end;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	unsigned long nfound = 0;
+	for (long n = 0; n < NQUERIES; ++n)
+	{
+		int i = 1 + (n % (NCHUNKS - 1));
+		if (!chunks[i]) i = (n % 2) ? i + 1 : i - 1;
+		nfound += (__liballocs_get_alloc_base((char*) chunks[i] + sizes[i] - 1) == chunks[i]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	assert(nfound == NQUERIES);
+	double ns = ((end.tv_sec - begin.tv_sec) * 1e9 + (end.tv_nsec - begin.tv_nsec))
+		/ NQUERIES;
+	printf("mean interior-pointer lookup latency: %.1f ns\n", ns);
+	return 0;
+}
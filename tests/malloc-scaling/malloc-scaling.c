@@ -0,0 +1,86 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+#include "liballocs.h"
+
+/* Malloc/free throughput from 1 to 64 threads, with and without indexing.
+ * The "without" case calls glibc's underlying entry points, which bypass
+ * our hooks; the "with" case goes through the indexed malloc. */
+extern void *__libc_malloc(size_t);
+extern void __libc_free(void *);
+
+#define MAX_THREADS 64
+#define NITERS 100000
+#define NLIVE 64
+
+static _Bool use_indexing;
+
+static void *worker(void *arg)
+{
+	void *live[NLIVE] = { NULL };
+	unsigned seed = (unsigned)(uintptr_t) arg;
+	for (int i = 0; i < NITERS; ++i)
+	{
+		int slot = i % NLIVE;
+		size_t sz = 16 + (rand_r(&seed) % 512);
+		if (use_indexing)
+		{
+			free(live[slot]);
+			live[slot] = malloc(sz);
+		}
+		else
+		{
+			__libc_free(live[slot]);
+			live[slot] = __libc_malloc(sz);
+		}
+		assert(live[slot]);
+		*(char*) live[slot] = 42;
+	}
+	if (use_indexing)
+	{
+		/* Check the index stayed coherent under concurrent updates. */
+		for (int i = 0; i < NLIVE; ++i)
+		{
+			assert(__liballocs_get_alloc_base(live[i]) == live[i]);
+			assert(__liballocs_get_alloc_base((char*) live[i] + 8) == live[i]);
+			free(live[i]);
+		}
+	}
+	else for (int i = 0; i < NLIVE; ++i) __libc_free(live[i]);
+	return NULL;
+}
+
+static double run(int nthreads)
+{
+	pthread_t threads[MAX_THREADS];
+	struct timespec begin, end;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (int i = 0; i < nthreads; ++i)
+	{
+		int ret = pthread_create(&threads[i], NULL, worker, (void*)(uintptr_t)(i + 1));
+		assert(ret == 0);
+	}
+	for (int i = 0; i < nthreads; ++i) pthread_join(threads[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double secs = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+	return ((double) nthreads * NITERS) / secs;
+}
+
+int main(void)
+{
+	printf("threads\tunindexed ops/s\tindexed ops/s\n");
+	for (int nthreads = 1; nthreads <= MAX_THREADS; nthreads *= 2)
+	{
+		use_indexing = 0;
+		double unindexed = run(nthreads);
+		use_indexing = 1;
+		double indexed = run(nthreads);
+		printf("%d\t%.0f\t%.0f\n", nthreads, unindexed, indexed);
+	}
+	return 0;
+}
@@ -0,0 +1,162 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "liballocs.h"
+
+/* Replay a synthetic mmap/mprotect/munmap trace, written to mimic a
+ * JIT-style code cache rather than recorded from one, and check the mmap
+ * allocator's view of every page after each step. The cache reserves a PROT_NONE region, commits pages read-write, flips
+ * them to read-exec, keeps a guard page between code blobs, and releases
+ * blobs by punching holes. That gives far more than eight mappings in one
+ * sequence, and munmaps and mprotects strictly inside existing mappings. */
+
+#define NPAGES 256
+
+enum op { MAP, PROTECT, UNMAP };
+struct trace_step
+{
+	enum op op;
+	unsigned first_page;
+	unsigned npages;
+	int prot;
+};
+
+#define RW (PROT_READ|PROT_WRITE)
+#define RX (PROT_READ|PROT_EXEC)
+static const struct trace_step trace[] = {
+	{ PROTECT,   0,  4, RW },
+	{ PROTECT,   5,  8, RW },
+	{ PROTECT,   5,  8, RX },
+	{ PROTECT,  14,  2, RW },
+	{ PROTECT,  14,  2, RX },
+	{ PROTECT,  17, 16, RW },
+	{ PROTECT,  17, 16, RX },
+	{ PROTECT,  34,  1, RW },
+	{ PROTECT,  34,  1, RX },
+	{ PROTECT,  36,  3, RW },
+	{ PROTECT,  36,  3, RX },
+	{ PROTECT,  40, 30, RW },
+	{ PROTECT,  40, 30, RX },
+	{ PROTECT,  71,  5, RW },
+	{ PROTECT,  71,  5, RX },
+	{ PROTECT,  77,  9, RW },
+	{ PROTECT,  77,  9, RX },
+	{ PROTECT,  87,  2, RW },
+	{ PROTECT,  87,  2, RX },
+	{ PROTECT,  90, 12, RW },
+	{ PROTECT,  90, 12, RX },
+	{ PROTECT,  20,  4, RW },  /* patch inside a blob */
+	{ PROTECT,  20,  4, RX },
+	{ UNMAP,    17, 16, 0 },   /* release a blob: punch a hole */
+	{ UNMAP,    40, 30, 0 },
+	{ MAP,      40, 30, PROT_NONE }, /* re-reserve it */
+	{ PROTECT,  41, 10, RW },
+	{ PROTECT,  41, 10, RX },
+	{ UNMAP,    36,  1, 0 },
+	{ UNMAP,    90, 12, 0 },
+	{ MAP,      17, 16, RW },  /* re-commit directly */
+	{ PROTECT,  17, 16, RX },
+	{ PROTECT, 110, 100, RW }, /* one big data area... */
+	{ PROTECT, 120,  1, PROT_NONE }, /* ...with guard pages dotted through */
+	{ PROTECT, 130,  1, PROT_NONE },
+	{ PROTECT, 140,  1, PROT_NONE },
+	{ PROTECT, 150,  1, PROT_NONE },
+	{ PROTECT, 160,  1, PROT_NONE },
+	{ PROTECT, 170,  1, PROT_NONE },
+	{ PROTECT, 180,  1, PROT_NONE },
+	{ PROTECT, 190,  1, PROT_NONE },
+	{ PROTECT, 200,  1, PROT_NONE },
+	{ PROTECT, 110, 100, RW }, /* drop the guards again */
+	{ UNMAP,     5,  8, 0 },
+	{ UNMAP,    71, 39, 0 },
+	{ MAP,      71, 39, PROT_NONE },
+	{ PROTECT,   0,  4, PROT_NONE },
+};
+#define NSTEPS (sizeof trace / sizeof trace[0])
+#define NROUNDS 20
+
+static size_t pagesz;
+static char *region;
+/* The prot we expect for each page, or -1 if unmapped. */
+static int model[NPAGES];
+
+static void check_page(unsigned i)
+{
+	char *page = region + i * pagesz;
+	struct big_allocation *b = NULL;
+	struct mapping_entry *m = __liballocs_get_memory_mapping(page, &b);
+	if (model[i] == -1)
+	{
+		assert(!m);
+		return;
+	}
+	assert(m);
+	assert(b);
+	assert((char*) m->begin <= page);
+	assert((char*) m->end >= page + pagesz);
+	assert((char*) b->begin <= page);
+	assert((char*) b->end >= page + pagesz);
+	assert(m->prot == model[i]);
+}
+
+static void replay_step(const struct trace_step *s)
+{
+	char *addr = region + s->first_page * pagesz;
+	size_t len = s->npages * pagesz;
+	int ret;
+	switch (s->op)
+	{
+		case MAP: ;
+			void *mapped = mmap(addr, len, s->prot,
+				MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE|MAP_FIXED, -1, 0);
+			assert(mapped == addr);
+			break;
+		case PROTECT:
+			ret = mprotect(addr, len, s->prot);
+			assert(ret == 0);
+			break;
+		case UNMAP:
+			ret = munmap(addr, len);
+			assert(ret == 0);
+			break;
+	}
+	for (unsigned i = s->first_page; i < s->first_page + s->npages; ++i)
+	{
+		model[i] = (s->op == UNMAP) ? -1 : s->prot;
+	}
+}
+
+int main(void)
+{
+	pagesz = sysconf(_SC_PAGE_SIZE);
+	for (unsigned round = 0; round < NROUNDS; ++round)
+	{
+		region = mmap(NULL, NPAGES * pagesz, PROT_NONE,
+			MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+		assert(region != MAP_FAILED);
+		for (unsigned i = 0; i < NPAGES; ++i) model[i] = PROT_NONE;
+		for (unsigned n = 0; n < NSTEPS; ++n)
+		{
+			replay_step(&trace[n]);
+			for (unsigned i = 0; i < NPAGES; ++i) check_page(i);
+		}
+		/* Dropping the guard pages merged the data area back into one mapping. */
+		struct mapping_entry *data = __liballocs_get_memory_mapping(
+			region + 150 * pagesz, NULL);
+		assert(data);
+		assert((char*) data->begin == region + 110 * pagesz);
+		assert((char*) data->end == region + 210 * pagesz);
+		int ret = munmap(region, NPAGES * pagesz);
+		assert(ret == 0);
+		for (unsigned i = 0; i < NPAGES; ++i)
+		{
+			model[i] = -1;
+			check_page(i);
+		}
+	}
+	printf("Replayed %d steps %d times\n", (int) NSTEPS, NROUNDS);
+	return 0;
+}
@@ -0,0 +1,75 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "liballocs.h"
+
+/* Time the recovery path for unindexed addresses in a process with
+ * 50k mappings. Alternating the protection of each page in one big
+ * region stops the kernel merging them. Wild addresses just past the
+ * region make the reconciler look at the maps and find nothing. Run
+ * with LIBALLOCS_NO_PROCMAP_QUERY=1 to time the pread-and-bisect
+ * fallback on kernels that have PROCMAP_QUERY. */
+
+#define NMAPPINGS 50000
+#define NQUERIES 200
+
+static double now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int main(void)
+{
+	size_t pagesz = sysconf(_SC_PAGE_SIZE);
+	/* One extra page at the end that we unmap again, to be wild. */
+	char *region = mmap(NULL, (NMAPPINGS + 1) * pagesz, PROT_READ,
+		MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	assert(region != MAP_FAILED);
+	for (unsigned i = 1; i < NMAPPINGS; i += 2)
+	{
+		int ret = mprotect(region + i * pagesz, pagesz, PROT_READ|PROT_WRITE);
+		assert(ret == 0);
+	}
+	char *wild = region + NMAPPINGS * pagesz;
+	int ret = munmap(wild, pagesz);
+	assert(ret == 0);
+
+	double begin = now_us();
+	for (int i = 0; i < NQUERIES; ++i)
+	{
+		_Bool claimed = __liballocs_notify_unindexed_address(wild);
+		assert(!claimed);
+	}
+	double end = now_us();
+	printf("%d mappings: %.1f us per wild-address miss\n", NMAPPINGS,
+		(end - begin) / NQUERIES);
+
+#ifdef SYS_mmap
+	/* A mapping made behind liballocs's back gets indexed on first miss,
+	 * unless the raw syscall was trapped and it is indexed already. Its
+	 * protection differs from the last page's, so the kernel keeps it
+	 * as a separate mapping. */
+	char *hidden = (char*) syscall(SYS_mmap, wild, pagesz, PROT_READ|PROT_EXEC,
+		MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0);
+	assert(hidden == wild);
+	if (!__liballocs_get_memory_mapping(hidden, NULL))
+	{
+		_Bool claimed = __liballocs_notify_unindexed_address(hidden);
+		assert(claimed);
+	}
+	struct mapping_entry *m = __liballocs_get_memory_mapping(hidden, NULL);
+	assert(m);
+	assert((char*) m->begin <= hidden && (char*) m->end >= hidden + pagesz);
+	ret = munmap(hidden, pagesz);
+	assert(ret == 0);
+#endif
+	munmap(region, NMAPPINGS * pagesz);
+	return 0;
+}
@@ -0,0 +1,81 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <dlfcn.h>
+#include "liballocs.h"
+
+/* Compare memcpy through liballocs's wrapper against plain glibc, for
+ * small copies (below the notification threshold), pointer-free arrays
+ * and arrays of structures containing pointers. Only the last should
+ * cost more than a type lookup per call. */
+
+struct node
+{
+	struct node *next;
+	long val;
+};
+
+#define NELEMS 256
+#define NREPS 200000
+
+typedef void *memcpy_fn(void *, const void *, size_t);
+
+static double time_copies(memcpy_fn *volatile fn, void *dest, const void *src, size_t n)
+{
+	struct timespec begin, end;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (int i = 0; i < NREPS; ++i) fn(dest, src, n);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return ((end.tv_sec - begin.tv_sec) * 1e9 + (end.tv_nsec - begin.tv_nsec)) / NREPS;
+}
+
+static void compare(const char *what, memcpy_fn *wrapped, memcpy_fn *plain,
+	void *dest, const void *src, size_t n)
+{
+	double wrapped_ns = time_copies(wrapped, dest, src, n);
+	double plain_ns = time_copies(plain, dest, src, n);
+	printf("%-24s%8zu\t%.1f\t%.1f\t%.2fx\n", what, n, wrapped_ns, plain_ns,
+		wrapped_ns / plain_ns);
+}
+
+int main(void)
+{
+	void *libc = dlopen("libc.so.6", RTLD_NOW|RTLD_NOLOAD);
+	assert(libc);
+	memcpy_fn *plain = (memcpy_fn *) dlsym(libc, "memcpy");
+	assert(plain);
+	memcpy_fn *wrapped = memcpy;
+	assert(wrapped != plain);
+
+	double *src_doubles = malloc(NELEMS * sizeof (double));
+	double *dest_doubles = malloc(NELEMS * sizeof (double));
+	struct node *src_nodes = malloc(NELEMS * sizeof (struct node));
+	struct node *dest_nodes = malloc(NELEMS * sizeof (struct node));
+	assert(src_doubles && dest_doubles && src_nodes && dest_nodes);
+	for (int i = 0; i < NELEMS; ++i)
+	{
+		src_doubles[i] = i;
+		src_nodes[i] = (struct node) { .next = &src_nodes[(i + 1) % NELEMS], .val = i };
+	}
+	/* Check the types are there to be used. */
+	assert(__liballocs_get_alloc_type(dest_nodes));
+
+	printf("%-24s%8s\twrapped ns\tglibc ns\tratio\n", "copy", "bytes");
+	compare("small", wrapped, plain, dest_doubles, src_doubles, 4);
+	compare("pointer-free", wrapped, plain, dest_doubles, src_doubles,
+		NELEMS * sizeof (double));
+	compare("with pointers (one)", wrapped, plain, dest_nodes, src_nodes,
+		sizeof (struct node));
+	compare("with pointers (all)", wrapped, plain, dest_nodes, src_nodes,
+		NELEMS * sizeof (struct node));
+	assert(dest_nodes[NELEMS - 1].next == &src_nodes[0]);
+
+	free(src_doubles);
+	free(dest_doubles);
+	free(src_nodes);
+	free(dest_nodes);
+	return 0;
+}
@@ -0,0 +1,36 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "liballocs.h"
+
+/* Time mmap/munmap of anonymous regions from 4 KiB to 64 GiB. Most of
+ * the cost beyond the raw syscalls is filling the pageindex for the new
+ * bigalloc and clearing it again. Note that regions bigger than
+ * BIGGEST_BIGALLOC are not indexed at all. */
+
+#define NREPS 8
+
+int main(void)
+{
+	printf("size (bytes)\tmean us per mmap+munmap\n");
+	for (unsigned long long sz = 4096; sz <= (64ull<<30); sz *= 4)
+	{
+		struct timespec begin, end;
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		for (int i = 0; i < NREPS; ++i)
+		{
+			void *p = mmap(NULL, sz, PROT_READ|PROT_WRITE,
+				MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+			assert(p != MAP_FAILED);
+			int ret = munmap(p, sz);
+			assert(ret == 0);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double us = ((end.tv_sec - begin.tv_sec) * 1e6 + (end.tv_nsec - begin.tv_nsec) / 1e3) / NREPS;
+		printf("%llu\t%.1f\n", sz, us);
+	}
+	return 0;
+}
@@ -0,0 +1,45 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include <malloc.h>
+#include "liballocs.h"
+
+/* Promote 10k malloc chunks to bigallocs, all children of the same
+ * arena, then measure the latency of freeing them. Every free looks up
+ * the chunk among the arena's children. */
+
+#define NCHUNKS 10000
+/* Just over the promotion threshold (SHOULD_PROMOTE_TO_BIGALLOC). */
+#define CHUNK_SIZE (132 * 1024)
+
+static void *chunks[NCHUNKS];
+
+int main(void)
+{
+	/* Keep the chunks in the brk arena rather than in separate mmaps,
+	 * so that they all share a parent. */
+	mallopt(M_MMAP_THRESHOLD, 64 * 1024 * 1024);
+	for (int i = 0; i < NCHUNKS; ++i)
+	{
+		chunks[i] = malloc(CHUNK_SIZE);
+		assert(chunks[i]);
+	}
+	/* Check a few promoted chunks are found from interior pointers. */
+	for (int i = 0; i < NCHUNKS; i += 1000)
+	{
+		assert(__liballocs_get_alloc_base((char*) chunks[i] + 4096) == chunks[i]);
+	}
+	struct timespec begin, end;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	/* Free in an interleaved order, so we don't only hit one end of the list. */
+	for (int stride_start = 0; stride_start < 2; ++stride_start)
+	{
+		for (int i = stride_start; i < NCHUNKS; i += 2) free(chunks[i]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double ns = ((end.tv_sec - begin.tv_sec) * 1e9 + (end.tv_nsec - begin.tv_nsec)) / NCHUNKS;
+	printf("mean free latency for %d promoted chunks: %.1f ns\n", NCHUNKS, ns);
+	return 0;
+}
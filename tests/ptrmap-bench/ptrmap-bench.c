@@ -0,0 +1,138 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include "liballocs.h"
+#include "uniqtype-ptrmap.h"
+
+/* Compare finding every pointer in an object by recursing through its
+ * type's subobjects against iterating the type's cached pointer map,
+ * for a deeply nested structure and a large array of structures. Both
+ * must find the same pointers. */
+
+struct leaf { long x; void *p; double d; };
+struct d1 { struct leaf a, b; int n; };
+struct d2 { struct d1 a; char pad[12]; struct d1 b; struct leaf *q; };
+struct d3 { struct d2 a, b; int arr[8]; };
+struct d4 { struct d3 a, b; void *r; };
+struct deep { struct d4 a, b, c; };
+
+struct node
+{
+	struct node *next;
+	long val;
+	struct node *prev;
+	char tag[8];
+};
+
+#define NNODES 100000
+#define NREPS 200
+
+static void count_ptr(void **slot, struct uniqtype *ptr_t, void *arg)
+{
+	if (*slot) ++*(unsigned long *) arg;
+}
+
+static unsigned long count_recursive(char *obj, struct uniqtype *t)
+{
+	switch (UNIQTYPE_KIND(t))
+	{
+		case ADDRESS:
+			return *(void **) obj != NULL;
+		case ARRAY:
+		{
+			struct uniqtype *elemtyp = UNIQTYPE_ARRAY_ELEMENT_TYPE(t);
+			unsigned long n = 0;
+			for (unsigned i = 0; i < UNIQTYPE_ARRAY_LENGTH(t); ++i)
+			{
+				n += count_recursive(obj + i * UNIQTYPE_SIZE_IN_BYTES(elemtyp), elemtyp);
+			}
+			return n;
+		}
+		case COMPOSITE:
+		{
+			unsigned long n = 0;
+			for (int i = 0; i < UNIQTYPE_COMPOSITE_MEMBER_COUNT(t); ++i)
+			{
+				n += count_recursive(obj + t->related[i].un.memb.off,
+					t->related[i].un.memb.ptr);
+			}
+			return n;
+		}
+		default:
+			return 0;
+	}
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void compare(const char *what, void *obj, struct uniqtype *t)
+{
+	unsigned long recursive_count = 0;
+	double begin = now_ns();
+	for (int i = 0; i < NREPS; ++i) recursive_count += count_recursive(obj, t);
+	double recursive_ns = (now_ns() - begin) / NREPS;
+
+	unsigned long ptrmap_count = 0;
+	begin = now_ns();
+	for (int i = 0; i < NREPS; ++i)
+	{
+		const struct uniqtype_ptrmap *m = __liballocs_get_ptrmap(t);
+		__liballocs_ptrmap_for_each_in_range(m, obj, obj, (char *) obj + m->size,
+			count_ptr, &ptrmap_count);
+	}
+	double ptrmap_ns = (now_ns() - begin) / NREPS;
+
+	assert(recursive_count == ptrmap_count);
+	printf("%-16s%12lu\t%.1f\t%.1f\t%.2fx\n", what, recursive_count / NREPS,
+		recursive_ns, ptrmap_ns, recursive_ns / ptrmap_ns);
+}
+
+int main(void)
+{
+	struct deep *deep = calloc(1, sizeof (struct deep));
+	struct node *nodes = malloc(NNODES * sizeof (struct node));
+	assert(deep && nodes);
+	deep->a.a.a.a.a.p = deep;
+	deep->c.b.b.b.q = &deep->a.a.a.a.a;
+	deep->b.a.r = deep;
+	for (int i = 0; i < NNODES; ++i)
+	{
+		nodes[i] = (struct node) {
+			.next = &nodes[(i + 1) % NNODES],
+			.prev = &nodes[(i + NNODES - 1) % NNODES],
+			.val = i
+		};
+	}
+
+	struct uniqtype *deep_t = __liballocs_get_alloc_type(deep);
+	struct uniqtype *node_t = __liballocs_get_alloc_type(nodes);
+	assert(deep_t && node_t);
+	struct uniqtype *nodes_t = __liballocs_get_or_create_array_type(node_t, NNODES);
+	assert(nodes_t);
+
+	/* Maps are cached, and describe the whole object. */
+	const struct uniqtype_ptrmap *m = __liballocs_get_ptrmap(deep_t);
+	assert(m && m == __liballocs_get_ptrmap(deep_t));
+	assert(m->size == sizeof (struct deep));
+	assert(__uniqtype_ptrmap_has_pointers(m));
+	/* The big array is a run, so a sub-range visits only what it touches. */
+	unsigned long n = 0;
+	__liballocs_ptrmap_for_each_in_range(__liballocs_get_ptrmap(nodes_t), nodes,
+		&nodes[10], &nodes[20], count_ptr, &n);
+	assert(n == 20);
+
+	printf("%-16s%12s\trecursive ns\tptrmap ns\tspeedup\n", "object", "pointers");
+	compare("deep struct", deep, deep_t);
+	compare("struct array", nodes, nodes_t);
+
+	free(deep);
+	free(nodes);
+	return 0;
+}
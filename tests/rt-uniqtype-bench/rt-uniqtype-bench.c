@@ -0,0 +1,72 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include <dlfcn.h>
+#include "liballocs.h"
+
+/* Create array types of 1M distinct lengths, as sizing that many
+ * differently-sized malloc'd arrays would, then look them all up
+ * again. Each must be made once and found thereafter, and once
+ * published must be findable by name. */
+
+struct point
+{
+	double x;
+	double y;
+};
+
+#define NLENGTHS 1000000u
+
+extern void *__liballocs_rt_uniqtypes_obj;
+static struct uniqtype *types[NLENGTHS + 1];
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void)
+{
+	struct point *p = malloc(sizeof (struct point));
+	struct uniqtype *point_t = __liballocs_get_alloc_type(p);
+	assert(point_t);
+	if (point_t->make_precise)
+	{
+		point_t = point_t->make_precise(point_t, NULL, 0, p, p,
+			sizeof (struct point), NULL, NULL);
+	}
+	assert(point_t && !point_t->make_precise);
+
+	double begin = now();
+	for (unsigned len = 1; len <= NLENGTHS; ++len)
+	{
+		types[len] = __liballocs_get_or_create_array_type(point_t, len);
+		assert(types[len]);
+	}
+	double created = now();
+	for (unsigned len = 1; len <= NLENGTHS; ++len)
+	{
+		assert(__liballocs_get_or_create_array_type(point_t, len) == types[len]);
+	}
+	double found = now();
+	printf("create\t%.1f ns/type\nlookup\t%.1f ns/type\n",
+		(created - begin) * 1e9 / NLENGTHS, (found - created) * 1e9 / NLENGTHS);
+
+	assert(UNIQTYPE_IS_ARRAY_TYPE(types[42]));
+	assert(UNIQTYPE_ARRAY_LENGTH(types[42]) == 42);
+	assert(UNIQTYPE_ARRAY_ELEMENT_TYPE(types[42]) == point_t);
+	assert(types[42]->pos_maxoff == 42 * sizeof (struct point));
+
+	/* Once published, types are also visible by name. */
+	__liballocs_publish_rt_uniqtypes();
+	char name[4096];
+	snprintf(name, sizeof name, "__uniqtype____ARR%d_%s", 4242, UNIQTYPE_NAME(point_t));
+	assert(dlsym(__liballocs_rt_uniqtypes_obj, name) == types[4242]);
+
+	free(p);
+	return 0;
+}
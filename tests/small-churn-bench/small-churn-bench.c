@@ -0,0 +1,39 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include "liballocs.h"
+
+/* Measure malloc/free pair throughput for small chunks. None of these
+ * is big enough to be promoted, so free() should not need to consult
+ * the bigalloc tree, and with nothing cached near the freed chunks,
+ * cache invalidation should not need to scan any entries. */
+
+#define NPAIRS 10000000
+#define NLIVE 64
+
+static void *live[NLIVE];
+
+int main(void)
+{
+	/* Make a query, so that this thread's cache holds something. */
+	void *queried = malloc(64);
+	assert(__liballocs_get_alloc_base((char*) queried + 8) == queried);
+	struct timespec begin, end;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (long i = 0; i < NPAIRS; ++i)
+	{
+		unsigned slot = i % NLIVE;
+		if (live[slot]) free(live[slot]);
+		live[slot] = malloc(16 + 16 * (i % 32));
+		assert(live[slot]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	for (unsigned slot = 0; slot < NLIVE; ++slot) free(live[slot]);
+	assert(__liballocs_get_alloc_base((char*) queried + 8) == queried);
+	free(queried);
+	double secs = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+	printf("malloc/free pairs: %.2f M/s\n", NPAIRS / secs / 1e6);
+	return 0;
+}
@@ -0,0 +1,46 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include "liballocs.h"
+
+/* Time type queries on a stack local of the outermost of a chain of
+ * recursive frames, made from the innermost, at depths 10, 100 and 1000.
+ * Each query walks the whole chain. */
+
+#define NQUERIES 10000
+
+static void time_queries(int depth, int *target)
+{
+	struct timespec begin, end;
+	struct uniqtype *t = NULL;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (int i = 0; i < NQUERIES; ++i)
+	{
+		t = __liballocs_get_alloc_type(target);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	assert(t);
+	double ns = ((end.tv_sec - begin.tv_sec) * 1e9 + (end.tv_nsec - begin.tv_nsec)) / NQUERIES;
+	printf("%d\t%.1f\n", depth, ns);
+}
+
+static int (__attribute__((noinline)) recurse)(int depth, int remaining, int *target)
+{
+	int local[4] = { depth, remaining, 0, 0 };
+	if (!target) target = &local[0];
+	if (remaining == 0) time_queries(depth, target);
+	else local[2] = recurse(depth, remaining - 1, target);
+	/* Use local after the call, so the frame stays live. */
+	return local[0] + local[2];
+}
+
+int main(void)
+{
+	printf("depth\tmean ns/query\n");
+	recurse(10, 10, NULL);
+	recurse(100, 100, NULL);
+	recurse(1000, 1000, NULL);
+	return 0;
+}
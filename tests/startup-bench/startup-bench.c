@@ -0,0 +1,77 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/* Report time-to-main with the early libs' meta-objects loaded on one
+ * thread and by the startup pipeline. We re-execute ourselves, passing
+ * the time just before the exec; the child subtracts it from the time at
+ * which main() starts, and sends back the difference over a pipe. The
+ * page cache is warm after the first run, so the first of each is
+ * dropped. */
+
+#define NRUNS 10
+
+static double now_ms(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+static double run_child(const char *argv0, const char *nthreads)
+{
+	int fds[2];
+	int ret = pipe(fds);
+	assert(ret == 0);
+	pid_t pid = fork();
+	assert(pid != -1);
+	if (pid == 0)
+	{
+		close(fds[0]);
+		if (nthreads) setenv("LIBALLOCS_STARTUP_THREADS", nthreads, 1);
+		else unsetenv("LIBALLOCS_STARTUP_THREADS");
+		char start_str[64];
+		char fd_str[16];
+		snprintf(fd_str, sizeof fd_str, "%d", fds[1]);
+		snprintf(start_str, sizeof start_str, "%.6f", now_ms());
+		execl("/proc/self/exe", argv0, start_str, fd_str, (char *) NULL);
+		_exit(127);
+	}
+	close(fds[1]);
+	double ms = -1;
+	ssize_t nread = read(fds[0], &ms, sizeof ms);
+	assert(nread == sizeof ms);
+	close(fds[0]);
+	int status;
+	pid_t waited = waitpid(pid, &status, 0);
+	assert(waited == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	return ms;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 2)
+	{
+		double ms = now_ms() - atof(argv[1]);
+		int fd = atoi(argv[2]);
+		ssize_t nwritten = write(fd, &ms, sizeof ms);
+		assert(nwritten == sizeof ms);
+		return 0;
+	}
+	const char *configs[] = { "1", NULL };
+	const char *config_names[] = { "one thread", "pipeline" };
+	printf("startup\tmean ms to main\n");
+	for (unsigned c = 0; c < sizeof configs / sizeof configs[0]; ++c)
+	{
+		double total = 0;
+		run_child(argv[0], configs[c]);
+		for (int i = 0; i < NRUNS; ++i) total += run_child(argv[0], configs[c]);
+		printf("%s\t%.2f\n", config_names[c], total / NRUNS);
+	}
+	return 0;
+}
@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "liballocs.h"
+#include "allocmeta.h"
+#include "pageindex.h"
+
+/* Walk the static symbols of our own data, in full and over a range
+ * covering just one of them. */
+
+struct point { int x; int y; };
+struct point origin = { 0, 0 };
+double scale = 2.0;
+struct point corners[4] = { { 1, 1 } };
+
+struct seen
+{
+	void *want;
+	struct uniqtype *want_t;
+	unsigned nseen;
+	unsigned nfound;
+	void *last;
+};
+static int saw_symbol_cb(struct big_allocation *maybe_the_allocation, void *obj,
+	struct uniqtype *t, const void *allocsite, struct alloc_tree_link *link, void *arg_as_void)
+{
+	struct seen *arg = arg_as_void;
+	/* We walk in address order. */
+	assert(!arg->last || (char*) obj >= (char*) arg->last);
+	arg->last = obj;
+	++arg->nseen;
+	if (obj == arg->want)
+	{
+		assert(t == arg->want_t);
+		++arg->nfound;
+	}
+	return 0;
+}
+
+int main(void)
+{
+	struct big_allocation *b = __lookup_bigalloc_from_root_by_suballocator(&origin,
+		&__static_symbol_allocator, NULL);
+	assert(b);
+	struct alloc_tree_pos pos = { .base = b->begin, .bigalloc_or_uniqtype = (uintptr_t) b };
+	void *wanted[] = { &origin, &scale, corners };
+	unsigned nseen_full = 0;
+	for (unsigned i = 0; i < sizeof wanted / sizeof wanted[0]; ++i)
+	{
+		struct seen full = { .want = wanted[i], .want_t = __liballocs_get_alloc_type(wanted[i]) };
+		assert(full.want_t);
+		int ret = __static_symbol_allocator.walk_allocations(&pos, saw_symbol_cb, &full, NULL, NULL);
+		assert(ret == 0);
+		assert(full.nfound == 1);
+		nseen_full = full.nseen;
+
+		struct seen one = { .want = wanted[i], .want_t = full.want_t };
+		ret = __static_symbol_allocator.walk_allocations(&pos, saw_symbol_cb, &one,
+			wanted[i], (char*) wanted[i] + 1);
+		assert(ret == 0);
+		assert(one.nfound == 1);
+		assert(one.nseen < nseen_full);
+	}
+	printf("walked %u static allocations\n", nseen_full);
+	return 0;
+}
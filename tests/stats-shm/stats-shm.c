@@ -0,0 +1,86 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "liballocs.h"
+
+/* Query statistics: heap queries from several threads, some of which have
+ * exited by the time we read, must all be counted, both when we sum our
+ * own blocks and when the exported mapping is read as another process
+ * would read it. */
+
+#define NTHREADS 8
+#define NQUERIES 10000
+
+static void *worker(void *arg)
+{
+	void *chunk = malloc(128);
+	for (int i = 0; i < NQUERIES; ++i)
+	{
+		struct allocator *a = NULL;
+		struct uniqtype *t = NULL;
+		liballocs_err_t err = __liballocs_get_alloc_info((char*) chunk + i % 128, &a,
+			NULL, NULL, &t, NULL);
+		assert(!err);
+	}
+	free(chunk);
+	return NULL;
+}
+
+int main(void)
+{
+	const char *path = __liballocs_stats_export(NULL);
+	assert(path);
+	struct liballocs_stats before;
+	__liballocs_stats_read(&before);
+
+	pthread_t threads[NTHREADS];
+	for (int i = 0; i < NTHREADS; ++i) pthread_create(&threads[i], NULL, worker, NULL);
+	for (int i = 0; i < NTHREADS; ++i) pthread_join(threads[i], NULL);
+
+	static struct liballocs_stats after;
+	__liballocs_stats_read(&after);
+	assert(after.counters[LIBALLOCS_STAT_HIT_HEAP_CASE]
+		- before.counters[LIBALLOCS_STAT_HIT_HEAP_CASE] >= NTHREADS * NQUERIES);
+	/* Exporting turned on per-allocator counts, so every query was timed. */
+	unsigned long timed = 0;
+	for (unsigned a = 0; a < after.nallocators; ++a)
+	{
+		unsigned long hist_total = 0;
+		for (unsigned j = 0; j < LIBALLOCS_STATS_LATENCY_NBUCKETS; ++j)
+			hist_total += after.alloc_latency[a][j];
+		assert(hist_total == after.alloc_queries[a]);
+		printf("%s: %lu queries, %lu failed\n", after.allocator_names[a],
+			after.alloc_queries[a], after.alloc_failures[a]);
+		timed += after.alloc_queries[a];
+	}
+	assert(timed >= NTHREADS * NQUERIES);
+
+	/* Now read it the way an external tool would. */
+	int fd = open(path, O_RDONLY);
+	assert(fd != -1);
+	const struct __liballocs_stats_shm *shm = mmap(NULL, sizeof *shm, PROT_READ,
+		MAP_SHARED, fd, 0);
+	assert(shm != MAP_FAILED);
+	close(fd);
+	assert(shm->magic == LIBALLOCS_STATS_MAGIC);
+	assert(shm->version == LIBALLOCS_STATS_VERSION);
+	assert(shm->block_size == sizeof (struct __liballocs_stats_block));
+	assert(shm->pid == getpid());
+	static struct liballocs_stats external;
+	__liballocs_stats_sum(shm, &external);
+	assert(0 == memcmp(external.counters, after.counters, sizeof after.counters));
+	assert(external.nallocators == after.nallocators);
+	for (unsigned a = 0; a < after.nallocators; ++a)
+	{
+		assert(0 == strcmp(external.allocator_names[a], after.allocator_names[a]));
+		assert(external.alloc_queries[a] == after.alloc_queries[a]);
+	}
+	printf("%s: %lu heap queries\n", path, external.counters[LIBALLOCS_STAT_HIT_HEAP_CASE]);
+	return 0;
+}
@@ -0,0 +1,66 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "liballocs.h"
+#include "pageindex.h"
+
+/* Report the per-mmap cost of each systrap backend. With no arguments we
+ * re-run ourselves once per backend, since the backend is chosen at
+ * startup by LIBALLOCS_SYSTRAP_BACKEND; each run checks that its mmaps
+ * were still seen by the mmap allocator, then times one-page
+ * mmap+munmap pairs. */
+
+#define NREPS 20000
+
+static const char *backends[] = { "sigill", "trampoline" };
+
+static int run_one(const char *backend)
+{
+	void *p = mmap(NULL, 4096, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	assert(p != MAP_FAILED);
+	assert(__lookup_bigalloc_from_root(p, &__mmap_allocator, NULL));
+	munmap(p, 4096);
+
+	struct timespec begin, end;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (int i = 0; i < NREPS; ++i)
+	{
+		p = mmap(NULL, 4096, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		assert(p != MAP_FAILED);
+		int ret = munmap(p, 4096);
+		assert(ret == 0);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double ns = ((end.tv_sec - begin.tv_sec) * 1e9 + (end.tv_nsec - begin.tv_nsec)) / NREPS;
+	printf("%s\t%.0f\n", backend, ns);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1) return run_one(argv[1]);
+	printf("backend\tmean ns per mmap+munmap\n");
+	fflush(stdout);
+	for (unsigned i = 0; i < sizeof backends / sizeof backends[0]; ++i)
+	{
+		pid_t pid = fork();
+		assert(pid != -1);
+		if (pid == 0)
+		{
+			setenv("LIBALLOCS_SYSTRAP_BACKEND", backends[i], 1);
+			execl("/proc/self/exe", argv[0], backends[i], (char *) NULL);
+			_exit(127);
+		}
+		int status;
+		pid_t waited = waitpid(pid, &status, 0);
+		assert(waited == pid);
+		assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	}
+	return 0;
+}
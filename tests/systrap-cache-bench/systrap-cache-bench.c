@@ -0,0 +1,84 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/wait.h>
+
+/* Time startup with the systrap cache disabled, cold and warm. Each run
+ * re-executes us with an argument, so does nothing but start up and
+ * exit; the cold runs each get a fresh cache directory, and the warm runs
+ * share one filled by an earlier run. */
+
+#define NRUNS 10
+
+static double run_child(const char *argv0, const char *cache_dir)
+{
+	struct timespec begin, end;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	pid_t pid = fork();
+	assert(pid != -1);
+	if (pid == 0)
+	{
+		setenv("LIBALLOCS_SYSTRAP_CACHE", cache_dir, 1);
+		execl("/proc/self/exe", argv0, "child", (char *) NULL);
+		_exit(127);
+	}
+	int status;
+	pid_t waited = waitpid(pid, &status, 0);
+	assert(waited == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - begin.tv_sec) * 1e3 + (end.tv_nsec - begin.tv_nsec) / 1e6;
+}
+
+static unsigned clear_dir(const char *path)
+{
+	unsigned n = 0;
+	DIR *d = opendir(path);
+	if (!d) return 0;
+	struct dirent *ent;
+	char buf[4096];
+	while (NULL != (ent = readdir(d)))
+	{
+		if (ent->d_name[0] == '.') continue;
+		snprintf(buf, sizeof buf, "%s/%s", path, ent->d_name);
+		if (0 == unlink(buf)) ++n;
+	}
+	closedir(d);
+	return n;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1) return 0;
+	char base[] = "/tmp/systrap-cache-bench.XXXXXX";
+	char *base_ok = mkdtemp(base);
+	assert(base_ok);
+	char cache_dir[sizeof base + 16];
+	snprintf(cache_dir, sizeof cache_dir, "%s/cache", base);
+
+	double disabled = 0, cold = 0, warm = 0;
+	for (int i = 0; i < NRUNS; ++i) disabled += run_child(argv[0], "");
+	for (int i = 0; i < NRUNS; ++i)
+	{
+		clear_dir(cache_dir);
+		cold += run_child(argv[0], cache_dir);
+	}
+	for (int i = 0; i < NRUNS; ++i) warm += run_child(argv[0], cache_dir);
+	unsigned nfiles = clear_dir(cache_dir);
+	rmdir(cache_dir);
+	rmdir(base);
+	/* If nothing was cached, the warm runs measured nothing. */
+	assert(nfiles > 0);
+
+	printf("cache\tmean ms to start and exit\n");
+	printf("disabled\t%.2f\n", disabled / NRUNS);
+	printf("cold\t%.2f\n", cold / NRUNS);
+	printf("warm\t%.2f\n", warm / NRUNS);
+	printf("(%u cached regions)\n", nfiles);
+	return 0;
+}
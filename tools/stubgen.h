@@ -500,6 +500,12 @@ static liballocs_err_t get_info( \
 { \
 	return __generic_malloc_get_info(&ALLOC_ALLOCATOR_NAME(allocator_namefrag), sizefn, obj, maybe_the_allocation, \
 		out_type, out_base, out_size, out_site); \
+} \
+static int walk_allocations(struct alloc_tree_pos *pos, walk_alloc_cb_t *cb, void *arg, \
+	void *maybe_range_begin, void *maybe_range_end) \
+{ \
+	return __generic_malloc_walk_allocations(&ALLOC_ALLOCATOR_NAME(allocator_namefrag), sizefn, \
+		pos, cb, arg, maybe_range_begin, maybe_range_end); \
 } \
  \
 ALLOC_EVENT_ATTRIBUTES \
@@ -509,6 +515,7 @@ struct allocator ALLOC_ALLOCATOR_NAME(allocator_namefrag) = { \
 	.is_cacheable = 1, \
 	.ensure_big = ensure_big, \
 	.set_type = set_type, \
+	.walk_allocations = walk_allocations, \
 	.free = (void (*)(struct allocated_chunk *)) free, \
 };
 